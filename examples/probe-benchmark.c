@@ -0,0 +1,101 @@
+/* Compare vips_probe_files() with the vipsheader path for a set of files.
+ *
+ * Compile with:
+ *
+ * 	gcc -g -Wall probe-benchmark.c `pkg-config vips --cflags --libs`
+ *
+ * Run with:
+ *
+ * 	./probe-benchmark *.jpg
+ *
+ */
+
+#include <vips/vips.h>
+
+/* What vipsheader does for each file.
+ */
+static int
+header_files(const char **filenames, int n, VipsProbe *probes)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		VipsImage *image;
+
+		if (!(image = vips_image_new_from_file(filenames[i], NULL)))
+			return -1;
+
+		probes[i].width = image->Xsize;
+		probes[i].height = vips_image_get_page_height(image);
+		probes[i].bands = image->Bands;
+		probes[i].format = image->BandFmt;
+		probes[i].orientation = vips_image_get_orientation(image);
+		probes[i].n_pages = vips_image_get_n_pages(image);
+
+		g_object_unref(image);
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char **filenames = (const char **) argv + 1;
+	int n = argc - 1;
+
+	VipsProbe *header;
+	VipsProbe *probe;
+	GTimer *timer;
+	int i;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	if (n < 1)
+		vips_error_exit("usage: %s FILE1 FILE2 ...", argv[0]);
+
+	/* Don't let the operation cache help the header path.
+	 */
+	vips_cache_set_max(0);
+
+	header = g_new0(VipsProbe, n);
+	probe = g_new0(VipsProbe, n);
+	timer = g_timer_new();
+
+	g_timer_start(timer);
+	if (header_files(filenames, n, header))
+		vips_error_exit(NULL);
+	printf("vipsheader path: %g s\n", g_timer_elapsed(timer, NULL));
+
+	g_timer_start(timer);
+	if (vips_probe_files(filenames, n, probe, FALSE))
+		vips_error_exit(NULL);
+	printf("vips_probe_files(): %g s\n", g_timer_elapsed(timer, NULL));
+
+	g_timer_start(timer);
+	if (vips_probe_files(filenames, n, probe, TRUE))
+		vips_error_exit(NULL);
+	printf("vips_probe_files(), parallel: %g s\n",
+		g_timer_elapsed(timer, NULL));
+
+	/* Both paths must agree.
+	 */
+	for (i = 0; i < n; i++)
+		if (header[i].width != probe[i].width ||
+			header[i].height != probe[i].height ||
+			header[i].bands != probe[i].bands ||
+			header[i].format != probe[i].format ||
+			header[i].orientation != probe[i].orientation ||
+			header[i].n_pages != probe[i].n_pages)
+			printf("%s: probe (%s) does not match header\n",
+				filenames[i], probe[i].loader);
+
+	g_timer_destroy(timer);
+	g_free(probe);
+	g_free(header);
+
+	vips_shutdown();
+
+	return 0;
+}
@@ -0,0 +1,99 @@
+/* Time a cheap pipeline through sink_memory and sink_disc, and report how
+ * long workers spent waiting for work.
+ *
+ * Compile with:
+ *
+ * 	gcc -g -Wall sink-benchmark.c `pkg-config vips --cflags --libs`
+ *
+ * Run with:
+ *
+ * 	./sink-benchmark 10000 10000
+ *
+ * Set VIPS_CONCURRENCY to try different numbers of workers.
+ *
+ */
+
+#include <glib/gstdio.h>
+#include <vips/vips.h>
+
+/* A pipeline where each tile is very cheap to make.
+ */
+static VipsImage *
+make_pipeline(int width, int height)
+{
+	VipsImage *black;
+	VipsImage *out;
+
+	if (vips_black(&black, width, height, "bands", 3, NULL))
+		return NULL;
+	if (vips_linear1(black, &out, 1.0, 10.0, "uchar", TRUE, NULL)) {
+		g_object_unref(black);
+		return NULL;
+	}
+	g_object_unref(black);
+
+	return out;
+}
+
+static void
+report(const char *name, GTimer *timer)
+{
+	VipsProfileReport *report = vips_profile_get();
+
+	printf("%s: %g s, workers waited for work for %g s\n",
+		name,
+		g_timer_elapsed(timer, NULL),
+		report->allocate_wait / 1000000.0);
+
+	vips_profile_report_free(report);
+}
+
+int
+main(int argc, char **argv)
+{
+	VipsImage *image;
+	GTimer *timer;
+	void *buf;
+	size_t size;
+	char *filename;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	if (argc != 3)
+		vips_error_exit("usage: %s WIDTH HEIGHT", argv[0]);
+
+	vips_cache_set_max(0);
+	vips_profile_summary_set(TRUE);
+	timer = g_timer_new();
+
+	printf("%d workers\n", vips_concurrency_get());
+
+	if (!(image = make_pipeline(atoi(argv[1]), atoi(argv[2]))))
+		vips_error_exit(NULL);
+	vips_profile_reset();
+	g_timer_start(timer);
+	if (!(buf = vips_image_write_to_memory(image, &size)))
+		vips_error_exit(NULL);
+	report("sink_memory", timer);
+	g_free(buf);
+	g_object_unref(image);
+
+	filename = g_build_filename(g_get_tmp_dir(), "sink-benchmark.v", NULL);
+	if (!(image = make_pipeline(atoi(argv[1]), atoi(argv[2]))))
+		vips_error_exit(NULL);
+	vips_profile_reset();
+	g_timer_start(timer);
+	if (vips_image_write_to_file(image, filename, NULL))
+		vips_error_exit(NULL);
+	report("sink_disc", timer);
+	g_object_unref(image);
+	g_unlink(filename);
+	g_free(filename);
+
+	g_timer_destroy(timer);
+
+	vips_shutdown();
+
+	return 0;
+}
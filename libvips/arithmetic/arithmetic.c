@@ -8,6 +8,9 @@
  * 	  corresponding pixel in the input)
  * 	- LUT-able: ie. arithmetic (image) can be exactly replaced by
  * 	  maplut (image, arithmetic (lut)) for 8/16 bit int images
+ *
+ * 18/10/26
+ * 	- fuse chains of point operations into a single generate
  */
 
 /*
@@ -57,6 +60,11 @@
 
 G_DEFINE_ABSTRACT_TYPE(VipsArithmetic, vips_arithmetic, VIPS_TYPE_OPERATION);
 
+/* Fused chains process lines in chunks of this many pixels, so the
+ * intermediates stay in cache.
+ */
+#define VIPS_ARITHMETIC_CHUNK (256)
+
 /* Save a bit of typing.
  */
 #define UC VIPS_FORMAT_UCHAR
@@ -323,6 +331,10 @@ typedef struct {
 	 */
 	VipsPel **p;
 
+	/* For fused chains, a pair of line buffers for intermediates.
+	 */
+	VipsPel *line[2];
+
 } VipsArithmeticSequence;
 
 static int
@@ -339,6 +351,8 @@ vips_arithmetic_stop(void *vseq, void *a, void *b)
 	}
 
 	VIPS_FREE(seq->p);
+	VIPS_FREE(seq->line[0]);
+	VIPS_FREE(seq->line[1]);
 
 	VIPS_FREE(seq);
 
@@ -360,6 +374,8 @@ vips_arithmetic_start(VipsImage *out, void *a, void *b)
 	seq->arithmetic = arithmetic;
 	seq->ir = NULL;
 	seq->p = NULL;
+	seq->line[0] = NULL;
+	seq->line[1] = NULL;
 
 	/* How many images?
 	 */
@@ -389,6 +405,24 @@ vips_arithmetic_start(VipsImage *out, void *a, void *b)
 		return NULL;
 	}
 
+	/* Line buffers for the intermediates in a fused chain.
+	 */
+	if (arithmetic->n_chain > 1) {
+		size_t size;
+
+		size = 0;
+		for (i = 0; i < arithmetic->n_chain - 1; i++)
+			size = VIPS_MAX(size,
+				VIPS_IMAGE_SIZEOF_PEL(arithmetic->chain[i]->out));
+		size *= VIPS_ARITHMETIC_CHUNK;
+
+		if (!(seq->line[0] = VIPS_ARRAY(NULL, size, VipsPel)) ||
+			!(seq->line[1] = VIPS_ARRAY(NULL, size, VipsPel))) {
+			vips_arithmetic_stop(seq, NULL, NULL);
+			return NULL;
+		}
+	}
+
 	return seq;
 }
 
@@ -432,6 +466,119 @@ vips_arithmetic_gen(VipsRegion *out_region,
 	return 0;
 }
 
+/* Generate for a fused chain. Our regions are on the inputs to the head of
+ * the chain, and each operation runs on a chunk of line in turn.
+ */
+static int
+vips_arithmetic_gen_fused(VipsRegion *out_region,
+	void *vseq, void *a, void *b, gboolean *stop)
+{
+	VipsArithmeticSequence *seq = (VipsArithmeticSequence *) vseq;
+	VipsRegion **ir = seq->ir;
+	VipsArithmetic *arithmetic = VIPS_ARITHMETIC(b);
+	VipsArithmeticClass *class = VIPS_ARITHMETIC_GET_CLASS(arithmetic);
+	VipsRect *r = &out_region->valid;
+	int n_chain = arithmetic->n_chain;
+	size_t out_psize = VIPS_IMAGE_SIZEOF_PEL(out_region->im);
+
+	int i, x, y;
+
+	/* The head of the chain reads these directly, so we can't use
+	 * out's reorder table.
+	 */
+	if (vips_region_prepare_many(ir, r))
+		return -1;
+
+	VIPS_GATE_START("vips_arithmetic_gen_fused: work");
+
+	for (y = 0; y < r->height; y++) {
+		VipsPel *q = VIPS_REGION_ADDR(out_region, r->left, r->top + y);
+
+		for (x = 0; x < r->width; x += VIPS_ARITHMETIC_CHUNK) {
+			int width = VIPS_MIN(VIPS_ARITHMETIC_CHUNK, r->width - x);
+
+			for (i = 0; ir[i]; i++)
+				seq->p[i] = VIPS_REGION_ADDR(ir[i],
+					r->left + x, r->top + y);
+			seq->p[i] = NULL;
+
+			/* Ping-pong between the line buffers, the last
+			 * operation writes straight to the output.
+			 */
+			for (i = 0; i < n_chain; i++) {
+				VipsArithmetic *link = arithmetic->chain[i];
+				VipsArithmeticClass *link_class =
+					VIPS_ARITHMETIC_GET_CLASS(link);
+				VipsPel *out = i == n_chain - 1
+					? q + x * out_psize
+					: seq->line[i & 1];
+
+				if (i > 0) {
+					seq->p[0] = seq->line[(i - 1) & 1];
+					seq->p[1] = NULL;
+				}
+
+				link_class->process_line(link, out, seq->p, width);
+			}
+		}
+	}
+
+	VIPS_GATE_STOP("vips_arithmetic_gen_fused: work");
+
+	VIPS_COUNT_PIXELS(out_region, VIPS_OBJECT_CLASS(class)->nickname);
+
+	return 0;
+}
+
+/* If our single input is the unmodified output of another arithmetic
+ * operation, we can run both in one generate and skip the intermediate
+ * image. Return the operation to fuse with, or NULL.
+ */
+static VipsArithmetic *
+vips_arithmetic_upstream(VipsArithmetic *arithmetic)
+{
+	VipsImage *in;
+	VipsImage *ready;
+	VipsArithmetic *upstream;
+
+	if (arithmetic->n != 1)
+		return NULL;
+
+	in = arithmetic->in[0];
+	ready = arithmetic->ready[0];
+
+	/* Decode, cast and bandup must have been no-ops. Only partial
+	 * images, since we mustn't skip pixels drawn on a memory image.
+	 */
+	if (in->dtype != VIPS_IMAGE_PARTIAL ||
+		in->Coding != VIPS_CODING_NONE ||
+		in->BandFmt != ready->BandFmt ||
+		in->Bands != ready->Bands ||
+		in->Xsize != ready->Xsize ||
+		in->Ysize != ready->Ysize)
+		return NULL;
+
+	if (in->generate_fn != vips_arithmetic_gen &&
+		in->generate_fn != vips_arithmetic_gen_fused)
+		return NULL;
+
+	/* If anything else reads the upstream output, fusing would compute
+	 * the chain twice. The decode step has linked a copy of in to it, and
+	 * the cache can share that copy with other operations, so that must
+	 * have no readers yet either.
+	 */
+	if (g_slist_length(in->downstream) != 1 ||
+		ready->downstream)
+		return NULL;
+
+	upstream = VIPS_ARITHMETIC(in->client2);
+	if (upstream->out != in ||
+		upstream->n_chain >= VIPS_ARITHMETIC_MAX_CHAIN)
+		return NULL;
+
+	return upstream;
+}
+
 static int
 vips_arithmetic_build(VipsObject *object)
 {
@@ -443,6 +590,7 @@ vips_arithmetic_build(VipsObject *object)
 	VipsImage **format;
 	VipsImage **band;
 	VipsImage **size;
+	VipsArithmetic *upstream;
 	int i;
 
 #ifdef DEBUG
@@ -483,6 +631,23 @@ vips_arithmetic_build(VipsObject *object)
 	 */
 	arithmetic->ready = size;
 
+	/* Extend the chain we read from, or start a new one.
+	 */
+	if ((upstream = vips_arithmetic_upstream(arithmetic))) {
+		for (i = 0; i < upstream->n_chain; i++) {
+			arithmetic->chain[i] = upstream->chain[i];
+			g_object_ref(arithmetic->chain[i]);
+		}
+		arithmetic->n_chain = upstream->n_chain;
+	}
+	arithmetic->chain[arithmetic->n_chain++] = arithmetic;
+
+#ifdef DEBUG
+	if (arithmetic->n_chain > 1)
+		printf("vips_arithmetic_build: fused chain of %d\n",
+			arithmetic->n_chain);
+#endif /*DEBUG*/
+
 	if (vips_image_pipeline_array(arithmetic->out,
 			VIPS_DEMAND_STYLE_THINSTRIP, arithmetic->ready))
 		return -1;
@@ -494,16 +659,42 @@ vips_arithmetic_build(VipsObject *object)
 		arithmetic->out->BandFmt =
 			aclass->format_table[arithmetic->ready[0]->BandFmt];
 
-	if (vips_image_generate(arithmetic->out,
-			vips_arithmetic_start,
-			vips_arithmetic_gen,
-			vips_arithmetic_stop,
-			arithmetic->ready, arithmetic))
-		return -1;
+	if (arithmetic->n_chain > 1) {
+		if (vips_image_generate(arithmetic->out,
+				vips_arithmetic_start,
+				vips_arithmetic_gen_fused,
+				vips_arithmetic_stop,
+				arithmetic->chain[0]->ready, arithmetic))
+			return -1;
+	}
+	else {
+		if (vips_image_generate(arithmetic->out,
+				vips_arithmetic_start,
+				vips_arithmetic_gen,
+				vips_arithmetic_stop,
+				arithmetic->ready, arithmetic))
+			return -1;
+	}
 
 	return 0;
 }
 
+static void
+vips_arithmetic_dispose(GObject *gobject)
+{
+	VipsArithmetic *arithmetic = VIPS_ARITHMETIC(gobject);
+
+	int i;
+
+	/* The last link is us, and we don't hold a ref to ourselves.
+	 */
+	for (i = 0; i < arithmetic->n_chain - 1; i++)
+		VIPS_UNREF(arithmetic->chain[i]);
+	arithmetic->n_chain = 0;
+
+	G_OBJECT_CLASS(vips_arithmetic_parent_class)->dispose(gobject);
+}
+
 static void
 vips_arithmetic_class_init(VipsArithmeticClass *class)
 {
@@ -511,6 +702,7 @@ vips_arithmetic_class_init(VipsArithmeticClass *class)
 	VipsObjectClass *vobject_class = VIPS_OBJECT_CLASS(class);
 	VipsOperationClass *operation_class = VIPS_OPERATION_CLASS(class);
 
+	gobject_class->dispose = vips_arithmetic_dispose;
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
 
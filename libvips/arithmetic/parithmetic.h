@@ -52,6 +52,10 @@ extern "C" {
 	(G_TYPE_INSTANCE_GET_CLASS((obj), \
 		VIPS_TYPE_ARITHMETIC, VipsArithmeticClass))
 
+/* The most operations we fuse into a single generate.
+ */
+#define VIPS_ARITHMETIC_MAX_CHAIN (8)
+
 struct _VipsArithmetic;
 typedef void (*VipsArithmeticProcessFn)(struct _VipsArithmetic *arithmetic,
 	VipsPel *out, VipsPel **in, int width);
@@ -80,6 +84,13 @@ typedef struct _VipsArithmetic {
 	/* Set this to override class->format_table.
 	 */
 	VipsBandFormat format;
+
+	/* If we've fused with the arithmetic operations that made our input,
+	 * the operations to run on each line, first to last. chain[0] reads
+	 * from its ready images, the last one is us.
+	 */
+	struct _VipsArithmetic *chain[VIPS_ARITHMETIC_MAX_CHAIN];
+	int n_chain;
 } VipsArithmetic;
 
 typedef struct _VipsArithmeticClass {
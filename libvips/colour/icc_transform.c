@@ -45,6 +45,8 @@
  * 	- better rejection of broken embedded profiles
  * 29/3/21 [hanssonrickard]
  * 	- add black_point_compensation
+ * 18/10/26
+ * 	- share lcms transforms between operations with the same profiles
  */
 
 /*
@@ -93,6 +95,7 @@
 #include <lcms2.h>
 
 #include <vips/vips.h>
+#include <vips/internal.h>
 
 #include "pcolour.h"
 
@@ -100,6 +103,10 @@
  */
 #define PIXEL_BUFFER_SIZE (10000)
 
+/* Keep up to this many lcms transforms for reuse.
+ */
+#define TRANSFORM_CACHE_MAX (100)
+
 /**
  * VipsIntent:
  * @VIPS_INTENT_PERCEPTUAL: perceptual rendering intent
@@ -170,6 +177,11 @@ typedef struct _VipsIcc {
 	cmsUInt32Number out_icc_format;
 	cmsHTRANSFORM trans;
 	gboolean non_standard_input_profile;
+
+	/* If trans came from the transform cache, this is the entry we hold a
+	 * ref to.
+	 */
+	struct _VipsIccTransformEntry *entry;
 } VipsIcc;
 
 typedef VipsColourCodeClass VipsIccClass;
@@ -185,12 +197,203 @@ icc_error(cmsContext context, cmsUInt32Number code, const char *text)
 	vips_error("VipsIcc", "%s", text);
 }
 
+/* Making an lcms transform can take several ms, often more than
+ * transforming the pixels of a small image. A server making many
+ * thumbnails will usually only see a few distinct profiles, so we share
+ * transforms between operations, keyed by a hash of the two profiles and
+ * the transform parameters.
+ *
+ * We use cmsFLAGS_NOCACHE, so a transform can be used by many threads at
+ * once.
+ */
+typedef struct _VipsIccTransformEntry {
+	char *key;
+	cmsHTRANSFORM trans;
+	int ref_count;
+} VipsIccTransformEntry;
+
+static GMutex vips_icc_transform_lock;
+static GHashTable *vips_icc_transform_cache = NULL;
+
+static void
+vips_icc_transform_entry_free(VipsIccTransformEntry *entry)
+{
+	VIPS_FREEF(cmsDeleteTransform, entry->trans);
+	VIPS_FREE(entry->key);
+	g_free(entry);
+}
+
+static gboolean
+vips_icc_transform_entry_unused(void *key, void *value, void *user_data)
+{
+	VipsIccTransformEntry *entry = (VipsIccTransformEntry *) value;
+
+	return entry->ref_count == 0;
+}
+
+static void
+vips_icc_checksum_blob(GChecksum *checksum, VipsBlob *blob)
+{
+	const void *data;
+	size_t size;
+	guint64 length;
+
+	/* Include the length, so a missing profile can't match some other
+	 * combination of profiles.
+	 */
+	data = blob ? vips_blob_get(blob, &size) : NULL;
+	length = data ? size : 0;
+	g_checksum_update(checksum, (guchar *) &length, sizeof(length));
+	if (length > 0)
+		g_checksum_update(checksum, data, size);
+}
+
+/* Profiles not made from a blob are the built-in LAB or XYZ PCS
+ * profiles, picked by icc->pcs.
+ */
+static char *
+vips_icc_transform_key(VipsIcc *icc, cmsUInt32Number flags)
+{
+	GChecksum *checksum;
+	guint32 params[5];
+	char *key;
+
+	checksum = g_checksum_new(G_CHECKSUM_SHA1);
+
+	vips_icc_checksum_blob(checksum, icc->in_blob);
+	vips_icc_checksum_blob(checksum, icc->out_blob);
+
+	params[0] = icc->in_icc_format;
+	params[1] = icc->out_icc_format;
+	params[2] = icc->selected_intent;
+	params[3] = flags;
+	params[4] = icc->pcs;
+	g_checksum_update(checksum, (guchar *) params, sizeof(params));
+
+	key = g_strdup(g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+
+	return key;
+}
+
+/* Find or make a transform for icc and set icc->trans.
+ */
+static int
+vips_icc_transform_get(VipsIcc *icc, cmsUInt32Number flags)
+{
+	char *key;
+	VipsIccTransformEntry *entry;
+	cmsHTRANSFORM trans;
+
+	key = vips_icc_transform_key(icc, flags);
+
+	g_mutex_lock(&vips_icc_transform_lock);
+
+	if (!vips_icc_transform_cache)
+		vips_icc_transform_cache = g_hash_table_new_full(
+			g_str_hash, g_str_equal,
+			NULL, (GDestroyNotify) vips_icc_transform_entry_free);
+
+	if ((entry = (VipsIccTransformEntry *)
+				g_hash_table_lookup(vips_icc_transform_cache, key))) {
+		entry->ref_count += 1;
+		icc->entry = entry;
+		icc->trans = entry->trans;
+		g_mutex_unlock(&vips_icc_transform_lock);
+		g_free(key);
+
+		return 0;
+	}
+
+	g_mutex_unlock(&vips_icc_transform_lock);
+
+	/* Make outside the lock, it's slow.
+	 */
+	if (!(trans = cmsCreateTransform(
+			  icc->in_profile, icc->in_icc_format,
+			  icc->out_profile, icc->out_icc_format,
+			  icc->selected_intent, flags))) {
+		g_free(key);
+		return -1;
+	}
+
+	g_mutex_lock(&vips_icc_transform_lock);
+
+	/* Someone else might have made the same transform while we were
+	 * busy.
+	 */
+	if ((entry = (VipsIccTransformEntry *)
+				g_hash_table_lookup(vips_icc_transform_cache, key))) {
+		cmsDeleteTransform(trans);
+		g_free(key);
+	}
+	else {
+		if (g_hash_table_size(vips_icc_transform_cache) >=
+			TRANSFORM_CACHE_MAX)
+			g_hash_table_foreach_remove(vips_icc_transform_cache,
+				vips_icc_transform_entry_unused, NULL);
+
+		/* Still full? Everything is in use, so just don't share this
+		 * one.
+		 */
+		if (g_hash_table_size(vips_icc_transform_cache) >=
+			TRANSFORM_CACHE_MAX) {
+			g_mutex_unlock(&vips_icc_transform_lock);
+			g_free(key);
+			icc->trans = trans;
+
+			return 0;
+		}
+
+		entry = g_new0(VipsIccTransformEntry, 1);
+		entry->key = key;
+		entry->trans = trans;
+		g_hash_table_insert(vips_icc_transform_cache, entry->key, entry);
+	}
+
+	entry->ref_count += 1;
+	icc->entry = entry;
+	icc->trans = entry->trans;
+
+	g_mutex_unlock(&vips_icc_transform_lock);
+
+	return 0;
+}
+
+/* Free the transform cache. Called from vips_shutdown(), after the
+ * operation cache has been dropped, so any entries still in use belong to
+ * leaked operations and we must keep them.
+ */
+void
+vips__icc_transform_shutdown(void)
+{
+	g_mutex_lock(&vips_icc_transform_lock);
+
+	if (vips_icc_transform_cache) {
+		g_hash_table_foreach_remove(vips_icc_transform_cache,
+			vips_icc_transform_entry_unused, NULL);
+		if (g_hash_table_size(vips_icc_transform_cache) == 0)
+			VIPS_FREEF(g_hash_table_destroy, vips_icc_transform_cache);
+	}
+
+	g_mutex_unlock(&vips_icc_transform_lock);
+}
+
 static void
 vips_icc_dispose(GObject *gobject)
 {
 	VipsIcc *icc = (VipsIcc *) gobject;
 
-	VIPS_FREEF(cmsDeleteTransform, icc->trans);
+	if (icc->entry) {
+		g_mutex_lock(&vips_icc_transform_lock);
+		icc->entry->ref_count -= 1;
+		g_mutex_unlock(&vips_icc_transform_lock);
+
+		icc->entry = NULL;
+		icc->trans = NULL;
+	}
+	else
+		VIPS_FREEF(cmsDeleteTransform, icc->trans);
 	VIPS_FREEF(cmsCloseProfile, icc->in_profile);
 	VIPS_FREEF(cmsCloseProfile, icc->out_profile);
 
@@ -446,10 +649,7 @@ vips_icc_build(VipsObject *object)
 	if (icc->black_point_compensation)
 		flags |= cmsFLAGS_BLACKPOINTCOMPENSATION;
 
-	if (!(icc->trans = cmsCreateTransform(
-			  icc->in_profile, icc->in_icc_format,
-			  icc->out_profile, icc->out_icc_format,
-			  icc->selected_intent, flags)))
+	if (vips_icc_transform_get(icc, flags))
 		return -1;
 
 	if (VIPS_OBJECT_CLASS(vips_icc_parent_class)->build(object))
@@ -1382,6 +1582,12 @@ vips_icc_is_compatible_profile(VipsImage *image,
 #else /*!HAVE_LCMS2*/
 
 #include <vips/vips.h>
+#include <vips/internal.h>
+
+void
+vips__icc_transform_shutdown(void)
+{
+}
 
 int
 vips_icc_present(void)
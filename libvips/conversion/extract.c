@@ -37,6 +37,8 @@
  * 	- gtkdoc
  * 26/10/11
  * 	- redone as a class
+ * 18/10/26
+ * 	- tell loaders which area we need
  */
 
 /*
@@ -141,6 +143,7 @@ vips_extract_area_build(VipsObject *object)
 	VipsExtractArea *extract = (VipsExtractArea *) object;
 
 	VipsImage *in;
+	VipsRect area;
 
 	if (VIPS_OBJECT_CLASS(vips_extract_area_parent_class)->build(object))
 		return -1;
@@ -163,6 +166,15 @@ vips_extract_area_build(VipsObject *object)
 			VIPS_DEMAND_STYLE_THINSTRIP, in, NULL))
 		return -1;
 
+	/* If we're reading directly from a loader, it might be able to
+	 * decode just this area.
+	 */
+	area.left = extract->left;
+	area.top = extract->top;
+	area.width = extract->width;
+	area.height = extract->height;
+	vips__foreign_load_set_roi(conversion->out, in, &area);
+
 	conversion->out->Xsize = extract->width;
 	conversion->out->Ysize = extract->height;
 	conversion->out->Xoffset = -extract->left;
@@ -74,7 +74,7 @@ im_tiff_read_header(const char *filename, VipsImage *out,
 	if (!(source = vips_source_new_from_file(filename)))
 		return -1;
 	if (vips__tiff_read_header_source(source, out,
-			page, n, autorotate, -1, VIPS_FAIL_ON_ERROR, TRUE)) {
+			page, n, autorotate, -1, VIPS_FAIL_ON_ERROR, TRUE, NULL)) {
 		VIPS_UNREF(source);
 		return -1;
 	}
@@ -5,6 +5,8 @@
  * 	- fix change detector
  * 3/12/22
  * 	- deprecate reoptimise, add reuse
+ * 18/10/26
+ * 	- quantise and remap batches of frames in parallel
  */
 
 /*
@@ -78,7 +80,59 @@ typedef enum _VipsForeignSaveCgifMode {
 	VIPS_FOREIGN_SAVE_CGIF_MODE_LOCAL
 } VipsForeignSaveCgifMode;
 
-typedef struct _VipsForeignSaveCgif {
+/* Don't buffer more than this many bytes of frames for parallel quantisation.
+ */
+#define CGIF_BATCH_SIZE (64 * 1024 * 1024)
+
+typedef struct _VipsForeignSaveCgif VipsForeignSaveCgif;
+
+/* A frame in a batch. We quantise and remap all the frames in a batch in
+ * parallel, then write them to libcgif in order.
+ */
+typedef struct _VipsForeignSaveCgifFrame {
+	VipsForeignSaveCgif *cgif;
+
+	/* The RGBA frame, and the index frame we get libimagequant to generate.
+	 */
+	VipsPel *frame_bytes;
+	VipsPel *index;
+
+	/* Quantisers keep state in their attr, so each frame has its own.
+	 */
+	VipsQuantiseAttr *attr;
+	VipsQuantiseImage *image;
+
+	/* The palette we made for just this frame, if we made one.
+	 */
+	VipsQuantiseResult *this_result;
+
+	/* The palette we picked for this frame, and a private copy of it if
+	 * an earlier frame in the batch is remapping with the same palette.
+	 */
+	VipsQuantiseResult *result;
+	VipsQuantiseResult *copy;
+	gboolean use_local;
+
+	/* There's no copy, so remap after the parallel phase.
+	 */
+	gboolean serial;
+
+	/* A palette this frame made obsolete. We can only free it once the
+	 * whole batch has been remapped.
+	 */
+	VipsQuantiseResult *retired;
+
+	VipsQuantiseError err;
+} VipsForeignSaveCgifFrame;
+
+/* The phases we run over a batch in parallel.
+ */
+typedef enum _VipsForeignSaveCgifPhase {
+	VIPS_FOREIGN_SAVE_CGIF_PHASE_QUANTISE,
+	VIPS_FOREIGN_SAVE_CGIF_PHASE_REMAP
+} VipsForeignSaveCgifPhase;
+
+struct _VipsForeignSaveCgif {
 	VipsForeignSave parent_object;
 
 	double dither;
@@ -108,11 +162,21 @@ typedef struct _VipsForeignSaveCgif {
 	 */
 	int frame_width;
 	int frame_height;
-	VipsPel *frame_bytes;
 	int write_y;
 	int page_number;
+	int n_pages;
 
-	/* The current frame as seen by libimagequant.
+	/* The batch of frames we are building, and the number of complete
+	 * frames in it.
+	 */
+	VipsForeignSaveCgifFrame *frames;
+	int n_frames;
+	int n_batch;
+	VipsForeignSaveCgifPhase phase;
+	VipsSemaphore finish;
+	gboolean finish_init;
+
+	/* The global palette.
 	 */
 	VipsQuantiseAttr *attr;
 	VipsQuantiseResult *quantisation_result;
@@ -127,10 +191,6 @@ typedef struct _VipsForeignSaveCgif {
 	 */
 	VipsQuantiseResult *free_quantisation_result;
 
-	/* The index frame we get libimagequant to generate.
-	 */
-	VipsPel *index;
-
 	/* The previous RGBA frame (needed for transparency trick).
 	 */
 	VipsPel *previous_frame;
@@ -145,13 +205,28 @@ typedef struct _VipsForeignSaveCgif {
 	/* Deprecated.
 	 */
 	gboolean reoptimise;
-} VipsForeignSaveCgif;
+};
 
 typedef VipsForeignSaveClass VipsForeignSaveCgifClass;
 
 G_DEFINE_ABSTRACT_TYPE(VipsForeignSaveCgif, vips_foreign_save_cgif,
 	VIPS_TYPE_FOREIGN_SAVE);
 
+/* Free everything the frame made during a batch.
+ */
+static void
+vips_foreign_save_cgif_frame_clear(VipsForeignSaveCgifFrame *frame)
+{
+	VIPS_FREEF(vips__quantise_image_destroy, frame->image);
+	VIPS_FREEF(vips__quantise_result_destroy, frame->this_result);
+	VIPS_FREEF(vips__quantise_result_destroy, frame->copy);
+	VIPS_FREEF(vips__quantise_result_destroy, frame->retired);
+	frame->result = NULL;
+	frame->use_local = FALSE;
+	frame->serial = FALSE;
+	frame->err = 0;
+}
+
 static void
 vips_foreign_save_cgif_dispose(GObject *gobject)
 {
@@ -162,6 +237,24 @@ vips_foreign_save_cgif_dispose(GObject *gobject)
 
 	VIPS_FREEF(cgif_close, cgif->cgif_context);
 
+	if (cgif->frames) {
+		for (int i = 0; i < cgif->n_frames; i++) {
+			VipsForeignSaveCgifFrame *frame = &cgif->frames[i];
+
+			vips_foreign_save_cgif_frame_clear(frame);
+			VIPS_FREEF(vips__quantise_attr_destroy, frame->attr);
+			VIPS_FREE(frame->frame_bytes);
+			VIPS_FREE(frame->index);
+		}
+
+		VIPS_FREE(cgif->frames);
+	}
+
+	if (cgif->finish_init) {
+		vips_semaphore_destroy(&cgif->finish);
+		cgif->finish_init = FALSE;
+	}
+
 	VIPS_FREEF(vips__quantise_result_destroy, cgif->quantisation_result);
 	VIPS_FREEF(vips__quantise_result_destroy,
 		cgif->free_quantisation_result);
@@ -169,8 +262,6 @@ vips_foreign_save_cgif_dispose(GObject *gobject)
 
 	VIPS_UNREF(cgif->target);
 
-	VIPS_FREE(cgif->index);
-	VIPS_FREE(cgif->frame_bytes);
 	VIPS_FREE(cgif->previous_frame);
 
 	G_OBJECT_CLASS(vips_foreign_save_cgif_parent_class)->dispose(gobject);
@@ -395,18 +486,18 @@ vips_foreign_save_cgif_get_rgb_palette(VipsForeignSaveCgif *cgif,
 	}
 }
 
-int
+/* Pick a palette for a frame, given the palette we made for just that frame.
+ * This takes ownership of frame->this_result.
+ */
+static void
 vips_foreign_save_cgif_pick_quantiser(VipsForeignSaveCgif *cgif,
-	VipsQuantiseImage *image, VipsQuantiseResult **result, gboolean *use_local)
+	VipsForeignSaveCgifFrame *frame)
 {
-	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(cgif);
+	VipsQuantiseResult *this_result = frame->this_result;
+	VipsQuantiseResult **result = &frame->result;
+	gboolean *use_local = &frame->use_local;
 
-	VipsQuantiseResult *this_result;
-
-	if (vips__quantise_image_quantize_fixed(image, cgif->attr, &this_result)) {
-		vips_error(class->nickname, "%s", _("quantisation failed"));
-		return -1;
-	}
+	frame->this_result = NULL;
 
 	/* No global quantiser set up yet? Use this result.
 	 */
@@ -456,9 +547,12 @@ vips_foreign_save_cgif_pick_quantiser(VipsForeignSaveCgif *cgif,
 				   "using global palette\n");
 #endif /*DEBUG_VERBOSE*/
 
+			/* Frames earlier in this batch might still need the old
+			 * local palette, so we can't free it yet.
+			 */
 			VIPS_FREEF(vips__quantise_result_destroy, this_result);
-			VIPS_FREEF(vips__quantise_result_destroy,
-				cgif->free_quantisation_result);
+			frame->retired = cgif->free_quantisation_result;
+			cgif->free_quantisation_result = NULL;
 
 			*result = cgif->quantisation_result;
 			*use_local = FALSE;
@@ -484,8 +578,7 @@ vips_foreign_save_cgif_pick_quantiser(VipsForeignSaveCgif *cgif,
 				   "using new local palette\n");
 #endif /*DEBUG_VERBOSE*/
 
-			VIPS_FREEF(vips__quantise_result_destroy,
-				cgif->free_quantisation_result);
+			frame->retired = cgif->free_quantisation_result;
 			cgif->free_quantisation_result = this_result;
 			cgif->n_palettes_generated += 1;
 
@@ -495,24 +588,116 @@ vips_foreign_save_cgif_pick_quantiser(VipsForeignSaveCgif *cgif,
 	}
 
 	cgif->previous_quantisation_result = *result;
+}
 
-	return 0;
+/* Threshold the alpha channel, and make the palette for just this frame, if
+ * we need one.
+ */
+static void
+vips_foreign_save_cgif_frame_quantise(VipsForeignSaveCgifFrame *frame,
+	gboolean need_result)
+{
+	VipsForeignSaveCgif *cgif = frame->cgif;
+	int n_pels = cgif->frame_height * cgif->frame_width;
+
+	VipsPel *restrict p;
+
+	p = frame->frame_bytes;
+	for (int i = 0; i < n_pels; i++) {
+		if (p[3] >= 128)
+			p[3] = 255;
+		else {
+			/* Helps the quantiser generate a better palette.
+			 */
+			p[0] = 0;
+			p[1] = 0;
+			p[2] = 0;
+			p[3] = 0;
+		}
+
+		p += 4;
+	}
+
+	/* Set up new frame for libimagequant.
+	 */
+	frame->image = vips__quantise_image_create_rgba(frame->attr,
+		frame->frame_bytes, cgif->frame_width, cgif->frame_height, 0);
+
+	if (frame->image &&
+		need_result)
+		frame->err = vips__quantise_image_quantize_fixed(frame->image,
+			frame->attr, &frame->this_result);
+}
+
+/* Dither the frame into @index.
+ */
+static void
+vips_foreign_save_cgif_frame_remap(VipsForeignSaveCgifFrame *frame)
+{
+	VipsForeignSaveCgif *cgif = frame->cgif;
+	int n_pels = cgif->frame_height * cgif->frame_width;
+
+	frame->err = vips__quantise_write_remapped_image(
+		frame->copy ? frame->copy : frame->result,
+		frame->image, frame->index, n_pels);
 }
 
-/* We have a complete frame -- write!
+static void
+vips_foreign_save_cgif_frame_work(void *data, void *user_data)
+{
+	VipsForeignSaveCgifFrame *frame = (VipsForeignSaveCgifFrame *) data;
+	VipsForeignSaveCgif *cgif = frame->cgif;
+
+	switch (cgif->phase) {
+	case VIPS_FOREIGN_SAVE_CGIF_PHASE_QUANTISE:
+		/* The first frame in GLOBAL mode makes the global palette, if
+		 * there's no input palette.
+		 */
+		vips_foreign_save_cgif_frame_quantise(frame,
+			cgif->mode == VIPS_FOREIGN_SAVE_CGIF_MODE_LOCAL ||
+				(!cgif->quantisation_result && frame == cgif->frames));
+		break;
+
+	case VIPS_FOREIGN_SAVE_CGIF_PHASE_REMAP:
+		if (!frame->serial)
+			vips_foreign_save_cgif_frame_remap(frame);
+		break;
+
+	default:
+		g_assert_not_reached();
+	}
+
+	vips_semaphore_up(&cgif->finish);
+}
+
+/* Run a phase over the frames in the batch, one thread each, and wait for
+ * them all.
+ */
+static void
+vips_foreign_save_cgif_frames_run(VipsForeignSaveCgif *cgif,
+	VipsForeignSaveCgifPhase phase)
+{
+	cgif->phase = phase;
+
+	for (int i = 1; i < cgif->n_batch; i++)
+		vips__thread_execute_or_run("cgifsave",
+			vips_foreign_save_cgif_frame_work, &cgif->frames[i]);
+	vips_foreign_save_cgif_frame_work(&cgif->frames[0], NULL);
+
+	vips_semaphore_downn(&cgif->finish, cgif->n_batch);
+}
+
+/* We have a quantised and remapped frame -- write!
  */
 static int
-vips_foreign_save_cgif_write_frame(VipsForeignSaveCgif *cgif)
+vips_foreign_save_cgif_write_frame(VipsForeignSaveCgif *cgif,
+	VipsForeignSaveCgifFrame *frame)
 {
-	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(cgif);
 	int n_pels = cgif->frame_height * cgif->frame_width;
 
 	gboolean has_transparency;
 	gboolean has_alpha_constraint;
 	VipsPel *restrict p;
-	VipsQuantiseImage *image;
-	gboolean use_local;
-	VipsQuantiseResult *quantisation_result;
 	const VipsQuantisePalette *lp;
 	CGIF_FrameConfig frame_config = { 0 };
 	int n_colours;
@@ -522,9 +707,7 @@ vips_foreign_save_cgif_write_frame(VipsForeignSaveCgif *cgif)
 	printf("vips_foreign_save_cgif_write_frame: %d\n", cgif->page_number);
 #endif /*DEBUG_VERBOSE*/
 
-	/* Threshold the alpha channel.
-	 *
-	 * Also, check if the alpha channel of the current frame matches the
+	/* Check if the alpha channel of the current frame matches the
 	 * frame before.
 	 *
 	 * If the current frame has an alpha component which is not identical
@@ -532,64 +715,26 @@ vips_foreign_save_cgif_write_frame(VipsForeignSaveCgif *cgif)
 	 * for the alpha channel instead of for the transparency size
 	 * optimization (maxerror).
 	 */
-	p = cgif->frame_bytes;
+	p = frame->frame_bytes;
 	has_alpha_constraint = FALSE;
-	for (int i = 0; i < n_pels; i++) {
-		if (p[3] >= 128)
-			p[3] = 255;
-		else {
-			/* Helps the quantiser generate a better palette.
-			 */
-			p[0] = 0;
-			p[1] = 0;
-			p[2] = 0;
-			p[3] = 0;
-
-			if (cgif->page_number > 0 &&
-				cgif->previous_frame[i * 4 + 3])
+	if (cgif->page_number > 0)
+		for (int i = 0; i < n_pels; i++) {
+			if (!p[3] &&
+				cgif->previous_frame[i * 4 + 3]) {
 				has_alpha_constraint = TRUE;
-		}
-
-		p += 4;
-	}
-
-	/* Set up new frame for libimagequant.
-	 */
-	image = vips__quantise_image_create_rgba(cgif->attr,
-		cgif->frame_bytes, cgif->frame_width, cgif->frame_height, 0);
+				break;
+			}
 
-	if (cgif->mode == VIPS_FOREIGN_SAVE_CGIF_MODE_LOCAL ||
-		!cgif->quantisation_result) {
-		/* Reoptimising each frame, or no global palette set up yet.
-		 */
-		if (vips_foreign_save_cgif_pick_quantiser(cgif,
-				image, &quantisation_result, &use_local))
-			return -1;
-	}
-	else {
-		quantisation_result = cgif->quantisation_result;
-		use_local = FALSE;
-	}
+			p += 4;
+		}
 
-	lp = vips__quantise_get_palette(quantisation_result);
+	lp = vips__quantise_get_palette(frame->result);
 	/* If there's a transparent pixel, it's always first.
 	 */
 	has_transparency = lp->entries[0].a == 0;
 	n_colours = lp->count;
 	vips_foreign_save_cgif_get_rgb_palette(cgif,
-		quantisation_result, palette_rgb);
-
-	/* Dither frame into @index.
-	 */
-	vips__quantise_set_dithering_level(quantisation_result, cgif->dither);
-	if (vips__quantise_write_remapped_image(quantisation_result,
-			image, cgif->index, n_pels)) {
-		vips_error(class->nickname, "%s", _("dither failed"));
-		VIPS_FREEF(vips__quantise_image_destroy, image);
-		return -1;
-	}
-
-	VIPS_FREEF(vips__quantise_image_destroy, image);
+		frame->result, palette_rgb);
 
 	/* Remapping is relatively slow, trigger eval callbacks.
 	 */
@@ -650,7 +795,7 @@ vips_foreign_save_cgif_write_frame(VipsForeignSaveCgif *cgif)
 		int trans = has_transparency ? 0 : n_colours;
 
 		vips_foreign_save_cgif_set_transparent(cgif,
-			cgif->previous_frame, cgif->frame_bytes, cgif->index,
+			cgif->previous_frame, frame->frame_bytes, frame->index,
 			n_pels, cgif->frame_width, trans);
 
 		if (has_transparency)
@@ -661,7 +806,7 @@ vips_foreign_save_cgif_write_frame(VipsForeignSaveCgif *cgif)
 	else {
 		/* Take a copy of the RGBA frame.
 		 */
-		memcpy(cgif->previous_frame, cgif->frame_bytes, 4 * n_pels);
+		memcpy(cgif->previous_frame, frame->frame_bytes, 4 * n_pels);
 	}
 
 	if (cgif->delay &&
@@ -670,7 +815,7 @@ vips_foreign_save_cgif_write_frame(VipsForeignSaveCgif *cgif)
 
 	/* Attach a local palette, if we need one.
 	 */
-	if (use_local) {
+	if (frame->use_local) {
 		frame_config.attrFlags |= CGIF_FRAME_ATTR_USE_LOCAL_TABLE;
 		frame_config.pLocalPalette = palette_rgb;
 		frame_config.numLocalPaletteEntries = n_colours;
@@ -688,14 +833,98 @@ vips_foreign_save_cgif_write_frame(VipsForeignSaveCgif *cgif)
 
 	/* Write frame to cgif.
 	 */
-	frame_config.pImageData = cgif->index;
+	frame_config.pImageData = frame->index;
 	cgif_addframe(cgif->cgif_context, &frame_config);
 
 	return 0;
 }
 
+/* Quantise and remap the batch of frames we have, then write them in order.
+ *
+ * Finding a palette is the slow part of quantisation, so we do that for all
+ * frames in parallel, then pick the palette for each frame in order.
+ * Results hold remap state, so a frame can only remap in parallel with
+ * others if no other frame is using its palette, or if it has a copy.
+ */
+static int
+vips_foreign_save_cgif_write_batch(VipsForeignSaveCgif *cgif)
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(cgif);
+
+	int i, j;
+
+	vips_foreign_save_cgif_frames_run(cgif,
+		VIPS_FOREIGN_SAVE_CGIF_PHASE_QUANTISE);
+
+	for (i = 0; i < cgif->n_batch; i++) {
+		VipsForeignSaveCgifFrame *frame = &cgif->frames[i];
+
+		if (!frame->image ||
+			frame->err) {
+			vips_error(class->nickname, "%s", _("quantisation failed"));
+			return -1;
+		}
+
+		if (frame->this_result)
+			vips_foreign_save_cgif_pick_quantiser(cgif, frame);
+		else {
+			frame->result = cgif->quantisation_result;
+			frame->use_local = FALSE;
+		}
+
+		for (j = 0; j < i; j++)
+			if (cgif->frames[j].result == frame->result)
+				break;
+		if (j < i &&
+			vips__quantise_result_copy(frame->attr,
+				frame->result, &frame->copy))
+			frame->serial = TRUE;
+
+		vips__quantise_set_dithering_level(
+			frame->copy ? frame->copy : frame->result, cgif->dither);
+	}
+
+	/* A single frame can be remapped in bands instead.
+	 */
+	if (cgif->n_batch == 1) {
+		VipsForeignSaveCgifFrame *frame = &cgif->frames[0];
+
+		frame->err = vips__quantise_remap(frame->attr, frame->result,
+			frame->image, frame->frame_bytes,
+			cgif->frame_width, cgif->frame_height, cgif->dither,
+			frame->index);
+	}
+	else {
+		vips_foreign_save_cgif_frames_run(cgif,
+			VIPS_FOREIGN_SAVE_CGIF_PHASE_REMAP);
+
+		for (i = 0; i < cgif->n_batch; i++)
+			if (cgif->frames[i].serial)
+				vips_foreign_save_cgif_frame_remap(&cgif->frames[i]);
+	}
+
+	for (i = 0; i < cgif->n_batch; i++)
+		if (cgif->frames[i].err) {
+			vips_error(class->nickname, "%s", _("dither failed"));
+			return -1;
+		}
+
+	for (i = 0; i < cgif->n_batch; i++) {
+		if (vips_foreign_save_cgif_write_frame(cgif, &cgif->frames[i]))
+			return -1;
+
+		cgif->page_number += 1;
+	}
+
+	for (i = 0; i < cgif->n_batch; i++)
+		vips_foreign_save_cgif_frame_clear(&cgif->frames[i]);
+	cgif->n_batch = 0;
+
+	return 0;
+}
+
 /* Another chunk of pixels have arrived from the pipeline. Add to frame, and
- * if the frame completes, compress and write to the target.
+ * if the batch of frames completes, compress and write to the target.
  */
 static int
 vips_foreign_save_cgif_sink_disc(VipsRegion *region, VipsRect *area, void *a)
@@ -709,23 +938,43 @@ vips_foreign_save_cgif_sink_disc(VipsRegion *region, VipsRect *area, void *a)
 #endif /*DEBUG_VERBOSE*/
 
 	for (int y = 0; y < area->height; y++) {
-		memcpy(cgif->frame_bytes + cgif->write_y * line_size,
+		VipsForeignSaveCgifFrame *frame = &cgif->frames[cgif->n_batch];
+
+		memcpy(frame->frame_bytes + cgif->write_y * line_size,
 			VIPS_REGION_ADDR(region, 0, area->top + y),
 			line_size);
 		cgif->write_y += 1;
 
 		if (cgif->write_y >= cgif->frame_height) {
-			if (vips_foreign_save_cgif_write_frame(cgif))
-				return -1;
-
 			cgif->write_y = 0;
-			cgif->page_number += 1;
+			cgif->n_batch += 1;
+
+			if (cgif->n_batch == cgif->n_frames ||
+				cgif->page_number + cgif->n_batch == cgif->n_pages)
+				if (vips_foreign_save_cgif_write_batch(cgif))
+					return -1;
 		}
 	}
 
 	return 0;
 }
 
+static VipsQuantiseAttr *
+vips_foreign_save_cgif_attr_new(VipsForeignSaveCgif *cgif)
+{
+	VipsQuantiseAttr *attr;
+
+	attr = vips__quantise_attr_create();
+	/* Limit the number of colours to 255 so there is always one index
+	 * free for transparency optimization.
+	 */
+	vips__quantise_set_max_colors(attr, VIPS_MIN(255, 1 << cgif->bitdepth));
+	vips__quantise_set_quality(attr, 0, 100);
+	vips__quantise_set_speed(attr, 11 - cgif->effort);
+
+	return attr;
+}
+
 static int
 vips_foreign_save_cgif_build(VipsObject *object)
 {
@@ -772,30 +1021,37 @@ vips_foreign_save_cgif_build(VipsObject *object)
 		return -1;
 	}
 
-	/* This RGBA frame as a contiguous buffer.
-	 */
-	cgif->frame_bytes = g_malloc0((size_t) 4 *
-		cgif->frame_width * cgif->frame_height);
-
 	/* The previous RGBA frame (for spotting pixels which haven't changed).
 	 */
 	cgif->previous_frame = g_malloc0((size_t) 4 *
 		cgif->frame_width * cgif->frame_height);
 
-	/* The frame index buffer.
-	 */
-	cgif->index = g_malloc0((size_t) cgif->frame_width * cgif->frame_height);
-
 	/* Set up libimagequant.
 	 */
-	cgif->attr = vips__quantise_attr_create();
-	/* Limit the number of colours to 255 so there is always one index
-	 * free for transparency optimization.
+	cgif->attr = vips_foreign_save_cgif_attr_new(cgif);
+
+	/* The batch of frames we quantise in parallel. Each needs an RGBA
+	 * buffer and an index buffer.
 	 */
-	vips__quantise_set_max_colors(cgif->attr,
-		VIPS_MIN(255, 1 << cgif->bitdepth));
-	vips__quantise_set_quality(cgif->attr, 0, 100);
-	vips__quantise_set_speed(cgif->attr, 11 - cgif->effort);
+	cgif->n_pages = cgif->in->Ysize / cgif->frame_height;
+	cgif->n_frames = VIPS_MIN(vips_concurrency_get(), cgif->n_pages);
+	cgif->n_frames = VIPS_MIN(cgif->n_frames, CGIF_BATCH_SIZE /
+		((size_t) 5 * cgif->frame_width * cgif->frame_height));
+	cgif->n_frames = VIPS_MAX(1, cgif->n_frames);
+	cgif->frames = g_new0(VipsForeignSaveCgifFrame, cgif->n_frames);
+	for (int i = 0; i < cgif->n_frames; i++) {
+		VipsForeignSaveCgifFrame *frame = &cgif->frames[i];
+
+		frame->cgif = cgif;
+		frame->frame_bytes = g_malloc0((size_t) 4 *
+			cgif->frame_width * cgif->frame_height);
+		frame->index = g_malloc0((size_t)
+			cgif->frame_width * cgif->frame_height);
+		frame->attr = vips_foreign_save_cgif_attr_new(cgif);
+	}
+
+	vips_semaphore_init(&cgif->finish, 0, "finish");
+	cgif->finish_init = TRUE;
 
 	/* Read the palette on the input if we've not been asked to
 	 * reoptimise.
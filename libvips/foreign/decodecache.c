@@ -0,0 +1,466 @@
+/* A process-wide cache of decoded tiles, shared between loaders.
+ *
+ * 18/10/26
+ *	- first version!
+ *	- don't track tile memory
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+
+/* Tiled loaders can ask this cache for a tile before they decode it, and
+ * offer it the tile afterwards. Several loads of the same file, perhaps
+ * from several viewers of the same slide, then only decode each tile once.
+ *
+ * Tiles are keyed by a string identifying the file and the loader state,
+ * plus a page number and the tile position. The file part of the string
+ * includes the size and modification time, so an edited file won't match.
+ */
+typedef struct _VipsDecodeTile {
+	/* The key.
+	 */
+	char *id;
+	int page;
+	int x;
+	int y;
+
+	/* The decoded pixels.
+	 */
+	VipsPel *data;
+	size_t length;
+
+	/* Our link in the LRU queue, most recently used at the head.
+	 */
+	GList link;
+} VipsDecodeTile;
+
+static GMutex vips_decode_cache_lock;
+
+/* All tiles, hashed on the key. The table owns the tiles.
+ */
+static GHashTable *vips_decode_cache_table = NULL;
+static GQueue vips_decode_cache_lru = G_QUEUE_INIT;
+
+/* Off by default.
+ */
+static size_t vips_decode_cache_max_mem = 0;
+static size_t vips_decode_cache_mem = 0;
+
+static guint64 vips_decode_cache_hits = 0;
+static guint64 vips_decode_cache_misses = 0;
+
+static guint
+vips_decode_tile_hash(gconstpointer key)
+{
+	VipsDecodeTile *tile = (VipsDecodeTile *) key;
+
+	guint hash;
+
+	hash = g_str_hash(tile->id);
+	hash = hash * 31 + tile->page;
+	hash = hash * 31 + tile->x;
+	hash = hash * 31 + tile->y;
+
+	return hash;
+}
+
+static gboolean
+vips_decode_tile_equal(gconstpointer a, gconstpointer b)
+{
+	VipsDecodeTile *tile1 = (VipsDecodeTile *) a;
+	VipsDecodeTile *tile2 = (VipsDecodeTile *) b;
+
+	return tile1->page == tile2->page &&
+		tile1->x == tile2->x &&
+		tile1->y == tile2->y &&
+		strcmp(tile1->id, tile2->id) == 0;
+}
+
+static void
+vips_decode_tile_free(VipsDecodeTile *tile)
+{
+	VIPS_FREE(tile->id);
+	VIPS_FREE(tile->data);
+	g_free(tile);
+}
+
+/* Drop tiles from the cold end of the queue until we fit in @max_mem. Call
+ * with the lock held.
+ */
+static void
+vips_decode_cache_trim(size_t max_mem)
+{
+	GList *link;
+
+	while (vips_decode_cache_mem > max_mem &&
+		(link = g_queue_peek_tail_link(&vips_decode_cache_lru))) {
+		VipsDecodeTile *tile = (VipsDecodeTile *) link->data;
+
+		g_queue_unlink(&vips_decode_cache_lru, link);
+		vips_decode_cache_mem -= tile->length;
+		g_hash_table_remove(vips_decode_cache_table, tile);
+	}
+}
+
+/* Find a tile and move it to the head of the queue. Call with the lock held.
+ */
+static VipsDecodeTile *
+vips_decode_cache_lookup(const char *id, int page, int x, int y,
+	size_t length)
+{
+	VipsDecodeTile key;
+	VipsDecodeTile *tile;
+
+	if (!vips_decode_cache_table)
+		return NULL;
+
+	key.id = (char *) id;
+	key.page = page;
+	key.x = x;
+	key.y = y;
+	if (!(tile = g_hash_table_lookup(vips_decode_cache_table, &key)) ||
+		tile->length != length)
+		return NULL;
+
+	g_queue_unlink(&vips_decode_cache_lru, &tile->link);
+	g_queue_push_head_link(&vips_decode_cache_lru, &tile->link);
+
+	return tile;
+}
+
+/* Add a tile, unless another thread got there first. Call with the lock
+ * held.
+ */
+static void
+vips_decode_cache_add(VipsDecodeTile *tile)
+{
+	if (!vips_decode_cache_table)
+		vips_decode_cache_table = g_hash_table_new_full(
+			vips_decode_tile_hash, vips_decode_tile_equal,
+			NULL, (GDestroyNotify) vips_decode_tile_free);
+
+	if (g_hash_table_contains(vips_decode_cache_table, tile)) {
+		vips_decode_tile_free(tile);
+		return;
+	}
+
+	g_hash_table_add(vips_decode_cache_table, tile);
+	g_queue_push_head_link(&vips_decode_cache_lru, &tile->link);
+	vips_decode_cache_mem += tile->length;
+
+	vips_decode_cache_trim(vips_decode_cache_max_mem);
+}
+
+static VipsDecodeTile *
+vips_decode_tile_new(const char *id, int page, int x, int y, size_t length)
+{
+	VipsDecodeTile *tile;
+
+	tile = g_new0(VipsDecodeTile, 1);
+	tile->id = g_strdup(id);
+	tile->page = page;
+	tile->x = x;
+	tile->y = y;
+	tile->length = length;
+	tile->link.data = tile;
+
+	/* The cache has its own limit, so don't count tiles in
+	 * vips_tracked_get_mem(), or a full decode cache would make the
+	 * operation cache drop entries. Running out of memory here just means
+	 * we don't cache this tile.
+	 */
+	if (!(tile->data = g_try_malloc(length))) {
+		vips_decode_tile_free(tile);
+		return NULL;
+	}
+
+	return tile;
+}
+
+/* Make the id for tiles from @filename, with a loader-specific part made
+ * from @format. NULL means this load should not use the cache, perhaps
+ * because there's no file, or the cache is off.
+ */
+char *
+vips__decode_cache_id(const char *filename, const char *format, ...)
+{
+	GStatBuf st;
+	va_list ap;
+	char *state;
+	char *id;
+
+	if (!filename ||
+		vips_decode_cache_max_mem == 0 ||
+		g_stat(filename, &st))
+		return NULL;
+
+	va_start(ap, format);
+	state = g_strdup_vprintf(format, ap);
+	va_end(ap);
+
+	id = g_strdup_printf("%s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+						 " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %s",
+		filename,
+		(guint64) st.st_dev, (guint64) st.st_ino,
+		(gint64) st.st_size, (gint64) st.st_mtime,
+		state);
+	g_free(state);
+
+#ifdef DEBUG
+	printf("vips__decode_cache_id: %s\n", id);
+#endif /*DEBUG*/
+
+	return id;
+}
+
+/* Copy a tile to @buf. FALSE means it wasn't in the cache and the caller
+ * must decode it.
+ */
+gboolean
+vips__decode_cache_get(const char *id, int page, int x, int y,
+	void *buf, size_t length)
+{
+	VipsDecodeTile *tile;
+	gboolean hit;
+
+	if (!id)
+		return FALSE;
+
+	g_mutex_lock(&vips_decode_cache_lock);
+
+	if ((tile = vips_decode_cache_lookup(id, page, x, y, length))) {
+		memcpy(buf, tile->data, length);
+		vips_decode_cache_hits += 1;
+		hit = TRUE;
+	}
+	else {
+		vips_decode_cache_misses += 1;
+		hit = FALSE;
+	}
+
+	g_mutex_unlock(&vips_decode_cache_lock);
+
+	return hit;
+}
+
+/* Offer a freshly decoded tile to the cache.
+ */
+void
+vips__decode_cache_put(const char *id, int page, int x, int y,
+	const void *buf, size_t length)
+{
+	VipsDecodeTile *tile;
+
+	if (!id ||
+		length > vips_decode_cache_max_mem ||
+		!(tile = vips_decode_tile_new(id, page, x, y, length)))
+		return;
+
+	memcpy(tile->data, buf, length);
+
+	g_mutex_lock(&vips_decode_cache_lock);
+	vips_decode_cache_add(tile);
+	g_mutex_unlock(&vips_decode_cache_lock);
+}
+
+/* As vips__decode_cache_get(), but fill the valid area of a region. Tiles are
+ * keyed on the top-left corner of the area.
+ */
+gboolean
+vips__decode_cache_get_region(const char *id, int page, VipsRegion *region)
+{
+	VipsRect *r = &region->valid;
+	size_t line = VIPS_REGION_SIZEOF_LINE(region);
+
+	VipsDecodeTile *tile;
+	gboolean hit;
+
+	if (!id)
+		return FALSE;
+
+	g_mutex_lock(&vips_decode_cache_lock);
+
+	if ((tile = vips_decode_cache_lookup(id, page, r->left, r->top,
+			 line * r->height))) {
+		for (int y = 0; y < r->height; y++)
+			memcpy(VIPS_REGION_ADDR(region, r->left, r->top + y),
+				tile->data + y * line, line);
+		vips_decode_cache_hits += 1;
+		hit = TRUE;
+	}
+	else {
+		vips_decode_cache_misses += 1;
+		hit = FALSE;
+	}
+
+	g_mutex_unlock(&vips_decode_cache_lock);
+
+	return hit;
+}
+
+/* As vips__decode_cache_put(), but from the valid area of a region.
+ */
+void
+vips__decode_cache_put_region(const char *id, int page, VipsRegion *region)
+{
+	VipsRect *r = &region->valid;
+	size_t line = VIPS_REGION_SIZEOF_LINE(region);
+	size_t length = line * r->height;
+
+	VipsDecodeTile *tile;
+
+	if (!id ||
+		length > vips_decode_cache_max_mem ||
+		!(tile = vips_decode_tile_new(id, page, r->left, r->top, length)))
+		return;
+
+	for (int y = 0; y < r->height; y++)
+		memcpy(tile->data + y * line,
+			VIPS_REGION_ADDR(region, r->left, r->top + y), line);
+
+	g_mutex_lock(&vips_decode_cache_lock);
+	vips_decode_cache_add(tile);
+	g_mutex_unlock(&vips_decode_cache_lock);
+}
+
+/* Pick up the cache size from the environment.
+ */
+void
+vips__decode_cache_init(void)
+{
+	const char *str;
+
+	if ((str = g_getenv("VIPS_DECODE_CACHE_MAX")))
+		vips_decode_cache_max_mem = vips__parse_size(str);
+}
+
+/* Free all tiles. Run on vips_shutdown().
+ */
+void
+vips__decode_cache_shutdown(void)
+{
+	g_mutex_lock(&vips_decode_cache_lock);
+
+	vips_decode_cache_trim(0);
+	VIPS_FREEF(g_hash_table_destroy, vips_decode_cache_table);
+
+	g_mutex_unlock(&vips_decode_cache_lock);
+}
+
+/**
+ * vips_decode_cache_set_max_mem:
+ * @max_mem: maximum number of bytes of decoded tiles to keep
+ *
+ * Tiled loaders, such as [ctor@Image.tiffload] for tiled and pyramidal TIFF,
+ * [ctor@Image.openslideload] and [ctor@Image.jp2kload], can share decoded
+ * tiles through a process-wide cache. If several loads of the same file
+ * are running at once, for example in a tile server with many viewers,
+ * each tile is only decoded once.
+ *
+ * This sets the most memory the cache will hold. The least recently used
+ * tiles are dropped first. Set 0 to disable the cache. The default is 0, or
+ * the value of the `VIPS_DECODE_CACHE_MAX` environment variable.
+ *
+ * Cached tiles are not included in [func@tracked_get_mem].
+ *
+ * Only loads from files use the cache, and only loads which start while
+ * the cache is enabled.
+ *
+ * ::: seealso
+ *     [func@decode_cache_get_stats].
+ */
+void
+vips_decode_cache_set_max_mem(size_t max_mem)
+{
+	g_mutex_lock(&vips_decode_cache_lock);
+
+	vips_decode_cache_max_mem = max_mem;
+	vips_decode_cache_trim(max_mem);
+
+	g_mutex_unlock(&vips_decode_cache_lock);
+}
+
+/**
+ * vips_decode_cache_get_max_mem:
+ *
+ * Get the most memory the decoded tile cache will hold.
+ *
+ * ::: seealso
+ *     [func@decode_cache_set_max_mem].
+ *
+ * Returns: the maximum size of the cache in bytes
+ */
+size_t
+vips_decode_cache_get_max_mem(void)
+{
+	return vips_decode_cache_max_mem;
+}
+
+/**
+ * vips_decode_cache_get_stats:
+ * @hits: (out) (optional): return the number of tiles found in the cache
+ * @misses: (out) (optional): return the number of tiles which had to be
+ *   decoded
+ * @cached: (out) (optional): return the number of bytes in the cache
+ *
+ * Get statistics for the decoded tile cache.
+ *
+ * ::: seealso
+ *     [func@decode_cache_set_max_mem].
+ */
+void
+vips_decode_cache_get_stats(guint64 *hits, guint64 *misses, size_t *cached)
+{
+	g_mutex_lock(&vips_decode_cache_lock);
+
+	if (hits)
+		*hits = vips_decode_cache_hits;
+	if (misses)
+		*misses = vips_decode_cache_misses;
+	if (cached)
+		*cached = vips_decode_cache_mem;
+
+	g_mutex_unlock(&vips_decode_cache_lock);
+}
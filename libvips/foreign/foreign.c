@@ -26,6 +26,9 @@
  * 	- drop incompatible ICC profiles before save
  * 24/7/21
  * 	- add fail_on
+ * 18/10/26
+ * 	- pick loaders with a table of signatures
+ * 	- loaders can decode just a region of interest
  */
 
 /*
@@ -66,6 +69,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <vips/vips.h>
 #include <vips/internal.h>
@@ -506,18 +510,60 @@ vips_foreign_map(const char *base, VipsSListMap2Fn fn, void *a, void *b)
 /* Abstract base class for image load.
  */
 
-G_DEFINE_ABSTRACT_TYPE(VipsForeignLoad, vips_foreign_load, VIPS_TYPE_FOREIGN);
+/* Decoding just a region of interest. This is private, so it can change
+ * without breaking the ABI of VipsForeignLoad.
+ */
+typedef struct _VipsForeignLoadPrivate {
+	/* Only this area of @out will be read, or an empty rect for the
+	 * whole image. Set just before the decode starts.
+	 */
+	VipsRect roi;
+
+	/* The area of @out that @real holds.
+	 */
+	VipsRect area;
+
+	/* For source loaders, a new source on the same file or memory to
+	 * reload from, since the decode still owns the original.
+	 */
+	VipsSource *reload;
+
+	/* A load of the whole image for any pixels outside @area, made on
+	 * first use under @lock.
+	 */
+	GMutex lock;
+	VipsForeignLoad *whole;
+} VipsForeignLoadPrivate;
+
+G_DEFINE_ABSTRACT_TYPE_WITH_PRIVATE(VipsForeignLoad, vips_foreign_load,
+	VIPS_TYPE_FOREIGN);
 
 static void
 vips_foreign_load_dispose(GObject *gobject)
 {
 	VipsForeignLoad *load = VIPS_FOREIGN_LOAD(gobject);
+	VipsForeignLoadPrivate *priv =
+		vips_foreign_load_get_instance_private(load);
 
 	VIPS_UNREF(load->real);
+	VIPS_UNREF(priv->whole);
+	VIPS_UNREF(priv->reload);
 
 	G_OBJECT_CLASS(vips_foreign_load_parent_class)->dispose(gobject);
 }
 
+static void
+vips_foreign_load_finalize(GObject *gobject)
+{
+	VipsForeignLoad *load = VIPS_FOREIGN_LOAD(gobject);
+	VipsForeignLoadPrivate *priv =
+		vips_foreign_load_get_instance_private(load);
+
+	g_mutex_clear(&priv->lock);
+
+	G_OBJECT_CLASS(vips_foreign_load_parent_class)->finalize(gobject);
+}
+
 static void
 vips_foreign_load_summary_class(VipsObjectClass *object_class, VipsBuf *buf)
 {
@@ -548,6 +594,281 @@ vips_foreign_load_summary_class(VipsObjectClass *object_class, VipsBuf *buf)
 	}
 }
 
+/* Signatures are attached to loader types as qdata, so we don't need to
+ * change the layout of VipsForeignLoadClass.
+ */
+static GQuark vips_foreign_signatures_quark = 0;
+static GQuark vips_foreign_signatures_only_quark = 0;
+
+/* Set the byte patterns which files in this format must match. If none
+ * match, we won't call the is_a() methods. If @signatures_only is set, we
+ * pick this loader on a signature match and never call is_a().
+ *
+ * Subclasses inherit the signatures of their parent unless they set their
+ * own. Call this from class_init.
+ */
+void
+vips__foreign_load_set_signatures(VipsForeignLoadClass *load_class,
+	const VipsForeignSignature *signatures, gboolean signatures_only)
+{
+	GType type = G_TYPE_FROM_CLASS(load_class);
+
+	if (!vips_foreign_signatures_quark) {
+		vips_foreign_signatures_quark =
+			g_quark_from_static_string("vips-foreign-signatures");
+		vips_foreign_signatures_only_quark =
+			g_quark_from_static_string("vips-foreign-signatures-only");
+	}
+
+	g_type_set_qdata(type, vips_foreign_signatures_quark,
+		(gpointer) signatures);
+	g_type_set_qdata(type, vips_foreign_signatures_only_quark,
+		GINT_TO_POINTER(signatures_only));
+}
+
+/* Find the signatures for a loader, searching up the type hierarchy.
+ */
+static const VipsForeignSignature *
+vips_foreign_load_get_signatures(VipsForeignLoadClass *load_class,
+	gboolean *signatures_only)
+{
+	GType type;
+
+	*signatures_only = FALSE;
+	if (!vips_foreign_signatures_quark)
+		return NULL;
+
+	for (type = G_TYPE_FROM_CLASS(load_class); type;
+		 type = g_type_parent(type)) {
+		const VipsForeignSignature *signatures;
+
+		if ((signatures = g_type_get_qdata(type,
+				 vips_foreign_signatures_quark))) {
+			*signatures_only = GPOINTER_TO_INT(g_type_get_qdata(type,
+				vips_foreign_signatures_only_quark));
+			return signatures;
+		}
+	}
+
+	return NULL;
+}
+
+/* A loader in the table, with its signatures looked up.
+ */
+typedef struct _VipsForeignLoadCandidate {
+	VipsForeignLoadClass *load_class;
+	const VipsForeignSignature *signatures;
+	gboolean signatures_only;
+} VipsForeignLoadCandidate;
+
+/* The loaders of one kind (file, buffer or source) in priority order, with a
+ * jump table on the first byte. We sniff the first few bytes once, then only
+ * run the is_a() methods of loaders whose signatures match.
+ */
+typedef struct _VipsForeignLoadTable {
+	/* "", "_buffer" or "_source".
+	 */
+	const char *suffix;
+
+	GOnce once;
+
+	/* The candidates for each value of the first byte, and one more for
+	 * data too short to have a first byte. Arrays of
+	 * VipsForeignLoadCandidate in priority order.
+	 */
+	GArray *first[257];
+
+	/* The number of bytes we need to test every signature.
+	 */
+	int sniff;
+} VipsForeignLoadTable;
+
+static gboolean
+vips_foreign_signature_match(const VipsForeignSignature *signature,
+	const unsigned char *data, size_t length)
+{
+	int i;
+
+	if (signature->offset + signature->length > length)
+		return FALSE;
+
+	for (i = 0; i < signature->length; i++) {
+		unsigned char mask = signature->mask
+			? signature->mask[i]
+			: 0xff;
+
+		if ((data[signature->offset + i] & mask) !=
+			(((const unsigned char *) signature->magic)[i] & mask))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Could a loader with these signatures match data starting with @first? -1
+ * for no first byte.
+ */
+static gboolean
+vips_foreign_signatures_first(const VipsForeignSignature *signatures,
+	int first)
+{
+	const VipsForeignSignature *signature;
+
+	if (!signatures)
+		return TRUE;
+	if (first < 0)
+		return FALSE;
+
+	for (signature = signatures; signature->magic; signature++) {
+		unsigned char mask = signature->mask
+			? signature->mask[0]
+			: 0xff;
+
+		if (signature->offset > 0 ||
+			(first & mask) ==
+				(((const unsigned char *) signature->magic)[0] & mask))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void *
+vips_foreign_load_table_add(VipsForeignLoadClass *load_class, GSList **classes)
+{
+	/* Blocking can change at runtime, so we test for that during the
+	 * search.
+	 */
+	if (vips_isprefix("rawload", VIPS_OBJECT_CLASS(load_class)->nickname))
+		return NULL;
+
+	*classes = g_slist_append(*classes, load_class);
+
+	return NULL;
+}
+
+static void *
+vips_foreign_load_table_build(void *client)
+{
+	VipsForeignLoadTable *table = (VipsForeignLoadTable *) client;
+
+	GSList *classes;
+	GSList *p;
+	int i;
+
+	classes = NULL;
+	(void) vips_class_map_all(g_type_from_name("VipsForeignLoad"),
+		(VipsClassMapFn) vips_foreign_load_table_add, (void *) &classes);
+	classes = g_slist_sort(classes, (GCompareFunc) file_compare);
+
+	for (i = 0; i < 257; i++)
+		table->first[i] = g_array_new(FALSE, FALSE,
+			sizeof(VipsForeignLoadCandidate));
+
+	for (p = classes; p; p = p->next) {
+		VipsForeignLoadClass *load_class = (VipsForeignLoadClass *) p->data;
+		const char *nickname = VIPS_OBJECT_CLASS(load_class)->nickname;
+		VipsForeignLoadCandidate candidate;
+		const VipsForeignSignature *signature;
+
+		/* The file loaders have no suffix.
+		 */
+		if (table->suffix[0]
+				? !g_str_has_suffix(nickname, table->suffix)
+				: (g_str_has_suffix(nickname, "_buffer") ||
+					  g_str_has_suffix(nickname, "_source")))
+			continue;
+
+		candidate.load_class = load_class;
+		candidate.signatures = vips_foreign_load_get_signatures(load_class,
+			&candidate.signatures_only);
+
+		for (i = 0; i < 257; i++)
+			if (vips_foreign_signatures_first(candidate.signatures,
+					i < 256 ? i : -1))
+				g_array_append_val(table->first[i], candidate);
+
+		if (candidate.signatures)
+			for (signature = candidate.signatures;
+				 signature->magic; signature++)
+				table->sniff = VIPS_MAX(table->sniff,
+					signature->offset + signature->length);
+	}
+
+	g_slist_free(classes);
+
+	return NULL;
+}
+
+/* Search the table for a loader for some data. @data is the start of the
+ * file, buffer or source, and @is_a is the test we run for candidates.
+ */
+static VipsForeignLoadClass *
+vips_foreign_load_table_search(VipsForeignLoadTable *table,
+	const unsigned char *data, size_t length,
+	VipsSListMap2Fn is_a, void *a, void *b)
+{
+	GArray *candidates = table->first[length > 0 ? data[0] : 256];
+
+	int i;
+
+	for (i = 0; i < candidates->len; i++) {
+		VipsForeignLoadCandidate *candidate =
+			&g_array_index(candidates, VipsForeignLoadCandidate, i);
+		VipsForeignLoadClass *load_class = candidate->load_class;
+		VipsOperationClass *operation_class =
+			VIPS_OPERATION_CLASS(load_class);
+
+		if (operation_class->flags & VIPS_OPERATION_BLOCKED)
+			continue;
+
+		if (candidate->signatures) {
+			const VipsForeignSignature *signature;
+
+			for (signature = candidate->signatures;
+				 signature->magic; signature++)
+				if (vips_foreign_signature_match(signature, data, length))
+					break;
+
+			/* No signature matched, so this can't be the loader.
+			 */
+			if (!signature->magic)
+				continue;
+
+			if (candidate->signatures_only)
+				return load_class;
+		}
+
+#ifdef DEBUG
+		printf("vips_foreign_load_table_search: testing %s\n",
+			VIPS_OBJECT_CLASS(load_class)->nickname);
+#endif /*DEBUG*/
+
+		if (is_a(load_class, a, b))
+			return load_class;
+	}
+
+	return NULL;
+}
+
+static VipsForeignLoadTable vips_foreign_load_table_file = {
+	"", G_ONCE_INIT
+};
+static VipsForeignLoadTable vips_foreign_load_table_buffer = {
+	"_buffer", G_ONCE_INIT
+};
+static VipsForeignLoadTable vips_foreign_load_table_source = {
+	"_source", G_ONCE_INIT
+};
+
+static VipsForeignLoadTable *
+vips_foreign_load_table_get(VipsForeignLoadTable *table)
+{
+	VIPS_ONCE(&table->once, vips_foreign_load_table_build, table);
+
+	return table;
+}
+
 /* Can this VipsForeign open this file?
  */
 static void *
@@ -607,6 +928,9 @@ vips_foreign_find_load(const char *name)
 {
 	char filename[VIPS_PATH_MAX];
 	char option_string[VIPS_PATH_MAX];
+	VipsForeignLoadTable *table;
+	unsigned char *data;
+	gint64 length;
 	VipsForeignLoadClass *load_class;
 
 	vips__filename_split8(name, filename, option_string);
@@ -624,10 +948,16 @@ vips_foreign_find_load(const char *name)
 		return NULL;
 	}
 
-	if (!(load_class = (VipsForeignLoadClass *) vips_foreign_map(
-			  "VipsForeignLoad",
-			  (VipsSListMap2Fn) vips_foreign_find_load_sub,
-			  (void *) filename, NULL))) {
+	table = vips_foreign_load_table_get(&vips_foreign_load_table_file);
+	data = g_malloc0(VIPS_MAX(1, table->sniff));
+	length = vips__get_bytes(filename, data, table->sniff);
+	load_class = vips_foreign_load_table_search(table,
+		data, VIPS_MAX(0, length),
+		(VipsSListMap2Fn) vips_foreign_find_load_sub,
+		(void *) filename, NULL);
+	g_free(data);
+
+	if (!load_class) {
 		vips_error("VipsForeignLoad",
 			_("\"%s\" is not a known file format"), name);
 		return NULL;
@@ -712,8 +1042,9 @@ vips_foreign_find_load_buffer(const void *data, size_t size)
 {
 	VipsForeignLoadClass *load_class;
 
-	if (!(load_class = (VipsForeignLoadClass *) vips_foreign_map(
-			  "VipsForeignLoad",
+	if (!(load_class = vips_foreign_load_table_search(
+			  vips_foreign_load_table_get(&vips_foreign_load_table_buffer),
+			  data, size,
 			  (VipsSListMap2Fn) vips_foreign_find_load_buffer_sub,
 			  &data, &size))) {
 		vips_error("VipsForeignLoad",
@@ -772,12 +1103,27 @@ vips_foreign_find_load_source_sub(void *item, void *a, void *b)
 const char *
 vips_foreign_find_load_source(VipsSource *source)
 {
+	VipsForeignLoadTable *table;
+	unsigned char *sniff;
+	unsigned char *data;
+	gint64 length;
 	VipsForeignLoadClass *load_class;
 
-	if (!(load_class = (VipsForeignLoadClass *) vips_foreign_map(
-			  "VipsForeignLoad",
-			  vips_foreign_find_load_source_sub,
-			  source, NULL))) {
+	/* The sniff buffer can change during is_a(), so we need a copy.
+	 */
+	table = vips_foreign_load_table_get(&vips_foreign_load_table_source);
+	data = g_malloc0(VIPS_MAX(1, table->sniff));
+	length = table->sniff > 0
+		? vips_source_sniff_at_most(source, &sniff, table->sniff)
+		: 0;
+	if (length > 0)
+		memcpy(data, sniff, length);
+	load_class = vips_foreign_load_table_search(table,
+		data, VIPS_MAX(0, length),
+		vips_foreign_find_load_source_sub, source, NULL);
+	g_free(data);
+
+	if (!load_class) {
 		vips_error("VipsForeignLoad",
 			"%s", _("source is not in a known format"));
 		return NULL;
@@ -973,12 +1319,25 @@ vips_foreign_load_temp(VipsForeignLoad *load)
 }
 
 /* Check two images for compatibility: their geometries need to match.
+ * Loaders which can decode part of an image may have loaded just the ROI.
  */
 static gboolean
 vips_foreign_load_iscompat(VipsForeignLoad *load, VipsImage *image)
 {
-	if (load->real->Xsize != image->Xsize ||
-		load->real->Ysize != image->Ysize ||
+	VipsForeignLoadPrivate *priv =
+		vips_foreign_load_get_instance_private(load);
+
+	priv->area.left = 0;
+	priv->area.top = 0;
+	priv->area.width = image->Xsize;
+	priv->area.height = image->Ysize;
+	if (!vips_rect_isempty(&priv->roi) &&
+		load->real->Xsize == priv->roi.width &&
+		load->real->Ysize == priv->roi.height)
+		priv->area = priv->roi;
+
+	if (load->real->Xsize != priv->area.width ||
+		load->real->Ysize != priv->area.height ||
 		load->real->Bands != image->Bands ||
 		load->real->Coding != image->Coding ||
 		load->real->BandFmt != image->BandFmt) {
@@ -992,6 +1351,210 @@ vips_foreign_load_iscompat(VipsForeignLoad *load, VipsImage *image)
 	return TRUE;
 }
 
+/* The area of @image that a downstream image will read.
+ */
+typedef struct _VipsForeignLoadRoi {
+	VipsImage *image;
+	VipsRect roi;
+} VipsForeignLoadRoi;
+
+static GQuark vips__foreign_load_roi_quark = 0;
+
+/* Operations which only need part of their input, like extract_area, can
+ * call this after linking @downstream to @image. If @image is the output
+ * of a load which has not started decoding yet, the loader can decode just
+ * the union of the areas its downstream images need.
+ *
+ * The area is attached to @downstream, so it goes away when @downstream
+ * does.
+ */
+void
+vips__foreign_load_set_roi(VipsImage *downstream,
+	VipsImage *image, const VipsRect *roi)
+{
+	VipsForeignLoadRoi *load_roi;
+
+	if (!g_object_get_qdata(G_OBJECT(image), vips__foreign_load_operation))
+		return;
+
+	load_roi = g_new(VipsForeignLoadRoi, 1);
+	load_roi->image = image;
+	load_roi->roi = *roi;
+	g_object_set_qdata_full(G_OBJECT(downstream),
+		vips__foreign_load_roi_quark, load_roi, g_free);
+}
+
+/* Loaders can test this in ->load() and decode just this area of @out to
+ * @real. It's an empty rect if they must decode everything.
+ */
+const VipsRect *
+vips__foreign_load_get_roi(VipsForeignLoad *load)
+{
+	VipsForeignLoadPrivate *priv =
+		vips_foreign_load_get_instance_private(load);
+
+	return &priv->roi;
+}
+
+/* Pixels outside the ROI must come from a second load, and that must not
+ * disturb the decode that's running. File and buffer loaders make a new
+ * source for each load. Source loaders can only reload from a new source
+ * on the same file or memory.
+ */
+static gboolean
+vips_foreign_load_can_reload(VipsForeignLoad *load)
+{
+	VipsForeignLoadPrivate *priv =
+		vips_foreign_load_get_instance_private(load);
+	GParamSpec *pspec;
+	VipsSource *source;
+
+	if (!(pspec = g_object_class_find_property(G_OBJECT_GET_CLASS(load),
+			  "source")) ||
+		!g_type_is_a(G_PARAM_SPEC_VALUE_TYPE(pspec), VIPS_TYPE_SOURCE))
+		return TRUE;
+
+	source = NULL;
+	g_object_get(load, "source", &source, NULL);
+	if (!source)
+		return FALSE;
+
+	if (source->blob)
+		priv->reload = vips_source_new_from_blob(source->blob);
+	else if (vips_source_is_file(source) == TRUE)
+		priv->reload = vips_source_new_from_file(
+			vips_connection_filename(VIPS_CONNECTION(source)));
+	else
+		vips_error_clear();
+
+	g_object_unref(source);
+
+	return priv->reload != NULL;
+}
+
+/* Just before we start decoding, decide on the ROI. Every image reading
+ * from us must have set an area, the union must be a useful size, and we
+ * must be able to reload for any pixels outside it.
+ */
+static void
+vips_foreign_load_roi_check(VipsForeignLoad *load)
+{
+	VipsForeignLoadPrivate *priv =
+		vips_foreign_load_get_instance_private(load);
+	VipsRect whole = { 0, 0, load->out->Xsize, load->out->Ysize };
+
+	VipsRect roi;
+	GSList *p;
+
+	roi.left = 0;
+	roi.top = 0;
+	roi.width = 0;
+	roi.height = 0;
+
+	g_mutex_lock(&vips__global_lock);
+
+	for (p = load->out->downstream; p; p = p->next) {
+		VipsForeignLoadRoi *load_roi = g_object_get_qdata(G_OBJECT(p->data),
+			vips__foreign_load_roi_quark);
+
+		if (!load_roi ||
+			load_roi->image != load->out) {
+			roi.width = 0;
+			roi.height = 0;
+			break;
+		}
+
+		if (vips_rect_isempty(&roi))
+			roi = load_roi->roi;
+		else
+			vips_rect_unionrect(&roi, &load_roi->roi, &roi);
+	}
+
+	g_mutex_unlock(&vips__global_lock);
+
+	if (vips_rect_isempty(&roi) ||
+		vips_rect_includesrect(&roi, &whole) ||
+		!vips_foreign_load_can_reload(load))
+		return;
+
+	priv->roi = roi;
+
+#ifdef DEBUG
+	printf("vips_foreign_load_roi_check: roi %d x %d at %d x %d\n",
+		roi.width, roi.height, roi.left, roi.top);
+#endif /*DEBUG*/
+}
+
+static void *
+vips_foreign_load_copy_argument(VipsObject *object,
+	GParamSpec *pspec,
+	VipsArgumentClass *argument_class,
+	VipsArgumentInstance *argument_instance,
+	void *a, void *b)
+{
+	VipsObject *new = VIPS_OBJECT(a);
+	VipsSource *reload = (VipsSource *) b;
+
+	if ((argument_class->flags & VIPS_ARGUMENT_CONSTRUCT) &&
+		(argument_class->flags & VIPS_ARGUMENT_INPUT) &&
+		argument_instance->assigned) {
+		const char *name = g_param_spec_get_name(pspec);
+		GValue value = G_VALUE_INIT;
+
+		if (reload &&
+			strcmp(name, "source") == 0) {
+			g_object_set(new, "source", reload, NULL);
+			return NULL;
+		}
+
+		g_value_init(&value, G_PARAM_SPEC_VALUE_TYPE(pspec));
+		g_object_get_property(G_OBJECT(object), name, &value);
+		g_object_set_property(G_OBJECT(new), name, &value);
+		g_value_unset(&value);
+	}
+
+	return NULL;
+}
+
+/* Pixels outside the ROI are very rarely needed, but they can be, for
+ * example if we were found in the cache just before we started to decode.
+ * Load the image again, this time all of it.
+ */
+static VipsImage *
+vips_foreign_load_whole(VipsForeignLoad *load)
+{
+	VipsForeignLoadPrivate *priv =
+		vips_foreign_load_get_instance_private(load);
+
+	VipsImage *whole;
+
+	g_mutex_lock(&priv->lock);
+
+	if (!priv->whole) {
+		VipsObject *object = VIPS_OBJECT(load);
+		VipsOperation *operation;
+
+		operation = vips_operation_new(
+			VIPS_OBJECT_GET_CLASS(object)->nickname);
+		(void) vips_argument_map(object,
+			vips_foreign_load_copy_argument, operation, priv->reload);
+		if (vips_object_build(VIPS_OBJECT(operation))) {
+			VIPS_UNREF(operation);
+			g_mutex_unlock(&priv->lock);
+
+			return NULL;
+		}
+
+		priv->whole = VIPS_FOREIGN_LOAD(operation);
+	}
+
+	whole = priv->whole->out;
+
+	g_mutex_unlock(&priv->lock);
+
+	return whole;
+}
+
 /* Our start function ... do the lazy open, if necessary, and return a region
  * on the new image.
  */
@@ -999,6 +1562,8 @@ static void *
 vips_foreign_load_start(VipsImage *out, void *a, void *b)
 {
 	VipsForeignLoad *load = VIPS_FOREIGN_LOAD(b);
+	VipsForeignLoadPrivate *priv =
+		vips_foreign_load_get_instance_private(load);
 	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(load);
 	VipsForeignLoadClass *load_class = VIPS_FOREIGN_LOAD_CLASS(class);
 
@@ -1014,6 +1579,8 @@ vips_foreign_load_start(VipsImage *out, void *a, void *b)
 	}
 
 	if (!load->real) {
+		vips_foreign_load_roi_check(load);
+
 		if (!(load->real = vips_foreign_load_temp(load)))
 			return NULL;
 
@@ -1057,6 +1624,13 @@ vips_foreign_load_start(VipsImage *out, void *a, void *b)
 			return NULL;
 		}
 
+		/* If the loader used the ROI, anything which finds us in the
+		 * cache later will probably want other pixels, so stop that.
+		 */
+		if (priv->area.width != out->Xsize ||
+			priv->area.height != out->Ysize)
+			vips_operation_invalidate(VIPS_OPERATION(load));
+
 		/* We have to tell vips that out depends on real. We've set
 		 * the demand hint below, but not given an input there.
 		 */
@@ -1075,17 +1649,44 @@ vips_foreign_load_generate(VipsRegion *out_region,
 	void *seq, void *a, void *b, gboolean *stop)
 {
 	VipsRegion *ir = (VipsRegion *) seq;
+	VipsForeignLoad *load = VIPS_FOREIGN_LOAD(b);
+	VipsForeignLoadPrivate *priv =
+		vips_foreign_load_get_instance_private(load);
 
 	VipsRect *r = &out_region->valid;
+	VipsRect need;
+
+	/* @real may only hold part of @out.
+	 */
+	if (!vips_rect_includesrect(&priv->area, r)) {
+		VipsImage *whole;
+		VipsRegion *region;
+		int result;
+
+		if (!(whole = vips_foreign_load_whole(load)) ||
+			vips_region_buffer(out_region, r))
+			return -1;
+
+		region = vips_region_new(whole);
+		result = vips_region_prepare_to(region,
+			out_region, r, r->left, r->top);
+		g_object_unref(region);
+
+		return result;
+	}
+
+	need = *r;
+	need.left -= priv->area.left;
+	need.top -= priv->area.top;
 
 	/* Ask for input we need.
 	 */
-	if (vips_region_prepare(ir, r))
+	if (vips_region_prepare(ir, &need))
 		return -1;
 
 	/* Attach output region to that.
 	 */
-	if (vips_region_region(out_region, ir, r, r->left, r->top))
+	if (vips_region_region(out_region, ir, r, need.left, need.top))
 		return -1;
 
 	return 0;
@@ -1183,6 +1784,11 @@ vips_foreign_load_build(VipsObject *object)
 				vips_stop_one,
 				NULL, load))
 			return -1;
+
+		/* So operations reading from us can set an ROI.
+		 */
+		g_object_set_qdata(G_OBJECT(load->out),
+			vips__foreign_load_operation, load);
 	}
 
 	/* Tell downstream if seq mode was requested.
@@ -1218,6 +1824,7 @@ vips_foreign_load_class_init(VipsForeignLoadClass *class)
 	VipsOperationClass *operation_class = (VipsOperationClass *) class;
 
 	gobject_class->dispose = vips_foreign_load_dispose;
+	gobject_class->finalize = vips_foreign_load_finalize;
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
 
@@ -1295,6 +1902,11 @@ vips_foreign_load_class_init(VipsForeignLoadClass *class)
 static void
 vips_foreign_load_init(VipsForeignLoad *load)
 {
+	VipsForeignLoadPrivate *priv =
+		vips_foreign_load_get_instance_private(load);
+
+	g_mutex_init(&priv->lock);
+
 	load->disc = TRUE;
 	load->access = VIPS_ACCESS_RANDOM;
 	load->fail_on = VIPS_FAIL_ON_NONE;
@@ -3329,4 +3941,6 @@ vips_foreign_operation_init(void)
 
 	vips__foreign_load_operation =
 		g_quark_from_static_string("vips-foreign-load-operation");
+	vips__foreign_load_roi_quark =
+		g_quark_from_static_string("vips-foreign-load-roi");
 }
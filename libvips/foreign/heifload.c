@@ -1057,6 +1057,13 @@ vips_foreign_load_heif_load(VipsForeignLoad *load)
 	return 0;
 }
 
+/* The brand is tested by is_a().
+ */
+static const VipsForeignSignature vips_foreign_load_heif_signatures[] = {
+	{ 4, "ftyp", NULL, 4 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_heif_class_init(VipsForeignLoadHeifClass *class)
 {
@@ -1074,6 +1081,8 @@ vips_foreign_load_heif_class_init(VipsForeignLoadHeifClass *class)
 	object_class->description = _("load a HEIF image");
 	object_class->build = vips_foreign_load_heif_build;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_heif_signatures, FALSE);
 	load_class->get_flags = vips_foreign_load_heif_get_flags;
 	load_class->header = vips_foreign_load_heif_header;
 	load_class->load = vips_foreign_load_heif_load;
@@ -11,6 +11,8 @@
  * 18/9/24
  *	- revise offset handling
  *	- test that decoded image matches header
+ * 18/10/26
+ *	- share decoded tiles between loads with the decode cache
  */
 
 /*
@@ -117,6 +119,10 @@ typedef struct _VipsForeignLoadJp2k {
 	/* If we need to do ycc->rgb conversion on load.
 	 */
 	gboolean ycc_to_rgb;
+
+	/* Share decoded tiles with other loads of this file, or NULL.
+	 */
+	char *cache_id;
 } VipsForeignLoadJp2k;
 
 typedef VipsForeignLoadClass VipsForeignLoadJp2kClass;
@@ -148,6 +154,7 @@ vips_foreign_load_jp2k_dispose(GObject *gobject)
 	VIPS_FREEF(opj_stream_destroy, jp2k->stream);
 	VIPS_FREEF(opj_image_destroy, jp2k->image);
 	VIPS_UNREF(jp2k->source);
+	VIPS_FREE(jp2k->cache_id);
 
 	G_OBJECT_CLASS(vips_foreign_load_jp2k_parent_class)->dispose(gobject);
 }
@@ -1068,6 +1075,11 @@ vips_foreign_load_jp2k_generate_tiled(VipsRegion *out,
 	if (jp2k->n_errors)
 		return 0;
 
+	/* Another load of this file may have decoded this tile already.
+	 */
+	if (vips__decode_cache_get_region(jp2k->cache_id, 0, out))
+		return 0;
+
 	y = 0;
 	while (y < r->height) {
 		VipsRect tile;
@@ -1152,6 +1164,11 @@ vips_foreign_load_jp2k_generate_tiled(VipsRegion *out,
 		jp2k->n_errors > 0)
 		return -1;
 
+	/* Only share tiles that decoded cleanly.
+	 */
+	if (!jp2k->n_errors)
+		vips__decode_cache_put_region(jp2k->cache_id, 0, out);
+
 	return 0;
 }
 
@@ -1194,6 +1211,10 @@ vips_foreign_load_jp2k_load(VipsForeignLoad *load)
 		tile_height = jp2k->info->tdy;
 		tiles_across = jp2k->info->tw;
 
+		jp2k->cache_id = vips__decode_cache_id(
+			vips_connection_filename(VIPS_CONNECTION(jp2k->source)),
+			"jp2kload %d %d", jp2k->page, jp2k->shrink);
+
 		if (vips_image_generate(t[0],
 				NULL, vips_foreign_load_jp2k_generate_tiled, NULL,
 				jp2k, NULL))
@@ -1216,6 +1237,13 @@ vips_foreign_load_jp2k_load(VipsForeignLoad *load)
 	return 0;
 }
 
+static const VipsForeignSignature vips_foreign_load_jp2k_signatures[] = {
+	{ 0, JP2_RFC3745_MAGIC, NULL, 12 },
+	{ 0, JP2_MAGIC, NULL, 4 },
+	{ 0, J2K_CODESTREAM_MAGIC, NULL, 4 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_jp2k_class_init(VipsForeignLoadJp2kClass *class)
 {
@@ -1236,6 +1264,8 @@ vips_foreign_load_jp2k_class_init(VipsForeignLoadJp2kClass *class)
 	 */
 	operation_class->flags |= VIPS_OPERATION_UNTRUSTED;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_jp2k_signatures, FALSE);
 	load_class->get_flags = vips_foreign_load_jp2k_get_flags;
 	load_class->header = vips_foreign_load_jp2k_header;
 	load_class->load = vips_foreign_load_jp2k_load;
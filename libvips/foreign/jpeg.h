@@ -107,16 +107,57 @@ typedef struct _ReadJpeg {
 	int output_width;
 	int output_height;
 
+	/* Only decode this area of the output, if it's not empty. @top is
+	 * the number of scanlines we skipped.
+	 */
+	VipsRect roi;
+	int top;
+
 	/* The source we read from.
 	 */
 	VipsSource *source;
 
 } ReadJpeg;
 
+/* JPEGs with restart markers can be decoded and encoded in parallel bands
+ * of roughly this many lines.
+ */
+#define JPEG_BAND_HEIGHT (256)
+
+/* Only use bands if we'll have at least this many.
+ */
+#define JPEG_MIN_BANDS (4)
+
+/* Bands must start on a restart marker, so the restart interval must put one
+ * at the start of an MCU row at least once every this many rows.
+ */
+#define JPEG_MAX_STEP (16)
+
+/* How a scan can be cut into bands.
+ */
+typedef struct _JpegBands {
+	/* Geometry, in MCUs.
+	 */
+	int mcus_per_row;
+	int mcu_rows;
+	int mcu_height;
+
+	/* There's a restart marker at the start of every step MCU rows. Bands
+	 * are band_rows MCU rows.
+	 */
+	int step;
+	int band_rows;
+} JpegBands;
+
 extern const char *vips__jpeg_message_table[];
 
 void vips__new_output_message(j_common_ptr cinfo);
 void vips__new_error_exit(j_common_ptr cinfo);
+void vips__jpeg_target_dest(j_compress_ptr cinfo, VipsTarget *target);
+gboolean vips__jpeg_bands(JpegBands *bands,
+	int image_width, int image_height, int num_components,
+	int max_h_samp_factor, int max_v_samp_factor,
+	int restart_interval, int band_height);
 
 ReadJpeg *vips__readjpeg_new(VipsSource *source, VipsImage *out,
 	int shrink, VipsFailOn fail_on, gboolean autorotate,
@@ -114,6 +114,10 @@
  * 	- add fail_on support
  * 2/8/22
  *      - add "unlimited"
+ * 18/10/26
+ * 	- index restart markers in large baseline images and decode bands in
+ * 	  parallel
+ * 	- decode just the region of interest, if we can
  */
 
 /*
@@ -838,7 +842,7 @@ read_jpeg_generate(VipsRegion *out_region,
 	/* And check that the y position is correct. It should be, since we are
 	 * inside a vips_sequential().
 	 */
-	if (r->top != cinfo->output_scanline) {
+	if (r->top + jpeg->top != cinfo->output_scanline) {
 		VIPS_GATE_STOP("read_jpeg_generate: work");
 		vips_error("VipsJpeg", _("out of order read at line %d"),
 			cinfo->output_scanline);
@@ -891,6 +895,432 @@ read_jpeg_generate(VipsRegion *out_region,
 	return 0;
 }
 
+/* An index of restart marker positions. Baseline images with restart
+ * markers at the start of MCU rows can be cut into bands, and each band
+ * decoded on its own.
+ */
+typedef struct _JpegIndex {
+	ReadJpeg *jpeg;
+
+	/* The whole file, mapped.
+	 */
+	const unsigned char *data;
+	size_t length;
+
+	/* A minimal header to go in front of each band, and the offset of the
+	 * image height in the SOF segment.
+	 */
+	unsigned char *header;
+	size_t header_length;
+	size_t sof_height;
+
+	/* The offset of the start of each restart interval, and of the EOI
+	 * marker.
+	 */
+	size_t *interval;
+	int n_intervals;
+	size_t scan_end;
+
+	/* How we cut the scan into bands, and the band height in output
+	 * lines.
+	 */
+	int restart_interval;
+	JpegBands bands;
+	int band_height;
+
+	int image_height;
+	int sz;
+} JpegIndex;
+
+static void
+index_init_source(j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+index_fill_input_buffer(j_decompress_ptr cinfo)
+{
+	static const JOCTET eoi[2] = { (JOCTET) 0xFF, (JOCTET) JPEG_EOI };
+
+	/* We always end bands with EOI, so this should never happen.
+	 */
+	WARNMS(cinfo, JWRN_JPEG_EOF);
+
+	cinfo->src->next_input_byte = eoi;
+	cinfo->src->bytes_in_buffer = 2;
+
+	return TRUE;
+}
+
+/* Copy the segments from the file header that libjpeg needs to decode a
+ * band, and note where the image height is. Skip metadata.
+ */
+static gboolean
+read_jpeg_index_header(JpegIndex *index, size_t scan_start)
+{
+	const unsigned char *data = index->data;
+
+	unsigned char *q;
+	size_t p, n;
+
+	if (!(index->header = VIPS_ARRAY(index->jpeg->out,
+			  scan_start, unsigned char)))
+		return FALSE;
+	q = index->header;
+
+	q[0] = 0xFF;
+	q[1] = 0xD8; /* SOI */
+	n = 2;
+	index->sof_height = 0;
+
+	for (p = 2; p < scan_start;) {
+		int marker;
+		size_t length;
+
+		if (data[p] != 0xFF)
+			return FALSE;
+
+		/* Skip any fill bytes.
+		 */
+		while (p < scan_start &&
+			data[p] == 0xFF)
+			p++;
+		if (p + 3 > scan_start)
+			return FALSE;
+
+		marker = data[p];
+		length = (data[p + 1] << 8) | data[p + 2];
+		if (length < 2 ||
+			p + 1 + length > scan_start)
+			return FALSE;
+
+		switch (marker) {
+		case 0xC0: /* SOF0 */
+		case 0xC1: /* SOF1 */
+			if (length < 7)
+				return FALSE;
+			index->sof_height = n + 5;
+
+			/* Fall through.
+			 */
+
+		case JPEG_APP0:		 /* JFIF, sets the default colourspace */
+		case JPEG_APP0 + 14: /* Adobe, sets the colour transform */
+		case 0xC4:			 /* DHT */
+		case 0xDB:			 /* DQT */
+		case 0xDD:			 /* DRI */
+		case 0xDA:			 /* SOS */
+			q[n] = 0xFF;
+			memcpy(q + n + 1, data + p, length + 1);
+			n += length + 2;
+			break;
+
+		default:
+			break;
+		}
+
+		p += 1 + length;
+	}
+
+	index->header_length = n;
+
+	return p == scan_start &&
+		index->sof_height > 0;
+}
+
+/* Find the restart markers in the scan. Any other marker before EOI, or a
+ * truncated scan, and we can't index.
+ */
+static gboolean
+read_jpeg_index_scan(JpegIndex *index, size_t scan_start)
+{
+	const unsigned char *data = index->data;
+	size_t length = index->length;
+
+	size_t p;
+	int n;
+
+	if (!(index->interval = VIPS_ARRAY(index->jpeg->out,
+			  index->n_intervals, size_t)))
+		return FALSE;
+
+	index->interval[0] = scan_start;
+	n = 1;
+
+	for (p = scan_start;;) {
+		const unsigned char *q;
+		int marker;
+
+		if (!(q = memchr(data + p, 0xFF, length - p)) ||
+			q + 1 >= data + length)
+			return FALSE;
+		p = q - data + 1;
+
+		marker = data[p];
+		if (marker == 0)
+			/* A stuffed zero.
+			 */
+			p += 1;
+		else if (marker == 0xFF)
+			/* A fill byte, look again.
+			 */
+			;
+		else if (marker >= JPEG_RST0 &&
+			marker <= JPEG_RST0 + 7) {
+			if (n >= index->n_intervals)
+				return FALSE;
+			index->interval[n++] = p + 1;
+			p += 1;
+		}
+		else if (marker == JPEG_EOI) {
+			index->scan_end = p - 1;
+			break;
+		}
+		else
+			return FALSE;
+	}
+
+	return n == index->n_intervals;
+}
+
+/* Try to make a restart marker index. NULL means the image can't be
+ * indexed, and is not an error.
+ */
+static JpegIndex *
+read_jpeg_index_new(ReadJpeg *jpeg)
+{
+	struct jpeg_decompress_struct *cinfo = &jpeg->cinfo;
+
+	JpegIndex *index;
+	const unsigned char *data;
+	size_t length;
+	size_t scan_start;
+
+	/* We need random access to the file, a single baseline scan and
+	 * restart markers.
+	 */
+	if (!vips_source_is_mappable(jpeg->source) ||
+		cinfo->progressive_mode ||
+		cinfo->arith_code ||
+		cinfo->restart_interval == 0 ||
+		cinfo->comps_in_scan != cinfo->num_components ||
+		!(data = vips_source_map(jpeg->source, &length)) ||
+		cinfo->src->next_input_byte < data ||
+		cinfo->src->next_input_byte >= data + length)
+		return NULL;
+
+	/* After the header read, libjpeg is at the start of the scan.
+	 */
+	scan_start = cinfo->src->next_input_byte - data;
+
+	if (!(index = VIPS_NEW(jpeg->out, JpegIndex)))
+		return NULL;
+	index->jpeg = jpeg;
+	index->data = data;
+	index->length = length;
+	index->restart_interval = cinfo->restart_interval;
+	index->image_height = cinfo->image_height;
+	index->sz = cinfo->output_width * cinfo->output_components;
+
+	/* Bands are in coded lines, so scale up by the shrink factor.
+	 */
+	if (!vips__jpeg_bands(&index->bands,
+			cinfo->image_width, cinfo->image_height,
+			cinfo->num_components,
+			cinfo->max_h_samp_factor, cinfo->max_v_samp_factor,
+			cinfo->restart_interval, JPEG_BAND_HEIGHT * jpeg->shrink))
+		return NULL;
+	index->band_height =
+		index->bands.band_rows * index->bands.mcu_height / jpeg->shrink;
+	index->n_intervals = VIPS_ROUND_UP(
+		index->bands.mcus_per_row * index->bands.mcu_rows,
+		index->restart_interval) / index->restart_interval;
+
+	if (!read_jpeg_index_header(index, scan_start) ||
+		!read_jpeg_index_scan(index, scan_start))
+		return NULL;
+
+#ifdef DEBUG
+	printf("read_jpeg_index_new: %d restart intervals, "
+		   "bands of %d MCU rows\n",
+		index->n_intervals, index->bands.band_rows);
+#endif /*DEBUG*/
+
+	return index;
+}
+
+/* Decode the band of output lines in @r.
+ *
+ * libjpeg's fancy upsampling looks at the chroma rows above and below, so
+ * we decode from one step above the band to one step below and keep the
+ * middle. DC prediction resets at every restart marker, so the result is
+ * the same as a decode from the top.
+ */
+static int
+read_jpeg_index_decode(JpegIndex *index, VipsRegion *out_region)
+{
+	ReadJpeg *jpeg = index->jpeg;
+	VipsRect *r = &out_region->valid;
+	int first = (r->top / index->band_height) * index->bands.band_rows;
+	int last = VIPS_MIN(first + index->bands.band_rows,
+		index->bands.mcu_rows);
+	int start = VIPS_MAX(0, first - index->bands.step);
+	int end = VIPS_MIN(last + index->bands.step, index->bands.mcu_rows);
+	int k_start =
+		start * index->bands.mcus_per_row / index->restart_interval;
+	int k_end = end < index->bands.mcu_rows
+		? end * index->bands.mcus_per_row / index->restart_interval
+		: index->n_intervals;
+	size_t data_start = index->interval[k_start];
+	size_t data_end = end < index->bands.mcu_rows
+		? index->interval[k_end] - 2
+		: index->scan_end;
+	int coded_height = VIPS_MIN(end * index->bands.mcu_height,
+						   index->image_height) -
+		start * index->bands.mcu_height;
+	int skip = (first - start) * index->bands.mcu_height / jpeg->shrink;
+	size_t length = index->header_length + (data_end - data_start) + 2;
+
+	struct jpeg_decompress_struct cinfo;
+	ErrorManager eman;
+	struct jpeg_source_mgr src;
+	unsigned char *buf;
+	JSAMPLE *line;
+	int k, y;
+
+	if (!(buf = VIPS_ARRAY(NULL, length, unsigned char)))
+		return -1;
+	if (!(line = VIPS_ARRAY(NULL, index->sz, JSAMPLE))) {
+		g_free(buf);
+		return -1;
+	}
+
+	/* Make a JPEG for this band: the header with the new height, the scan
+	 * data with the restart markers renumbered from zero, then EOI.
+	 */
+	memcpy(buf, index->header, index->header_length);
+	buf[index->sof_height] = coded_height >> 8;
+	buf[index->sof_height + 1] = coded_height & 0xff;
+	memcpy(buf + index->header_length,
+		index->data + data_start, data_end - data_start);
+	for (k = k_start + 1; k < k_end; k++)
+		buf[index->header_length + index->interval[k] - 1 - data_start] =
+			JPEG_RST0 + (k - k_start - 1) % 8;
+	buf[length - 2] = 0xFF;
+	buf[length - 1] = JPEG_EOI;
+
+	cinfo.err = jpeg_std_error(&eman.pub);
+	cinfo.err->addon_message_table = vips__jpeg_message_table;
+	cinfo.err->first_addon_message = 1000;
+	cinfo.err->last_addon_message = 1001;
+	eman.pub.error_exit = vips__new_error_exit;
+	eman.pub.output_message = vips__new_output_message;
+	eman.fp = NULL;
+	cinfo.client_data = NULL;
+
+	/* Don't jpeg_destroy_decompress() if create fails.
+	 */
+	if (setjmp(eman.jmp)) {
+		g_free(buf);
+		g_free(line);
+		return -1;
+	}
+
+	jpeg_create_decompress(&cinfo);
+
+	/* Here for longjmp() during decode.
+	 */
+	if (setjmp(eman.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		g_free(buf);
+		g_free(line);
+		return -1;
+	}
+
+	src.init_source = index_init_source;
+	src.fill_input_buffer = index_fill_input_buffer;
+	src.skip_input_data = skip_input_data_mappable;
+	src.resync_to_restart = jpeg_resync_to_restart;
+	src.term_source = index_init_source;
+	src.next_input_byte = buf;
+	src.bytes_in_buffer = length;
+	cinfo.src = &src;
+
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.scale_denom = jpeg->shrink;
+	cinfo.scale_num = 1;
+	jpeg_start_decompress(&cinfo);
+
+	if ((int) (cinfo.output_width * cinfo.output_components) != index->sz ||
+		(int) cinfo.output_height < skip + r->height) {
+		vips_error("VipsJpeg", "%s", _("bad restart marker index"));
+		longjmp(eman.jmp, 1);
+	}
+
+	for (y = 0; y < skip + r->height; y++) {
+		JSAMPROW row_pointer[1];
+
+		row_pointer[0] = y < skip
+			? line
+			: (JSAMPLE *) VIPS_REGION_ADDR(out_region,
+				  0, r->top + y - skip);
+
+		jpeg_read_scanlines(&cinfo, &row_pointer[0], 1);
+
+		if (y >= skip &&
+			jpeg->invert_pels) {
+			int x;
+
+			for (x = 0; x < index->sz; x++)
+				row_pointer[0][x] = 255 - row_pointer[0][x];
+		}
+	}
+
+	if (eman.pub.num_warnings > 0 &&
+		jpeg->fail_on >= VIPS_FAIL_ON_WARNING)
+		longjmp(eman.jmp, 1);
+
+	jpeg_destroy_decompress(&cinfo);
+	g_free(buf);
+	g_free(line);
+
+	return 0;
+}
+
+static int
+read_jpeg_generate_indexed(VipsRegion *out_region,
+	void *seq, void *a, void *b, gboolean *stop)
+{
+	VipsRect *r = &out_region->valid;
+	JpegIndex *index = (JpegIndex *) a;
+
+	int result;
+
+#ifdef DEBUG_VERBOSE
+	printf("read_jpeg_generate_indexed: %p line %d, %d rows\n",
+		g_thread_self(), r->top, r->height);
+#endif /*DEBUG_VERBOSE*/
+
+	/* We're inside a tilecache where tiles are whole bands.
+	 */
+	g_assert(r->left == 0);
+	g_assert(r->width == out_region->im->Xsize);
+	g_assert(r->top % index->band_height == 0);
+
+	VIPS_GATE_START("read_jpeg_generate_indexed: work");
+
+	result = read_jpeg_index_decode(index, out_region);
+
+	VIPS_GATE_STOP("read_jpeg_generate_indexed: work");
+
+	if (result)
+		/* Knock the output out of cache.
+		 */
+		vips_foreign_load_invalidate(index->jpeg->out);
+
+	return result;
+}
+
 /* Read a cinfo to a VIPS image.
  */
 static int
@@ -901,6 +1331,9 @@ read_jpeg_image(ReadJpeg *jpeg, VipsImage *out)
 		vips_object_local_array(VIPS_OBJECT(out), 5);
 
 	VipsImage *im;
+	JpegIndex *index;
+	VipsRect area;
+	int left;
 
 	/* Here for longjmp() from vips__new_error_exit() during
 	 * jpeg_read_header() or jpeg_start_decompress().
@@ -912,28 +1345,82 @@ read_jpeg_image(ReadJpeg *jpeg, VipsImage *out)
 	if (read_jpeg_header(jpeg, t[0]))
 		return -1;
 
+	/* The ROI is in output coordinates, so we can't use it if we will
+	 * rotate.
+	 */
+	area.left = 0;
+	area.top = 0;
+	area.width = jpeg->output_width;
+	area.height = jpeg->output_height;
+	if (!vips_rect_isempty(&jpeg->roi) &&
+		!(jpeg->autorotate &&
+			vips_image_get_orientation(t[0]) != 1))
+		vips_rect_intersectrect(&area, &jpeg->roi, &area);
+	left = 0;
+
 	/* Switch to pixel decode.
 	 */
 	if (vips_source_decode(jpeg->source))
 		return -1;
 
-	jpeg_start_decompress(cinfo);
+	if ((index = read_jpeg_index_new(jpeg))) {
+		/* We can decode bands in parallel and in any order. Tiles
+		 * are whole bands so we never decode a band twice.
+		 */
+		if (vips_image_generate(t[0],
+				NULL, read_jpeg_generate_indexed, NULL,
+				index, NULL) ||
+			vips_tilecache(t[0], &t[1],
+				"tile_width", t[0]->Xsize,
+				"tile_height", index->band_height,
+				"max_tiles", 2 * vips_concurrency_get(),
+				"threaded", TRUE,
+				NULL))
+			return -1;
+	}
+	else {
+		jpeg_start_decompress(cinfo);
 
 #ifdef DEBUG
-	printf("read_jpeg_image: starting decompress\n");
+		printf("read_jpeg_image: starting decompress\n");
 #endif /*DEBUG*/
 
+		if (area.width < jpeg->output_width ||
+			area.height < jpeg->output_height) {
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+			JDIMENSION xoffset = area.left;
+			JDIMENSION width = area.width;
+
+			/* Only decode the iMCU columns we need, and skip the
+			 * lines above the area. libjpeg rounds the crop out to
+			 * iMCU boundaries.
+			 */
+			jpeg_crop_scanline(cinfo, &xoffset, &width);
+			jpeg->top = jpeg_skip_scanlines(cinfo, area.top);
+			left = xoffset;
+			t[0]->Xsize = cinfo->output_width;
+#endif /*HAVE_JPEG_SKIP_SCANLINES*/
+
+			/* And stop at the bottom of the area.
+			 */
+			t[0]->Ysize = VIPS_RECT_BOTTOM(&area) - jpeg->top;
+		}
+
+		if (vips_image_generate(t[0],
+				NULL, read_jpeg_generate, NULL,
+				jpeg, NULL) ||
+			vips_sequential(t[0], &t[1],
+				"tile_height", 8,
+				NULL))
+			return -1;
+	}
+
 	/* We must crop after the seq, or our generate may not be asked for
 	 * full lines of pixels and will attempt to write beyond the buffer.
 	 */
-	if (vips_image_generate(t[0],
-			NULL, read_jpeg_generate, NULL,
-			jpeg, NULL) ||
-		vips_sequential(t[0], &t[1],
-			"tile_height", 8,
-			NULL) ||
-		vips_extract_area(t[1], &t[2],
-			0, 0, jpeg->output_width, jpeg->output_height, NULL))
+	if (vips_extract_area(t[1], &t[2],
+			area.left - left, area.top - jpeg->top,
+			area.width, area.height, NULL))
 		return -1;
 	im = t[2];
 
@@ -1010,13 +1497,15 @@ jpeg_read(ReadJpeg *jpeg, VipsImage *out, gboolean header_only)
 int
 vips__jpeg_read_source(VipsSource *source, VipsImage *out,
 	gboolean header_only, int shrink, VipsFailOn fail_on,
-	gboolean autorotate, gboolean unlimited)
+	gboolean autorotate, gboolean unlimited, const VipsRect *roi)
 {
 	ReadJpeg *jpeg;
 
 	if (!(jpeg = vips__readjpeg_new(source, out, shrink, fail_on,
 			  autorotate, unlimited)))
 		return -1;
+	if (roi)
+		jpeg->roi = *roi;
 
 	/* Here for longjmp() from vips__new_error_exit() during
 	 * cinfo->mem->alloc_small() or jpeg_read_header().
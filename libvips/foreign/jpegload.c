@@ -140,7 +140,7 @@ vips_foreign_load_jpeg_header(VipsForeignLoad *load)
 
 	if (vips__jpeg_read_source(jpeg->source,
 			load->out, TRUE, jpeg->shrink, load->fail_on,
-			jpeg->autorotate, jpeg->unlimited))
+			jpeg->autorotate, jpeg->unlimited, NULL))
 		return -1;
 
 	return 0;
@@ -153,12 +153,18 @@ vips_foreign_load_jpeg_load(VipsForeignLoad *load)
 
 	if (vips__jpeg_read_source(jpeg->source,
 			load->real, FALSE, jpeg->shrink, load->fail_on,
-			jpeg->autorotate, jpeg->unlimited))
+			jpeg->autorotate, jpeg->unlimited,
+			vips__foreign_load_get_roi(load)))
 		return -1;
 
 	return 0;
 }
 
+static const VipsForeignSignature vips_foreign_load_jpeg_signatures[] = {
+	{ 0, "\xff\xd8", NULL, 2 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_jpeg_class_init(VipsForeignLoadJpegClass *class)
 {
@@ -179,6 +185,8 @@ vips_foreign_load_jpeg_class_init(VipsForeignLoadJpegClass *class)
 	 */
 	foreign_class->priority = 50;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_jpeg_signatures, TRUE);
 	load_class->get_flags_filename = vips_foreign_load_jpeg_get_flags_filename;
 	load_class->get_flags = vips_foreign_load_jpeg_get_flags;
 	load_class->header = vips_foreign_load_jpeg_header;
@@ -438,6 +446,11 @@ vips_foreign_load_jpeg_buffer_init(VipsForeignLoadJpegBuffer *buffer)
  * are 1, 2, 4 and 8. Shrinking during read is very much faster than
  * decompressing the whole image and then shrinking later.
  *
+ * Large baseline images from files or memory with a restart marker at the
+ * start of MCU rows (see the @restart_interval option to
+ * [method@Image.jpegsave]) are decoded in bands. Bands are decoded in
+ * parallel, and regions can be read in any order.
+ *
  * Use @fail_on to set the type of error that will cause load to fail. By
  * default, loaders are permissive, that is, [enum@Vips.FailOn.NONE].
  *
@@ -584,6 +584,11 @@ vips_foreign_save_jpeg_mime_init(VipsForeignSaveJpegMime *mime)
  * if there are transmission errors, but also allows for some decoders to read
  * part of the JPEG without decoding the whole stream.
  *
+ * If the restart interval puts a marker at the start of an MCU row every few
+ * rows, for example if it is the number of MCUs across the image, large
+ * baseline images with fixed huffman tables are encoded in parallel bands.
+ * The output is the same as a sequential encode.
+ *
  * The image is automatically converted to RGB, Monochrome or CMYK before
  * saving.
  *
@@ -6,6 +6,8 @@
  * 	- reset read point for _load
  * 13/3/23 MathemanFlo
  * 	- add bits per sample metadata
+ * 18/10/26
+ * 	- only copy the region of interest to the output
  */
 
 /*
@@ -1087,6 +1089,7 @@ vips_foreign_load_jxl_load(VipsForeignLoad *load)
 		vips_object_local_array(VIPS_OBJECT(load), 3);
 
 	VipsImage *out;
+	const VipsRect *roi;
 
 #ifdef DEBUG
 	printf("vips_foreign_load_jxl_load:\n");
@@ -1133,6 +1136,17 @@ vips_foreign_load_jxl_load(VipsForeignLoad *load)
 		out = t[0];
 	}
 
+	/* libjxl can't decode part of a frame, but we can avoid making a
+	 * second copy of all of it.
+	 */
+	roi = vips__foreign_load_get_roi(load);
+	if (!vips_rect_isempty(roi)) {
+		if (vips_extract_area(out, &t[2],
+				roi->left, roi->top, roi->width, roi->height, NULL))
+			return -1;
+		out = t[2];
+	}
+
 	if (vips_image_write(out, load->real))
 		return -1;
 
@@ -1144,6 +1158,14 @@ vips_foreign_load_jxl_load(VipsForeignLoad *load)
 	return 0;
 }
 
+/* A bare codestream, or the ISOBMFF container.
+ */
+static const VipsForeignSignature vips_foreign_load_jxl_signatures[] = {
+	{ 0, "\xff\x0a", NULL, 2 },
+	{ 0, "\0\0\0\x0cJXL \r\n\x87\n", NULL, 12 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_jxl_class_init(VipsForeignLoadJxlClass *class)
 {
@@ -1165,6 +1187,8 @@ vips_foreign_load_jxl_class_init(VipsForeignLoadJxlClass *class)
 	 */
 	operation_class->flags |= VIPS_OPERATION_UNTRUSTED;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_jxl_signatures, FALSE);
 	load_class->get_flags = vips_foreign_load_jxl_get_flags;
 	load_class->header = vips_foreign_load_jxl_header;
 	load_class->load = vips_foreign_load_jxl_load;
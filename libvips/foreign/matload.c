@@ -106,6 +106,11 @@ vips_foreign_load_mat_load(VipsForeignLoad *load)
 	return 0;
 }
 
+static const VipsForeignSignature vips_foreign_load_mat_signatures[] = {
+	{ 0, "MATLAB 5.0", NULL, 10 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_mat_class_init(VipsForeignLoadMatClass *class)
 {
@@ -127,6 +132,8 @@ vips_foreign_load_mat_class_init(VipsForeignLoadMatClass *class)
 
 	foreign_class->suffs = vips__mat_suffs;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_mat_signatures, TRUE);
 	load_class->is_a = vips__mat_ismat;
 	load_class->get_flags_filename =
 		vips_foreign_load_mat_get_flags_filename;
@@ -591,6 +591,11 @@ vips_foreign_load_nsgif_load(VipsForeignLoad *load)
 	return 0;
 }
 
+static const VipsForeignSignature vips_foreign_load_nsgif_signatures[] = {
+	{ 0, "GIF8", NULL, 4 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_nsgif_class_init(VipsForeignLoadNsgifClass *class)
 {
@@ -610,6 +615,8 @@ vips_foreign_load_nsgif_class_init(VipsForeignLoadNsgifClass *class)
 	 */
 	foreign_class->priority = 50;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_nsgif_signatures, TRUE);
 	load_class->get_flags_filename =
 		vips_foreign_load_nsgif_get_flags_filename;
 	load_class->get_flags = vips_foreign_load_nsgif_get_flags;
@@ -113,6 +113,11 @@ vips_foreign_load_openexr_load(VipsForeignLoad *load)
 
 static const char *vips_foreign_openexr_suffs[] = { ".exr", NULL };
 
+static const VipsForeignSignature vips_foreign_load_openexr_signatures[] = {
+	{ 0, "\x76\x2f\x31\x01", NULL, 4 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_openexr_class_init(VipsForeignLoadOpenexrClass *class)
 {
@@ -138,6 +143,8 @@ vips_foreign_load_openexr_class_init(VipsForeignLoadOpenexrClass *class)
 	 */
 	foreign_class->priority = 200;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_openexr_signatures, TRUE);
 	load_class->is_a = vips__openexr_isexr;
 	load_class->get_flags_filename =
 		vips_foreign_load_openexr_get_flags_filename;
@@ -59,6 +59,8 @@
  *	- add "rgb" option
  * 1/10/23
  *	- add openslide4 icc profile support
+ * 18/10/26
+ *	- share decoded tiles between loads with the decode cache
  */
 
 /*
@@ -100,6 +102,7 @@
 
 #include <vips/vips.h>
 #include <vips/debug.h>
+#include <vips/internal.h>
 
 #include "pforeign.h"
 
@@ -138,6 +141,10 @@ typedef struct {
 	 */
 	int tile_width;
 	int tile_height;
+
+	/* Share decoded tiles with other loads of this slide, or NULL.
+	 */
+	char *cache_id;
 } ReadSlide;
 
 static int
@@ -169,6 +176,7 @@ readslide_destroy_cb(VipsImage *image, ReadSlide *rslide)
 	}
 	VIPS_FREE(rslide->associated);
 	VIPS_FREE(rslide->filename);
+	VIPS_FREE(rslide->cache_id);
 	VIPS_FREE(rslide);
 }
 
@@ -689,6 +697,11 @@ vips__openslide_generate(VipsRegion *out,
 	 */
 	g_assert(VIPS_REGION_LSKIP(out) == r->width * out->im->Bands);
 
+	/* Another load of this slide may have decoded this tile already.
+	 */
+	if (vips__decode_cache_get_region(rslide->cache_id, 0, out))
+		return 0;
+
 	/* In RGB mode we need to read to the tile buffer.
 	 */
 	if (rslide->rgb) {
@@ -725,6 +738,8 @@ vips__openslide_generate(VipsRegion *out,
 	else
 		argb2rgba(buf, n, bg);
 
+	vips__decode_cache_put_region(rslide->cache_id, 0, out);
+
 	return 0;
 }
 
@@ -757,8 +772,18 @@ vips__openslide_read(const char *filename, VipsImage *out,
 	raw = vips_image_new();
 	vips_object_local(out, raw);
 
-	if (readslide_parse(rslide, raw) ||
-		vips_image_generate(raw,
+	if (readslide_parse(rslide, raw))
+		return -1;
+
+	/* Decoded tiles depend on the level, crop and output format.
+	 */
+	rslide->cache_id = vips__decode_cache_id(rslide->filename,
+		"openslideload %d %d %d %d %d %d",
+		rslide->level, rslide->rgb,
+		rslide->bounds.left, rslide->bounds.top,
+		rslide->tile_width, rslide->tile_height);
+
+	if (vips_image_generate(raw,
 			vips__openslide_start,
 			vips__openslide_generate,
 			vips__openslide_stop, rslide, NULL))
@@ -68,7 +68,7 @@ gboolean vips__istiff_source(VipsSource *source);
 gboolean vips__istifftiled_source(VipsSource *source);
 int vips__tiff_read_header_source(VipsSource *source, VipsImage *out,
 	int page, int n, gboolean autorotate, int subifd, VipsFailOn fail_on,
-	gboolean unlimited);
+	gboolean unlimited, gboolean *mappable);
 int vips__tiff_read_source(VipsSource *source, VipsImage *out,
 	int page, int n, gboolean autorotate, int subifd, VipsFailOn fail_on,
 	gboolean unlimited);
@@ -138,14 +138,14 @@ int vips__jpeg_region_write_target(VipsRegion *region, VipsRect *rect,
 
 int vips__jpeg_read_source(VipsSource *source, VipsImage *out,
 	gboolean header_only, int shrink, VipsFailOn fail_on,
-	gboolean autorotate, gboolean unlimited);
+	gboolean autorotate, gboolean unlimited, const VipsRect *roi);
 int vips__isjpeg_source(VipsSource *source);
 
 int vips__png_ispng_source(VipsSource *source);
 int vips__png_header_source(VipsSource *source, VipsImage *out,
 	gboolean unlimited);
 int vips__png_read_source(VipsSource *source, VipsImage *out,
-	VipsFailOn fail_on, gboolean unlimited);
+	VipsFailOn fail_on, gboolean unlimited, const VipsRect *roi);
 gboolean vips__png_isinterlaced_source(VipsSource *source);
 extern const char *vips__png_suffs[];
 
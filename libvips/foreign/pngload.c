@@ -135,12 +135,18 @@ vips_foreign_load_png_load(VipsForeignLoad *load)
 	VipsForeignLoadPng *png = (VipsForeignLoadPng *) load;
 
 	if (vips__png_read_source(png->source, load->real,
-			load->fail_on, png->unlimited))
+			load->fail_on, png->unlimited,
+			vips__foreign_load_get_roi(load)))
 		return -1;
 
 	return 0;
 }
 
+static const VipsForeignSignature vips_foreign_load_png_signatures[] = {
+	{ 0, "\x89PNG\r\n\x1a\n", NULL, 8 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_png_class_init(VipsForeignLoadPngClass *class)
 {
@@ -160,6 +166,8 @@ vips_foreign_load_png_class_init(VipsForeignLoadPngClass *class)
 	 */
 	foreign_class->priority = 200;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_png_signatures, TRUE);
 	load_class->get_flags_filename =
 		vips_foreign_load_png_get_flags_filename;
 	load_class->get_flags = vips_foreign_load_png_get_flags;
@@ -486,6 +486,10 @@ vips_foreign_save_png_buffer_init(VipsForeignSavePngBuffer *buffer)
  * than an interlaced PNG can be up to 7 times slower to write than a
  * non-interlaced image.
  *
+ * Large non-interlaced images with 8 or 16 bits per sample are filtered
+ * and compressed in parallel, in strips of about 256kb. The output is the
+ * same whatever the number of threads.
+ *
  * Use @filter to specify one or more filters, defaults to none,
  * see [flags@ForeignPngFilter].
  *
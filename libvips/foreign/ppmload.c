@@ -729,6 +729,20 @@ vips_foreign_load_ppm_load(VipsForeignLoad *load)
 	return 0;
 }
 
+/* Must match magic_names[].
+ */
+static const VipsForeignSignature vips_foreign_load_ppm_signatures[] = {
+	{ 0, "P1", NULL, 2 },
+	{ 0, "P2", NULL, 2 },
+	{ 0, "P3", NULL, 2 },
+	{ 0, "P4", NULL, 2 },
+	{ 0, "P5", NULL, 2 },
+	{ 0, "P6", NULL, 2 },
+	{ 0, "PF", NULL, 2 },
+	{ 0, "Pf", NULL, 2 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_ppm_class_init(VipsForeignLoadPpmClass *class)
 {
@@ -756,6 +770,8 @@ vips_foreign_load_ppm_class_init(VipsForeignLoadPpmClass *class)
 	 */
 	foreign_class->priority = 200;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_ppm_signatures, TRUE);
 	load_class->get_flags = vips_foreign_load_ppm_get_flags;
 	load_class->header = vips_foreign_load_ppm_header;
 	load_class->load = vips_foreign_load_ppm_load;
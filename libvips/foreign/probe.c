@@ -0,0 +1,1022 @@
+/* Find the basic properties of many images quickly.
+ *
+ * 18/10/26
+ *	- first version!
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+
+/* The common formats have a fixed-layout header near the start of the file,
+ * so we can parse them directly from a few hundred bytes, with no loader
+ * object and no operation cache. Anything else, or anything odd, is passed
+ * to the loader that would load it for a header-only build.
+ *
+ * A fast path must only claim files that its loader would load, and must
+ * give the same answer as its loader.
+ */
+
+/* The most bytes we sniff to pick a fast path.
+ */
+#define PROBE_SNIFF (32)
+
+/* Don't follow TIFF IFD chains for ever.
+ */
+#define PROBE_MAX_PAGES (100000)
+
+/* A fast path. Return 0 for success, -1 to fall back to the loader.
+ */
+typedef int (*VipsProbeFn)(VipsSource *source,
+	const unsigned char *header, size_t length, VipsProbe *probe);
+
+typedef struct _VipsProbeFormat {
+	/* The loader this fast path stands in for.
+	 */
+	const char *loader;
+
+	/* Any loaders of a higher priority which might also claim these
+	 * files. The fast path is disabled if one of these is present.
+	 */
+	const char *rival;
+
+	/* The signature we test for.
+	 */
+	int offset;
+	const char *magic;
+	int magic_length;
+
+	VipsProbeFn probe;
+
+	/* The loader is present and the fast path can be used.
+	 */
+	gboolean enabled;
+} VipsProbeFormat;
+
+static guint
+vips_probe_get16(const unsigned char *p, gboolean big_endian)
+{
+	return big_endian
+		? ((guint) p[0] << 8) | p[1]
+		: ((guint) p[1] << 8) | p[0];
+}
+
+static guint32
+vips_probe_get32(const unsigned char *p, gboolean big_endian)
+{
+	return big_endian
+		? ((guint32) vips_probe_get16(p, TRUE) << 16) |
+			vips_probe_get16(p + 2, TRUE)
+		: ((guint32) vips_probe_get16(p + 2, FALSE) << 16) |
+			vips_probe_get16(p, FALSE);
+}
+
+static guint64
+vips_probe_get64(const unsigned char *p, gboolean big_endian)
+{
+	return big_endian
+		? ((guint64) vips_probe_get32(p, TRUE) << 32) |
+			vips_probe_get32(p + 4, TRUE)
+		: ((guint64) vips_probe_get32(p + 4, FALSE) << 32) |
+			vips_probe_get32(p, FALSE);
+}
+
+/* Read exactly @length bytes, or fail.
+ */
+static int
+vips_probe_read(VipsSource *source, void *buffer, size_t length)
+{
+	unsigned char *p = (unsigned char *) buffer;
+
+	while (length > 0) {
+		gint64 bytes_read;
+
+		if ((bytes_read = vips_source_read(source, p, length)) <= 0)
+			return -1;
+
+		p += bytes_read;
+		length -= bytes_read;
+	}
+
+	return 0;
+}
+
+/* The orientation tag from an EXIF block, with or without the "Exif" prefix,
+ * or 1 if there's no tag.
+ */
+static int
+vips_probe_exif_orientation(const unsigned char *data, size_t length)
+{
+	gboolean big_endian;
+	guint32 offset;
+	int n_entries;
+	int i;
+
+	if (length >= 6 &&
+		memcmp(data, "Exif\0\0", 6) == 0) {
+		data += 6;
+		length -= 6;
+	}
+
+	if (length < 8)
+		return 1;
+	if (data[0] == 'I' &&
+		data[1] == 'I')
+		big_endian = FALSE;
+	else if (data[0] == 'M' &&
+		data[1] == 'M')
+		big_endian = TRUE;
+	else
+		return 1;
+
+	offset = vips_probe_get32(data + 4, big_endian);
+	if (offset > length - 2)
+		return 1;
+	n_entries = vips_probe_get16(data + offset, big_endian);
+
+	for (i = 0; i < n_entries; i++) {
+		const unsigned char *entry = data + offset + 2 + i * 12;
+
+		if (entry + 12 > data + length)
+			break;
+
+		if (vips_probe_get16(entry, big_endian) == 0x112) {
+			int orientation = vips_probe_get16(entry + 8, big_endian);
+
+			return orientation > 0 && orientation < 9 ? orientation : 1;
+		}
+	}
+
+	return 1;
+}
+
+/* Walk the markers to the first SOF, picking up the orientation from any
+ * EXIF block on the way.
+ */
+static int
+vips_probe_jpeg(VipsSource *source,
+	const unsigned char *header, size_t length, VipsProbe *probe)
+{
+	gboolean seen_exif;
+	unsigned char buffer[8];
+
+	probe->orientation = 1;
+
+	if (vips_source_seek(source, 2, SEEK_SET) < 0)
+		return -1;
+
+	seen_exif = FALSE;
+	for (;;) {
+		int marker;
+		int segment_length;
+
+		if (vips_probe_read(source, buffer, 1) ||
+			buffer[0] != 0xff)
+			return -1;
+
+		/* Skip any fill bytes.
+		 */
+		do {
+			if (vips_probe_read(source, buffer, 1))
+				return -1;
+		} while (buffer[0] == 0xff);
+		marker = buffer[0];
+
+		if (vips_probe_read(source, buffer, 2))
+			return -1;
+		segment_length = vips_probe_get16(buffer, TRUE);
+		if (segment_length < 2)
+			return -1;
+
+		/* SOF0 to SOF15, except DHT, JPG and DAC.
+		 */
+		if (marker >= 0xc0 &&
+			marker <= 0xcf &&
+			marker != 0xc4 &&
+			marker != 0xc8 &&
+			marker != 0xcc) {
+			if (segment_length < 8 ||
+				vips_probe_read(source, buffer, 6))
+				return -1;
+
+			probe->height = vips_probe_get16(buffer + 1, TRUE);
+			probe->width = vips_probe_get16(buffer + 3, TRUE);
+			probe->bands = buffer[5];
+
+			/* A height of zero means the height is in a DNL marker
+			 * after the first scan.
+			 */
+			if (probe->width == 0 ||
+				probe->height == 0 ||
+				(probe->bands != 1 &&
+					probe->bands != 3 &&
+					probe->bands != 4))
+				return -1;
+
+			probe->format = VIPS_FORMAT_UCHAR;
+			probe->n_pages = 1;
+
+			return 0;
+		}
+
+		/* APP1 might be EXIF.
+		 */
+		if (marker == 0xe1 &&
+			!seen_exif &&
+			segment_length > 8) {
+			unsigned char *data;
+
+			data = g_malloc(segment_length - 2);
+			if (vips_probe_read(source, data, segment_length - 2)) {
+				g_free(data);
+				return -1;
+			}
+
+			if (memcmp(data, "Exif\0\0", 6) == 0) {
+				probe->orientation = vips_probe_exif_orientation(data,
+					segment_length - 2);
+				seen_exif = TRUE;
+			}
+
+			g_free(data);
+		}
+		else if (vips_source_seek(source, segment_length - 2, SEEK_CUR) < 0)
+			return -1;
+	}
+}
+
+/* IHDR is always first, but we must look for tRNS and eXIf up to the first
+ * IDAT.
+ */
+static int
+vips_probe_png(VipsSource *source,
+	const unsigned char *header, size_t length, VipsProbe *probe)
+{
+	unsigned char buffer[13];
+	int bit_depth;
+	int colour_type;
+
+	if (length < 29 ||
+		memcmp(header + 12, "IHDR", 4) != 0)
+		return -1;
+
+	probe->width = vips_probe_get32(header + 16, TRUE);
+	probe->height = vips_probe_get32(header + 20, TRUE);
+	bit_depth = header[24];
+	colour_type = header[25];
+	if (probe->width <= 0 ||
+		probe->height <= 0)
+		return -1;
+
+	switch (colour_type) {
+	case 0:
+		probe->bands = 1;
+		break;
+
+	case 2:
+	case 3:
+		probe->bands = 3;
+		break;
+
+	case 4:
+		probe->bands = 2;
+		break;
+
+	case 6:
+		probe->bands = 4;
+		break;
+
+	default:
+		return -1;
+	}
+	probe->format = bit_depth > 8 ? VIPS_FORMAT_USHORT : VIPS_FORMAT_UCHAR;
+	probe->orientation = 1;
+	probe->n_pages = 1;
+
+	/* Skip the IHDR data and CRC.
+	 */
+	if (vips_source_seek(source, 33, SEEK_SET) < 0)
+		return -1;
+
+	for (;;) {
+		guint32 chunk_length;
+
+		if (vips_probe_read(source, buffer, 8))
+			return -1;
+		chunk_length = vips_probe_get32(buffer, TRUE);
+		if (chunk_length > G_MAXINT32)
+			return -1;
+
+		if (memcmp(buffer + 4, "IDAT", 4) == 0)
+			break;
+
+		if (memcmp(buffer + 4, "tRNS", 4) == 0) {
+			if (colour_type == 0 ||
+				colour_type == 2 ||
+				colour_type == 3)
+				probe->bands += 1;
+		}
+		else if (memcmp(buffer + 4, "eXIf", 4) == 0 &&
+			chunk_length < 10 * 1024 * 1024) {
+			unsigned char *data;
+
+			data = g_malloc(chunk_length);
+			if (vips_probe_read(source, data, chunk_length)) {
+				g_free(data);
+				return -1;
+			}
+			probe->orientation =
+				vips_probe_exif_orientation(data, chunk_length);
+			g_free(data);
+
+			chunk_length = 0;
+		}
+
+		/* Skip the chunk data and the CRC.
+		 */
+		if (vips_source_seek(source, chunk_length + 4, SEEK_CUR) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Simple lossy, simple lossless, and extended stills. Animations need a
+ * scan of every frame to find the alpha, so we leave those to the loader.
+ */
+static int
+vips_probe_webp(VipsSource *source,
+	const unsigned char *header, size_t length, VipsProbe *probe)
+{
+	unsigned char buffer[8];
+
+	if (length < 30 ||
+		memcmp(header, "RIFF", 4) != 0)
+		return -1;
+
+	probe->format = VIPS_FORMAT_UCHAR;
+	probe->orientation = 1;
+	probe->n_pages = 1;
+
+	if (memcmp(header + 12, "VP8 ", 4) == 0) {
+		/* Three byte frame tag, then a start code.
+		 */
+		if (header[23] != 0x9d ||
+			header[24] != 0x01 ||
+			header[25] != 0x2a)
+			return -1;
+
+		probe->width = vips_probe_get16(header + 26, FALSE) & 0x3fff;
+		probe->height = vips_probe_get16(header + 28, FALSE) & 0x3fff;
+		probe->bands = 3;
+	}
+	else if (memcmp(header + 12, "VP8L", 4) == 0) {
+		guint32 bits;
+
+		if (header[20] != 0x2f)
+			return -1;
+
+		bits = vips_probe_get32(header + 21, FALSE);
+		probe->width = (bits & 0x3fff) + 1;
+		probe->height = ((bits >> 14) & 0x3fff) + 1;
+		probe->bands = (bits >> 28) & 1 ? 4 : 3;
+	}
+	else if (memcmp(header + 12, "VP8X", 4) == 0) {
+		int flags = header[20];
+
+		/* Animation.
+		 */
+		if (flags & 0x02)
+			return -1;
+
+		probe->width = 1 + (header[24] |
+			(header[25] << 8) |
+			(header[26] << 16));
+		probe->height = 1 + (header[27] |
+			(header[28] << 8) |
+			(header[29] << 16));
+		probe->bands = flags & 0x10 ? 4 : 3;
+
+		/* There's an EXIF chunk somewhere, walk the chunks to find it.
+		 */
+		if (flags & 0x08) {
+			gint64 offset;
+
+			offset = 30;
+			for (;;) {
+				guint32 chunk_length;
+
+				if (vips_source_seek(source, offset, SEEK_SET) < 0 ||
+					vips_probe_read(source, buffer, 8))
+					return -1;
+				chunk_length = vips_probe_get32(buffer + 4, FALSE);
+
+				if (memcmp(buffer, "EXIF", 4) == 0) {
+					unsigned char *data;
+
+					if (chunk_length > 10 * 1024 * 1024)
+						return -1;
+
+					data = g_malloc(chunk_length);
+					if (vips_probe_read(source, data, chunk_length)) {
+						g_free(data);
+						return -1;
+					}
+					probe->orientation =
+						vips_probe_exif_orientation(data, chunk_length);
+					g_free(data);
+
+					break;
+				}
+
+				/* Chunks are padded to an even length.
+				 */
+				offset += 8 + chunk_length + (chunk_length & 1);
+			}
+		}
+	}
+	else
+		return -1;
+
+	return 0;
+}
+
+/* Fetch the first value of an IFD entry, following the offset if the
+ * values don't fit in the entry.
+ */
+static int
+vips_probe_tiff_value(VipsSource *source, const unsigned char *entry,
+	gboolean big_endian, gboolean bigtiff, guint64 *value)
+{
+	int type = vips_probe_get16(entry + 2, big_endian);
+	guint64 count = bigtiff
+		? vips_probe_get64(entry + 4, big_endian)
+		: vips_probe_get32(entry + 4, big_endian);
+	const unsigned char *p = entry + (bigtiff ? 12 : 8);
+	int inline_size = bigtiff ? 8 : 4;
+
+	unsigned char buffer[8];
+	int size;
+
+	switch (type) {
+	case 1:
+		size = 1;
+		break;
+
+	case 3:
+		size = 2;
+		break;
+
+	case 4:
+		size = 4;
+		break;
+
+	case 16:
+		size = 8;
+		break;
+
+	default:
+		return -1;
+	}
+
+	if (count == 0)
+		return -1;
+
+	if (count > inline_size / size) {
+		guint64 offset = bigtiff
+			? vips_probe_get64(p, big_endian)
+			: vips_probe_get32(p, big_endian);
+
+		if (offset > G_MAXINT64 ||
+			vips_source_seek(source, offset, SEEK_SET) < 0 ||
+			vips_probe_read(source, buffer, size))
+			return -1;
+		p = buffer;
+	}
+
+	switch (size) {
+	case 1:
+		*value = p[0];
+		break;
+
+	case 2:
+		*value = vips_probe_get16(p, big_endian);
+		break;
+
+	case 4:
+		*value = vips_probe_get32(p, big_endian);
+		break;
+
+	default:
+		*value = vips_probe_get64(p, big_endian);
+		break;
+	}
+
+	return 0;
+}
+
+/* Parse the first IFD, then count the rest.
+ */
+static int
+vips_probe_tiff(VipsSource *source,
+	const unsigned char *header, size_t length, VipsProbe *probe)
+{
+	gboolean big_endian = header[0] == 'M';
+	gboolean bigtiff = vips_probe_get16(header + 2, big_endian) == 43;
+	int entry_size = bigtiff ? 20 : 12;
+	int count_size = bigtiff ? 8 : 2;
+	int offset_size = bigtiff ? 8 : 4;
+
+	guint64 width = 0;
+	guint64 height = 0;
+	guint64 bits_per_sample = 1;
+	guint64 compression = 1;
+	guint64 photometric = G_MAXUINT64;
+	guint64 orientation = 1;
+	guint64 samples_per_pixel = 1;
+	guint64 sample_format = 1;
+
+	unsigned char buffer[8];
+	guint64 offset;
+	guint64 n_entries;
+	unsigned char *entries;
+	int i;
+
+	if (bigtiff) {
+		if (length < 16 ||
+			vips_probe_get16(header + 4, big_endian) != 8)
+			return -1;
+		offset = vips_probe_get64(header + 8, big_endian);
+	}
+	else
+		offset = vips_probe_get32(header + 4, big_endian);
+
+	if (offset > G_MAXINT64 ||
+		vips_source_seek(source, offset, SEEK_SET) < 0 ||
+		vips_probe_read(source, buffer, count_size))
+		return -1;
+	n_entries = bigtiff
+		? vips_probe_get64(buffer, big_endian)
+		: vips_probe_get16(buffer, big_endian);
+	if (n_entries == 0 ||
+		n_entries > 4096)
+		return -1;
+
+	entries = g_malloc(n_entries * entry_size + offset_size);
+	if (vips_probe_read(source, entries, n_entries * entry_size + offset_size)) {
+		g_free(entries);
+		return -1;
+	}
+
+	for (i = 0; i < n_entries; i++) {
+		const unsigned char *entry = entries + i * entry_size;
+		guint64 *value;
+
+		switch (vips_probe_get16(entry, big_endian)) {
+		case 256:
+			value = &width;
+			break;
+
+		case 257:
+			value = &height;
+			break;
+
+		case 258:
+			value = &bits_per_sample;
+			break;
+
+		case 259:
+			value = &compression;
+			break;
+
+		case 262:
+			value = &photometric;
+			break;
+
+		case 274:
+			value = &orientation;
+			break;
+
+		case 277:
+			value = &samples_per_pixel;
+			break;
+
+		case 339:
+			value = &sample_format;
+			break;
+
+		default:
+			value = NULL;
+			break;
+		}
+
+		if (value &&
+			vips_probe_tiff_value(source, entry,
+				big_endian, bigtiff, value)) {
+			g_free(entries);
+			return -1;
+		}
+	}
+
+	offset = bigtiff
+		? vips_probe_get64(entries + n_entries * entry_size, big_endian)
+		: vips_probe_get32(entries + n_entries * entry_size, big_endian);
+	g_free(entries);
+
+	if (width == 0 ||
+		width > VIPS_MAX_COORD ||
+		height == 0 ||
+		height > VIPS_MAX_COORD ||
+		samples_per_pixel == 0 ||
+		samples_per_pixel > VIPS_MAX_COORD)
+		return -1;
+
+	/* Only the photometrics tiffload copies straight through. YCbCr is
+	 * only converted to RGB with no change in bands for JPEG compression.
+	 */
+	switch (photometric) {
+	case 0:
+	case 1:
+		if (bits_per_sample < 8 &&
+			samples_per_pixel != 1)
+			return -1;
+		break;
+
+	case 2:
+	case 5:
+		if (bits_per_sample < 8)
+			return -1;
+		break;
+
+	case 6:
+		if (compression != 7 ||
+			bits_per_sample != 8)
+			return -1;
+		break;
+
+	default:
+		return -1;
+	}
+
+	/* As rtiff_guess_format().
+	 */
+	probe->format = VIPS_FORMAT_NOTSET;
+	switch (bits_per_sample) {
+	case 1:
+	case 2:
+	case 4:
+	case 8:
+		if (sample_format == 2)
+			probe->format = VIPS_FORMAT_CHAR;
+		else if (sample_format == 1)
+			probe->format = VIPS_FORMAT_UCHAR;
+		break;
+
+	case 16:
+		if (sample_format == 2)
+			probe->format = VIPS_FORMAT_SHORT;
+		else if (sample_format == 1)
+			probe->format = VIPS_FORMAT_USHORT;
+		else if (sample_format == 3)
+			probe->format = VIPS_FORMAT_FLOAT;
+		break;
+
+	case 32:
+		if (sample_format == 2)
+			probe->format = VIPS_FORMAT_INT;
+		else if (sample_format == 1)
+			probe->format = VIPS_FORMAT_UINT;
+		else if (sample_format == 3)
+			probe->format = VIPS_FORMAT_FLOAT;
+		break;
+
+	case 64:
+		if (sample_format == 3)
+			probe->format = VIPS_FORMAT_DOUBLE;
+		else if (sample_format == 6)
+			probe->format = VIPS_FORMAT_COMPLEX;
+		break;
+
+	case 128:
+		if (sample_format == 6)
+			probe->format = VIPS_FORMAT_DPCOMPLEX;
+		break;
+
+	default:
+		break;
+	}
+	if (probe->format == VIPS_FORMAT_NOTSET)
+		return -1;
+
+	probe->width = width;
+	probe->height = height;
+	probe->bands = samples_per_pixel;
+	probe->orientation = orientation > 0 && orientation < 9 ? orientation : 1;
+
+	/* Count the pages.
+	 */
+	for (probe->n_pages = 1; offset; probe->n_pages++) {
+		if (probe->n_pages >= PROBE_MAX_PAGES ||
+			offset > G_MAXINT64 ||
+			vips_source_seek(source, offset, SEEK_SET) < 0 ||
+			vips_probe_read(source, buffer, count_size))
+			return -1;
+		n_entries = bigtiff
+			? vips_probe_get64(buffer, big_endian)
+			: vips_probe_get16(buffer, big_endian);
+		if (n_entries > 4096 ||
+			vips_source_seek(source,
+				n_entries * entry_size, SEEK_CUR) < 0 ||
+			vips_probe_read(source, buffer, offset_size))
+			return -1;
+		offset = bigtiff
+			? vips_probe_get64(buffer, big_endian)
+			: vips_probe_get32(buffer, big_endian);
+	}
+
+	return 0;
+}
+
+static VipsProbeFormat vips_probe_formats[] = {
+	{ "jpegload_source", "uhdrload_source", 0, "\xff\xd8\xff", 3,
+		vips_probe_jpeg },
+	{ "pngload_source", NULL, 0, "\x89PNG\r\n\x1a\n", 8,
+		vips_probe_png },
+	{ "webpload_source", NULL, 8, "WEBP", 4,
+		vips_probe_webp },
+	{ "tiffload_source", "openslideload_source", 0, "II*\0", 4,
+		vips_probe_tiff },
+	{ "tiffload_source", "openslideload_source", 0, "MM\0*", 4,
+		vips_probe_tiff },
+	{ "tiffload_source", "openslideload_source", 0, "II+\0", 4,
+		vips_probe_tiff },
+	{ "tiffload_source", "openslideload_source", 0, "MM\0+", 4,
+		vips_probe_tiff },
+};
+
+static void *
+vips_probe_init_cb(void *client)
+{
+	int i;
+
+	for (i = 0; i < VIPS_NUMBER(vips_probe_formats); i++) {
+		VipsProbeFormat *format = &vips_probe_formats[i];
+
+		format->enabled =
+			vips_type_find("VipsForeignLoad", format->loader) &&
+			(!format->rival ||
+				!vips_type_find("VipsForeignLoad", format->rival));
+	}
+
+	return NULL;
+}
+
+/* Make the loader we'd use for a header-only build, skipping the operation
+ * cache.
+ */
+static int
+vips_probe_load(VipsSource *source, VipsProbe *probe)
+{
+	const char *name;
+	VipsOperation *operation;
+	VipsImage *out;
+
+	if (vips_source_rewind(source) ||
+		!(name = vips_foreign_find_load_source(source)) ||
+		!(operation = vips_operation_new(name)))
+		return -1;
+
+	g_object_set(operation, "source", source, NULL);
+	if (vips_object_build(VIPS_OBJECT(operation))) {
+		vips_object_unref_outputs(VIPS_OBJECT(operation));
+		g_object_unref(operation);
+		return -1;
+	}
+
+	g_object_get(operation, "out", &out, NULL);
+
+	probe->loader = VIPS_OBJECT_GET_CLASS(operation)->nickname;
+	probe->width = out->Xsize;
+	probe->height = vips_image_get_page_height(out);
+	probe->bands = out->Bands;
+	probe->format = out->BandFmt;
+	probe->orientation = vips_image_get_orientation(out);
+	probe->n_pages = vips_image_get_n_pages(out);
+
+	g_object_unref(out);
+	vips_object_unref_outputs(VIPS_OBJECT(operation));
+	g_object_unref(operation);
+
+	return 0;
+}
+
+/**
+ * VipsProbe:
+ * @loader: the nickname of the loader for this image
+ * @width: image width in pixels
+ * @height: image height in pixels, of a single page
+ * @bands: number of bands the loader will produce
+ * @format: the band format the loader will produce
+ * @orientation: the EXIF orientation, or 1 if there's none
+ * @n_pages: number of pages in the image
+ *
+ * The basic properties of an image, as found by [func@probe_source].
+ */
+
+/**
+ * vips_probe_source:
+ * @source: source to probe
+ * @probe: (out caller-allocates): fill this with the image properties
+ *
+ * Find the basic properties of an image as quickly as possible.
+ *
+ * JPEG, PNG, WebP and TIFF are probed by parsing a few bytes of header
+ * directly. Other formats, and unusual images in these formats, are
+ * probed with a header-only build of the loader that
+ * [func@Foreign.find_load_source] picks.
+ *
+ * Either way, the result is the same as loading the image with
+ * [ctor@Image.new_from_source] and reading the header fields, except
+ * that @height is the height of a single page. Nothing goes into the
+ * operation cache.
+ *
+ * ::: seealso
+ *     [func@probe_files].
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_probe_source(VipsSource *source, VipsProbe *probe)
+{
+	static GOnce once = G_ONCE_INIT;
+
+	const unsigned char *header;
+	gint64 length;
+	int i;
+
+	VIPS_ONCE(&once, vips_probe_init_cb, NULL);
+
+	memset(probe, 0, sizeof(VipsProbe));
+
+	if ((length = vips_source_sniff_at_most(source,
+			 (unsigned char **) &header, PROBE_SNIFF)) <= 0)
+		return -1;
+
+	for (i = 0; i < VIPS_NUMBER(vips_probe_formats); i++) {
+		VipsProbeFormat *format = &vips_probe_formats[i];
+
+		if (format->enabled &&
+			length >= format->offset + format->magic_length &&
+			memcmp(header + format->offset,
+				format->magic, format->magic_length) == 0) {
+			/* The sniff buffer can be invalidated by a read, so
+			 * take a copy.
+			 */
+			unsigned char copy[PROBE_SNIFF];
+
+			memcpy(copy, header, length);
+			if (!format->probe(source, copy, length, probe)) {
+				probe->loader = format->loader;
+				return 0;
+			}
+
+#ifdef DEBUG
+			printf("vips_probe_source: falling back from %s\n",
+				format->loader);
+#endif /*DEBUG*/
+
+			memset(probe, 0, sizeof(VipsProbe));
+			break;
+		}
+	}
+
+	return vips_probe_load(source, probe);
+}
+
+typedef struct _VipsProbeFiles {
+	const char **filenames;
+	VipsProbe *probes;
+	int n;
+
+	/* The next file to probe, and the number that failed.
+	 */
+	int next;
+	int n_failed;
+
+	VipsSemaphore finish;
+} VipsProbeFiles;
+
+static int
+vips_probe_file(const char *filename, VipsProbe *probe)
+{
+	VipsSource *source;
+	int result;
+
+	if (!(source = vips_source_new_from_file(filename))) {
+		memset(probe, 0, sizeof(VipsProbe));
+		return -1;
+	}
+	result = vips_probe_source(source, probe);
+	VIPS_UNREF(source);
+
+	return result;
+}
+
+static void
+vips_probe_files_work(void *data, void *user_data)
+{
+	VipsProbeFiles *files = (VipsProbeFiles *) data;
+
+	int i;
+
+	while ((i = g_atomic_int_add(&files->next, 1)) < files->n)
+		if (vips_probe_file(files->filenames[i], &files->probes[i]))
+			g_atomic_int_inc(&files->n_failed);
+
+	vips_semaphore_up(&files->finish);
+}
+
+/**
+ * vips_probe_files:
+ * @filenames: (array length=n): files to probe
+ * @n: number of files
+ * @probes: (array length=n) (out caller-allocates): fill these with the
+ *   image properties
+ * @parallel: probe with a set of threads
+ *
+ * Run [func@probe_source] on a set of files. If @parallel is set, files are
+ * probed by up to [func@concurrency_get] threads.
+ *
+ * If a file can't be probed, its @loader is set to `NULL` and an error
+ * message is added to the error buffer. Other files are still probed.
+ *
+ * Returns: 0 on success, -1 if any file failed.
+ */
+int
+vips_probe_files(const char **filenames, int n, VipsProbe *probes,
+	gboolean parallel)
+{
+	VipsProbeFiles files;
+	int n_threads;
+	int i;
+
+	files.filenames = filenames;
+	files.probes = probes;
+	files.n = n;
+	files.next = 0;
+	files.n_failed = 0;
+	vips_semaphore_init(&files.finish, 0, "finish");
+
+	n_threads = parallel
+		? VIPS_CLIP(1, vips_concurrency_get(), n)
+		: 1;
+
+	for (i = 1; i < n_threads; i++)
+		vips__thread_execute_or_run("probe",
+			vips_probe_files_work, &files);
+	vips_probe_files_work(&files, NULL);
+
+	vips_semaphore_downn(&files.finish, n_threads);
+	vips_semaphore_destroy(&files.finish);
+
+	return files.n_failed ? -1 : 0;
+}
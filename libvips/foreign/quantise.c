@@ -2,6 +2,8 @@
  *
  * 20/6/18
  * 	  - from vipspng.c
+ * 18/10/26
+ * 	- remap large undithered images in parallel bands
  */
 
 /*
@@ -41,7 +43,10 @@
 #endif /*HAVE_CONFIG_H*/
 #include <glib/gi18n-lib.h>
 
+#include <string.h>
+
 #include <vips/vips.h>
+#include <vips/internal.h>
 
 #include "quantise.h"
 
@@ -160,6 +165,64 @@ vips__quantise_write_remapped_image(VipsQuantiseResult *result,
 		result, input_image, buffer, buffer_size);
 }
 
+/* Make a copy of a result with a fixed palette. Results hold remap state, so
+ * two threads can't remap with the same result, but they can each use a copy.
+ */
+VipsQuantiseError
+vips__quantise_result_copy(VipsQuantiseAttr *attr,
+	VipsQuantiseResult *result, VipsQuantiseResult **result_output)
+{
+	const liq_palette *palette = liq_get_palette(result);
+
+	int i;
+	liq_attr *copy_attr;
+	const liq_palette *copy_palette;
+	liq_error err;
+	liq_image *fake_image;
+	char fake_image_pixels[4] = { 0 };
+
+	if (palette->count < 2)
+		return LIQ_VALUE_OUT_OF_RANGE;
+
+	/* As vips__quantise_image_quantize_fixed(), but with exactly as many
+	 * colours as the palette, so no new colours are added.
+	 */
+	if (!(copy_attr = liq_attr_copy(attr)))
+		return LIQ_OUT_OF_MEMORY;
+	liq_set_max_colors(copy_attr, palette->count);
+
+	fake_image =
+		liq_image_create_rgba(copy_attr, fake_image_pixels, 1, 1, 0);
+	if (!fake_image) {
+		liq_attr_destroy(copy_attr);
+		return LIQ_OUT_OF_MEMORY;
+	}
+
+	for (i = 0; i < palette->count; i++)
+		liq_image_add_fixed_color(fake_image, palette->entries[i]);
+
+	err = liq_image_quantize(fake_image, copy_attr, result_output);
+
+	liq_image_destroy(fake_image);
+	liq_attr_destroy(copy_attr);
+
+	if (err != LIQ_OK)
+		return err;
+
+	/* The index values must mean the same thing, so the copy must have the
+	 * same palette in the same order.
+	 */
+	copy_palette = liq_get_palette(*result_output);
+	if (copy_palette->count != palette->count ||
+		memcmp(copy_palette->entries, palette->entries,
+			palette->count * sizeof(liq_color))) {
+		VIPS_FREEF(liq_result_destroy, *result_output);
+		return LIQ_VALUE_OUT_OF_RANGE;
+	}
+
+	return LIQ_OK;
+}
+
 void
 vips__quantise_result_destroy(VipsQuantiseResult *result)
 {
@@ -257,6 +320,15 @@ vips__quantise_write_remapped_image(VipsQuantiseResult *result,
 	return quantizr_remap(result, input_image, buffer, buffer_size);
 }
 
+VipsQuantiseError
+vips__quantise_result_copy(VipsQuantiseAttr *attr,
+	VipsQuantiseResult *result, VipsQuantiseResult **result_output)
+{
+	/* Not supported by quantizr
+	 */
+	return 1;
+}
+
 void
 vips__quantise_result_destroy(VipsQuantiseResult *result)
 {
@@ -277,6 +349,144 @@ vips__quantise_attr_destroy(VipsQuantiseAttr *attr)
 
 #endif /*HAVE_IMAGEQUANT*/
 
+/* Without error diffusion, each pixel maps to its nearest palette entry, so
+ * we can remap large images as a set of bands, each with its own copy of the
+ * palette, and get the same result as a single remap. Band size depends only
+ * on the image, never on the number of threads.
+ */
+#define QUANTISE_BAND_HEIGHT (256)
+#define QUANTISE_BAND_MIN_PELS (2 * 1024 * 1024)
+#define QUANTISE_MAX_BANDS (16)
+
+typedef struct _QuantiseBand {
+	VipsSemaphore *finish;
+
+	VipsQuantiseResult *result;
+	VipsQuantiseImage *image;
+	VipsPel *index;
+	size_t n_pels;
+
+	VipsQuantiseError err;
+} QuantiseBand;
+
+/* The number of bands we'd remap an image of this size in.
+ */
+static int
+vips__quantise_n_bands(int width, int height)
+{
+	if ((guint64) width * height < QUANTISE_BAND_MIN_PELS)
+		return 1;
+
+	return VIPS_CLIP(1, height / QUANTISE_BAND_HEIGHT, QUANTISE_MAX_BANDS);
+}
+
+static void
+vips__quantise_band_work(void *data, void *user_data)
+{
+	QuantiseBand *band = (QuantiseBand *) data;
+
+	band->err = vips__quantise_write_remapped_image(band->result,
+		band->image, band->index, band->n_pels);
+
+	vips_semaphore_up(band->finish);
+}
+
+static void
+vips__quantise_bands_free(QuantiseBand *bands, int n_bands)
+{
+	int i;
+
+	for (i = 0; i < n_bands; i++) {
+		VIPS_FREEF(vips__quantise_image_destroy, bands[i].image);
+
+		/* The first band uses the caller's result.
+		 */
+		if (i > 0)
+			VIPS_FREEF(vips__quantise_result_destroy, bands[i].result);
+	}
+
+	g_free(bands);
+}
+
+/* Dither @image (made from the RGBA pixels in @rgba) into @index with
+ * @result, which must have a fixed palette, see
+ * vips__quantise_image_quantize_fixed(). Large images with no dithering are
+ * remapped in parallel bands.
+ *
+ * If we can't copy @result, we fall back to a single remap.
+ */
+VipsQuantiseError
+vips__quantise_remap(VipsQuantiseAttr *attr, VipsQuantiseResult *result,
+	VipsQuantiseImage *image, VipsPel *rgba, int width, int height,
+	double dither, VipsPel *index)
+{
+	int n_bands = dither == 0.0
+		? vips__quantise_n_bands(width, height)
+		: 1;
+	int band_height = VIPS_ROUND_UP(height, n_bands) / n_bands;
+
+	QuantiseBand *bands;
+	VipsSemaphore finish;
+	VipsQuantiseError err;
+	int i;
+
+	vips__quantise_set_dithering_level(result, dither);
+
+	if (n_bands < 2)
+		return vips__quantise_write_remapped_image(result,
+			image, index, (size_t) width * height);
+
+	bands = g_new0(QuantiseBand, n_bands);
+	for (i = 0; i < n_bands; i++) {
+		QuantiseBand *band = &bands[i];
+		int top = i * band_height;
+		int n_lines = VIPS_MIN(band_height, height - top);
+
+		if (i == 0)
+			band->result = result;
+		else if (vips__quantise_result_copy(attr, result, &band->result))
+			break;
+		else
+			vips__quantise_set_dithering_level(band->result, dither);
+
+		if (!(band->image = vips__quantise_image_create_rgba(attr,
+				  rgba + (size_t) top * width * 4, width, n_lines, 0)))
+			break;
+
+		band->finish = &finish;
+		band->index = index + (size_t) top * width;
+		band->n_pels = (size_t) width * n_lines;
+	}
+
+	if (i < n_bands) {
+		vips__quantise_bands_free(bands, n_bands);
+
+		return vips__quantise_write_remapped_image(result,
+			image, index, (size_t) width * height);
+	}
+
+	vips_semaphore_init(&finish, 0, "finish");
+
+	for (i = 1; i < n_bands; i++)
+		vips__thread_execute_or_run("quantise",
+			vips__quantise_band_work, &bands[i]);
+	vips__quantise_band_work(&bands[0], NULL);
+
+	vips_semaphore_downn(&finish, n_bands);
+	vips_semaphore_destroy(&finish);
+
+	err = 0;
+	for (i = 0; i < n_bands; i++)
+		if (bands[i].err) {
+			err = bands[i].err;
+			break;
+		}
+
+	vips__quantise_bands_free(bands, n_bands);
+
+	return err;
+}
+
 /* Track during a quantisation.
  */
 typedef struct _Quantise {
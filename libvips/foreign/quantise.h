@@ -76,9 +76,15 @@ VipsQuantiseError vips__quantise_set_dithering_level(VipsQuantiseResult *res,
 const VipsQuantisePalette *vips__quantise_get_palette(VipsQuantiseResult *result);
 VipsQuantiseError vips__quantise_write_remapped_image(VipsQuantiseResult *result,
 	VipsQuantiseImage *input_image, void *buffer, size_t buffer_size);
+VipsQuantiseError vips__quantise_result_copy(VipsQuantiseAttr *attr,
+	VipsQuantiseResult *result, VipsQuantiseResult **result_output);
 void vips__quantise_result_destroy(VipsQuantiseResult *result);
 void vips__quantise_image_destroy(VipsQuantiseImage *img);
 void vips__quantise_attr_destroy(VipsQuantiseAttr *attr);
+
+VipsQuantiseError vips__quantise_remap(VipsQuantiseAttr *attr,
+	VipsQuantiseResult *result, VipsQuantiseImage *image,
+	VipsPel *rgba, int width, int height, double dither, VipsPel *index);
 #endif /*HAVE_QUANTIZATION*/
 
 int vips__quantise_image(VipsImage *in,
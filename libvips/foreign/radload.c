@@ -110,6 +110,11 @@ vips_foreign_load_rad_load(VipsForeignLoad *load)
 	return 0;
 }
 
+static const VipsForeignSignature vips_foreign_load_rad_signatures[] = {
+	{ 0, "#?RADIANCE", NULL, 10 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_rad_class_init(VipsForeignLoadRadClass *class)
 {
@@ -132,6 +137,8 @@ vips_foreign_load_rad_class_init(VipsForeignLoadRadClass *class)
 	 */
 	foreign_class->priority = -50;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_rad_signatures, FALSE);
 	load_class->get_flags_filename =
 		vips_foreign_load_rad_get_flags_filename;
 	load_class->get_flags = vips_foreign_load_rad_get_flags;
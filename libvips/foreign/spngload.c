@@ -8,6 +8,8 @@
  *	-  add "unlimited" flag to png load
  * 3/2/23 MathemanFlo
  * 	- add bits per sample metadata
+ * 18/10/26
+ * 	- stop at the bottom of the region of interest
  */
 
 /*
@@ -577,9 +579,11 @@ vips_foreign_load_png_load(VipsForeignLoad *load)
 	VipsForeignLoadPng *png = (VipsForeignLoadPng *) load;
 	VipsImage **t = (VipsImage **)
 		vips_object_local_array(VIPS_OBJECT(load), 3);
+	const VipsRect *roi = vips__foreign_load_get_roi(load);
 
 	enum spng_decode_flags flags;
 	int error;
+	VipsImage *in;
 
 	if (vips_source_decode(png->source))
 		return -1;
@@ -610,8 +614,7 @@ vips_foreign_load_png_load(VipsForeignLoad *load)
 		 */
 		vips_source_minimise(png->source);
 
-		if (vips_image_write(t[0], load->real))
-			return -1;
+		in = t[0];
 	}
 	else {
 		t[0] = vips_image_new();
@@ -619,6 +622,12 @@ vips_foreign_load_png_load(VipsForeignLoad *load)
 		if (vips_foreign_load_png_set_header(png, t[0]))
 			return -1;
 
+		/* Rows are only available in order, but we can stop at the
+		 * bottom of the ROI.
+		 */
+		if (!vips_rect_isempty(roi))
+			t[0]->Ysize = VIPS_RECT_BOTTOM(roi);
+
 		/* We can decode these progressively.
 		 */
 		flags |= SPNG_DECODE_PROGRESSIVE;
@@ -640,14 +649,30 @@ vips_foreign_load_png_load(VipsForeignLoad *load)
 				png, NULL) ||
 			vips_sequential(t[0], &t[1],
 				"tile_height", VIPS__FATSTRIP_HEIGHT,
-				NULL) ||
-			vips_image_write(t[1], load->real))
+				NULL))
+			return -1;
+
+		in = t[1];
+	}
+
+	if (!vips_rect_isempty(roi)) {
+		if (vips_extract_area(in, &t[2],
+				roi->left, roi->top, roi->width, roi->height, NULL))
 			return -1;
+		in = t[2];
 	}
 
+	if (vips_image_write(in, load->real))
+		return -1;
+
 	return 0;
 }
 
+static const VipsForeignSignature vips_foreign_load_png_signatures[] = {
+	{ 0, "\x89PNG\r\n\x1a\n", NULL, 8 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_png_class_init(VipsForeignLoadPngClass *class)
 {
@@ -667,6 +692,8 @@ vips_foreign_load_png_class_init(VipsForeignLoadPngClass *class)
 	 */
 	foreign_class->priority = 200;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_png_signatures, TRUE);
 	load_class->get_flags_filename =
 		vips_foreign_load_png_get_flags_filename;
 	load_class->get_flags = vips_foreign_load_png_get_flags;
@@ -213,6 +213,9 @@
  *  - fix demand hinting
  * 3/2/23 MathemanFlo
  * 	- add bits per sample metadata
+ * 18/10/26
+ * 	- share decoded tiles between loads with the decode cache
+ * 	- map uncompressed strip images directly from the file
  */
 
 /*
@@ -422,6 +425,10 @@ typedef struct _Rtiff {
 	/* Stop processing due to an error or warning.
 	 */
 	gboolean failed;
+
+	/* Share decoded tiles with other loads of this file, or NULL.
+	 */
+	char *cache_id;
 } Rtiff;
 
 /* Convert IEEE 754-2008 16-bit float to 32-bit float
@@ -589,6 +596,7 @@ rtiff_free(Rtiff *rtiff)
 	VIPS_FREEF(TIFFClose, rtiff->tiff);
 	g_rec_mutex_clear(&rtiff->lock);
 	VIPS_UNREF(rtiff->source);
+	VIPS_FREE(rtiff->cache_id);
 }
 
 static void
@@ -673,6 +681,7 @@ rtiff_new(VipsSource *source, VipsImage *out,
 	rtiff->contig_buf = NULL;
 	rtiff->y_pos = 0;
 	rtiff->failed = FALSE;
+	rtiff->cache_id = NULL;
 
 	g_signal_connect(out, "close",
 		G_CALLBACK(rtiff_close_cb), rtiff);
@@ -1443,6 +1452,15 @@ rtiff_parse_greyscale(Rtiff *rtiff, VipsImage *out)
 
 	rtiff->sfn = rtiff_greyscale_line;
 
+	/* Black-is-zero images need no processing, so we can memcpy.
+	 */
+	rtiff->memcpy =
+		rtiff->header.photometric_interpretation == PHOTOMETRIC_MINISBLACK &&
+		(!rtiff->header.separate ||
+			rtiff->header.samples_per_pixel == 1) &&
+		!(rtiff->header.bits_per_sample == 16 &&
+			rtiff->header.sample_format == SAMPLEFORMAT_IEEEFP);
+
 	return 0;
 }
 
@@ -2312,6 +2330,12 @@ rtiff_read_tile(RtiffSeq *seq, tdata_t *buf, int page, int x, int y)
 		page, x, y, rtiff->header.we_decompress);
 #endif /*DEBUG_VERBOSE*/
 
+	/* Another load of this file may have decoded this tile already.
+	 */
+	if (vips__decode_cache_get(rtiff->cache_id, page, x, y,
+			buf, rtiff->header.tile_size))
+		return 0;
+
 	/* Compressed tiles load to compressed_buf.
 	 */
 	if (rtiff->header.we_decompress) {
@@ -2363,8 +2387,16 @@ rtiff_read_tile(RtiffSeq *seq, tdata_t *buf, int page, int x, int y)
 		}
 
 		g_rec_mutex_unlock(&rtiff->lock);
+
+		/* Don't share damaged tiles.
+		 */
+		if (result)
+			return 0;
 	}
 
+	vips__decode_cache_put(rtiff->cache_id, page, x, y,
+		buf, rtiff->header.tile_size);
+
 	return 0;
 }
 
@@ -2621,6 +2653,12 @@ rtiff_read_tilewise(Rtiff *rtiff, VipsImage *out)
 		return -1;
 	}
 
+	/* Tiles are shared between loads of the same file and subifd.
+	 */
+	rtiff->cache_id = vips__decode_cache_id(
+		vips_connection_filename(VIPS_CONNECTION(rtiff->source)),
+		"tiffload %d", rtiff->subifd);
+
 	/* Read to this image, then cache to out, see below.
 	 */
 	t[0] = vips_image_new();
@@ -2877,52 +2915,140 @@ rtiff_stripwise_generate(VipsRegion *out_region,
 	return 0;
 }
 
-/* Stripwise reading.
+/* Test if this page is uncompressed, stored as a single contiguous run of
+ * pixels, and in a layout libvips can use directly. If it is, set @offset
+ * to the position of the first pixel in the file.
  *
- * We could potentially read strips in any order, but this would give
- * catastrophic performance for operations like 90 degrees rotate on a
- * large image. Only offer sequential read.
+ * This must be called after rtiff_set_header().
  */
+static gboolean
+rtiff_is_mappable(Rtiff *rtiff, VipsImage *image, guint64 *offset)
+{
+	RtiffHeader *header = &rtiff->header;
+	guint64 line_size = VIPS_IMAGE_SIZEOF_LINE(image);
+
+	/* rows_per_strip can be 2**32 - 1 for "the whole image".
+	 */
+	int rows_per_strip = VIPS_MIN(header->rows_per_strip, header->height);
+	guint64 strip_size = line_size * rows_per_strip;
+
+	toff_t *offsets;
+	toff_t *bytecounts;
+	int i;
+
+	/* We need a source we can map, a simple copy from tiff to vips, and
+	 * tiff byte order to match ours.
+	 */
+	if (vips_source_is_mappable(rtiff->source) != TRUE ||
+		rtiff->n != 1 ||
+		header->tiled ||
+		header->compression != COMPRESSION_NONE ||
+		header->we_decompress ||
+		header->read_as_rgba ||
+		!rtiff->memcpy ||
+		(header->separate &&
+			header->samples_per_pixel > 1) ||
+		(header->bits_per_sample > 8 &&
+			TIFFIsByteSwapped(rtiff->tiff)) ||
+		(guint64) header->scanline_size != line_size ||
+		rows_per_strip < 1 ||
+		header->number_of_strips < 1)
+		return FALSE;
+
+	if (!TIFFGetField(rtiff->tiff, TIFFTAG_STRIPOFFSETS, &offsets) ||
+		!TIFFGetField(rtiff->tiff, TIFFTAG_STRIPBYTECOUNTS, &bytecounts) ||
+		!offsets ||
+		!bytecounts)
+		return FALSE;
+
+	/* Every strip must follow on directly from the previous one, and be
+	 * large enough to hold its lines.
+	 */
+	for (i = 0; i < header->number_of_strips; i++) {
+		int lines = VIPS_MIN(rows_per_strip,
+			(int) header->height - i * rows_per_strip);
+
+		if (lines <= 0 ||
+			offsets[i] != offsets[0] + i * strip_size ||
+			bytecounts[i] < lines * line_size)
+			return FALSE;
+	}
+
+	/* Truncated files must go via libtiff so @fail_on works.
+	 */
+	if (vips_source_length(rtiff->source) <
+		(gint64) (offsets[0] + header->height * line_size))
+		return FALSE;
+
+	*offset = offsets[0];
+
+	return TRUE;
+}
+
 static int
-rtiff_read_stripwise(Rtiff *rtiff, VipsImage *out)
+rtiff_mapped_generate(VipsRegion *out_region,
+	void *seq, void *a, void *b, gboolean *stop)
 {
-	VipsImage **t = (VipsImage **)
-		vips_object_local_array(VIPS_OBJECT(out), 4);
+	VipsRegion *ir = (VipsRegion *) seq;
+	VipsRect *r = &out_region->valid;
 
-	VipsImage *in;
-	int tile_height;
+	/* Just point the output at the file mapping.
+	 */
+	if (vips_region_prepare(ir, r) ||
+		vips_region_region(out_region, ir, r, r->left, r->top))
+		return -1;
+
+	return 0;
+}
+
+/* Map the pixels of an uncompressed page, rather than reading via libtiff.
+ * Pages are only touched as regions are computed, so the OS can page in just
+ * the parts of the file that are needed.
+ */
+static int
+rtiff_read_mapped(Rtiff *rtiff, VipsImage *out, guint64 offset)
+{
+	const void *data;
+	size_t length;
+	VipsImage *mapped;
 
 #ifdef DEBUG
-	printf("tiff2vips: rtiff_read_stripwise\n");
+	printf("tiff2vips: rtiff_read_mapped: offset = %" G_GUINT64_FORMAT "\n",
+		offset);
 #endif /*DEBUG*/
 
-	t[0] = vips_image_new();
-	if (rtiff_set_header(rtiff, t[0]))
+	if (!(data = vips_source_map(rtiff->source, &length)))
 		return -1;
+	data = (char *) data + offset;
+	length -= offset;
 
-	/* Double check: in memcpy mode, the vips linesize should exactly
-	 * match the tiff line size.
+	if (!(mapped = vips_image_new_from_memory(data, length,
+			  out->Xsize, out->Ysize, out->Bands, out->BandFmt)))
+		return -1;
+	vips_object_local(out, mapped);
+
+	/* The mapping belongs to the source, so it must stay alive for as
+	 * long as the image does.
 	 */
-	if (rtiff->memcpy) {
-		size_t vips_line_size;
+	g_object_ref(rtiff->source);
+	vips_object_local(mapped, rtiff->source);
 
-		/* Lines are smaller in plane-separated mode.
-		 */
-		if (rtiff->header.separate)
-			vips_line_size = VIPS_IMAGE_SIZEOF_ELEMENT(t[0]) *
-				t[0]->Xsize;
-		else
-			vips_line_size = VIPS_IMAGE_SIZEOF_LINE(t[0]);
+	if (vips_image_pio_input(mapped) ||
+		vips_image_generate(out,
+			vips_start_one, rtiff_mapped_generate, vips_stop_one,
+			mapped, NULL))
+		return -1;
 
-		if (rtiff->header.bits_per_sample == 16 &&
-			rtiff->header.sample_format == SAMPLEFORMAT_IEEEFP)
-			vips_line_size /= 2;
+	return 0;
+}
 
-		if (vips_line_size != rtiff->header.scanline_size) {
-			vips_error("tiff2vips", "%s", _("unsupported tiff image type"));
-			return -1;
-		}
-	}
+/* Decode a strip image via libtiff. Strips can only be read in order, so
+ * this adds a sequential.
+ */
+static int
+rtiff_read_stripwise_decode(Rtiff *rtiff, VipsImage *image, VipsImage **out)
+{
+	int tile_height;
 
 	/* If we have separate image planes, we must read to a plane buffer,
 	 * then interleave to the output.
@@ -2931,7 +3057,7 @@ rtiff_read_stripwise(Rtiff *rtiff, VipsImage *out)
 	 * function runs inside the cache lock.
 	 */
 	if (rtiff->header.separate) {
-		if (!(rtiff->plane_buf = VIPS_MALLOC(out,
+		if (!(rtiff->plane_buf = VIPS_MALLOC(image,
 				  rtiff->header.read_size)))
 			return -1;
 	}
@@ -2953,7 +3079,7 @@ rtiff_read_stripwise(Rtiff *rtiff, VipsImage *out)
 		if (rtiff->header.separate)
 			size *= rtiff->header.samples_per_pixel;
 
-		if (!(rtiff->contig_buf = VIPS_MALLOC(out, size)))
+		if (!(rtiff->contig_buf = VIPS_MALLOC(image, size)))
 			return -1;
 	}
 
@@ -2968,14 +3094,80 @@ rtiff_read_stripwise(Rtiff *rtiff, VipsImage *out)
 		VIPS_ROUND_DOWN(16, rtiff->header.read_height),
 		rtiff->header.read_height);
 
-	if (
-		vips_image_generate(t[0],
+	if (vips_image_generate(image,
 			NULL, rtiff_stripwise_generate, NULL,
 			rtiff, NULL) ||
-		vips_sequential(t[0], &t[1],
+		vips_sequential(image, out,
 			"tile_height", tile_height,
-			NULL) ||
-		rtiff_unpremultiply(rtiff, t[1], &t[2]))
+			NULL))
+		return -1;
+
+	return 0;
+}
+
+/* Stripwise reading.
+ *
+ * We could potentially read strips in any order, but this would give
+ * catastrophic performance for operations like 90 degrees rotate on a
+ * large image. Only offer sequential read, unless the page is uncompressed
+ * and we can map it.
+ */
+static int
+rtiff_read_stripwise(Rtiff *rtiff, VipsImage *out)
+{
+	VipsImage **t = (VipsImage **)
+		vips_object_local_array(VIPS_OBJECT(out), 4);
+
+	VipsImage *in;
+	guint64 offset;
+
+#ifdef DEBUG
+	printf("tiff2vips: rtiff_read_stripwise\n");
+#endif /*DEBUG*/
+
+	t[0] = vips_image_new();
+	if (rtiff_set_header(rtiff, t[0]))
+		return -1;
+
+	/* Double check: in memcpy mode, the vips linesize should exactly
+	 * match the tiff line size.
+	 */
+	if (rtiff->memcpy) {
+		size_t vips_line_size;
+
+		/* Lines are smaller in plane-separated mode.
+		 */
+		if (rtiff->header.separate)
+			vips_line_size = VIPS_IMAGE_SIZEOF_ELEMENT(t[0]) *
+				t[0]->Xsize;
+		else
+			vips_line_size = VIPS_IMAGE_SIZEOF_LINE(t[0]);
+
+		if (rtiff->header.bits_per_sample == 16 &&
+			rtiff->header.sample_format == SAMPLEFORMAT_IEEEFP)
+			vips_line_size /= 2;
+
+		if (vips_line_size != rtiff->header.scanline_size) {
+			vips_error("tiff2vips", "%s", _("unsupported tiff image type"));
+			return -1;
+		}
+	}
+
+	/* Uncompressed pages can be mapped directly, and then support random
+	 * access.
+	 */
+	if (rtiff_is_mappable(rtiff, t[0], &offset)) {
+		if (rtiff_read_mapped(rtiff, t[0], offset))
+			return -1;
+		in = t[0];
+	}
+	else {
+		if (rtiff_read_stripwise_decode(rtiff, t[0], &t[1]))
+			return -1;
+		in = t[1];
+	}
+
+	if (rtiff_unpremultiply(rtiff, in, &t[2]))
 		return -1;
 	in = t[2];
 
@@ -3472,10 +3664,14 @@ vips__istifftiled_source(VipsSource *source)
 	return vips__testtiff_source(source, TIFFIsTiled);
 }
 
+/* Read the header into @out. If @mappable is not NULL, it's set TRUE if
+ * the pixels can be mapped directly from the file, and so support random
+ * access.
+ */
 int
 vips__tiff_read_header_source(VipsSource *source, VipsImage *out,
 	int page, int n, gboolean autorotate, int subifd, VipsFailOn fail_on,
-	gboolean unlimited)
+	gboolean unlimited, gboolean *mappable)
 {
 	Rtiff *rtiff;
 
@@ -3489,6 +3685,12 @@ vips__tiff_read_header_source(VipsSource *source, VipsImage *out,
 	if (rtiff_set_header(rtiff, out))
 		return -1;
 
+	if (mappable) {
+		guint64 offset;
+
+		*mappable = rtiff_is_mappable(rtiff, out, &offset);
+	}
+
 	if (rtiff->autorotate &&
 		vips_image_get_orientation_swap(out)) {
 		VIPS_SWAP(int, out->Xsize, out->Ysize);
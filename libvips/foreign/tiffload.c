@@ -4,6 +4,9 @@
  * 	- from tiffload.c
  * 27/1/17
  * 	- add get_flags for buffer loader
+ * 18/10/26
+ * 	- uncompressed strip images are partial
+ * 	- only read the header once for strip images
  */
 
 /*
@@ -81,6 +84,11 @@ typedef struct _VipsForeignLoadTiff {
 	 */
 	gboolean unlimited;
 
+	/* For strip images, get_flags reads the header here to see if the
+	 * pixels can be mapped, and ->header() then copies it.
+	 */
+	VipsImage *header;
+
 } VipsForeignLoadTiff;
 
 typedef VipsForeignLoadClass VipsForeignLoadTiffClass;
@@ -94,6 +102,7 @@ vips_foreign_load_tiff_dispose(GObject *gobject)
 	VipsForeignLoadTiff *tiff = (VipsForeignLoadTiff *) gobject;
 
 	VIPS_UNREF(tiff->source);
+	VIPS_UNREF(tiff->header);
 
 	G_OBJECT_CLASS(vips_foreign_load_tiff_parent_class)->dispose(gobject);
 }
@@ -131,7 +140,29 @@ vips_foreign_load_tiff_get_flags(VipsForeignLoad *load)
 {
 	VipsForeignLoadTiff *tiff = (VipsForeignLoadTiff *) load;
 
-	return vips_foreign_load_tiff_get_flags_source(tiff->source);
+	VipsForeignFlags flags;
+	gboolean mappable;
+
+	flags = vips_foreign_load_tiff_get_flags_source(tiff->source);
+
+	/* Uncompressed strip images are mapped, so they are partial too. We
+	 * need the header to tell, so keep it for ->header(). Any error will
+	 * be found again there.
+	 */
+	if ((flags & VIPS_FOREIGN_SEQUENTIAL) &&
+		!tiff->header) {
+		tiff->header = vips_image_new();
+		if (vips__tiff_read_header_source(tiff->source, tiff->header,
+				tiff->page, tiff->n, tiff->autorotate, tiff->subifd,
+				load->fail_on, tiff->unlimited, &mappable)) {
+			VIPS_UNREF(tiff->header);
+			vips_error_clear();
+		}
+		else if (mappable)
+			flags = VIPS_FOREIGN_PARTIAL;
+	}
+
+	return flags;
 }
 
 static int
@@ -139,9 +170,20 @@ vips_foreign_load_tiff_header(VipsForeignLoad *load)
 {
 	VipsForeignLoadTiff *tiff = (VipsForeignLoadTiff *) load;
 
+	if (tiff->header) {
+		VipsImage *in[] = { tiff->header, NULL };
+
+		if (vips__image_copy_fields_array(load->out, in))
+			return -1;
+		load->out->dhint = tiff->header->dhint;
+		VIPS_UNREF(tiff->header);
+
+		return 0;
+	}
+
 	if (vips__tiff_read_header_source(tiff->source, load->out,
 			tiff->page, tiff->n, tiff->autorotate, tiff->subifd,
-			load->fail_on, tiff->unlimited))
+			load->fail_on, tiff->unlimited, NULL))
 		return -1;
 
 	return 0;
@@ -160,6 +202,16 @@ vips_foreign_load_tiff_load(VipsForeignLoad *load)
 	return 0;
 }
 
+/* Classic and BigTIFF, in both byte orders.
+ */
+static const VipsForeignSignature vips_foreign_load_tiff_signatures[] = {
+	{ 0, "II*\0", NULL, 4 },
+	{ 0, "MM\0*", NULL, 4 },
+	{ 0, "II+\0", NULL, 4 },
+	{ 0, "MM\0+", NULL, 4 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_tiff_class_init(VipsForeignLoadTiffClass *class)
 {
@@ -186,6 +238,8 @@ vips_foreign_load_tiff_class_init(VipsForeignLoadTiffClass *class)
 	 */
 	foreign_class->priority = 50;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_tiff_signatures, FALSE);
 	load_class->get_flags_filename =
 		vips_foreign_load_tiff_get_flags_filename;
 	load_class->get_flags = vips_foreign_load_tiff_get_flags;
@@ -504,6 +558,10 @@ vips_foreign_load_tiff_buffer_init(VipsForeignLoadTiffBuffer *buffer)
  * Use @fail_on to set the type of error that will cause load to fail. By
  * default, loaders are permissive, that is, [enum@Vips.FailOn.NONE].
  *
+ * Uncompressed strip images whose pixels are stored contiguously in a
+ * layout libvips can use directly are mapped rather than read, so they open
+ * instantly, support random access and share the OS page cache.
+ *
  * When using libtiff 4.7.0+, the TIFF loader will limit memory allocation
  * for decoding each input file to 50MB to prevent denial of service attacks.
  * Set @unlimited to remove this limit.
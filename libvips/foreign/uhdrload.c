@@ -577,6 +577,11 @@ vips_foreign_load_uhdr_load(VipsForeignLoad *load)
 	return 0;
 }
 
+static const VipsForeignSignature vips_foreign_load_uhdr_signatures[] = {
+	{ 0, "\xff\xd8", NULL, 2 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_uhdr_class_init(VipsForeignLoadUhdrClass *class)
 {
@@ -597,6 +602,8 @@ vips_foreign_load_uhdr_class_init(VipsForeignLoadUhdrClass *class)
 	 */
 	foreign_class->priority = 100;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_uhdr_signatures, FALSE);
 	load_class->get_flags = vips_foreign_load_uhdr_get_flags;
 	load_class->header = vips_foreign_load_uhdr_header;
 	load_class->load = vips_foreign_load_uhdr_load;
@@ -100,6 +100,8 @@
  *	- add restart_interval
  * 21/10/21 usualuse
  *	- raise single-chunk limit on APP to 65533
+ * 18/10/26
+ *	- encode bands in parallel when there are restart markers
  */
 
 /*
@@ -207,13 +209,120 @@ vips__new_error_exit(j_common_ptr cinfo)
 	longjmp(eman->jmp, 1);
 }
 
+static int
+gcd(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/* Work out how to cut a scan into bands of about band_height lines, each
+ * starting on a restart marker. FALSE if the scan can't be cut, or would
+ * give too few bands.
+ */
+gboolean
+vips__jpeg_bands(JpegBands *bands,
+	int image_width, int image_height, int num_components,
+	int max_h_samp_factor, int max_v_samp_factor,
+	int restart_interval, int band_height)
+{
+	int mcu_width;
+	int rows;
+
+	if (restart_interval == 0)
+		return FALSE;
+
+	/* A single component scan is not interleaved and has 8x8 MCUs.
+	 */
+	if (num_components == 1) {
+		mcu_width = DCTSIZE;
+		bands->mcu_height = DCTSIZE;
+	}
+	else {
+		mcu_width = max_h_samp_factor * DCTSIZE;
+		bands->mcu_height = max_v_samp_factor * DCTSIZE;
+	}
+	bands->mcus_per_row =
+		VIPS_ROUND_UP(image_width, mcu_width) / mcu_width;
+	bands->mcu_rows =
+		VIPS_ROUND_UP(image_height, bands->mcu_height) / bands->mcu_height;
+
+	/* Row r starts with a restart marker if r * mcus_per_row is a
+	 * multiple of the restart interval.
+	 */
+	bands->step = restart_interval /
+		gcd(restart_interval, bands->mcus_per_row);
+	if (bands->step > JPEG_MAX_STEP)
+		return FALSE;
+
+	rows = VIPS_MAX(1, band_height / bands->mcu_height);
+	bands->band_rows = VIPS_ROUND_UP(rows, bands->step);
+	if (bands->mcu_rows < JPEG_MIN_BANDS * bands->band_rows)
+		return FALSE;
+
+	return TRUE;
+}
+
+struct _Write;
+
+/* A band of lines we encode with a compressor of our own.
+ */
+typedef struct _JpegBand {
+	struct _Write *write;
+
+	struct jpeg_compress_struct cinfo;
+	ErrorManager eman;
+	gboolean cinfo_init;
+	JSAMPROW *row_pointer;
+
+	/* Lines of the current batch we hold.
+	 */
+	int first;
+	int height;
+
+	/* The encoded band, a complete JPEG.
+	 */
+	VipsTarget *target;
+	unsigned char *data;
+	size_t length;
+
+	int result;
+} JpegBand;
+
 /* What we track during a JPEG write.
  */
-typedef struct {
+typedef struct _Write {
 	struct jpeg_compress_struct cinfo;
 	ErrorManager eman;
 	JSAMPROW *row_pointer;
 	gboolean invert;
+
+	/* Set for a write to a target, where we can encode in parallel bands.
+	 */
+	VipsTarget *target;
+
+	/* A batch of lines, enough for n_bands bands.
+	 */
+	size_t sizeof_line;
+	int band_height;
+	int n_bands;
+	JpegBand *bands;
+	VipsPel *raw;
+	int n_rows;
+
+	/* Lines sent so far, and restart markers written so far.
+	 */
+	int y;
+	int n_restarts;
+
+	VipsSemaphore finish;
+	gboolean finish_init;
 } Write;
 
 static void
@@ -222,9 +331,38 @@ write_destroy(Write *write)
 	jpeg_destroy_compress(&write->cinfo);
 	VIPS_FREE(write->row_pointer);
 
+	if (write->bands) {
+		for (int i = 0; i < write->n_bands; i++) {
+			JpegBand *band = &write->bands[i];
+
+			if (band->cinfo_init)
+				jpeg_destroy_compress(&band->cinfo);
+			VIPS_FREE(band->row_pointer);
+			VIPS_UNREF(band->target);
+			VIPS_FREE(band->data);
+		}
+		VIPS_FREE(write->bands);
+	}
+	VIPS_FREE(write->raw);
+	if (write->finish_init)
+		vips_semaphore_destroy(&write->finish);
+
 	g_free(write);
 }
 
+static void
+write_error_init(struct jpeg_compress_struct *cinfo, ErrorManager *eman)
+{
+	cinfo->err = jpeg_std_error(&eman->pub);
+	cinfo->err->addon_message_table = vips__jpeg_message_table;
+	cinfo->err->first_addon_message = 1000;
+	cinfo->err->last_addon_message = 1001;
+	cinfo->dest = NULL;
+	eman->pub.error_exit = vips__new_error_exit;
+	eman->pub.output_message = vips__new_output_message;
+	eman->fp = NULL;
+}
+
 static Write *
 write_new(void)
 {
@@ -234,14 +372,7 @@ write_new(void)
 		return NULL;
 
 	write->row_pointer = NULL;
-	write->cinfo.err = jpeg_std_error(&write->eman.pub);
-	write->cinfo.err->addon_message_table = vips__jpeg_message_table;
-	write->cinfo.err->first_addon_message = 1000;
-	write->cinfo.err->last_addon_message = 1001;
-	write->cinfo.dest = NULL;
-	write->eman.pub.error_exit = vips__new_error_exit;
-	write->eman.pub.output_message = vips__new_output_message;
-	write->eman.fp = NULL;
+	write_error_init(&write->cinfo, &write->eman);
 	write->invert = FALSE;
 
 	return write;
@@ -723,6 +854,306 @@ write_metadata(Write *write, VipsImage *in,
 	return 0;
 }
 
+/* Can we encode in parallel bands? We need a single baseline scan with fixed
+ * huffman tables, and a restart marker at the start of an MCU row every few
+ * rows. Call after jpeg_start_compress(), it sets band_height.
+ */
+static gboolean
+write_bands_ok(Write *write)
+{
+	struct jpeg_compress_struct *cinfo = &write->cinfo;
+
+	JpegBands bands;
+
+	if (!write->target ||
+		vips_concurrency_get() < 2 ||
+		cinfo->optimize_coding ||
+		cinfo->arith_code ||
+		cinfo->scan_info ||
+		!vips__jpeg_bands(&bands,
+			cinfo->image_width, cinfo->image_height,
+			cinfo->num_components,
+			cinfo->max_h_samp_factor, cinfo->max_v_samp_factor,
+			cinfo->restart_interval, JPEG_BAND_HEIGHT))
+		return FALSE;
+
+	write->band_height = bands.band_rows * bands.mcu_height;
+
+	return TRUE;
+}
+
+/* Encode a band as a complete JPEG in memory.
+ */
+static int
+write_band_encode(JpegBand *band)
+{
+	Write *write = band->write;
+
+	/* Catch any longjmp()s from libjpeg in this thread.
+	 */
+	if (setjmp(band->eman.jmp))
+		return -1;
+
+	band->target = vips_target_new_to_memory();
+	vips__jpeg_target_dest(&band->cinfo, band->target);
+	band->cinfo.image_height = band->height;
+
+	jpeg_start_compress(&band->cinfo, TRUE);
+
+	for (int y = 0; y < band->height; y++)
+		band->row_pointer[y] = (JSAMPROW) (write->raw +
+			(size_t) (band->first + y) * write->sizeof_line);
+	jpeg_write_scanlines(&band->cinfo, band->row_pointer, band->height);
+
+	jpeg_finish_compress(&band->cinfo);
+
+	if (!(band->data = vips_target_steal(band->target, &band->length)))
+		return -1;
+	VIPS_UNREF(band->target);
+
+	return 0;
+}
+
+static void
+write_band_work(void *data, void *user_data)
+{
+	JpegBand *band = (JpegBand *) data;
+
+	band->result = write_band_encode(band);
+
+	vips_semaphore_up(&band->write->finish);
+}
+
+/* Append an encoded band to the output. The first band of the image supplies
+ * the frame header, with the image height patched in. The other bands only
+ * supply their entropy coded segment, after a restart marker. Restart markers
+ * are renumbered to follow on from the previous band.
+ */
+static int
+write_band_output(Write *write, JpegBand *band, gboolean first)
+{
+	unsigned char *data = band->data;
+	size_t length = band->length;
+
+	size_t header_start;
+	size_t i;
+
+	/* Skip SOI, then walk the markers to the end of the SOS header.
+	 * libjpeg also writes JFIF and Adobe markers, but we've already
+	 * written those.
+	 */
+	header_start = 0;
+	i = 2;
+	for (;;) {
+		int marker;
+
+		if (i + 4 > length ||
+			data[i] != 0xFF) {
+			vips_error("VipsJpeg", "%s", _("bad band header"));
+			return -1;
+		}
+
+		marker = data[i + 1];
+		if (!header_start &&
+			(marker < JPEG_APP0 || marker > JPEG_APP0 + 15) &&
+			marker != JPEG_COM)
+			header_start = i;
+
+		if ((marker == 0xC0 /* SOF0 */ ||
+				marker == 0xC1 /* SOF1 */) &&
+			i + 9 <= length) {
+			data[i + 5] = write->cinfo.image_height >> 8;
+			data[i + 6] = write->cinfo.image_height & 0xff;
+		}
+
+		i += 2 + ((data[i + 2] << 8) | data[i + 3]);
+
+		if (marker == 0xDA /* SOS */)
+			break;
+	}
+
+	if (i + 2 > length ||
+		data[length - 2] != 0xFF ||
+		data[length - 1] != JPEG_EOI) {
+		vips_error("VipsJpeg", "%s", _("bad band trailer"));
+		return -1;
+	}
+	length -= 2;
+
+	if (first) {
+		if (vips_target_write(write->target,
+				data + header_start, i - header_start))
+			return -1;
+	}
+	else {
+		unsigned char rst[2];
+
+		rst[0] = 0xFF;
+		rst[1] = JPEG_RST0 + (write->n_restarts & 7);
+		write->n_restarts += 1;
+		if (vips_target_write(write->target, rst, 2))
+			return -1;
+	}
+
+	/* 0xFF in entropy coded data is always followed by a zero byte or a
+	 * restart marker.
+	 */
+	for (size_t j = i; j + 1 < length; j++)
+		if (data[j] == 0xFF &&
+			data[j + 1] >= JPEG_RST0 &&
+			data[j + 1] <= JPEG_RST0 + 7) {
+			data[j + 1] = JPEG_RST0 + (write->n_restarts & 7);
+			write->n_restarts += 1;
+			j += 1;
+		}
+
+	if (vips_target_write(write->target, data + i, length - i))
+		return -1;
+
+	return 0;
+}
+
+/* Encode the batch of lines we have in parallel, then write the bands in
+ * order.
+ */
+static int
+write_bands_batch(Write *write)
+{
+	int n = VIPS_ROUND_UP(write->n_rows, write->band_height) /
+		write->band_height;
+	int top = write->y - write->n_rows;
+
+	for (int i = 0; i < n; i++) {
+		JpegBand *band = &write->bands[i];
+
+		band->first = i * write->band_height;
+		band->height = VIPS_MIN(write->band_height,
+			write->n_rows - band->first);
+		band->result = 0;
+	}
+
+	for (int i = 1; i < n; i++)
+		vips__thread_execute_or_run("jpegband",
+			write_band_work, &write->bands[i]);
+	write_band_work(&write->bands[0], NULL);
+
+	vips_semaphore_downn(&write->finish, n);
+
+	for (int i = 0; i < n; i++)
+		if (write->bands[i].result)
+			return -1;
+
+	for (int i = 0; i < n; i++) {
+		JpegBand *band = &write->bands[i];
+
+		if (write_band_output(write, band, top == 0 && i == 0))
+			return -1;
+		VIPS_FREE(band->data);
+	}
+
+	write->n_rows = 0;
+
+	return 0;
+}
+
+static int
+write_bands_block(VipsRegion *region, VipsRect *area, void *a)
+{
+	Write *write = (Write *) a;
+	int height = region->im->Ysize;
+
+	for (int y = 0; y < area->height; y++) {
+		VipsPel *p = VIPS_REGION_ADDR(region, area->left, area->top + y);
+		VipsPel *q = write->raw +
+			(size_t) write->n_rows * write->sizeof_line;
+
+		if (write->invert)
+			for (size_t x = 0; x < write->sizeof_line; x++)
+				q[x] = 255 - p[x];
+		else
+			memcpy(q, p, write->sizeof_line);
+
+		write->n_rows += 1;
+		write->y += 1;
+
+		if (write->n_rows == write->n_bands * write->band_height ||
+			write->y == height)
+			if (write_bands_batch(write))
+				return -1;
+	}
+
+	return 0;
+}
+
+/* Encode the image in parallel bands, each with a compressor of its own, and
+ * join them into a single scan. Band boundaries fall on restart markers and
+ * the huffman tables are fixed, so the result is the same as a sequential
+ * encode.
+ */
+static int
+write_bands(Write *write, VipsImage *in, int Q,
+	gboolean overshoot_deringing, int quant_table,
+	VipsForeignSubsample subsample_mode, int restart_interval)
+{
+	size_t batch_size;
+	unsigned char eoi[2];
+
+	write->sizeof_line = VIPS_IMAGE_SIZEOF_LINE(in);
+
+	/* Don't let the batch of lines get too huge for very wide images.
+	 */
+	batch_size = (size_t) write->band_height * write->sizeof_line;
+	write->n_bands = VIPS_CLIP(1,
+		256 * 1024 * 1024 / VIPS_MAX(1, batch_size),
+		vips_concurrency_get());
+
+	vips_semaphore_init(&write->finish, 0, "finish");
+	write->finish_init = TRUE;
+
+	if (!(write->bands = VIPS_ARRAY(NULL, write->n_bands, JpegBand)) ||
+		!(write->raw = VIPS_ARRAY(NULL,
+			  (size_t) write->n_bands * batch_size, VipsPel)))
+		return -1;
+	memset(write->bands, 0, write->n_bands * sizeof(JpegBand));
+
+	for (int i = 0; i < write->n_bands; i++) {
+		JpegBand *band = &write->bands[i];
+
+		band->write = write;
+		if (!(band->row_pointer =
+					VIPS_ARRAY(NULL, write->band_height, JSAMPROW)))
+			return -1;
+
+		write_error_init(&band->cinfo, &band->eman);
+		if (setjmp(band->eman.jmp))
+			return -1;
+		jpeg_create_compress(&band->cinfo);
+		band->cinfo_init = TRUE;
+
+		/* The options that stop us going parallel are all off.
+		 */
+		set_cinfo(&band->cinfo, in, in->Xsize, write->band_height,
+			Q, FALSE, FALSE, FALSE, overshoot_deringing, FALSE,
+			quant_table, subsample_mode, restart_interval);
+	}
+
+	/* The main compressor has written SOI, JFIF and the metadata markers
+	 * to the target. Flush them out, we write the rest ourselves.
+	 */
+	write->cinfo.dest->term_destination(&write->cinfo);
+	write->cinfo.dest->init_destination(&write->cinfo);
+
+	if (vips_sink_disc(in, write_bands_block, write))
+		return -1;
+
+	eoi[0] = 0xFF;
+	eoi[1] = JPEG_EOI;
+	if (vips_target_write(write->target, eoi, 2))
+		return -1;
+
+	return 0;
+}
+
 /* Write a VIPS image to a JPEG compress struct.
  */
 static int
@@ -770,6 +1201,13 @@ write_vips(Write *write, VipsImage *in, int Q, const char *profile,
 	if (write_metadata(write, in, profile))
 		return -1;
 
+	/* With restart markers we can often encode in parallel.
+	 */
+	if (write_bands_ok(write))
+		return write_bands(write, in, Q,
+			overshoot_deringing, quant_table,
+			subsample_mode, restart_interval);
+
 	/* Write data. Note that the write function grabs the longjmp()!
 	 */
 	if (vips_sink_disc(in, write_jpeg_block, write))
@@ -896,6 +1334,7 @@ vips__jpeg_write_target(VipsImage *in, VipsTarget *target,
 	/* Attach output.
 	 */
 	vips__jpeg_target_dest(&write->cinfo, target);
+	write->target = target;
 
 	/* Convert! Write errors come back here as an error return.
 	 */
@@ -142,6 +142,14 @@ vips_foreign_load_vips_header(VipsForeignLoad *load)
 	return 0;
 }
 
+/* VIPS_MAGIC_INTEL and VIPS_MAGIC_SPARC in either byte order.
+ */
+static const VipsForeignSignature vips_foreign_load_vips_signatures[] = {
+	{ 0, "\x08\xf2\xa6\xb6", NULL, 4 },
+	{ 0, "\xb6\xa6\xf2\x08", NULL, 4 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_vips_class_init(VipsForeignLoadVipsClass *class)
 {
@@ -164,6 +172,8 @@ vips_foreign_load_vips_class_init(VipsForeignLoadVipsClass *class)
 	 */
 	foreign_class->priority = 200;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_vips_signatures, FALSE);
 	load_class->get_flags = vips_foreign_load_vips_get_flags;
 	load_class->get_flags_filename =
 		vips_foreign_load_vips_get_flags_filename;
@@ -228,6 +238,8 @@ vips_foreign_load_vips_file_class_init(VipsForeignLoadVipsClass *class)
 	foreign_class->suffs = vips__suffs;
 
 	load_class->is_a = vips_foreign_load_vips_file_is_a;
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_vips_signatures, TRUE);
 
 	VIPS_ARG_STRING(class, "filename", 1,
 		_("Filename"),
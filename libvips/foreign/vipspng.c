@@ -89,6 +89,9 @@
  * 	- add exif read/write
  * 3/2/23 MathemanFlo
  * 	- add bits per sample metadata
+ * 18/10/26
+ * 	- filter and deflate large non-interlaced images in parallel strips
+ * 	- stop at the bottom of the region of interest
  */
 
 /*
@@ -147,6 +150,10 @@ const char *vips__png_suffs[] = { ".png", NULL };
 
 #include <png.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /*HAVE_ZLIB*/
+
 #if PNG_LIBPNG_VER < 10003
 #error "PNG library too old."
 #endif
@@ -765,35 +772,57 @@ png2vips_generate(VipsRegion *out_region,
 }
 
 static int
-png2vips_image(Read *read, VipsImage *out)
+png2vips_image(Read *read, VipsImage *out, const VipsRect *roi)
 {
 	int interlace_type = png_get_interlace_type(read->pPng, read->pInfo);
 	VipsImage **t = (VipsImage **)
 		vips_object_local_array(VIPS_OBJECT(out), 3);
 
+	VipsImage *in;
+
 	if (interlace_type != PNG_INTERLACE_NONE) {
 		/* Arg awful interlaced image. We have to load to a huge mem
 		 * buffer, then copy to out.
 		 */
 		t[0] = vips_image_new_memory();
 		if (png2vips_header(read, t[0]) ||
-			png2vips_interlace(read, t[0]) ||
-			vips_image_write(t[0], out))
+			png2vips_interlace(read, t[0]))
 			return -1;
+		in = t[0];
 	}
 	else {
 		t[0] = vips_image_new();
-		if (png2vips_header(read, t[0]) ||
-			vips_image_generate(t[0],
+		if (png2vips_header(read, t[0]))
+			return -1;
+
+		/* Rows are only available in order, but we can stop at the
+		 * bottom of the ROI.
+		 */
+		if (roi &&
+			!vips_rect_isempty(roi))
+			t[0]->Ysize = VIPS_RECT_BOTTOM(roi);
+
+		if (vips_image_generate(t[0],
 				NULL, png2vips_generate, NULL,
 				read, NULL) ||
 			vips_sequential(t[0], &t[1],
 				"tile_height", VIPS__FATSTRIP_HEIGHT,
-				NULL) ||
-			vips_image_write(t[1], out))
+				NULL))
 			return -1;
+		in = t[1];
 	}
 
+	if (roi &&
+		!vips_rect_isempty(roi)) {
+		if (vips_extract_area(in, &t[2],
+				roi->left, roi->top, roi->width, roi->height, NULL))
+			return -1;
+		in = t[2];
+	}
+
+	if (vips_image_write(in, out))
+		return -1;
+
 	return 0;
 }
 
@@ -826,12 +855,12 @@ vips__png_header_source(VipsSource *source, VipsImage *out,
 
 int
 vips__png_read_source(VipsSource *source, VipsImage *out,
-	VipsFailOn fail_on, gboolean unlimited)
+	VipsFailOn fail_on, gboolean unlimited, const VipsRect *roi)
 {
 	Read *read;
 
 	if (!(read = read_new(source, out, fail_on, unlimited)) ||
-		png2vips_image(read, out) ||
+		png2vips_image(read, out, roi) ||
 		vips_source_decode(source))
 		return -1;
 
@@ -860,9 +889,65 @@ vips__png_isinterlaced_source(VipsSource *source)
 	return interlace_type != PNG_INTERLACE_NONE;
 }
 
+#ifdef HAVE_ZLIB
+/* Large non-interlaced images are filtered and deflated in strips of about
+ * this many bytes, several strips at once.
+ */
+#define PNG_STRIP_SIZE (256 * 1024)
+
+/* Only images with at least this many strips go parallel.
+ */
+#define PNG_MIN_STRIPS (4)
+
+/* The deflate window. Each strip is primed with this much of the filtered
+ * data before it, so splitting costs almost nothing in compression.
+ */
+#define PNG_WINDOW_SIZE (32768)
+
+struct _Write;
+
+/* A strip of scanlines we filter and deflate in one thread.
+ */
+typedef struct _PngStrip {
+	struct _Write *write;
+
+	/* Rows of the current batch we hold.
+	 */
+	int first;
+	int n_rows;
+
+	/* Filtered rows, each with a leading filter type byte.
+	 */
+	VipsPel *filtered;
+	size_t filtered_length;
+
+	/* Scratch rows for adaptive filtering.
+	 */
+	VipsPel *try;
+	VipsPel *best;
+
+	/* Our deflate stream and its output. We leave the first two bytes of
+	 * out free for the zlib header, and four bytes at the end for the
+	 * checksum.
+	 */
+	z_stream stream;
+	gboolean stream_init;
+	VipsPel *out;
+	size_t out_size;
+	size_t out_length;
+
+	/* Set for the final strip of the image.
+	 */
+	gboolean last;
+
+	uLong adler;
+	int result;
+} PngStrip;
+#endif /*HAVE_ZLIB*/
+
 /* What we track during a PNG write.
  */
-typedef struct {
+typedef struct _Write {
 	VipsImage *in;
 	VipsImage *memory;
 
@@ -871,6 +956,43 @@ typedef struct {
 	png_structp pPng;
 	png_infop pInfo;
 	png_bytep *row_pointer;
+
+#ifdef HAVE_ZLIB
+	/* Parallel strip write state.
+	 */
+	int compress;
+	VipsForeignPngFilter filter;
+	gboolean swap;
+	size_t bpp;
+	size_t rowbytes;
+	int strip_rows;
+
+	/* A batch of unfiltered rows, enough for n_strips strips.
+	 */
+	int n_strips;
+	PngStrip *strips;
+	VipsPel *raw;
+	int n_rows;
+
+	/* Rows sent so far.
+	 */
+	int y;
+
+	/* The final row of the previous batch, the last PNG_WINDOW_SIZE
+	 * bytes of filtered data, and the running checksum.
+	 */
+	VipsPel *prior;
+	gboolean have_prior;
+	VipsPel *window;
+	size_t window_length;
+	uLong adler;
+
+	/* Set while strip threads deflate, rather than filter.
+	 */
+	gboolean deflate;
+	VipsSemaphore finish;
+	gboolean finish_init;
+#endif /*HAVE_ZLIB*/
 } Write;
 
 static void
@@ -884,6 +1006,30 @@ write_destroy(Write *write)
 	if (write->pPng)
 		png_destroy_write_struct(&write->pPng, &write->pInfo);
 	VIPS_FREE(write->row_pointer);
+
+#ifdef HAVE_ZLIB
+	if (write->strips) {
+		int i;
+
+		for (i = 0; i < write->n_strips; i++) {
+			PngStrip *strip = &write->strips[i];
+
+			if (strip->stream_init)
+				deflateEnd(&strip->stream);
+			VIPS_FREE(strip->filtered);
+			VIPS_FREE(strip->try);
+			VIPS_FREE(strip->best);
+			VIPS_FREE(strip->out);
+		}
+		VIPS_FREE(write->strips);
+	}
+	VIPS_FREE(write->raw);
+	VIPS_FREE(write->prior);
+	VIPS_FREE(write->window);
+	if (write->finish_init)
+		vips_semaphore_destroy(&write->finish);
+#endif /*HAVE_ZLIB*/
+
 	VIPS_FREE(write);
 }
 
@@ -972,6 +1118,500 @@ write_png_block(VipsRegion *region, VipsRect *area, void *a)
 	return 0;
 }
 
+#ifdef HAVE_ZLIB
+static int
+png_paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+
+	if (pa <= pb &&
+		pa <= pc)
+		return a;
+	else if (pb <= pc)
+		return b;
+	else
+		return c;
+}
+
+/* Filter a row with a single filter type. @prior is NULL for the first row
+ * of the image. Return the sum of absolute values, the same cost estimate
+ * libpng uses to pick a filter.
+ */
+static size_t
+png_filter_row(int type, size_t bpp, size_t rowbytes,
+	VipsPel *row, VipsPel *prior, VipsPel *out)
+{
+	VipsPel *q = out + 1;
+
+	size_t i;
+	size_t sum;
+
+	out[0] = type;
+
+	switch (type) {
+	case PNG_FILTER_VALUE_SUB:
+		for (i = 0; i < bpp; i++)
+			q[i] = row[i];
+		for (; i < rowbytes; i++)
+			q[i] = row[i] - row[i - bpp];
+		break;
+
+	case PNG_FILTER_VALUE_UP:
+		if (prior)
+			for (i = 0; i < rowbytes; i++)
+				q[i] = row[i] - prior[i];
+		else
+			memcpy(q, row, rowbytes);
+		break;
+
+	case PNG_FILTER_VALUE_AVG:
+		if (prior) {
+			for (i = 0; i < bpp; i++)
+				q[i] = row[i] - (prior[i] >> 1);
+			for (; i < rowbytes; i++)
+				q[i] = row[i] - ((row[i - bpp] + prior[i]) >> 1);
+		}
+		else {
+			for (i = 0; i < bpp; i++)
+				q[i] = row[i];
+			for (; i < rowbytes; i++)
+				q[i] = row[i] - (row[i - bpp] >> 1);
+		}
+		break;
+
+	case PNG_FILTER_VALUE_PAETH:
+		if (prior) {
+			for (i = 0; i < bpp; i++)
+				q[i] = row[i] - prior[i];
+			for (; i < rowbytes; i++)
+				q[i] = row[i] -
+					png_paeth(row[i - bpp], prior[i], prior[i - bpp]);
+		}
+		else {
+			/* With no row above, paeth is the same as sub.
+			 */
+			for (i = 0; i < bpp; i++)
+				q[i] = row[i];
+			for (; i < rowbytes; i++)
+				q[i] = row[i] - row[i - bpp];
+		}
+		break;
+
+	default:
+		memcpy(q, row, rowbytes);
+		break;
+	}
+
+	sum = 0;
+	for (i = 0; i < rowbytes; i++)
+		sum += q[i] < 128 ? q[i] : 256 - q[i];
+
+	return sum;
+}
+
+/* Filter a row into @out with the filter, or the best of the set of
+ * filters we were given.
+ */
+static void
+write_png_filter(Write *write, PngStrip *strip,
+	VipsPel *row, VipsPel *prior, VipsPel *out)
+{
+	size_t best_sum;
+	int n_filters;
+	int type;
+
+	n_filters = 0;
+	for (type = PNG_FILTER_VALUE_NONE; type < PNG_FILTER_VALUE_LAST; type++)
+		if (write->filter & (PNG_FILTER_NONE << type))
+			n_filters += 1;
+
+	if (n_filters < 2) {
+		for (type = PNG_FILTER_VALUE_NONE;
+			 type < PNG_FILTER_VALUE_LAST; type++)
+			if (write->filter & (PNG_FILTER_NONE << type))
+				break;
+		if (type == PNG_FILTER_VALUE_LAST)
+			type = PNG_FILTER_VALUE_NONE;
+
+		(void) png_filter_row(type,
+			write->bpp, write->rowbytes, row, prior, out);
+
+		return;
+	}
+
+	best_sum = 0;
+	n_filters = 0;
+	for (type = PNG_FILTER_VALUE_NONE; type < PNG_FILTER_VALUE_LAST; type++)
+		if (write->filter & (PNG_FILTER_NONE << type)) {
+			size_t sum = png_filter_row(type,
+				write->bpp, write->rowbytes, row, prior, strip->try);
+
+			if (n_filters == 0 ||
+				sum < best_sum) {
+				VIPS_SWAP(VipsPel *, strip->try, strip->best);
+				best_sum = sum;
+			}
+
+			n_filters += 1;
+		}
+
+	memcpy(out, strip->best, write->rowbytes + 1);
+}
+
+static void
+write_png_strip_filter(PngStrip *strip)
+{
+	Write *write = strip->write;
+	size_t stride = write->rowbytes + 1;
+
+	int y;
+
+	for (y = 0; y < strip->n_rows; y++) {
+		int row = strip->first + y;
+		VipsPel *p = write->raw + (size_t) row * write->rowbytes;
+
+		VipsPel *prior;
+
+		if (row > 0)
+			prior = p - write->rowbytes;
+		else if (write->have_prior)
+			prior = write->prior;
+		else
+			prior = NULL;
+
+		write_png_filter(write, strip, p, prior, strip->filtered + y * stride);
+	}
+
+	strip->filtered_length = strip->n_rows * stride;
+	strip->adler = adler32(adler32(0L, Z_NULL, 0),
+		strip->filtered, strip->filtered_length);
+}
+
+/* Deflate a strip as a raw deflate fragment, primed with the filtered data
+ * before it and ending on a byte boundary, so the fragments concatenate into
+ * a single zlib stream.
+ */
+static void
+write_png_strip_deflate(PngStrip *strip)
+{
+	Write *write = strip->write;
+	int index = strip - write->strips;
+	z_stream *stream = &strip->stream;
+
+	VipsPel *dictionary;
+	size_t dictionary_length;
+	size_t bound;
+	int flush;
+
+	if (index > 0) {
+		PngStrip *previous = &write->strips[index - 1];
+
+		dictionary_length =
+			VIPS_MIN(PNG_WINDOW_SIZE, previous->filtered_length);
+		dictionary = previous->filtered +
+			previous->filtered_length - dictionary_length;
+	}
+	else {
+		dictionary_length = write->window_length;
+		dictionary = write->window;
+	}
+
+	if (deflateReset(stream) != Z_OK ||
+		(dictionary_length > 0 &&
+			deflateSetDictionary(stream,
+				dictionary, dictionary_length) != Z_OK)) {
+		strip->result = -1;
+		return;
+	}
+
+	/* Room for the zlib header, the sync flush and the checksum.
+	 */
+	bound = 2 + deflateBound(stream, strip->filtered_length) + 16 + 4;
+	if (strip->out_size < bound) {
+		VIPS_FREE(strip->out);
+		strip->out_size = 0;
+		if (!(strip->out = VIPS_ARRAY(NULL, bound, VipsPel))) {
+			strip->result = -1;
+			return;
+		}
+		strip->out_size = bound;
+	}
+
+	flush = strip->last ? Z_FINISH : Z_SYNC_FLUSH;
+	stream->next_in = strip->filtered;
+	stream->avail_in = strip->filtered_length;
+	stream->next_out = strip->out + 2;
+	stream->avail_out = strip->out_size - 2 - 4;
+	if (deflate(stream, flush) != (strip->last ? Z_STREAM_END : Z_OK) ||
+		stream->avail_in != 0 ||
+		stream->avail_out == 0) {
+		strip->result = -1;
+		return;
+	}
+
+	strip->out_length = strip->out_size - 2 - 4 - stream->avail_out;
+}
+
+static void
+write_png_strip_work(void *data, void *user_data)
+{
+	PngStrip *strip = (PngStrip *) data;
+	Write *write = strip->write;
+
+	if (write->deflate)
+		write_png_strip_deflate(strip);
+	else
+		write_png_strip_filter(strip);
+
+	vips_semaphore_up(&write->finish);
+}
+
+/* Run a phase over the first @n strips, one thread each, and wait for them
+ * all.
+ */
+static void
+write_png_strips_run(Write *write, int n, gboolean deflate)
+{
+	int i;
+
+	write->deflate = deflate;
+
+	for (i = 1; i < n; i++)
+		vips__thread_execute_or_run("pngstrip",
+			write_png_strip_work, &write->strips[i]);
+	write_png_strip_work(&write->strips[0], NULL);
+
+	vips_semaphore_downn(&write->finish, n);
+}
+
+/* Add some filtered data to the deflate window.
+ */
+static void
+write_png_window(Write *write, VipsPel *data, size_t length)
+{
+	if (length >= PNG_WINDOW_SIZE) {
+		memcpy(write->window, data + length - PNG_WINDOW_SIZE,
+			PNG_WINDOW_SIZE);
+		write->window_length = PNG_WINDOW_SIZE;
+	}
+	else {
+		size_t keep =
+			VIPS_MIN(write->window_length, PNG_WINDOW_SIZE - length);
+
+		memmove(write->window,
+			write->window + write->window_length - keep, keep);
+		memcpy(write->window + keep, data, length);
+		write->window_length = keep + length;
+	}
+}
+
+/* Filter and deflate the batch of rows we have, then write the strips as
+ * IDAT chunks in order.
+ */
+static int
+write_png_batch(Write *write, int height)
+{
+	int n = VIPS_ROUND_UP(write->n_rows, write->strip_rows) /
+		write->strip_rows;
+	int top = write->y - write->n_rows;
+
+	int i;
+
+	for (i = 0; i < n; i++) {
+		PngStrip *strip = &write->strips[i];
+
+		strip->first = i * write->strip_rows;
+		strip->n_rows = VIPS_MIN(write->strip_rows,
+			write->n_rows - strip->first);
+		strip->last = write->y == height && i == n - 1;
+		strip->result = 0;
+	}
+
+	write_png_strips_run(write, n, FALSE);
+	write_png_strips_run(write, n, TRUE);
+
+	for (i = 0; i < n; i++)
+		if (write->strips[i].result) {
+			vips_error("vips2png", "%s", _("deflate failed"));
+			return -1;
+		}
+
+	for (i = 0; i < n; i++) {
+		PngStrip *strip = &write->strips[i];
+		VipsPel *p = strip->out + 2;
+		size_t length = strip->out_length;
+
+		write->adler = adler32_combine(write->adler,
+			strip->adler, strip->filtered_length);
+		write_png_window(write, strip->filtered, strip->filtered_length);
+
+		/* The first strip of the image gets the zlib header, see
+		 * RFC 1950. We always use a 32kb window.
+		 */
+		if (top == 0 &&
+			i == 0) {
+			int level;
+			int header;
+
+			if (write->compress < 2)
+				level = 0;
+			else if (write->compress < 6)
+				level = 1;
+			else if (write->compress == 6)
+				level = 2;
+			else
+				level = 3;
+			header = (0x78 << 8) | (level << 6);
+
+			header += 31 - header % 31;
+			p -= 2;
+			p[0] = header >> 8;
+			p[1] = header & 0xff;
+			length += 2;
+		}
+
+		/* And the final strip gets the checksum.
+		 */
+		if (strip->last) {
+			VipsPel *q = p + length;
+
+			q[0] = write->adler >> 24;
+			q[1] = (write->adler >> 16) & 0xff;
+			q[2] = (write->adler >> 8) & 0xff;
+			q[3] = write->adler & 0xff;
+			length += 4;
+		}
+
+		png_write_chunk(write->pPng, (png_bytep) "IDAT", p, length);
+	}
+
+	memcpy(write->prior,
+		write->raw + (size_t) (write->n_rows - 1) * write->rowbytes,
+		write->rowbytes);
+	write->have_prior = TRUE;
+	write->n_rows = 0;
+
+	return 0;
+}
+
+static int
+write_png_parallel_block(VipsRegion *region, VipsRect *area, void *a)
+{
+	Write *write = (Write *) a;
+	int height = region->im->Ysize;
+
+	int i;
+
+	g_assert(area->left == 0);
+	g_assert(area->width == region->im->Xsize);
+	g_assert(area->top + area->height <= height);
+
+	/* Catch PNG errors.
+	 */
+	if (setjmp(png_jmpbuf(write->pPng)))
+		return -1;
+
+	for (i = 0; i < area->height; i++) {
+		VipsPel *p = VIPS_REGION_ADDR(region, 0, area->top + i);
+		VipsPel *q = write->raw + (size_t) write->n_rows * write->rowbytes;
+
+		if (write->swap) {
+			size_t x;
+
+			for (x = 0; x < write->rowbytes; x += 2) {
+				q[x] = p[x + 1];
+				q[x + 1] = p[x];
+			}
+		}
+		else
+			memcpy(q, p, write->rowbytes);
+
+		write->n_rows += 1;
+		write->y += 1;
+
+		if (write->n_rows == write->n_strips * write->strip_rows ||
+			write->y == height)
+			if (write_png_batch(write, height))
+				return -1;
+	}
+
+	return 0;
+}
+
+/* Write the image data as IDAT chunks deflated in parallel strips, then
+ * IEND. Strip boundaries only depend on the image, so the output is the same
+ * for any number of threads.
+ */
+static int
+write_png_parallel(Write *write, VipsImage *in,
+	int compress, VipsForeignPngFilter filter, int bitdepth)
+{
+	int i;
+
+	write->compress = compress;
+	write->filter = filter;
+	write->swap = bitdepth > 8 && !vips_amiMSBfirst();
+	write->bpp = VIPS_IMAGE_SIZEOF_PEL(in);
+	write->rowbytes = VIPS_IMAGE_SIZEOF_LINE(in);
+	write->strip_rows = VIPS_MAX(1, PNG_STRIP_SIZE / (write->rowbytes + 1));
+	write->n_strips = VIPS_MAX(1, vips_concurrency_get());
+	write->adler = adler32(0L, Z_NULL, 0);
+
+	vips_semaphore_init(&write->finish, 0, "finish");
+	write->finish_init = TRUE;
+
+	if (!(write->strips = VIPS_ARRAY(NULL, write->n_strips, PngStrip)) ||
+		!(write->raw = VIPS_ARRAY(NULL,
+			  (size_t) write->n_strips * write->strip_rows * write->rowbytes,
+			  VipsPel)) ||
+		!(write->prior = VIPS_ARRAY(NULL, write->rowbytes, VipsPel)) ||
+		!(write->window = VIPS_ARRAY(NULL, PNG_WINDOW_SIZE, VipsPel)))
+		return -1;
+	memset(write->strips, 0, write->n_strips * sizeof(PngStrip));
+
+	for (i = 0; i < write->n_strips; i++) {
+		PngStrip *strip = &write->strips[i];
+
+		strip->write = write;
+		if (!(strip->filtered = VIPS_ARRAY(NULL,
+				  (size_t) write->strip_rows * (write->rowbytes + 1),
+				  VipsPel)) ||
+			!(strip->try = VIPS_ARRAY(NULL, write->rowbytes + 1, VipsPel)) ||
+			!(strip->best = VIPS_ARRAY(NULL, write->rowbytes + 1, VipsPel)))
+			return -1;
+
+		/* Raw deflate, with the same strategy libpng would pick.
+		 */
+		if (deflateInit2(&strip->stream, compress, Z_DEFLATED, -15, 8,
+				filter == VIPS_FOREIGN_PNG_FILTER_NONE
+					? Z_DEFAULT_STRATEGY
+					: Z_FILTERED) != Z_OK) {
+			vips_error("vips2png", "%s", _("unable to init deflate"));
+			return -1;
+		}
+		strip->stream_init = TRUE;
+	}
+
+	if (vips_sink_disc(in, write_png_parallel_block, write))
+		return -1;
+
+	/* The setjmp() was held by our background writer: reset it.
+	 */
+	if (setjmp(png_jmpbuf(write->pPng)))
+		return -1;
+
+	/* We can't use png_write_end(), libpng never saw our IDATs.
+	 * Everything else was written by png_write_info().
+	 */
+	png_write_chunk(write->pPng, (png_bytep) "IEND", NULL, 0);
+
+	return 0;
+}
+#endif /*HAVE_ZLIB*/
+
 static void
 vips__png_set_text(png_structp pPng, png_infop pInfo,
 	const char *key, const char *value)
@@ -1289,6 +1929,17 @@ write_vips(Write *write,
 
 	png_write_info(write->pPng, write->pInfo);
 
+#ifdef HAVE_ZLIB
+	/* Large non-interlaced images with whole byte samples are filtered and
+	 * deflated in parallel.
+	 */
+	if (!interlace &&
+		bitdepth >= 8 &&
+		(guint64) VIPS_IMAGE_SIZEOF_LINE(in) * in->Ysize >=
+			PNG_MIN_STRIPS * PNG_STRIP_SIZE)
+		return write_png_parallel(write, in, compress, filter, bitdepth);
+#endif /*HAVE_ZLIB*/
+
 	/* If we're an intel byte order CPU and this is a 16bit image, we need
 	 * to swap bytes.
 	 */
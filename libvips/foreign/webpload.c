@@ -50,6 +50,7 @@
 #include <string.h>
 
 #include <vips/vips.h>
+#include <vips/internal.h>
 
 #include "pforeign.h"
 
@@ -146,6 +147,14 @@ vips_foreign_load_webp_load(VipsForeignLoad *load)
 	return 0;
 }
 
+/* "RIFF", a four byte length, then "WEBP".
+ */
+static const VipsForeignSignature vips_foreign_load_webp_signatures[] = {
+	{ 0, "RIFF\0\0\0\0WEBP",
+		"\xff\xff\xff\xff\0\0\0\0\xff\xff\xff\xff", 12 },
+	{ 0 }
+};
+
 static void
 vips_foreign_load_webp_class_init(VipsForeignLoadWebpClass *class)
 {
@@ -166,6 +175,8 @@ vips_foreign_load_webp_class_init(VipsForeignLoadWebpClass *class)
 	 */
 	foreign_class->priority = 200;
 
+	vips__foreign_load_set_signatures(load_class,
+		vips_foreign_load_webp_signatures, TRUE);
 	load_class->get_flags_filename =
 		vips_foreign_load_webp_get_flags_filename;
 	load_class->get_flags = vips_foreign_load_webp_get_flags;
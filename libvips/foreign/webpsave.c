@@ -30,6 +30,8 @@
  * 	- rename "reduction_effort" as "effort"
  * 7/9/22 dloebl
  * 	- switch to sink_disc
+ * 18/10/26
+ * 	- add @stream: write animation frames as they are encoded
  */
 
 /*
@@ -87,9 +89,26 @@
 typedef int (*webp_import)(WebPPicture *picture,
 	const uint8_t *rgb, int stride);
 
+/* The modes we work in.
+ *
+ * VIPS_FOREIGN_SAVE_WEBP_MODE_SINGLE:
+ *
+ * 	A single frame, written with WebPEncode().
+ *
+ * VIPS_FOREIGN_SAVE_WEBP_MODE_ANIM:
+ *
+ * 	An animation, assembled in memory by WebPAnimEncoder.
+ *
+ * VIPS_FOREIGN_SAVE_WEBP_MODE_STREAM:
+ *
+ * 	An animation, written to the target a frame at a time. Each frame is
+ * 	encoded as the rectangle that changed since the previous frame. We
+ * 	seek back at the end to set the RIFF size.
+ */
 typedef enum _VipsForeignSaveWebpMode {
 	VIPS_FOREIGN_SAVE_WEBP_MODE_SINGLE,
-	VIPS_FOREIGN_SAVE_WEBP_MODE_ANIM
+	VIPS_FOREIGN_SAVE_WEBP_MODE_ANIM,
+	VIPS_FOREIGN_SAVE_WEBP_MODE_STREAM
 } VipsForeignSaveWebpMode;
 
 typedef struct _VipsForeignSaveWebp {
@@ -174,6 +193,10 @@ typedef struct _VipsForeignSaveWebp {
 	 */
 	int kmax;
 
+	/* Write animation frames to the target as they are encoded.
+	 */
+	gboolean stream;
+
 	WebPConfig config;
 
 	/* Output is written here. We can only support memory write, since we
@@ -198,6 +221,17 @@ typedef struct _VipsForeignSaveWebp {
 	 * for libwebp. We need to copy each frame to a local buffer.
 	 */
 	VipsPel *frame_bytes;
+
+	/* Stream mode. The previous frame, to find the area that changed, and
+	 * the last encoded frame, which we hold back so that identical frames
+	 * can be merged into it.
+	 */
+	VipsPel *previous_bytes;
+	WebPMemoryWriter pending_writer;
+	VipsRect pending_rect;
+	int pending_delay;
+	int frames_since_key;
+	gint64 riff_start;
 } VipsForeignSaveWebp;
 
 typedef VipsForeignSaveClass VipsForeignSaveWebpClass;
@@ -227,6 +261,7 @@ static void
 vips_foreign_save_webp_unset(VipsForeignSaveWebp *webp)
 {
 	WebPMemoryWriterClear(&webp->memory_writer);
+	WebPMemoryWriterClear(&webp->pending_writer);
 	VIPS_FREEF(WebPAnimEncoderDelete, webp->enc);
 	VIPS_FREEF(WebPMuxDelete, webp->mux);
 }
@@ -239,6 +274,7 @@ vips_foreign_save_webp_dispose(GObject *gobject)
 	vips_foreign_save_webp_unset(webp);
 	VIPS_UNREF(webp->target);
 	VIPS_FREE(webp->frame_bytes);
+	VIPS_FREE(webp->previous_bytes);
 
 	G_OBJECT_CLASS(vips_foreign_save_webp_parent_class)->dispose(gobject);
 }
@@ -316,6 +352,382 @@ vips_foreign_save_webp_get_delay(VipsForeignSaveWebp *webp, int page_number)
 	return delay <= 10 ? 100 : delay;
 }
 
+static void
+vips_webp_put24(VipsPel *p, guint32 value)
+{
+	p[0] = value & 0xff;
+	p[1] = (value >> 8) & 0xff;
+	p[2] = (value >> 16) & 0xff;
+}
+
+static void
+vips_webp_put32(VipsPel *p, guint32 value)
+{
+	vips_webp_put24(p, value);
+	p[3] = (value >> 24) & 0xff;
+}
+
+static guint32
+vips_webp_get32(const VipsPel *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+/* Write a chunk header, then the chunk, padded to an even length.
+ */
+static int
+vips_foreign_save_webp_stream_chunk(VipsForeignSaveWebp *webp,
+	const char *fourcc, const void *data, size_t length)
+{
+	VipsPel header[8];
+
+	memcpy(header, fourcc, 4);
+	vips_webp_put32(header + 4, length);
+	if (vips_target_write(webp->target, header, 8) ||
+		vips_target_write(webp->target, data, length) ||
+		((length & 1) &&
+			vips_target_write(webp->target, "", 1)))
+		return -1;
+
+	return 0;
+}
+
+static int
+vips_foreign_save_webp_stream_loop(VipsForeignSaveWebp *webp)
+{
+	VipsForeignSave *save = (VipsForeignSave *) webp;
+
+	int loop;
+
+	loop = 0;
+	if (vips_image_get_typeof(save->ready, "loop"))
+		(void) vips_image_get_int(save->ready, "loop", &loop);
+	else if (vips_image_get_typeof(save->ready, "gif-loop")) {
+		/* DEPRECATED "gif-loop"
+		 */
+		int gif_loop;
+
+		if (!vips_image_get_int(save->ready, "gif-loop", &gif_loop))
+			loop = gif_loop == 0 ? 0 : gif_loop + 1;
+	}
+
+	return VIPS_CLIP(0, loop, 65535);
+}
+
+/* Write the RIFF header, VP8X, ICCP and ANIM chunks. The RIFF size is
+ * patched in vips_foreign_save_webp_stream_end().
+ */
+static int
+vips_foreign_save_webp_stream_start(VipsForeignSaveWebp *webp)
+{
+	VipsForeignSave *save = (VipsForeignSave *) webp;
+	int page_height = vips_image_get_page_height(save->ready);
+
+	VipsBlob *blob;
+	const void *icc_data;
+	size_t icc_length;
+	VipsPel vp8x[10];
+	VipsPel anim[6];
+	guint32 flags;
+	int loop;
+
+	/* A profile supplied as an argument overrides an embedded
+	 * profile.
+	 */
+	blob = NULL;
+	icc_data = NULL;
+	icc_length = 0;
+	if (save->profile) {
+		if (vips_profile_load(save->profile, &blob, NULL))
+			return -1;
+		if (blob)
+			icc_data = vips_blob_get(blob, &icc_length);
+	}
+	else if (vips_image_get_typeof(save->ready, VIPS_META_ICC_NAME) &&
+		vips_image_get_blob(save->ready, VIPS_META_ICC_NAME,
+			&icc_data, &icc_length))
+		return -1;
+
+	flags = ANIMATION_FLAG;
+	if (save->ready->Bands == 4)
+		flags |= ALPHA_FLAG;
+	if (icc_data)
+		flags |= ICCP_FLAG;
+	for (int i = 0; i < vips__n_webp_names; i++)
+		if (!g_str_equal(vips__webp_names[i].vips, VIPS_META_ICC_NAME) &&
+			vips_image_get_typeof(save->ready, vips__webp_names[i].vips))
+			flags |= vips__webp_names[i].flags;
+
+	vips_webp_put32(vp8x, flags);
+	vips_webp_put24(vp8x + 4, save->ready->Xsize - 1);
+	vips_webp_put24(vp8x + 7, page_height - 1);
+
+	/* Opaque white background, as WebPAnimEncoder.
+	 */
+	vips_webp_put32(anim, 0xffffffff);
+	loop = vips_foreign_save_webp_stream_loop(webp);
+	anim[4] = loop & 0xff;
+	anim[5] = loop >> 8;
+
+	if (vips_target_write(webp->target, "RIFF\0\0\0\0WEBP", 12) ||
+		vips_foreign_save_webp_stream_chunk(webp, "VP8X", vp8x, 10) ||
+		(icc_data &&
+			vips_foreign_save_webp_stream_chunk(webp,
+				"ICCP", icc_data, icc_length)) ||
+		vips_foreign_save_webp_stream_chunk(webp, "ANIM", anim, 6)) {
+		if (blob)
+			vips_area_unref((VipsArea *) blob);
+		return -1;
+	}
+
+	if (blob)
+		vips_area_unref((VipsArea *) blob);
+
+	return 0;
+}
+
+/* Write the held-back frame as an ANMF chunk.
+ */
+static int
+vips_foreign_save_webp_stream_flush(VipsForeignSaveWebp *webp)
+{
+	const VipsPel *data = webp->pending_writer.mem;
+	size_t size = webp->pending_writer.size;
+	VipsRect *rect = &webp->pending_rect;
+
+	size_t frame_length;
+	VipsPel anmf[24];
+
+	if (!data)
+		return 0;
+
+	/* WebPEncode() makes a complete file. The frame is every chunk after
+	 * the RIFF header, except VP8X.
+	 */
+	frame_length = 0;
+	for (size_t i = 12; i + 8 <= size;) {
+		guint32 length = vips_webp_get32(data + i + 4);
+		size_t chunk_length = 8 + length + (length & 1);
+
+		if (i + chunk_length > size) {
+			vips_error("webpsave", "%s", _("bad frame"));
+			return -1;
+		}
+
+		if (memcmp(data + i, "VP8X", 4) != 0)
+			frame_length += chunk_length;
+		i += chunk_length;
+	}
+
+	memcpy(anmf, "ANMF", 4);
+	vips_webp_put32(anmf + 4, 16 + frame_length);
+	vips_webp_put24(anmf + 8, rect->left / 2);
+	vips_webp_put24(anmf + 11, rect->top / 2);
+	vips_webp_put24(anmf + 14, rect->width - 1);
+	vips_webp_put24(anmf + 17, rect->height - 1);
+	vips_webp_put24(anmf + 20, VIPS_MIN(webp->pending_delay, 0xffffff));
+
+	/* Don't blend, don't dispose: the rectangle replaces the canvas.
+	 */
+	anmf[23] = 0x02;
+
+	if (vips_target_write(webp->target, anmf, 24))
+		return -1;
+
+	for (size_t i = 12; i + 8 <= size;) {
+		guint32 length = vips_webp_get32(data + i + 4);
+		size_t chunk_length = 8 + length + (length & 1);
+
+		if (memcmp(data + i, "VP8X", 4) != 0 &&
+			vips_target_write(webp->target, data + i, chunk_length))
+			return -1;
+		i += chunk_length;
+	}
+
+	WebPMemoryWriterClear(&webp->pending_writer);
+	WebPMemoryWriterInit(&webp->pending_writer);
+
+	return 0;
+}
+
+/* Find the area of frame_bytes that differs from previous_bytes. Left and
+ * top must be even for ANMF.
+ */
+static void
+vips_foreign_save_webp_stream_changed(VipsForeignSaveWebp *webp,
+	VipsRect *rect)
+{
+	VipsForeignSave *save = (VipsForeignSave *) webp;
+	int page_height = vips_image_get_page_height(save->ready);
+	int bands = save->ready->Bands;
+	size_t line_size = (size_t) bands * save->ready->Xsize;
+
+	int top, bottom, left, right;
+
+	for (top = 0; top < page_height; top++)
+		if (memcmp(webp->frame_bytes + top * line_size,
+				webp->previous_bytes + top * line_size, line_size))
+			break;
+	if (top == page_height) {
+		*rect = (VipsRect) { 0 };
+		return;
+	}
+
+	for (bottom = page_height - 1; bottom > top; bottom--)
+		if (memcmp(webp->frame_bytes + bottom * line_size,
+				webp->previous_bytes + bottom * line_size, line_size))
+			break;
+
+	left = save->ready->Xsize - 1;
+	right = 0;
+	for (int y = top; y <= bottom; y++) {
+		VipsPel *p = webp->frame_bytes + y * line_size;
+		VipsPel *q = webp->previous_bytes + y * line_size;
+
+		for (int x = 0; x < left; x++)
+			if (memcmp(p + x * bands, q + x * bands, bands)) {
+				left = x;
+				break;
+			}
+
+		for (int x = save->ready->Xsize - 1; x > right; x--)
+			if (memcmp(p + x * bands, q + x * bands, bands)) {
+				right = x;
+				break;
+			}
+	}
+	right = VIPS_MAX(left, right);
+
+	rect->left = VIPS_ROUND_DOWN(left, 2);
+	rect->top = VIPS_ROUND_DOWN(top, 2);
+	rect->width = right + 1 - rect->left;
+	rect->height = bottom + 1 - rect->top;
+}
+
+/* Encode the part of the current frame that changed, and hold it back in
+ * pending_writer.
+ */
+static int
+vips_foreign_save_webp_stream_frame(VipsForeignSaveWebp *webp)
+{
+	VipsForeignSave *save = (VipsForeignSave *) webp;
+	int page_height = vips_image_get_page_height(save->ready);
+	int bands = save->ready->Bands;
+	int delay = vips_foreign_save_webp_get_delay(webp, webp->page_number);
+
+	VipsRect rect;
+	WebPPicture pic;
+	webp_import import;
+	VipsPel *swap;
+
+	/* The first frame, and every kmax frames after that, is a keyframe.
+	 * As with libwebp, kmax <= 0 means no forced keyframes.
+	 */
+	if (webp->page_number == 0 ||
+		(webp->kmax > 0 &&
+			webp->frames_since_key >= webp->kmax)) {
+		rect = (VipsRect) { 0, 0, save->ready->Xsize, page_height };
+		webp->frames_since_key = 0;
+	}
+	else {
+		vips_foreign_save_webp_stream_changed(webp, &rect);
+
+		/* Nothing changed? Show the previous frame for longer.
+		 */
+		if (vips_rect_isempty(&rect)) {
+			webp->pending_delay += delay;
+			return 0;
+		}
+	}
+
+	if (vips_foreign_save_webp_stream_flush(webp))
+		return -1;
+
+	if (!vips_foreign_save_webp_pic_init(webp, &pic))
+		return -1;
+	pic.width = rect.width;
+	pic.height = rect.height;
+	pic.custom_ptr = (void *) &webp->pending_writer;
+
+	if (bands == 4)
+		import = WebPPictureImportRGBA;
+	else
+		import = WebPPictureImportRGB;
+
+	if (!import(&pic,
+			webp->frame_bytes +
+				((size_t) rect.top * save->ready->Xsize + rect.left) * bands,
+			save->ready->Xsize * bands)) {
+		WebPPictureFree(&pic);
+		vips_error("webpsave", "%s", _("picture memory error"));
+		return -1;
+	}
+
+	if (!WebPEncode(&webp->config, &pic)) {
+		WebPPictureFree(&pic);
+		vips_error("webpsave", "%s", _("unable to encode"));
+		return -1;
+	}
+
+	WebPPictureFree(&pic);
+
+	webp->pending_rect = rect;
+	webp->pending_delay = delay;
+	webp->frames_since_key += 1;
+
+	/* The next frame overwrites all of frame_bytes, so we can just swap.
+	 */
+	swap = webp->previous_bytes;
+	webp->previous_bytes = webp->frame_bytes;
+	webp->frame_bytes = swap;
+
+	return 0;
+}
+
+/* Write the last frame, then EXIF and XMP, then set the RIFF size.
+ */
+static int
+vips_foreign_save_webp_stream_end(VipsForeignSaveWebp *webp)
+{
+	VipsForeignSave *save = (VipsForeignSave *) webp;
+
+	gint64 end;
+	VipsPel riff_size[4];
+
+	if (vips_foreign_save_webp_stream_flush(webp))
+		return -1;
+
+	for (int i = 0; i < vips__n_webp_names; i++) {
+		const char *vips_name = vips__webp_names[i].vips;
+
+		if (!g_str_equal(vips_name, VIPS_META_ICC_NAME) &&
+			vips_image_get_typeof(save->ready, vips_name)) {
+			const void *data;
+			size_t length;
+
+			if (vips_image_get_blob(save->ready, vips_name, &data, &length) ||
+				vips_foreign_save_webp_stream_chunk(webp,
+					vips__webp_names[i].webp, data, length))
+				return -1;
+		}
+	}
+
+	if ((end = vips_target_seek(webp->target, 0, SEEK_CUR)) < 0)
+		return -1;
+	if (end - webp->riff_start - 8 > UINT_MAX) {
+		vips_error("webpsave", "%s", _("image too large"));
+		return -1;
+	}
+
+	vips_webp_put32(riff_size, end - webp->riff_start - 8);
+	if (vips_target_seek(webp->target, webp->riff_start + 4, SEEK_SET) < 0 ||
+		vips_target_write(webp->target, riff_size, 4) ||
+		vips_target_seek(webp->target, end, SEEK_SET) < 0)
+		return -1;
+
+	return 0;
+}
+
 /* We have a complete frame -- write!
  */
 static int
@@ -325,6 +737,9 @@ vips_foreign_save_webp_write_frame(VipsForeignSaveWebp *webp)
 
 	WebPPicture pic;
 
+	if (webp->mode == VIPS_FOREIGN_SAVE_WEBP_MODE_STREAM)
+		return vips_foreign_save_webp_stream_frame(webp);
+
 	if (vips_foreign_save_webp_write_webp_image(webp, webp->frame_bytes, &pic))
 		return -1;
 
@@ -649,6 +1064,30 @@ vips_foreign_save_webp_init_config(VipsForeignSaveWebp *webp)
 	return 0;
 }
 
+static int
+vips_foreign_save_webp_init_delay(VipsForeignSaveWebp *webp)
+{
+	VipsForeignSave *save = (VipsForeignSave *) webp;
+
+	/* Get delay array
+	 *
+	 * There might just be the old gif-delay field. This is centiseconds.
+	 * New images have an array of ints giving millisecond durations.
+	 */
+	webp->gif_delay = 10;
+	if (vips_image_get_typeof(save->ready, "gif-delay") &&
+		vips_image_get_int(save->ready, "gif-delay", &webp->gif_delay))
+		return -1;
+
+	webp->delay = NULL;
+	if (vips_image_get_typeof(save->ready, "delay") &&
+		vips_image_get_array_int(save->ready, "delay",
+			&webp->delay, &webp->delay_length))
+		return -1;
+
+	return 0;
+}
+
 static int
 vips_foreign_save_webp_init_anim_enc(VipsForeignSaveWebp *webp)
 {
@@ -675,20 +1114,7 @@ vips_foreign_save_webp_init_anim_enc(VipsForeignSaveWebp *webp)
 		return -1;
 	}
 
-	/* Get delay array
-	 *
-	 * There might just be the old gif-delay field. This is centiseconds.
-	 * New images have an array of ints giving millisecond durations.
-	 */
-	webp->gif_delay = 10;
-	if (vips_image_get_typeof(save->ready, "gif-delay") &&
-		vips_image_get_int(save->ready, "gif-delay", &webp->gif_delay))
-		return -1;
-
-	webp->delay = NULL;
-	if (vips_image_get_typeof(save->ready, "delay") &&
-		vips_image_get_array_int(save->ready, "delay",
-			&webp->delay, &webp->delay_length))
+	if (vips_foreign_save_webp_init_delay(webp))
 		return -1;
 
 	return 0;
@@ -767,15 +1193,47 @@ vips_foreign_save_webp_build(VipsObject *object)
 	if (page_height != save->ready->Ysize)
 		webp->mode = VIPS_FOREIGN_SAVE_WEBP_MODE_ANIM;
 
+	/* Stream mode needs to seek back to set the RIFF size, so the target
+	 * must support seek.
+	 */
+	if (webp->mode == VIPS_FOREIGN_SAVE_WEBP_MODE_ANIM &&
+		webp->stream &&
+		(webp->riff_start = vips_target_seek(webp->target, 0, SEEK_CUR)) >= 0)
+		webp->mode = VIPS_FOREIGN_SAVE_WEBP_MODE_STREAM;
+
 	/* Init config for animated write (if necessary)
 	 */
 	if (webp->mode == VIPS_FOREIGN_SAVE_WEBP_MODE_ANIM)
 		if (vips_foreign_save_webp_init_anim_enc(webp))
 			return -1;
 
+	if (webp->mode == VIPS_FOREIGN_SAVE_WEBP_MODE_STREAM) {
+		webp->previous_bytes = g_try_malloc(frame_size);
+		if (webp->previous_bytes == NULL) {
+			vips_error("webpsave",
+				_("failed to allocate %zu bytes"), frame_size);
+			return -1;
+		}
+		WebPMemoryWriterInit(&webp->pending_writer);
+
+		if (vips_foreign_save_webp_init_delay(webp) ||
+			vips_foreign_save_webp_stream_start(webp))
+			return -1;
+	}
+
 	if (vips_sink_disc(save->ready, vips_foreign_save_webp_sink_disc, webp))
 		return -1;
 
+	if (webp->mode == VIPS_FOREIGN_SAVE_WEBP_MODE_STREAM) {
+		if (vips_foreign_save_webp_stream_end(webp) ||
+			vips_target_end(webp->target))
+			return -1;
+
+		vips_foreign_save_webp_unset(webp);
+
+		return 0;
+	}
+
 	/* Finish animated write
 	 */
 	if (webp->mode == VIPS_FOREIGN_SAVE_WEBP_MODE_ANIM)
@@ -942,6 +1400,13 @@ vips_foreign_save_webp_class_init(VipsForeignSaveWebpClass *class)
 		VIPS_ARGUMENT_OPTIONAL_INPUT,
 		G_STRUCT_OFFSET(VipsForeignSaveWebp, passes),
 		1, 10, 1);
+
+	VIPS_ARG_BOOL(class, "stream", 26,
+		_("Stream"),
+		_("Write animation frames as they are encoded"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignSaveWebp, stream),
+		FALSE);
 }
 
 static void
@@ -1225,6 +1690,14 @@ vips_foreign_save_webp_mime_init(VipsForeignSaveWebpMime *mime)
  * For animated webp output, @mixed tries to improve the file size by mixing
  * both lossy and lossless encoding.
  *
+ * For animated webp output, set @stream to write each frame to the target as
+ * soon as it is encoded, rather than assembling the whole file in memory.
+ * Memory use is then independent of the number of frames. Each frame is
+ * stored as the rectangle that changed since the previous frame, and @kmax
+ * sets the keyframe spacing. @min_size, @mixed and @kmin are ignored. The
+ * target must support seek, or the animation is assembled in memory as
+ * usual.
+ *
  * Use the metadata items `loop` and `delay` to set the number of
  * loops for the animation and the frame delays.
  *
@@ -1246,6 +1719,7 @@ vips_foreign_save_webp_mime_init(VipsForeignSaveWebpMime *mime)
  *     * @mixed: `gboolean`, allow both lossy and lossless encoding
  *     * @kmin: `gint`, minimum number of frames between keyframes
  *     * @kmax: `gint`, maximum number of frames between keyframes
+ *     * @stream: `gboolean`, write animation frames as they are encoded
  *
  * ::: seealso
  *     [ctor@Image.webpload], [method@Image.write_to_file].
@@ -1296,6 +1770,7 @@ vips_webpsave(VipsImage *in, const char *filename, ...)
  *     * @mixed: `gboolean`, allow both lossy and lossless encoding
  *     * @kmin: `gint`, minimum number of frames between keyframes
  *     * @kmax: `gint`, maximum number of frames between keyframes
+ *     * @stream: `gboolean`, write animation frames as they are encoded
  *
  * ::: seealso
  *     [method@Image.webpsave].
@@ -1355,6 +1830,7 @@ vips_webpsave_buffer(VipsImage *in, void **buf, size_t *len, ...)
  *     * @mixed: `gboolean`, allow both lossy and lossless encoding
  *     * @kmin: `gint`, minimum number of frames between keyframes
  *     * @kmax: `gint`, maximum number of frames between keyframes
+ *     * @stream: `gboolean`, write animation frames as they are encoded
  *
  * ::: seealso
  *     [method@Image.webpsave], [method@Image.write_to_file].
@@ -1399,6 +1875,7 @@ vips_webpsave_mime(VipsImage *in, ...)
  *     * @mixed: `gboolean`, allow both lossy and lossless encoding
  *     * @kmin: `gint`, minimum number of frames between keyframes
  *     * @kmax: `gint`, maximum number of frames between keyframes
+ *     * @stream: `gboolean`, write animation frames as they are encoded
  *
  * ::: seealso
  *     [method@Image.webpsave].
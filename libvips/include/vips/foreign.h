@@ -92,6 +92,30 @@ VIPS_API
 void *vips_foreign_map(const char *base,
 	VipsSListMap2Fn fn, void *a, void *b);
 
+VIPS_API
+void vips_decode_cache_set_max_mem(size_t max_mem);
+VIPS_API
+size_t vips_decode_cache_get_max_mem(void);
+VIPS_API
+void vips_decode_cache_get_stats(guint64 *hits, guint64 *misses,
+	size_t *cached);
+
+typedef struct _VipsProbe {
+	const char *loader;
+	int width;
+	int height;
+	int bands;
+	VipsBandFormat format;
+	int orientation;
+	int n_pages;
+} VipsProbe;
+
+VIPS_API
+int vips_probe_source(VipsSource *source, VipsProbe *probe);
+VIPS_API
+int vips_probe_files(const char **filenames, int n, VipsProbe *probes,
+	gboolean parallel);
+
 /* Image file load properties.
  *
  * Keep in sync with the deprecated VipsFormatFlags, we need to be able to
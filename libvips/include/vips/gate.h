@@ -69,9 +69,59 @@ extern "C" {
 	} \
 	G_STMT_END
 
+/**
+ * VipsProfileEntry:
+ * @nickname: the operation nickname
+ * @calls: number of calls to generate
+ * @pixels: number of pixels generated
+ * @time: microseconds spent generating, not counting upstream operations
+ * @total_time: microseconds spent generating, including upstream operations
+ * @buffer_hits: number of times a thread reused pixels it had already made
+ * @buffer_misses: number of times a thread had to make new pixels
+ *
+ * Counters for one operation in a [struct@ProfileReport].
+ */
+typedef struct _VipsProfileEntry {
+	const char *nickname;
+	gint64 calls;
+	gint64 pixels;
+	gint64 time;
+	gint64 total_time;
+	gint64 buffer_hits;
+	gint64 buffer_misses;
+} VipsProfileEntry;
+
+/**
+ * VipsProfileReport:
+ * @n_entries: number of entries
+ * @entries: (array length=n_entries): per-operation counters, most
+ *   expensive first
+ * @allocate_wait: microseconds workers spent waiting for work
+ * @write_wait: microseconds spent waiting for background writes to finish
+ *
+ * A profile summary, see [func@profile_get].
+ */
+typedef struct _VipsProfileReport {
+	int n_entries;
+	VipsProfileEntry *entries;
+	gint64 allocate_wait;
+	gint64 write_wait;
+} VipsProfileReport;
+
 VIPS_API
 void vips_profile_set(gboolean profile);
 
+VIPS_API
+void vips_profile_summary_set(gboolean summary);
+VIPS_API
+VipsProfileReport *vips_profile_get(void);
+VIPS_API
+void vips_profile_report_free(VipsProfileReport *report);
+VIPS_API
+void vips_profile_reset(void);
+VIPS_API
+void vips_profile_print(void);
+
 #endif /*VIPS_GATE_H*/
 
 #ifdef __cplusplus
@@ -40,6 +40,12 @@ extern "C" {
 typedef int (*VipsRegionWrite)(VipsRegion *region, VipsRect *area, void *a);
 VIPS_API
 int vips_sink_disc(VipsImage *im, VipsRegionWrite write_fn, void *a);
+VIPS_API
+void vips_sink_disc_set_buffers(int n_buffers, size_t max_mem);
+VIPS_API
+int vips_sink_disc_get_buffers(void);
+VIPS_API
+void vips_sink_disc_get_stats(guint64 *stall, guint64 *write);
 
 VIPS_API
 int vips_sink(VipsImage *im,
@@ -123,10 +123,13 @@ extern int vips__tile_width;
 extern int vips__tile_height;
 extern int vips__fatstrip_height;
 extern int vips__thinstrip_height;
+extern int vips__tile_target;
 
 /* Default n threads.
  */
 extern int vips__concurrency;
+extern int vips__concurrency_total;
+extern gboolean vips__numa;
 
 /* abort() on any error.
  */
@@ -151,10 +154,16 @@ extern char *vips__disc_threshold;
 
 extern gboolean vips__cache_dump;
 extern gboolean vips__cache_trace;
+extern gboolean vips__cache_cost;
 
 extern float vips_v2Y_16[65536];
 
 void vips__thread_init(void);
+GThread *vips__g_thread_try_new(const char *domain,
+	GThreadFunc func, gpointer data, GError **error);
+int vips__numa_node_current(void);
+int vips__numa_node_n_cpus(int node);
+void vips__numa_pin(int node);
 void vips__threadpool_init(void);
 void vips__threadpool_shutdown(void);
 
@@ -162,13 +171,36 @@ typedef struct _VipsThreadset VipsThreadset;
 VipsThreadset *vips_threadset_new(int max_threads);
 int vips_threadset_run(VipsThreadset *set,
 	const char *domain, GFunc func, gpointer data);
+int vips__threadset_try_run(VipsThreadset *set,
+	const char *domain, GFunc func, gpointer data);
+
+/* Run a task in a thread if we can, or in the calling thread if not.
+ */
+VIPS_API
+void vips__thread_execute_or_run(const char *domain,
+	GFunc func, gpointer data);
 void vips_threadset_free(VipsThreadset *set);
 
+/* A claim function. This is run by workers without any lock to try to get a
+ * new work unit. Return TRUE if a unit was claimed, FALSE to fall back to
+ * the (single-threaded) allocate function.
+ */
+typedef gboolean (*VipsThreadpoolClaimFn)(VipsThreadState *state, void *a);
+
+int vips__threadpool_run_claim(VipsImage *im,
+	VipsThreadStartFn start,
+	VipsThreadpoolClaimFn claim,
+	VipsThreadpoolAllocateFn allocate,
+	VipsThreadpoolWorkFn work,
+	VipsThreadpoolProgressFn progress,
+	void *a);
+
 VIPS_API void vips__worker_lock(GMutex *mutex);
 VIPS_API void vips__worker_cond_wait(GCond *cond, GMutex *mutex);
 gboolean vips__worker_exit(void);
 
 void vips__cache_init(void);
+void vips__cache_generate_time(VipsImage *image, gint64 time);
 
 int vips__print_renders(void);
 int vips__type_leak(void);
@@ -207,7 +239,56 @@ int vips_remapfilerw(VipsImage *image);
 #endif
 
 void vips__buffer_init(void);
+void vips__sink_disc_init(void);
 void vips__buffer_shutdown(void);
+void vips__buffer_pool_shutdown(void);
+
+void vips__tracked_aligned_untrack(void *s);
+void vips__tracked_aligned_retrack(void *s);
+void vips__tracked_aligned_free_untracked(void *s);
+
+void vips__decode_cache_init(void);
+void vips__decode_cache_shutdown(void);
+
+void vips__icc_transform_shutdown(void);
+void vips__reduce_mask_shutdown(void);
+/* VIPS_API is required by the openslide module.
+ */
+VIPS_API
+char *vips__decode_cache_id(const char *filename, const char *format, ...)
+	G_GNUC_PRINTF(2, 3);
+VIPS_API
+gboolean vips__decode_cache_get(const char *id, int page, int x, int y,
+	void *buf, size_t length);
+VIPS_API
+void vips__decode_cache_put(const char *id, int page, int x, int y,
+	const void *buf, size_t length);
+VIPS_API
+gboolean vips__decode_cache_get_region(const char *id, int page,
+	VipsRegion *region);
+VIPS_API
+void vips__decode_cache_put_region(const char *id, int page,
+	VipsRegion *region);
+
+void vips__foreign_load_set_roi(VipsImage *downstream,
+	VipsImage *image, const VipsRect *roi);
+VIPS_API
+const VipsRect *vips__foreign_load_get_roi(VipsForeignLoad *load);
+
+/* A byte pattern that files in a format must match, with an optional mask
+ * to AND with the file bytes and @magic before comparing. Lists end with a
+ * signature with a NULL @magic.
+ */
+typedef struct _VipsForeignSignature {
+	int offset;
+	const char *magic;
+	const char *mask;
+	int length;
+} VipsForeignSignature;
+
+VIPS_API
+void vips__foreign_load_set_signatures(VipsForeignLoadClass *load_class,
+	const VipsForeignSignature *signatures, gboolean signatures_only);
 
 void vips__copy_4byte(int swap, unsigned char *to, unsigned char *from);
 void vips__copy_2byte(gboolean swap, unsigned char *to, unsigned char *from);
@@ -374,6 +455,26 @@ void vips__thread_profile_attach(const char *thread_name);
 void vips__thread_profile_detach(void);
 void vips__thread_profile_stop(void);
 
+/* A generate in progress, for the profile summary.
+ */
+typedef struct _VipsProfileFrame {
+	struct _VipsProfileFrame *parent;
+	const char *nickname;
+	gint64 start;
+	gint64 child_time;
+} VipsProfileFrame;
+
+extern gboolean vips__profile_summary;
+
+void vips__profile_thread_detach(void);
+void vips__profile_shutdown(void);
+void vips__profile_tag(VipsImage *image, const char *nickname);
+void vips__profile_generate_start(VipsProfileFrame *frame, VipsImage *image);
+void vips__profile_generate_stop(VipsProfileFrame *frame, gint64 pixels);
+void vips__profile_buffer(VipsImage *image, gboolean hit);
+void vips__profile_allocate_wait(gint64 time);
+void vips__profile_write_wait(gint64 time);
+
 int vips__lrmosaic(VipsImage *ref, VipsImage *sec, VipsImage *out,
 	int bandno,
 	int xref, int yref, int xsec, int ysec,
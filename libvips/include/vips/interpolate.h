@@ -68,6 +68,13 @@ struct _VipsInterpolate {
 typedef void (*VipsInterpolateMethod)(VipsInterpolate *interpolate,
 	void *out, VipsRegion *in, double x, double y);
 
+/* Interpolate a run of n pixels along a line. Write n pixels to "out",
+ * interpolating at (x, y), then (x + dx, y + dy), and so on.
+ */
+typedef void (*VipsInterpolateSpanMethod)(VipsInterpolate *interpolate,
+	void *out, VipsRegion *in,
+	double x, double y, double dx, double dy, int n);
+
 typedef struct _VipsInterpolateClass {
 	VipsObjectClass parent_class;
 
@@ -99,6 +106,13 @@ void vips_interpolate(VipsInterpolate *interpolate,
 VIPS_API
 VipsInterpolateMethod vips_interpolate_get_method(VipsInterpolate *interpolate);
 VIPS_API
+void vips_interpolate_span(VipsInterpolate *interpolate,
+	void *out, VipsRegion *in,
+	double x, double y, double dx, double dy, int n);
+VIPS_API
+VipsInterpolateSpanMethod
+vips_interpolate_get_span_method(VipsInterpolate *interpolate);
+VIPS_API
 int vips_interpolate_get_window_size(VipsInterpolate *interpolate);
 VIPS_API
 int vips_interpolate_get_window_offset(VipsInterpolate *interpolate);
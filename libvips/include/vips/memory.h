@@ -120,6 +120,14 @@ int vips_tracked_close(int fd);
 VIPS_API
 int vips_tracked_get_files(void);
 
+VIPS_API
+void vips_buffer_pool_set_max_mem(size_t max_mem);
+VIPS_API
+size_t vips_buffer_pool_get_max_mem(void);
+VIPS_API
+void vips_buffer_pool_get_stats(guint64 *hits, guint64 *misses,
+	size_t *cached);
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
@@ -53,6 +53,23 @@ typedef enum /*< flags >*/ {
 	VIPS_OPERATION_REVALIDATE = 64
 } VipsOperationFlags;
 
+/**
+ * VipsCachePolicy:
+ * @VIPS_CACHE_POLICY_LRU: drop the least-recently-used operation first
+ * @VIPS_CACHE_POLICY_COST: GreedyDual-Size, weighting recency by the time
+ *   taken to make an operation, the memory it holds and its reuse
+ *
+ * How the operation cache picks operations to drop.
+ *
+ * ::: seealso
+ *     [func@cache_set_policy].
+ */
+typedef enum {
+	VIPS_CACHE_POLICY_LRU,
+	VIPS_CACHE_POLICY_COST,
+	VIPS_CACHE_POLICY_LAST	/*< skip >*/
+} VipsCachePolicy;
+
 #define VIPS_TYPE_OPERATION (vips_operation_get_type())
 #define VIPS_OPERATION(obj) \
 	(G_TYPE_CHECK_INSTANCE_CAST((obj), \
@@ -158,6 +175,13 @@ VIPS_API
 void vips_cache_set_dump(gboolean dump);
 VIPS_API
 void vips_cache_set_trace(gboolean trace);
+VIPS_API
+void vips_cache_set_policy(VipsCachePolicy policy);
+VIPS_API
+VipsCachePolicy vips_cache_get_policy(void);
+VIPS_API
+void vips_cache_get_stats(guint64 *hits, guint64 *misses,
+	guint64 *bytes_saved);
 
 /* Part of threadpool, really, but we want these in a header that gets scanned
  * for our typelib.
@@ -166,6 +190,14 @@ VIPS_API
 void vips_concurrency_set(int concurrency);
 VIPS_API
 int vips_concurrency_get(void);
+VIPS_API
+void vips_concurrency_set_total(int total);
+VIPS_API
+int vips_concurrency_get_total(void);
+VIPS_API
+void vips_concurrency_set_numa(gboolean numa);
+VIPS_API
+gboolean vips_concurrency_get_numa(void);
 
 VIPS_API
 void vips_operation_block_set(const char *name, gboolean state);
@@ -73,6 +73,10 @@ void vips_window_print(VipsWindow *window);
 typedef struct {
 	GHashTable *hash; /* VipsImage -> VipsBufferCache* */
 	GThread *thread;  /* Just for sanity checking */
+
+	/* Pixel memory this thread has freed, for reuse.
+	 */
+	struct _VipsBufferPoolCache *pool_cache;
 } VipsBufferThread;
 
 /* Per-image buffer cache. This keeps a list of "done" VipsBuffer that this
@@ -88,8 +92,6 @@ typedef struct _VipsBufferCache {
 	GThread *thread; /* Just for sanity checking */
 	struct _VipsImage *im;
 	VipsBufferThread *buffer_thread;
-	GSList *reserve; /* VipsBuffer kept in reserve */
-	int n_reserve;	 /* Number in reserve */
 } VipsBufferCache;
 
 /* What we track for each pixel buffer. These can move between caches and
@@ -104,8 +106,9 @@ typedef struct _VipsBuffer {
 	VipsRect area;			/* Area this pixel buffer covers */
 	gboolean done;			/* Calculated and in a cache */
 	VipsBufferCache *cache; /* The cache this buffer is published on */
-	VipsPel *buf;			/* Private malloc() area */
+	VipsPel *buf;			/* Private pooled malloc() area */
 	size_t bsize;			/* Size of private malloc() */
+	int node;				/* Pool buf came from */
 } VipsBuffer;
 
 VIPS_API
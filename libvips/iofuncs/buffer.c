@@ -25,6 +25,11 @@
  * 	  buffers don't clog up the system
  * 13/10/16
  * 	- better solution: don't keep a buffercache for non-workers
+ * 18/10/26
+ * 	- replace the per-image reserve lists with a global pool of pixel
+ * 	  memory in size classes, with a small cache on each worker
+ * 	- don't count pooled memory in vips_tracked_get_mem()
+ * 	- keep a pool per NUMA node in NUMA mode
  */
 
 /*
@@ -81,9 +86,72 @@ static GSList *vips__buffer_all = NULL;
 static GSList *vips__buffer_cache_all = NULL;
 #endif /*DEBUG_CREATE*/
 
-/* The maximum numbers of buffers we hold in reserve per image.
+/* Pixel memory is pooled in size classes going up in quarter powers of two,
+ * from 4kb to 64mb. Smaller and larger buffers are not pooled.
  */
-static const int buffer_cache_max_reserve = 2;
+#define POOL_MIN_SHIFT (12)
+#define POOL_MAX_SHIFT (26)
+#define POOL_N_CLASSES ((POOL_MAX_SHIFT - POOL_MIN_SHIFT) * 4 + 1)
+
+/* All pooled memory has this alignment, enough for the highway paths.
+ */
+#define POOL_ALIGN (64)
+
+/* The number of free blocks of each size class a worker keeps for itself.
+ */
+#define POOL_THREAD_MAX (4)
+
+/* Free blocks are linked through their first few bytes.
+ */
+typedef struct _PoolBlock {
+	struct _PoolBlock *next;
+} PoolBlock;
+
+/* The number of global pools. In NUMA mode, each node has its own pool, so
+ * memory stays on the node that first wrote to it. Nodes past the end share
+ * the last pool.
+ */
+#define POOL_N_NODES (8)
+
+/* A global pool. Workers return their caches here on exit.
+ */
+typedef struct _Pool {
+	GMutex lock;
+
+	PoolBlock *free[POOL_N_CLASSES];
+
+	guint64 hits;
+	guint64 misses;
+} Pool;
+
+/* Each worker has a small pool of its own, so most allocs don't need the
+ * lock.
+ */
+typedef struct _VipsBufferPoolCache {
+	PoolBlock *free[POOL_N_CLASSES];
+	int n_free[POOL_N_CLASSES];
+
+	/* The global pool these blocks came from.
+	 */
+	int node;
+
+	/* Stats we've not yet added to the global pool.
+	 */
+	guint64 hits;
+	guint64 misses;
+} VipsBufferPoolCache;
+
+static Pool vips_buffer_pool[POOL_N_NODES];
+
+/* The number of kb in the global pools plus all worker caches. Pooled memory
+ * is not counted by vips_tracked_get_mem(), so it won't make the operation
+ * cache drop entries.
+ */
+static int vips_buffer_pool_cached_kb = 0;
+
+/* Stop pooling memory when we have this much.
+ */
+static size_t vips_buffer_pool_max_mem = 32 * 1024 * 1024;
 
 /* Workers have a BufferThread (and BufferCache) in a GPrivate they have
  * exclusive access to.
@@ -92,6 +160,8 @@ static void buffer_thread_destroy_notify(gpointer data);
 static GPrivate buffer_thread_key =
 	G_PRIVATE_INIT(buffer_thread_destroy_notify);
 
+static VipsBufferThread *buffer_thread_get(void);
+
 void
 vips_buffer_print(VipsBuffer *buffer)
 {
@@ -109,7 +179,7 @@ vips_buffer_print(VipsBuffer *buffer)
 
 #ifdef DEBUG
 static void *
-vips_buffer_dump(VipsBuffer *buffer, size_t *reserve, size_t *alive)
+vips_buffer_dump(VipsBuffer *buffer, size_t *alive, void *b)
 {
 	vips_buffer_print(buffer);
 
@@ -136,15 +206,6 @@ vips_buffer_dump(VipsBuffer *buffer, size_t *reserve, size_t *alive)
 		*alive += buffer->bsize;
 	}
 
-	else if (buffer->ref_count == 0 &&
-		buffer->cache &&
-		!buffer->done &&
-		vips_rect_isempty(&buffer->area) &&
-		g_slist_find(buffer->cache->reserve, buffer))
-		/* Held in reserve.
-		 */
-		*reserve += buffer->bsize;
-
 	else
 		printf("buffer craziness!\n");
 
@@ -161,7 +222,6 @@ vips_buffer_cache_dump(VipsBufferCache *cache, void *a, void *b)
 	printf("\tthread %p\n", cache->thread);
 	printf("\timage %p\n", cache->im);
 	printf("\tbuffer_thread %p\n", cache->buffer_thread);
-	printf("\t%d in reserve\n", g_slist_length(cache->reserve));
 
 	return NULL;
 }
@@ -172,17 +232,16 @@ vips_buffer_dump_all(void)
 {
 #ifdef DEBUG
 	if (vips__buffer_all) {
-		size_t reserve;
 		size_t alive;
 
 		printf("buffers:\n");
 
-		reserve = 0;
 		alive = 0;
 		vips_slist_map2(vips__buffer_all,
-			(VipsSListMap2Fn) vips_buffer_dump, &reserve, &alive);
+			(VipsSListMap2Fn) vips_buffer_dump, &alive, NULL);
 		printf("%.3g MB alive\n", alive / (1024 * 1024.0));
-		printf("%.3g MB in reserve\n", reserve / (1024 * 1024.0));
+		printf("%.3g MB in pool\n",
+			g_atomic_int_get(&vips_buffer_pool_cached_kb) / 1024.0);
 	}
 
 #ifdef DEBUG_CREATE
@@ -197,10 +256,263 @@ vips_buffer_dump_all(void)
 #endif /*DEBUG*/
 }
 
+/* The size class for a buffer size, or -1 if we don't pool this size.
+ */
+static int
+pool_class(size_t size)
+{
+	int shift;
+	size_t base;
+	size_t step;
+
+	if (size < ((size_t) 1 << POOL_MIN_SHIFT) ||
+		size > ((size_t) 1 << POOL_MAX_SHIFT))
+		return -1;
+	if (size == ((size_t) 1 << POOL_MIN_SHIFT))
+		return 0;
+
+	/* Find the power of two below size, then the quarter step above
+	 * that.
+	 */
+	for (shift = POOL_MIN_SHIFT; ((size_t) 1 << (shift + 1)) < size; shift++)
+		;
+	base = (size_t) 1 << shift;
+	step = (size - base + base / 4 - 1) / (base / 4);
+
+	return (shift - POOL_MIN_SHIFT) * 4 + step;
+}
+
+static size_t
+pool_class_size(int i)
+{
+	size_t base;
+
+	if (i == 0)
+		return (size_t) 1 << POOL_MIN_SHIFT;
+
+	base = (size_t) 1 << (POOL_MIN_SHIFT + (i - 1) / 4);
+
+	return base + (base / 4) * ((i - 1) % 4 + 1);
+}
+
+/* The global pool for the calling thread.
+ */
+static int
+pool_node(void)
+{
+	int node = vips__numa_node_current();
+
+	return VIPS_CLIP(0, node, POOL_N_NODES - 1);
+}
+
+/* Add a worker's stats to a global pool. Call with the pool lock held.
+ */
+static void
+pool_cache_flush_stats(Pool *pool, VipsBufferPoolCache *pool_cache)
+{
+	pool->hits += pool_cache->hits;
+	pool->misses += pool_cache->misses;
+	pool_cache->hits = 0;
+	pool_cache->misses = 0;
+}
+
+/* Free pooled blocks until we're under the limit. Call with the pool lock
+ * held.
+ */
+static void
+pool_trim(Pool *pool, size_t max_mem)
+{
+	for (int i = POOL_N_CLASSES - 1; i >= 0; i--)
+		while (pool->free[i] &&
+			(size_t) g_atomic_int_get(&vips_buffer_pool_cached_kb) * 1024 >
+				max_mem) {
+			PoolBlock *block = pool->free[i];
+
+			pool->free[i] = block->next;
+			g_atomic_int_add(&vips_buffer_pool_cached_kb,
+				-(int) (pool_class_size(i) / 1024));
+			vips__tracked_aligned_free_untracked(block);
+		}
+}
+
+static void
+pool_trim_all(size_t max_mem)
+{
+	for (int i = 0; i < POOL_N_NODES; i++) {
+		Pool *pool = &vips_buffer_pool[i];
+
+		g_mutex_lock(&pool->lock);
+		pool_trim(pool, max_mem);
+		g_mutex_unlock(&pool->lock);
+	}
+}
+
+/* Move all of a worker's pooled memory back to its global pool.
+ */
+static void
+pool_cache_flush(VipsBufferPoolCache *pool_cache)
+{
+	Pool *pool = &vips_buffer_pool[pool_cache->node];
+
+	g_mutex_lock(&pool->lock);
+
+	for (int i = 0; i < POOL_N_CLASSES; i++) {
+		while (pool_cache->free[i]) {
+			PoolBlock *block = pool_cache->free[i];
+
+			pool_cache->free[i] = block->next;
+			block->next = pool->free[i];
+			pool->free[i] = block;
+		}
+		pool_cache->n_free[i] = 0;
+	}
+	pool_cache_flush_stats(pool, pool_cache);
+
+	/* The limit might have been lowered while we held these.
+	 */
+	pool_trim(pool, vips_buffer_pool_max_mem);
+
+	g_mutex_unlock(&pool->lock);
+}
+
+static void
+pool_cache_free(VipsBufferPoolCache *pool_cache)
+{
+	pool_cache_flush(pool_cache);
+	g_free(pool_cache);
+}
+
+/* Get the calling worker's cache. Workers can move between nodes as they
+ * are reused, so blocks from another node go back to that node's pool.
+ */
+static VipsBufferPoolCache *
+pool_cache_get(int node)
+{
+	VipsBufferThread *buffer_thread;
+	VipsBufferPoolCache *pool_cache;
+
+	if (!(buffer_thread = buffer_thread_get()))
+		return NULL;
+
+	if (!(pool_cache = buffer_thread->pool_cache)) {
+		pool_cache = g_new0(VipsBufferPoolCache, 1);
+		pool_cache->node = node;
+		buffer_thread->pool_cache = pool_cache;
+	}
+	else if (pool_cache->node != node) {
+		pool_cache_flush(pool_cache);
+		pool_cache->node = node;
+	}
+
+	return pool_cache;
+}
+
+/* Get a block of pixel memory of at least @size bytes. The size we actually
+ * allocated is returned in @bsize, and the pool it belongs to in @node.
+ */
+static void *
+pool_alloc(size_t size, size_t *bsize, int *node)
+{
+	Pool *pool;
+
+	int i;
+	VipsBufferPoolCache *pool_cache;
+	PoolBlock *block;
+
+	*node = pool_node();
+	pool = &vips_buffer_pool[*node];
+
+	if ((i = pool_class(size)) < 0) {
+		*bsize = size;
+		return vips_tracked_aligned_alloc(size, POOL_ALIGN);
+	}
+	*bsize = pool_class_size(i);
+
+	block = NULL;
+	if ((pool_cache = pool_cache_get(*node)) &&
+		(block = pool_cache->free[i])) {
+		pool_cache->free[i] = block->next;
+		pool_cache->n_free[i] -= 1;
+		pool_cache->hits += 1;
+	}
+	else {
+		g_mutex_lock(&pool->lock);
+
+		if ((block = pool->free[i])) {
+			pool->free[i] = block->next;
+			pool->hits += 1;
+		}
+		else
+			pool->misses += 1;
+
+		if (pool_cache)
+			pool_cache_flush_stats(pool, pool_cache);
+
+		g_mutex_unlock(&pool->lock);
+	}
+
+	if (block) {
+		g_atomic_int_add(&vips_buffer_pool_cached_kb,
+			-(int) (*bsize / 1024));
+		vips__tracked_aligned_retrack(block);
+		return block;
+	}
+
+	return vips_tracked_aligned_alloc(*bsize, POOL_ALIGN);
+}
+
+/* Return a block of pixel memory from pool_alloc() to the pool of the node
+ * it was allocated on. If that's not our node, skip our cache and put it
+ * straight back in the global pool, so our cache only holds blocks from
+ * one node.
+ */
+static void
+pool_free(void *buf, size_t bsize, int node)
+{
+	Pool *pool = &vips_buffer_pool[node];
+	int i = pool_class(bsize);
+	int kb = bsize / 1024;
+
+	PoolBlock *block;
+	VipsBufferPoolCache *pool_cache;
+
+	if (i < 0 ||
+		pool_class_size(i) != bsize ||
+		(size_t) (g_atomic_int_get(&vips_buffer_pool_cached_kb) + kb) *
+				1024 >
+			vips_buffer_pool_max_mem) {
+		vips_tracked_aligned_free(buf);
+		return;
+	}
+
+	vips__tracked_aligned_untrack(buf);
+	g_atomic_int_add(&vips_buffer_pool_cached_kb, kb);
+	block = (PoolBlock *) buf;
+
+	if (node == pool_node() &&
+		(pool_cache = pool_cache_get(node)) &&
+		pool_cache->n_free[i] < POOL_THREAD_MAX) {
+		block->next = pool_cache->free[i];
+		pool_cache->free[i] = block;
+		pool_cache->n_free[i] += 1;
+	}
+	else {
+		g_mutex_lock(&pool->lock);
+
+		block->next = pool->free[i];
+		pool->free[i] = block;
+
+		g_mutex_unlock(&pool->lock);
+	}
+}
+
 static void
 vips_buffer_free(VipsBuffer *buffer)
 {
-	VIPS_FREEF(vips_tracked_aligned_free, buffer->buf);
+	if (buffer->buf) {
+		pool_free(buffer->buf, buffer->bsize, buffer->node);
+		buffer->buf = NULL;
+	}
 	buffer->bsize = 0;
 	g_free(buffer);
 
@@ -222,6 +534,7 @@ static void
 buffer_thread_free(VipsBufferThread *buffer_thread)
 {
 	VIPS_FREEF(g_hash_table_destroy, buffer_thread->hash);
+	VIPS_FREEF(pool_cache_free, buffer_thread->pool_cache);
 	VIPS_FREE(buffer_thread);
 }
 
@@ -258,13 +571,6 @@ buffer_cache_free(VipsBufferCache *cache)
 	}
 	VIPS_FREEF(g_slist_free, cache->buffers);
 
-	for (p = cache->reserve; p; p = p->next) {
-		VipsBuffer *buffer = (VipsBuffer *) p->data;
-
-		vips_buffer_free(buffer);
-	}
-	VIPS_FREEF(g_slist_free, cache->reserve);
-
 	g_free(cache);
 }
 
@@ -278,8 +584,6 @@ buffer_cache_new(VipsBufferThread *buffer_thread, VipsImage *im)
 	cache->thread = g_thread_self();
 	cache->im = im;
 	cache->buffer_thread = buffer_thread;
-	cache->reserve = NULL;
-	cache->n_reserve = 0;
 
 #ifdef DEBUG_CREATE
 	g_mutex_lock(&vips__global_lock);
@@ -306,6 +610,7 @@ buffer_thread_new(void)
 		g_direct_hash, g_direct_equal,
 		NULL, (GDestroyNotify) buffer_cache_free);
 	buffer_thread->thread = g_thread_self();
+	buffer_thread->pool_cache = NULL;
 
 	return buffer_thread;
 }
@@ -436,8 +741,6 @@ vips_buffer_unref(VipsBuffer *buffer)
 	buffer->ref_count -= 1;
 
 	if (buffer->ref_count == 0) {
-		VipsBufferCache *cache;
-
 #ifdef DEBUG_VERBOSE
 		if (!buffer->done)
 			printf("vips_buffer_unref: buffer was not done\n");
@@ -445,22 +748,9 @@ vips_buffer_unref(VipsBuffer *buffer)
 
 		vips_buffer_undone(buffer);
 
-		/* Place on this thread's reserve list for reuse.
+		/* The pixel memory goes back to the pool for reuse.
 		 */
-		if ((cache = buffer_cache_get(buffer->im)) &&
-			cache->n_reserve < buffer_cache_max_reserve) {
-			g_assert(!buffer->cache);
-
-			cache->reserve =
-				g_slist_prepend(cache->reserve, buffer);
-			cache->n_reserve += 1;
-
-			buffer->cache = cache;
-			buffer->area.width = 0;
-			buffer->area.height = 0;
-		}
-		else
-			vips_buffer_free(buffer);
+		vips_buffer_free(buffer);
 	}
 }
 
@@ -493,11 +783,20 @@ buffer_move(VipsBuffer *buffer, VipsRect *area)
 #endif /*HAVE_HWY*/
 		align = 16;
 
+	/* Pooled memory is always aligned enough.
+	 */
+	g_assert(align <= POOL_ALIGN);
+
 	if (buffer->bsize < new_bsize ||
 		!buffer->buf) {
-		buffer->bsize = new_bsize;
-		VIPS_FREEF(vips_tracked_aligned_free, buffer->buf);
-		if (!(buffer->buf = vips_tracked_aligned_alloc(buffer->bsize, align)))
+		if (buffer->buf) {
+			pool_free(buffer->buf, buffer->bsize, buffer->node);
+			buffer->buf = NULL;
+			buffer->bsize = 0;
+		}
+
+		if (!(buffer->buf = pool_alloc(new_bsize,
+				  &buffer->bsize, &buffer->node)))
 			return -1;
 	}
 
@@ -509,39 +808,23 @@ buffer_move(VipsBuffer *buffer, VipsRect *area)
 VipsBuffer *
 vips_buffer_new(VipsImage *im, VipsRect *area)
 {
-	VipsBufferCache *cache;
 	VipsBuffer *buffer;
 
-	if ((cache = buffer_cache_get(im)) &&
-		cache->reserve) {
-		buffer = (VipsBuffer *) cache->reserve->data;
-		cache->reserve = g_slist_remove(cache->reserve, buffer);
-		cache->n_reserve -= 1;
-
-		g_assert(buffer->im == im);
-		g_assert(buffer->done == FALSE);
-		g_assert(buffer->cache);
-
-		buffer->ref_count = 1;
-		buffer->done = FALSE;
-		buffer->cache = NULL;
-	}
-	else {
-		buffer = g_new0(VipsBuffer, 1);
-		buffer->ref_count = 1;
-		buffer->im = im;
-		buffer->done = FALSE;
-		buffer->cache = NULL;
-		buffer->buf = NULL;
-		buffer->bsize = 0;
+	buffer = g_new0(VipsBuffer, 1);
+	buffer->ref_count = 1;
+	buffer->im = im;
+	buffer->done = FALSE;
+	buffer->cache = NULL;
+	buffer->buf = NULL;
+	buffer->bsize = 0;
+	buffer->node = 0;
 
 #ifdef DEBUG
-		g_mutex_lock(&vips__global_lock);
-		vips__buffer_all =
-			g_slist_prepend(vips__buffer_all, buffer);
-		g_mutex_unlock(&vips__global_lock);
+	g_mutex_lock(&vips__global_lock);
+	vips__buffer_all =
+		g_slist_prepend(vips__buffer_all, buffer);
+	g_mutex_unlock(&vips__global_lock);
 #endif /*DEBUG*/
-	}
 
 	if (buffer_move(buffer, area)) {
 		vips_buffer_free(buffer);
@@ -591,10 +874,16 @@ buffer_find(VipsImage *im, VipsRect *r)
 				buffer);
 #endif /*DEBUG_VERBOSE*/
 
+			if (vips__profile_summary)
+				vips__profile_buffer(im, TRUE);
+
 			return buffer;
 		}
 	}
 
+	if (vips__profile_summary)
+		vips__profile_buffer(im, FALSE);
+
 	return NULL;
 }
 
@@ -674,8 +963,10 @@ buffer_thread_destroy_notify(gpointer data)
 void
 vips__buffer_init(void)
 {
-	if (buffer_cache_max_reserve < 1)
-		printf("vips__buffer_init: buffer reserve disabled\n");
+	const char *str;
+
+	if ((str = g_getenv("VIPS_BUFFER_POOL_MAX")))
+		vips_buffer_pool_max_mem = vips__parse_size(str);
 
 #ifdef DEBUG
 	printf("vips__buffer_init: DEBUG enabled\n");
@@ -696,3 +987,95 @@ vips__buffer_shutdown(void)
 		g_private_set(&buffer_thread_key, NULL);
 	}
 }
+
+/* Free the global pools. Run on vips_shutdown(), after the workers have gone.
+ */
+void
+vips__buffer_pool_shutdown(void)
+{
+	pool_trim_all(0);
+}
+
+/**
+ * vips_buffer_pool_set_max_mem:
+ * @max_mem: maximum number of bytes of pixel memory to keep for reuse
+ *
+ * libvips keeps a pool of free pixel buffers so that it can reuse them
+ * rather than freeing and allocating memory as images are processed. Pooled
+ * memory is shared between images and threads.
+ *
+ * This sets the most memory the pool will hold. Set 0 to disable the pool.
+ * The default is 32mb, or the value of the `VIPS_BUFFER_POOL_MAX`
+ * environment variable.
+ *
+ * Pooled memory is not included in [func@tracked_get_mem]. In NUMA mode,
+ * each node has its own pool, see [func@concurrency_set_numa].
+ *
+ * ::: seealso
+ *     [func@buffer_pool_get_stats].
+ */
+void
+vips_buffer_pool_set_max_mem(size_t max_mem)
+{
+	vips_buffer_pool_max_mem = max_mem;
+
+	pool_trim_all(max_mem);
+}
+
+/**
+ * vips_buffer_pool_get_max_mem:
+ *
+ * Get the most memory the buffer pool will hold.
+ *
+ * ::: seealso
+ *     [func@buffer_pool_set_max_mem].
+ *
+ * Returns: the maximum size of the pool in bytes
+ */
+size_t
+vips_buffer_pool_get_max_mem(void)
+{
+	return vips_buffer_pool_max_mem;
+}
+
+/**
+ * vips_buffer_pool_get_stats:
+ * @hits: (out) (optional): return the number of allocs served by the pool
+ * @misses: (out) (optional): return the number of allocs which missed
+ * @cached: (out) (optional): return the number of bytes in the pool
+ *
+ * Get statistics for the buffer pool. The hit rate is
+ * @hits / (@hits + @misses). Buffers which are too small or too large to
+ * pool are not counted.
+ *
+ * Workers add their counts when they touch the global pool, so recent
+ * activity may not be included yet.
+ *
+ * ::: seealso
+ *     [func@buffer_pool_set_max_mem].
+ */
+void
+vips_buffer_pool_get_stats(guint64 *hits, guint64 *misses, size_t *cached)
+{
+	if (hits)
+		*hits = 0;
+	if (misses)
+		*misses = 0;
+
+	for (int i = 0; i < POOL_N_NODES; i++) {
+		Pool *pool = &vips_buffer_pool[i];
+
+		g_mutex_lock(&pool->lock);
+
+		if (hits)
+			*hits += pool->hits;
+		if (misses)
+			*misses += pool->misses;
+
+		g_mutex_unlock(&pool->lock);
+	}
+
+	if (cached)
+		*cached = (size_t) g_atomic_int_get(&vips_buffer_pool_cached_kb) *
+			1024;
+}
@@ -6,6 +6,12 @@
  * 	- add a lock so we can run operations from many threads
  * 28/11/19 [MaxKellermann]
  * 	- make invalidate advisory rather than immediate
+ * 18/10/26
+ * 	- split into shards, each with a lock, so many threads can use the
+ * 	  cache at once
+ * 	- drop entries from a single shard with a CLOCK sweep
+ * 	- add vips_cache_set_policy() and GreedyDual-Size eviction
+ * 	- add vips_cache_get_stats()
  */
 
 /*
@@ -93,36 +99,113 @@ static int vips_cache_max_files = 100;
  */
 static size_t vips_cache_max_mem = 100 * 1024 * 1024;
 
-/* Hold a ref to all "recent" operations.
+/* How we pick operations to drop.
  */
-static GHashTable *vips_cache_table = NULL;
+static VipsCachePolicy vips_cache_policy = VIPS_CACHE_POLICY_LRU;
+
+/* Set for VIPS_CACHE_POLICY_COST, so region.c knows to time generate.
+ */
+gboolean vips__cache_cost = FALSE;
+
+/* The cache is split into this many shards, each with its own lock and
+ * table, so lookups from many threads don't all queue on a single lock.
+ */
+#define VIPS_CACHE_N_SHARDS (16)
+
+/* A shard of the operation cache.
+ */
+typedef struct _VipsCacheShard {
+	/* Protect shard access with this.
+	 */
+	GMutex lock;
+
+	/* Hold a ref to all "recent" operations in this shard.
+	 */
+	GHashTable *table;
+
+	/* The same entries, in the order the clock hand visits them.
+	 */
+	GQueue clock;
+
+	/* The GreedyDual-Size inflation value for VIPS_CACHE_POLICY_COST: the
+	 * priority of the last entry we dropped.
+	 */
+	double inflation;
+
+	/* Stats for this shard, summed by vips_cache_get_stats().
+	 */
+	guint64 hits;
+	guint64 misses;
+	guint64 bytes_saved;
+} VipsCacheShard;
+
+static VipsCacheShard vips_cache_shards[VIPS_CACHE_N_SHARDS];
+
+/* The number of operations in all shards.
+ */
+static int vips_cache_size = 0;
 
 /* A 'time' counter: increment on all cache ops. Use this to detect LRU.
  */
 static int vips_cache_time = 0;
 
-/* Protect cache access with this.
+/* The part of a cache entry we share with the images it makes. Operations in
+ * other shards touch this via those images, so it's refcounted and updated
+ * with atomic ops, except for generate_time, which is under the lock of the
+ * shard the entry was made in.
  */
-static GMutex vips_cache_lock;
+typedef struct _VipsCacheStamp {
+	int ref_count;
+
+	/* When we last used this operation .. used to find LRU for flush.
+	 */
+	int time;
+
+	/* Microseconds spent generating pixels for the images this operation
+	 * made, with VIPS_CACHE_POLICY_COST. Shards are never freed, so the
+	 * stamp can keep a pointer to the shard whose lock guards this, even
+	 * after the entry has gone.
+	 */
+	VipsCacheShard *shard;
+	gint64 generate_time;
+
+	/* Set if someone thinks this cache entry should be dropped.
+	 */
+	gboolean invalid;
+} VipsCacheStamp;
 
 /* A cache entry.
  */
 typedef struct _VipsOperationCacheEntry {
 	VipsOperation *operation;
 
-	/* When we added this operation to cache .. used to find LRU for
-	 * flush.
+	/* Our ref to the shared part of the entry.
 	 */
-	int time;
+	VipsCacheStamp *stamp;
+
+	/* How long _build() took in microseconds, how much memory its output
+	 * images hold, and how many times we've reused it.
+	 */
+	gint64 build_time;
+	size_t mem;
+	int hits;
 
 	/* We listen for "invalidate" from the operation. Track the id here so
 	 * we can disconnect when we drop an operation.
 	 */
 	gulong invalidate_id;
 
-	/* Set if someone thinks this cache entry should be dropped.
+	/* The shard we are in, our link in its clock, and the stamp time when
+	 * the clock hand last passed us.
 	 */
-	gboolean invalid;
+	VipsCacheShard *shard;
+	GList link;
+	int checked;
+
+	/* Our GreedyDual-Size priority, updated when the clock hand sees
+	 * we've been used.
+	 */
+	double priority;
 
 } VipsOperationCacheEntry;
 
@@ -595,9 +678,9 @@ vips_object_unref_arg(VipsObject *object,
 			g_param_spec_get_name(pspec), &value, NULL);
 
 		/* This operation is probably going, so we must wipe the cache
-		 * entry pointer on the object.
+		 * stamp on the object.
 		 */
-		g_object_set_data(value, "libvips-cache-entry", NULL);
+		g_object_set_data(value, "libvips-cache-stamp", NULL);
 
 		/* Drop the ref we just got, then drop the ref we make when we
 		 * added to the cache.
@@ -609,6 +692,54 @@ vips_object_unref_arg(VipsObject *object,
 	return NULL;
 }
 
+static VipsCacheStamp *
+vips_cache_stamp_new(VipsCacheShard *shard)
+{
+	VipsCacheStamp *stamp = g_new(VipsCacheStamp, 1);
+
+	stamp->ref_count = 1;
+	stamp->time = 0;
+	stamp->shard = shard;
+	stamp->generate_time = 0;
+	stamp->invalid = FALSE;
+
+	return stamp;
+}
+
+static VipsCacheStamp *
+vips_cache_stamp_ref(VipsCacheStamp *stamp)
+{
+	g_atomic_int_inc(&stamp->ref_count);
+
+	return stamp;
+}
+
+static void
+vips_cache_stamp_unref(VipsCacheStamp *stamp)
+{
+	if (g_atomic_int_dec_and_test(&stamp->ref_count))
+		g_free(stamp);
+}
+
+/* A GDuplicateFunc for g_object_dup_data().
+ */
+static void *
+vips_cache_stamp_dup(void *data, void *user_data)
+{
+	return data ? vips_cache_stamp_ref((VipsCacheStamp *) data) : NULL;
+}
+
+/* Pick the shard an operation lives in. The bottom bit of the hash is
+ * always set, so mix the bits first.
+ */
+static VipsCacheShard *
+vips_cache_shard(VipsOperation *operation)
+{
+	guint hash = vips_operation_hash(operation) * 2654435761U;
+
+	return &vips_cache_shards[(hash >> 16) % VIPS_CACHE_N_SHARDS];
+}
+
 static void
 vips_cache_free_cb(VipsOperationCacheEntry *entry)
 {
@@ -622,21 +753,27 @@ vips_cache_free_cb(VipsOperationCacheEntry *entry)
 		entry->invalidate_id = 0;
 	}
 
+	g_queue_unlink(&entry->shard->clock, &entry->link);
+
 	(void) vips_argument_map(VIPS_OBJECT(entry->operation),
 		vips_object_unref_arg, NULL, NULL);
 	g_object_unref(entry->operation);
 
+	vips_cache_stamp_unref(entry->stamp);
 	g_free(entry);
+
+	g_atomic_int_add(&vips_cache_size, -1);
 }
 
 void *
 vips__cache_once_init(void *data)
 {
-	vips_cache_table = g_hash_table_new_full(
-		(GHashFunc) vips_operation_hash,
-		(GEqualFunc) vips_operation_equal,
-		NULL,
-		(GDestroyNotify) vips_cache_free_cb);
+	for (int i = 0; i < VIPS_CACHE_N_SHARDS; i++)
+		vips_cache_shards[i].table = g_hash_table_new_full(
+			(GHashFunc) vips_operation_hash,
+			(GEqualFunc) vips_operation_equal,
+			NULL,
+			(GDestroyNotify) vips_cache_free_cb);
 
 	return NULL;
 }
@@ -665,13 +802,11 @@ vips_cache_print_fn(void *value, void *a, void *b)
 }
 
 static void
-vips_cache_print_nolock(void)
+vips_cache_print_nolock(VipsCacheShard *shard)
 {
-	if (vips_cache_table) {
-		printf("Operation cache:\n");
-		vips_hash_table_map(vips_cache_table,
+	if (shard->table)
+		vips_hash_table_map(shard->table,
 			vips_cache_print_fn, NULL, NULL);
-	}
 }
 
 /**
@@ -682,25 +817,44 @@ vips_cache_print_nolock(void)
 void
 vips_cache_print(void)
 {
-	g_mutex_lock(&vips_cache_lock);
+	guint64 hits;
+	guint64 misses;
+	guint64 bytes_saved;
 
-	vips_cache_print_nolock();
+	vips_cache_get_stats(&hits, &misses, &bytes_saved);
+	printf("Operation cache: %d operations, "
+		   "%" G_GUINT64_FORMAT " hits, "
+		   "%" G_GUINT64_FORMAT " misses, "
+		   "%" G_GUINT64_FORMAT " bytes saved\n",
+		vips_cache_get_size(), hits, misses, bytes_saved);
 
-	g_mutex_unlock(&vips_cache_lock);
+	for (int i = 0; i < VIPS_CACHE_N_SHARDS; i++) {
+		VipsCacheShard *shard = &vips_cache_shards[i];
+
+		g_mutex_lock(&shard->lock);
+
+		vips_cache_print_nolock(shard);
+
+		g_mutex_unlock(&shard->lock);
+	}
 }
 
+/* Call with the shard lock held.
+ */
 static VipsOperationCacheEntry *
-vips_cache_operation_get(VipsOperation *operation)
+vips_cache_operation_get(VipsCacheShard *shard, VipsOperation *operation)
 {
-	return g_hash_table_lookup(vips_cache_table, operation);
+	return shard->table
+		? g_hash_table_lookup(shard->table, operation)
+		: NULL;
 }
 
-/* Remove an operation from the cache.
+/* Remove an operation from the cache. Call with the shard lock held.
  */
 static void
-vips_cache_remove(VipsOperation *operation)
+vips_cache_remove(VipsCacheShard *shard, VipsOperation *operation)
 {
-	g_hash_table_remove(vips_cache_table, operation);
+	g_hash_table_remove(shard->table, operation);
 }
 
 static void *
@@ -725,30 +879,69 @@ vips_object_ref_arg(VipsObject *object,
 
 		/* This object has been made by this cache entry.
 		 */
-		g_object_set_data(value, "libvips-cache-entry", entry);
+		g_object_set_data_full(value, "libvips-cache-stamp",
+			vips_cache_stamp_ref(entry->stamp),
+			(GDestroyNotify) vips_cache_stamp_unref);
 	}
 
 	return NULL;
 }
 
 static void
-vips_entry_touch(VipsOperationCacheEntry *entry)
+vips_stamp_touch(VipsCacheStamp *stamp)
 {
 	/* Don't up the time for invalid items -- we want them to fall out of
 	 * cache.
 	 */
-	if (!entry->invalid)
-		entry->time = vips_cache_time;
+	if (!g_atomic_int_get(&stamp->invalid))
+		g_atomic_int_set(&stamp->time,
+			g_atomic_int_get(&vips_cache_time));
+}
+
+/* The GreedyDual-Size credit an entry earns: the time it would take to
+ * remake, per MB it holds, times the number of times it's been used.
+ *
+ * Call with the shard lock held.
+ */
+static double
+vips_entry_credit(VipsOperationCacheEntry *entry)
+{
+	double mb = 1.0 + (double) entry->mem / (1024 * 1024);
+	double cost = entry->build_time + entry->stamp->generate_time;
+
+	return (1 + entry->hits) * cost / mb;
+}
+
+/* Record time spent generating pixels for an image. Called from
+ * vips_region_generate() with VIPS_CACHE_POLICY_COST.
+ */
+void
+vips__cache_generate_time(VipsImage *image, gint64 time)
+{
+	VipsCacheStamp *stamp;
+
+	if ((stamp = g_object_dup_data(G_OBJECT(image), "libvips-cache-stamp",
+			 vips_cache_stamp_dup, NULL))) {
+		g_mutex_lock(&stamp->shard->lock);
+		stamp->generate_time += time;
+		g_mutex_unlock(&stamp->shard->lock);
+		vips_cache_stamp_unref(stamp);
+	}
 }
 
 static void *
 vips_image_touch_cb(VipsImage *image, void *a, void *b)
 {
-	VipsOperationCacheEntry *entry =
-		g_object_get_data(G_OBJECT(image), "libvips-cache-entry");
+	VipsCacheStamp *stamp;
 
-	if (entry)
-		vips_entry_touch(entry);
+	/* The entry that made this image can be in any shard and can be
+	 * dropped at any moment, so hold a ref to the stamp while we touch it.
+	 */
+	if ((stamp = g_object_dup_data(G_OBJECT(image), "libvips-cache-stamp",
+			 vips_cache_stamp_dup, NULL))) {
+		vips_stamp_touch(stamp);
+		vips_cache_stamp_unref(stamp);
+	}
 
 	return NULL;
 }
@@ -778,6 +971,65 @@ vips_object_touch_arg(VipsObject *object,
 	return NULL;
 }
 
+/* Sum the memory held by output images with pixels in memory.
+ */
+static void *
+vips_object_mem_arg(VipsObject *object,
+	GParamSpec *pspec,
+	VipsArgumentClass *argument_class,
+	VipsArgumentInstance *argument_instance,
+	void *a, void *b)
+{
+	size_t *mem = (size_t *) a;
+
+	if ((argument_class->flags & VIPS_ARGUMENT_OUTPUT) &&
+		argument_instance->assigned &&
+		g_type_is_a(G_PARAM_SPEC_VALUE_TYPE(pspec), VIPS_TYPE_IMAGE)) {
+		VipsImage *image;
+
+		g_object_get(G_OBJECT(object),
+			g_param_spec_get_name(pspec), &image, NULL);
+
+		if (image &&
+			(image->dtype == VIPS_IMAGE_SETBUF ||
+				image->dtype == VIPS_IMAGE_SETBUF_FOREIGN ||
+				image->dtype == VIPS_IMAGE_MMAPIN ||
+				image->dtype == VIPS_IMAGE_MMAPINRW))
+			*mem += VIPS_IMAGE_SIZEOF_IMAGE(image);
+
+		VIPS_UNREF(image);
+	}
+
+	return NULL;
+}
+
+/* Tag output images with the operation nickname for the profile summary.
+ */
+static void *
+vips_object_tag_arg(VipsObject *object,
+	GParamSpec *pspec,
+	VipsArgumentClass *argument_class,
+	VipsArgumentInstance *argument_instance,
+	void *a, void *b)
+{
+	if ((argument_class->flags & VIPS_ARGUMENT_OUTPUT) &&
+		argument_instance->assigned &&
+		g_type_is_a(G_PARAM_SPEC_VALUE_TYPE(pspec), VIPS_TYPE_IMAGE)) {
+		VipsImage *image;
+
+		g_object_get(G_OBJECT(object),
+			g_param_spec_get_name(pspec), &image, NULL);
+
+		if (image)
+			vips__profile_tag(image,
+				VIPS_OBJECT_GET_CLASS(object)->nickname);
+
+		VIPS_UNREF(image);
+	}
+
+	return NULL;
+}
+
 /* Ref an operation for the cache. The operation itself, plus all the output
  * objects it makes.
  */
@@ -793,7 +1045,7 @@ vips_entry_ref(VipsOperationCacheEntry *entry)
 	(void) vips_argument_map(VIPS_OBJECT(entry->operation),
 		vips_object_ref_arg, entry, NULL);
 
-	vips_cache_time += 1;
+	g_atomic_int_inc(&vips_cache_time);
 
 	/* Touch the cache entries on the upstream trees on all input images.
 	 */
@@ -802,7 +1054,7 @@ vips_entry_ref(VipsOperationCacheEntry *entry)
 
 	/* And this entry.
 	 */
-	vips_entry_touch(entry);
+	vips_stamp_touch(entry->stamp);
 }
 
 static void
@@ -814,11 +1066,14 @@ vips_cache_invalidate_cb(VipsOperation *operation,
 	vips_object_print_summary(VIPS_OBJECT(operation));
 #endif /*DEBUG*/
 
-	entry->invalid = TRUE;
+	g_atomic_int_set(&entry->stamp->invalid, TRUE);
 }
 
+/* Call with the shard lock held.
+ */
 static void
-vips_cache_insert(VipsOperation *operation)
+vips_cache_insert(VipsCacheShard *shard, VipsOperation *operation,
+	gint64 build_time, size_t mem)
 {
 	VipsOperationCacheEntry *entry = g_new(VipsOperationCacheEntry, 1);
 
@@ -828,11 +1083,25 @@ vips_cache_insert(VipsOperation *operation)
 #endif /*VIPS_DEBUG*/
 
 	entry->operation = operation;
-	entry->time = 0;
+	entry->stamp = vips_cache_stamp_new(shard);
+	entry->build_time = build_time;
+	entry->mem = mem;
+	entry->hits = 0;
 	entry->invalidate_id = 0;
-	entry->invalid = FALSE;
+	entry->shard = shard;
+	entry->link.data = entry;
+	entry->link.prev = NULL;
+	entry->link.next = NULL;
+
+	/* New entries get a second chance, as if they had been used since the
+	 * hand last passed.
+	 */
+	entry->checked = -1;
+	entry->priority = shard->inflation;
 
-	g_hash_table_insert(vips_cache_table, operation, entry);
+	g_hash_table_insert(shard->table, operation, entry);
+	g_queue_push_tail_link(&shard->clock, &entry->link);
+	g_atomic_int_inc(&vips_cache_size);
 	vips_entry_ref(entry);
 
 	/* If the operation signals "invalidate", we must tag this cache entry
@@ -855,70 +1124,195 @@ vips_cache_drop_all(void)
 	printf("vips_cache_drop_all:\n");
 #endif /*VIPS_DEBUG*/
 
-	g_mutex_lock(&vips_cache_lock);
+	if (vips__cache_dump)
+		printf("Operation cache:\n");
 
-	if (vips_cache_table) {
-		if (vips__cache_dump)
-			vips_cache_print_nolock();
+	for (int i = 0; i < VIPS_CACHE_N_SHARDS; i++) {
+		VipsCacheShard *shard = &vips_cache_shards[i];
 
-		g_hash_table_remove_all(vips_cache_table);
-		VIPS_FREEF(g_hash_table_unref, vips_cache_table);
-	}
+		g_mutex_lock(&shard->lock);
+
+		if (shard->table) {
+			if (vips__cache_dump)
+				vips_cache_print_nolock(shard);
 
-	g_mutex_unlock(&vips_cache_lock);
+			g_hash_table_remove_all(shard->table);
+			VIPS_FREEF(g_hash_table_unref, shard->table);
+		}
+
+		g_mutex_unlock(&shard->lock);
+	}
 }
 
-static void
-vips_cache_get_lru_cb(VipsOperation *key, VipsOperationCacheEntry *value,
-	VipsOperationCacheEntry **best)
+/* Pick an entry to drop from a shard with a CLOCK sweep. The hand gives
+ * entries which have been used since it last passed a second chance by
+ * moving them to the back, and stops at the first entry which has not.
+ * Call with the shard lock held.
+ */
+static VipsOperationCacheEntry *
+vips_cache_shard_victim_lru(VipsCacheShard *shard)
 {
-	if (!*best ||
-		(*best)->time > value->time)
-		*best = value;
+	guint n = shard->clock.length;
+
+	for (guint i = 0; i < n; i++) {
+		GList *link = shard->clock.head;
+		VipsOperationCacheEntry *entry =
+			(VipsOperationCacheEntry *) link->data;
+		int time = g_atomic_int_get(&entry->stamp->time);
+
+		if (g_atomic_int_get(&entry->stamp->invalid) ||
+			time == entry->checked)
+			return entry;
+
+		entry->checked = time;
+		g_queue_unlink(&shard->clock, link);
+		g_queue_push_tail_link(&shard->clock, link);
+	}
+
+	/* Everything had been used, so we're back at the start.
+	 */
+	return shard->clock.head
+		? (VipsOperationCacheEntry *) shard->clock.head->data
+		: NULL;
 }
 
-/* Get the least-recently-used cache item.
+/* GreedyDual-Size: each entry has a priority H, set to L + credit each
+ * time it's used, where L is the shard's inflation value. We drop the entry
+ * with the lowest H and raise L to that H, so entries which aren't used
+ * age relative to ones that are, and costly entries take longer to age.
+ *
+ * Entries are touched without the shard lock, so we only see uses here, when
+ * we find the stamp time has changed. An entry with H no greater than L
+ * can't be beaten, so we stop at the first one.
  *
- * TODO ... will this be too expensive? probably not
+ * Call with the shard lock held.
  */
-static VipsOperation *
-vips_cache_get_lru(void)
+static VipsOperationCacheEntry *
+vips_cache_shard_victim_cost(VipsCacheShard *shard)
 {
-	VipsOperationCacheEntry *entry;
+	VipsOperationCacheEntry *best;
 
-	entry = NULL;
-	g_hash_table_foreach(vips_cache_table,
-		(GHFunc) vips_cache_get_lru_cb, &entry);
+	best = NULL;
+	for (GList *p = shard->clock.head; p; p = p->next) {
+		VipsOperationCacheEntry *entry = (VipsOperationCacheEntry *) p->data;
+		int time = g_atomic_int_get(&entry->stamp->time);
 
-	if (entry)
-		return entry->operation;
+		if (g_atomic_int_get(&entry->stamp->invalid))
+			return entry;
 
-	return NULL;
+		if (time != entry->checked) {
+			entry->checked = time;
+			entry->priority = shard->inflation + vips_entry_credit(entry);
+		}
+
+		if (!best ||
+			entry->priority < best->priority)
+			best = entry;
+
+		if (best->priority <= shard->inflation)
+			break;
+	}
+
+	if (best)
+		shard->inflation = VIPS_MAX(shard->inflation, best->priority);
+
+	return best;
 }
 
-/* Is the cache full? Drop until it's not.
+static VipsOperationCacheEntry *
+vips_cache_shard_victim(VipsCacheShard *shard)
+{
+	if (vips_cache_policy == VIPS_CACHE_POLICY_COST)
+		return vips_cache_shard_victim_cost(shard);
+	else
+		return vips_cache_shard_victim_lru(shard);
+}
+
+/* Drop one entry from a shard. FALSE if the shard is empty. Call with the
+ * shard lock held.
  */
-static void
-vips_cache_trim(void)
+static gboolean
+vips_cache_evict(VipsCacheShard *shard)
 {
-	VipsOperation *operation;
+	VipsOperationCacheEntry *entry;
 
-	g_mutex_lock(&vips_cache_lock);
+	if (!(entry = vips_cache_shard_victim(shard)))
+		return FALSE;
 
-	while (vips_cache_table &&
-		(g_hash_table_size(vips_cache_table) > vips_cache_max ||
-			vips_tracked_get_files() > vips_cache_max_files ||
-			vips_tracked_get_mem() > vips_cache_max_mem) &&
-		(operation = vips_cache_get_lru())) {
 #ifdef DEBUG
-		printf("vips_cache_trim: trimming ");
-		vips_object_print_summary(VIPS_OBJECT(operation));
+	printf("vips_cache_evict: trimming ");
+	vips_object_print_summary(VIPS_OBJECT(entry->operation));
 #endif /*DEBUG*/
 
-		vips_cache_remove(operation);
-	}
+	vips_cache_remove(shard, entry->operation);
+
+	return TRUE;
+}
+
+/* Over the memory or files limit.
+ */
+static gboolean
+vips_cache_is_over_resources(void)
+{
+	return vips_tracked_get_files() > vips_cache_max_files ||
+		vips_tracked_get_mem() > vips_cache_max_mem;
+}
+
+static gboolean
+vips_cache_is_full(void)
+{
+	return g_atomic_int_get(&vips_cache_size) > vips_cache_max ||
+		vips_cache_is_over_resources();
+}
+
+/* Drop from all shards until the cache is no longer full. We take one
+ * entry from each shard in turn and never hold more than one shard lock.
+ */
+static void
+vips_cache_trim_all(void)
+{
+	gboolean dropped;
+
+	do {
+		dropped = FALSE;
 
-	g_mutex_unlock(&vips_cache_lock);
+		for (int i = 0; i < VIPS_CACHE_N_SHARDS; i++) {
+			VipsCacheShard *shard = &vips_cache_shards[i];
+
+			if (!vips_cache_is_full())
+				return;
+
+			g_mutex_lock(&shard->lock);
+			if (vips_cache_evict(shard))
+				dropped = TRUE;
+			g_mutex_unlock(&shard->lock);
+		}
+	} while (dropped);
+}
+
+/* Is the cache full? Drop from the shard we've just used until it's not.
+ *
+ * Operations hash evenly over shards, so this keeps the count close to the
+ * limit without looking at other shards, and a miss on a full cache only
+ * takes one lock and moves the clock hand a few steps. We can drop the
+ * entry we've just added, for example with a max of 0, the caller holds its
+ * own ref.
+ *
+ * Emptying this shard might not be enough to get under the limits, for
+ * example if max is less than the number of shards, so then we go on to
+ * the other shards.
+ */
+static void
+vips_cache_trim(VipsCacheShard *shard)
+{
+	g_mutex_lock(&shard->lock);
+	while (vips_cache_is_full() &&
+		vips_cache_evict(shard))
+		;
+	g_mutex_unlock(&shard->lock);
+
+	if (vips_cache_is_full())
+		vips_cache_trim_all();
 }
 
 #ifdef DEBUG_LEAK
@@ -993,6 +1387,7 @@ vips_cache_operation_buildp(VipsOperation **operation)
 	 */
 	VipsOperationFlags flags = vips_operation_get_flags(*operation);
 
+	VipsCacheShard *shard;
 	VipsOperationCacheEntry *hit;
 
 	g_assert(VIPS_IS_OPERATION(*operation));
@@ -1004,19 +1399,21 @@ vips_cache_operation_buildp(VipsOperation **operation)
 	vips_object_print_dump(VIPS_OBJECT(*operation));
 #endif /*VIPS_DEBUG*/
 
-	g_mutex_lock(&vips_cache_lock);
+	shard = vips_cache_shard(*operation);
+
+	g_mutex_lock(&shard->lock);
 
-	hit = vips_cache_operation_get(*operation);
+	hit = vips_cache_operation_get(shard, *operation);
 
 	/* We need to remove the existing cache entry if it's been tagged
 	 * as invalid, if it's been blocked, or someone has requested
 	 * revalidation.
 	 */
 	if (hit) {
-		if (hit->invalid ||
+		if (g_atomic_int_get(&hit->stamp->invalid) ||
 			(flags & VIPS_OPERATION_BLOCKED) ||
 			(flags & VIPS_OPERATION_REVALIDATE)) {
-			vips_cache_remove(hit->operation);
+			vips_cache_remove(shard, hit->operation);
 			hit = NULL;
 		}
 	}
@@ -1025,6 +1422,10 @@ vips_cache_operation_buildp(VipsOperation **operation)
 	 * passed.
 	 */
 	if (hit) {
+		hit->hits += 1;
+		shard->hits += 1;
+		shard->bytes_saved += hit->mem;
+
 		vips_entry_ref(hit);
 		g_object_unref(*operation);
 		*operation = hit->operation;
@@ -1035,12 +1436,16 @@ vips_cache_operation_buildp(VipsOperation **operation)
 		}
 	}
 
-	g_mutex_unlock(&vips_cache_lock);
+	g_mutex_unlock(&shard->lock);
 
 	/* If there was a miss, we need to build this operation and add
 	 * it to the cache, if appropriate.
 	 */
 	if (!hit) {
+		gint64 build_start;
+		gint64 build_time;
+		size_t mem;
+
 #ifdef DEBUG_LEAK
 		unsigned int hash_before = 0;
 		VipsOperation *operation_before = NULL;
@@ -1059,9 +1464,25 @@ vips_cache_operation_buildp(VipsOperation **operation)
 		}
 #endif /*DEBUG_LEAK*/
 
+		/* Record the cost of building this operation, for
+		 * VIPS_CACHE_POLICY_COST. Most builds are lazy, so the time
+		 * spent generating pixels is added later, see
+		 * vips__cache_generate_time().
+		 */
+		build_start = g_get_monotonic_time();
+
 		if (vips_object_build(VIPS_OBJECT(*operation)))
 			return -1;
 
+		build_time = g_get_monotonic_time() - build_start;
+
+		if (vips__profile_summary)
+			(void) vips_argument_map(VIPS_OBJECT(*operation),
+				vips_object_tag_arg, NULL, NULL);
+		mem = 0;
+		(void) vips_argument_map(VIPS_OBJECT(*operation),
+			vips_object_mem_arg, &mem, NULL);
+
 #ifdef DEBUG_LEAK
 		if (vips__leak &&
 			!(flags & VIPS_OPERATION_NOCACHE) &&
@@ -1084,13 +1505,22 @@ vips_cache_operation_buildp(VipsOperation **operation)
 		 */
 		flags = vips_operation_get_flags(*operation);
 
-		g_mutex_lock(&vips_cache_lock);
+		/* _build() must not change the hash, but get the shard again
+		 * to be safe.
+		 */
+		shard = vips_cache_shard(*operation);
+
+		g_mutex_lock(&shard->lock);
+
+		if (!(flags & VIPS_OPERATION_NOCACHE))
+			shard->misses += 1;
 
 		/* If two threads build the same operation at the same time,
 		 * we can get multiple adds. Let the first one win. See
 		 * https://github.com/libvips/libvips/pull/181
 		 */
-		if (!vips_cache_operation_get(*operation)) {
+		if (shard->table &&
+			!vips_cache_operation_get(shard, *operation)) {
 			/* Has to be after _build() so we can see output args.
 			 */
 			if (vips__cache_trace) {
@@ -1102,13 +1532,14 @@ vips_cache_operation_buildp(VipsOperation **operation)
 			}
 
 			if (!(flags & VIPS_OPERATION_NOCACHE))
-				vips_cache_insert(*operation);
+				vips_cache_insert(shard, *operation,
+					build_time, mem);
 		}
 
-		g_mutex_unlock(&vips_cache_lock);
+		g_mutex_unlock(&shard->lock);
 	}
 
-	vips_cache_trim();
+	vips_cache_trim(shard);
 
 	return 0;
 }
@@ -1153,7 +1584,7 @@ void
 vips_cache_set_max(int max)
 {
 	vips_cache_max = max;
-	vips_cache_trim();
+	vips_cache_trim_all();
 }
 
 /**
@@ -1174,7 +1605,7 @@ void
 vips_cache_set_max_mem(size_t max_mem)
 {
 	vips_cache_max_mem = max_mem;
-	vips_cache_trim();
+	vips_cache_trim_all();
 }
 
 /**
@@ -1200,17 +1631,94 @@ vips_cache_get_max(void)
 int
 vips_cache_get_size(void)
 {
-	guint size;
+	return g_atomic_int_get(&vips_cache_size);
+}
 
-	g_mutex_lock(&vips_cache_lock);
+/**
+ * vips_cache_set_policy:
+ * @policy: how to pick operations to drop
+ *
+ * Set how the operation cache picks operations to drop when it's full.
+ *
+ * With [enum@Vips.CachePolicy.LRU], the default, the least-recently-used
+ * operation is dropped first.
+ *
+ * With [enum@Vips.CachePolicy.COST], the cache uses GreedyDual-Size. Each
+ * operation is given a priority when it's used: the time it took to build
+ * and to generate pixels, per MB of memory its output images hold, times the
+ * number of times it has been reused, plus an inflation value. The operation
+ * with the lowest priority is dropped first, and the inflation value rises
+ * to that priority, so operations which are no longer used slowly age out.
+ * Operations which are slow to make but small, like a blur of a small image,
+ * stay in cache longer than cheap operations which hold a lot of memory.
+ *
+ * Timing pixel generation adds a little overhead, so it's only done with
+ * [enum@Vips.CachePolicy.COST].
+ *
+ * ::: seealso
+ *     [func@cache_get_stats].
+ */
+void
+vips_cache_set_policy(VipsCachePolicy policy)
+{
+	vips_cache_policy = policy;
+	vips__cache_cost = policy == VIPS_CACHE_POLICY_COST;
+	vips_cache_trim_all();
+}
+
+/**
+ * vips_cache_get_policy:
+ *
+ * Get how the operation cache picks operations to drop.
+ *
+ * Returns: the current cache policy
+ */
+VipsCachePolicy
+vips_cache_get_policy(void)
+{
+	return vips_cache_policy;
+}
+
+/**
+ * vips_cache_get_stats:
+ * @hits: (out) (optional): return the number of cache hits here
+ * @misses: (out) (optional): return the number of cache misses here
+ * @bytes_saved: (out) (optional): return the number of bytes saved here
+ *
+ * Get statistics for the operation cache since startup. The hit rate is
+ * @hits / (@hits + @misses).
+ *
+ * @bytes_saved is the total tracked memory that cache hits would otherwise
+ * have allocated again.
+ */
+void
+vips_cache_get_stats(guint64 *hits, guint64 *misses, guint64 *bytes_saved)
+{
+	guint64 total_hits;
+	guint64 total_misses;
+	guint64 total_bytes_saved;
 
-	size = 0;
-	if (vips_cache_table)
-		size = g_hash_table_size(vips_cache_table);
+	total_hits = 0;
+	total_misses = 0;
+	total_bytes_saved = 0;
+	for (int i = 0; i < VIPS_CACHE_N_SHARDS; i++) {
+		VipsCacheShard *shard = &vips_cache_shards[i];
 
-	g_mutex_unlock(&vips_cache_lock);
+		g_mutex_lock(&shard->lock);
+
+		total_hits += shard->hits;
+		total_misses += shard->misses;
+		total_bytes_saved += shard->bytes_saved;
+
+		g_mutex_unlock(&shard->lock);
+	}
 
-	return size;
+	if (hits)
+		*hits = total_hits;
+	if (misses)
+		*misses = total_misses;
+	if (bytes_saved)
+		*bytes_saved = total_bytes_saved;
 }
 
 /**
@@ -1265,7 +1773,7 @@ void
 vips_cache_set_max_files(int max_files)
 {
 	vips_cache_max_files = max_files;
-	vips_cache_trim();
+	vips_cache_trim_all();
 }
 
 /**
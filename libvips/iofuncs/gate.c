@@ -1,6 +1,9 @@
 /* gate.c -- thread profiling
  *
  * Written on: 18 nov 13
+ * 18/10/26
+ * 	- add vips_profile_get() and friends: a per-operation profile summary
+ * 	  you can query at runtime
  */
 
 /*
@@ -84,6 +87,42 @@ static GPrivate vips_thread_profile_key =
 
 static FILE *vips__thread_fp = NULL;
 
+/* Set to collect the per-operation profile summary.
+ */
+gboolean vips__profile_summary = FALSE;
+
+/* Output images are tagged with the nickname of the operation that made
+ * them with this.
+ */
+static GQuark vips_profile_quark = 0;
+
+/* Counters for the summary are collected per thread with no locks, then
+ * merged into the global set when the thread shuts down.
+ */
+typedef struct _VipsProfileThread {
+	/* Nickname -> VipsProfileEntry.
+	 */
+	GHashTable *entries;
+
+	/* The innermost generate on this thread.
+	 */
+	VipsProfileFrame *frame;
+
+	gint64 allocate_wait;
+	gint64 write_wait;
+} VipsProfileThread;
+
+static void profile_thread_destroy_notify(gpointer data);
+static GPrivate vips_profile_thread_key =
+	G_PRIVATE_INIT(profile_thread_destroy_notify);
+
+/* The merged summary.
+ */
+static GMutex vips_profile_lock;
+static GHashTable *vips_profile_entries = NULL;
+static gint64 vips_profile_allocate_wait = 0;
+static gint64 vips_profile_write_wait = 0;
+
 /**
  * vips_profile_set:
  * @profile: `TRUE` to enable profile recording
@@ -361,3 +400,373 @@ vips__thread_malloc_free(gint64 size)
 		gate->stop->time[gate->stop->i++] = size;
 	}
 }
+
+static VipsProfileEntry *
+vips_profile_entry_get(GHashTable *entries, const char *nickname)
+{
+	VipsProfileEntry *entry;
+
+	if (!(entry = g_hash_table_lookup(entries, nickname))) {
+		entry = g_new0(VipsProfileEntry, 1);
+		entry->nickname = nickname;
+		g_hash_table_insert(entries, (char *) nickname, entry);
+	}
+
+	return entry;
+}
+
+static GHashTable *
+vips_profile_entries_new(void)
+{
+	return g_hash_table_new_full(g_str_hash, g_str_equal,
+		NULL, (GDestroyNotify) g_free);
+}
+
+static void
+vips_profile_thread_free(VipsProfileThread *thread)
+{
+	VIPS_FREEF(g_hash_table_destroy, thread->entries);
+	VIPS_FREE(thread);
+}
+
+static void
+vips_profile_merge_cb(gpointer key, gpointer value, gpointer data)
+{
+	VipsProfileEntry *from = (VipsProfileEntry *) value;
+	VipsProfileEntry *to =
+		vips_profile_entry_get(vips_profile_entries, from->nickname);
+
+	to->calls += from->calls;
+	to->pixels += from->pixels;
+	to->time += from->time;
+	to->total_time += from->total_time;
+	to->buffer_hits += from->buffer_hits;
+	to->buffer_misses += from->buffer_misses;
+}
+
+/* Add a thread's counters to the global summary and zap them.
+ */
+static void
+vips_profile_thread_merge(VipsProfileThread *thread)
+{
+	g_mutex_lock(&vips_profile_lock);
+
+	if (!vips_profile_entries)
+		vips_profile_entries = vips_profile_entries_new();
+
+	g_hash_table_foreach(thread->entries, vips_profile_merge_cb, NULL);
+	g_hash_table_remove_all(thread->entries);
+	vips_profile_allocate_wait += thread->allocate_wait;
+	vips_profile_write_wait += thread->write_wait;
+	thread->allocate_wait = 0;
+	thread->write_wait = 0;
+
+	g_mutex_unlock(&vips_profile_lock);
+}
+
+static void
+profile_thread_destroy_notify(gpointer data)
+{
+	VipsProfileThread *thread = (VipsProfileThread *) data;
+
+	/* GPrivate has stopped working, be careful not to touch that.
+	 */
+	vips_profile_thread_merge(thread);
+	vips_profile_thread_free(thread);
+}
+
+static VipsProfileThread *
+vips_profile_thread_get(void)
+{
+	VipsProfileThread *thread;
+
+	if (!(thread = g_private_get(&vips_profile_thread_key))) {
+		thread = g_new0(VipsProfileThread, 1);
+		thread->entries = vips_profile_entries_new();
+		g_private_set(&vips_profile_thread_key, thread);
+	}
+
+	return thread;
+}
+
+/* Merge and free this thread's summary counters. Run from
+ * vips_thread_shutdown().
+ */
+void
+vips__profile_thread_detach(void)
+{
+	VipsProfileThread *thread;
+
+	if ((thread = g_private_get(&vips_profile_thread_key))) {
+		g_assert(!thread->frame);
+
+		vips_profile_thread_merge(thread);
+		vips_profile_thread_free(thread);
+		g_private_set(&vips_profile_thread_key, NULL);
+	}
+}
+
+/* Note the operation that made an image, so we can attribute its generate
+ * time.
+ */
+void
+vips__profile_tag(VipsImage *image, const char *nickname)
+{
+	if (!vips_profile_quark)
+		vips_profile_quark =
+			g_quark_from_static_string("libvips-profile-nickname");
+
+	if (!g_object_get_qdata(G_OBJECT(image), vips_profile_quark))
+		g_object_set_qdata(G_OBJECT(image), vips_profile_quark,
+			(gpointer) nickname);
+}
+
+/* Start timing a generate on an image. Generates nest, so we keep a stack of
+ * frames and subtract the time spent upstream.
+ */
+void
+vips__profile_generate_start(VipsProfileFrame *frame, VipsImage *image)
+{
+	frame->nickname = vips_profile_quark
+		? g_object_get_qdata(G_OBJECT(image), vips_profile_quark)
+		: NULL;
+
+	if (frame->nickname) {
+		VipsProfileThread *thread = vips_profile_thread_get();
+
+		frame->parent = thread->frame;
+		frame->start = g_get_monotonic_time();
+		frame->child_time = 0;
+		thread->frame = frame;
+	}
+}
+
+void
+vips__profile_generate_stop(VipsProfileFrame *frame, gint64 pixels)
+{
+	if (frame->nickname) {
+		VipsProfileThread *thread = vips_profile_thread_get();
+		gint64 time = g_get_monotonic_time() - frame->start;
+
+		VipsProfileEntry *entry;
+
+		g_assert(thread->frame == frame);
+
+		thread->frame = frame->parent;
+		if (frame->parent)
+			frame->parent->child_time += time;
+
+		entry = vips_profile_entry_get(thread->entries, frame->nickname);
+		entry->calls += 1;
+		entry->pixels += pixels;
+		entry->time += time - frame->child_time;
+		entry->total_time += time;
+	}
+}
+
+/* Record a hit or miss in the per-thread buffer cache for an image.
+ */
+void
+vips__profile_buffer(VipsImage *image, gboolean hit)
+{
+	const char *nickname = vips_profile_quark
+		? g_object_get_qdata(G_OBJECT(image), vips_profile_quark)
+		: NULL;
+
+	if (nickname) {
+		VipsProfileThread *thread = vips_profile_thread_get();
+		VipsProfileEntry *entry =
+			vips_profile_entry_get(thread->entries, nickname);
+
+		if (hit)
+			entry->buffer_hits += 1;
+		else
+			entry->buffer_misses += 1;
+	}
+}
+
+/* Microseconds a worker spent waiting for the threadpool allocate lock.
+ */
+void
+vips__profile_allocate_wait(gint64 time)
+{
+	vips_profile_thread_get()->allocate_wait += time;
+}
+
+/* Microseconds spent waiting for sink_disc write-behind to finish.
+ */
+void
+vips__profile_write_wait(gint64 time)
+{
+	vips_profile_thread_get()->write_wait += time;
+}
+
+/**
+ * vips_profile_summary_set:
+ * @summary: `TRUE` to collect a profile summary
+ *
+ * If set, vips will count the pixels each operation generates, the time it
+ * spends generating them, and other useful numbers. Fetch the summary with
+ * [func@profile_get], and it is printed on [func@shutdown].
+ *
+ * The overhead is low enough to leave on in production. Workers add their
+ * counts to the summary as they finish, so computations still in progress
+ * are not included.
+ *
+ * You can also enable this with `--vips-profile-summary` or the
+ * `VIPS_PROFILE_SUMMARY` environment variable.
+ *
+ * ::: seealso
+ *     [func@profile_get], [func@profile_set].
+ */
+void
+vips_profile_summary_set(gboolean summary)
+{
+	vips__profile_summary = summary;
+}
+
+static gint
+vips_profile_entry_compare(gconstpointer a, gconstpointer b)
+{
+	const VipsProfileEntry *ea = (const VipsProfileEntry *) a;
+	const VipsProfileEntry *eb = (const VipsProfileEntry *) b;
+
+	return ea->time < eb->time ? 1 : ea->time > eb->time ? -1 : 0;
+}
+
+/**
+ * vips_profile_get:
+ *
+ * Get the profile summary collected since startup or the last
+ * [func@profile_reset]. Counters from the calling thread are included.
+ *
+ * Entries are sorted by the time spent in the operation itself, largest
+ * first, so the first entry is usually the bottleneck.
+ *
+ * Free the result with [func@profile_report_free].
+ *
+ * ::: seealso
+ *     [func@profile_summary_set].
+ *
+ * Returns: (transfer full): a new profile report
+ */
+VipsProfileReport *
+vips_profile_get(void)
+{
+	VipsProfileThread *thread;
+	VipsProfileReport *report;
+	GHashTableIter iter;
+	gpointer value;
+	int i;
+
+	if ((thread = g_private_get(&vips_profile_thread_key)))
+		vips_profile_thread_merge(thread);
+
+	report = g_new0(VipsProfileReport, 1);
+
+	g_mutex_lock(&vips_profile_lock);
+
+	if (vips_profile_entries) {
+		report->n_entries = g_hash_table_size(vips_profile_entries);
+		report->entries = g_new(VipsProfileEntry, report->n_entries);
+
+		i = 0;
+		g_hash_table_iter_init(&iter, vips_profile_entries);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+			report->entries[i++] = *((VipsProfileEntry *) value);
+	}
+	report->allocate_wait = vips_profile_allocate_wait;
+	report->write_wait = vips_profile_write_wait;
+
+	g_mutex_unlock(&vips_profile_lock);
+
+	qsort(report->entries, report->n_entries, sizeof(VipsProfileEntry),
+		vips_profile_entry_compare);
+
+	return report;
+}
+
+/**
+ * vips_profile_report_free:
+ * @report: (transfer full): report to free
+ *
+ * Free a report from [func@profile_get].
+ */
+void
+vips_profile_report_free(VipsProfileReport *report)
+{
+	VIPS_FREE(report->entries);
+	VIPS_FREE(report);
+}
+
+/**
+ * vips_profile_reset:
+ *
+ * Zero the profile summary.
+ */
+void
+vips_profile_reset(void)
+{
+	VipsProfileThread *thread;
+
+	if ((thread = g_private_get(&vips_profile_thread_key)))
+		vips_profile_thread_merge(thread);
+
+	g_mutex_lock(&vips_profile_lock);
+
+	VIPS_FREEF(g_hash_table_destroy, vips_profile_entries);
+	vips_profile_allocate_wait = 0;
+	vips_profile_write_wait = 0;
+
+	g_mutex_unlock(&vips_profile_lock);
+}
+
+/**
+ * vips_profile_print:
+ *
+ * Print the profile summary to stdout.
+ *
+ * ::: seealso
+ *     [func@profile_get].
+ */
+void
+vips_profile_print(void)
+{
+	VipsProfileReport *report = vips_profile_get();
+
+	printf("profile summary:\n");
+	printf("%-20s %10s %10s %10s %10s %10s\n",
+		"operation", "calls", "Mpixels", "self (s)", "total (s)",
+		"buf hits");
+	for (int i = 0; i < report->n_entries; i++) {
+		VipsProfileEntry *entry = &report->entries[i];
+		gint64 lookups = entry->buffer_hits + entry->buffer_misses;
+
+		printf("%-20s %10" G_GINT64_FORMAT " %10.3g %10.3g %10.3g %9.3g%%\n",
+			entry->nickname,
+			entry->calls,
+			entry->pixels / 1000000.0,
+			entry->time / 1000000.0,
+			entry->total_time / 1000000.0,
+			lookups ? 100.0 * entry->buffer_hits / lookups : 0.0);
+	}
+	printf("workers waited %.3gs for allocate\n",
+		report->allocate_wait / 1000000.0);
+	printf("waited %.3gs for write-behind\n",
+		report->write_wait / 1000000.0);
+
+	vips_profile_report_free(report);
+}
+
+/* Print the summary, if enabled, and free it. Run from vips_shutdown().
+ */
+void
+vips__profile_shutdown(void)
+{
+	if (vips__profile_summary)
+		vips_profile_print();
+
+	g_mutex_lock(&vips_profile_lock);
+	VIPS_FREEF(g_hash_table_destroy, vips_profile_entries);
+	g_mutex_unlock(&vips_profile_lock);
+}
@@ -498,6 +498,8 @@ vips_init(const char *argv0)
 		vips_verbose();
 	if (g_getenv("VIPS_PROFILE"))
 		vips_profile_set(TRUE);
+	if (g_getenv("VIPS_PROFILE_SUMMARY"))
+		vips_profile_summary_set(TRUE);
 	if (g_getenv("VIPS_LEAK"))
 		vips_leak_set(TRUE);
 	if (g_getenv("VIPS_TRACE"))
@@ -520,6 +522,8 @@ vips_init(const char *argv0)
 	vips__thread_init();
 	vips__threadpool_init();
 	vips__buffer_init();
+	vips__sink_disc_init();
+	vips__decode_cache_init();
 
 	if (!vips__global_timer)
 		vips__global_timer = g_timer_new();
@@ -708,6 +712,7 @@ void
 vips_thread_shutdown(void)
 {
 	vips__thread_profile_detach();
+	vips__profile_thread_detach();
 	vips__buffer_shutdown();
 }
 
@@ -755,6 +760,11 @@ vips_shutdown(void)
 	vips_thread_shutdown();
 	vips__thread_profile_stop();
 	vips__threadpool_shutdown();
+	vips__buffer_pool_shutdown();
+	vips__decode_cache_shutdown();
+	vips__icc_transform_shutdown();
+	vips__reduce_mask_shutdown();
+	vips__profile_shutdown();
 
 	VIPS_FREE(vips__argv0);
 	VIPS_FREE(vips__prgname);
@@ -867,6 +877,12 @@ static GOptionEntry option_entries[] = {
 	{ "vips-concurrency", 0, 0,
 		G_OPTION_ARG_INT, &vips__concurrency,
 		N_("evaluate with N concurrent threads"), "N" },
+	{ "vips-concurrency-total", 0, 0,
+		G_OPTION_ARG_INT, &vips__concurrency_total,
+		N_("evaluate with at most N threads across all pipelines"), "N" },
+	{ "vips-numa", 0, 0,
+		G_OPTION_ARG_NONE, &vips__numa,
+		N_("pin workers to the NUMA node that starts each pipeline"), NULL },
 	{ "vips-max-coord", 0, 0,
 		G_OPTION_ARG_STRING, &vips__max_coord_arg,
 		N_("maximum coordinate"), NULL },
@@ -882,6 +898,10 @@ static GOptionEntry option_entries[] = {
 	{ "vips-fatstrip-height", 0, G_OPTION_FLAG_HIDDEN,
 		G_OPTION_ARG_INT, &vips__fatstrip_height,
 		N_("set fatstrip height to N (DEBUG)"), "N" },
+	{ "vips-tile-target", 0, 0,
+		G_OPTION_ARG_INT, &vips__tile_target,
+		N_("resize tiles so each work unit takes about N microseconds"),
+		"N" },
 	{ "vips-progress", 0, 0,
 		G_OPTION_ARG_NONE, &vips__progress,
 		N_("show progress feedback"), NULL },
@@ -891,6 +911,9 @@ static GOptionEntry option_entries[] = {
 	{ "vips-profile", 0, 0,
 		G_OPTION_ARG_NONE, &vips__thread_profile,
 		N_("profile and dump timing on exit"), NULL },
+	{ "vips-profile-summary", 0, 0,
+		G_OPTION_ARG_NONE, &vips__profile_summary,
+		N_("print a per-operation profile summary on exit"), NULL },
 	{ "vips-disc-threshold", 0, 0,
 		G_OPTION_ARG_STRING, &vips__disc_threshold,
 		N_("images larger than N are decompressed to disc"), "N" },
@@ -22,6 +22,8 @@
  * 21/9/11
  * 	- rename as vips_tracked_malloc() to emphasise difference from
  * 	  g_malloc()/g_free()
+ * 18/10/26
+ * 	- add vips__tracked_aligned_untrack() and friends for the buffer pool
  */
 
 /*
@@ -283,6 +285,62 @@ vips_tracked_aligned_free(void *s)
 	VIPS_GATE_FREE(size);
 }
 
+/* Stop counting a block from vips_tracked_aligned_alloc(), for example while
+ * it sits unused in the buffer pool. It must be retracked before it is
+ * freed with vips_tracked_aligned_free().
+ */
+void
+vips__tracked_aligned_untrack(void *s)
+{
+	size_t size = *((size_t *) s - 1);
+
+	g_mutex_lock(&vips_tracked_mutex);
+
+	if (vips_tracked_allocs <= 0)
+		g_warning("vips_free: too many frees");
+	if (vips_tracked_mem < size)
+		g_warning("vips_free: too much free");
+
+	vips_tracked_mem -= size;
+	vips_tracked_allocs -= 1;
+
+	g_mutex_unlock(&vips_tracked_mutex);
+}
+
+/* Start counting an untracked block again.
+ */
+void
+vips__tracked_aligned_retrack(void *s)
+{
+	size_t size = *((size_t *) s - 1);
+
+	g_mutex_lock(&vips_tracked_mutex);
+
+	vips_tracked_mem += size;
+	if (vips_tracked_mem > vips_tracked_mem_highwater)
+		vips_tracked_mem_highwater = vips_tracked_mem;
+	vips_tracked_allocs += 1;
+
+	g_mutex_unlock(&vips_tracked_mutex);
+}
+
+/* Free an untracked block.
+ */
+void
+vips__tracked_aligned_free_untracked(void *s)
+{
+	void *start = (size_t *) s - 1;
+	size_t size = *((size_t *) start);
+
+#ifdef HAVE__ALIGNED_MALLOC
+	_aligned_free(start);
+#else /*defined(HAVE_POSIX_MEMALIGN) || defined(HAVE_MEMALIGN)*/
+	free(start);
+#endif
+
+	VIPS_GATE_FREE(size);
+}
+
 /**
  * vips_tracked_malloc:
  * @size: number of bytes to allocate
@@ -1602,16 +1602,30 @@ vips_region_generate(VipsRegion *reg, void *a)
 	VipsImage *im = reg->im;
 
 	gboolean stop;
+	gboolean profile;
+	VipsProfileFrame frame;
+	gint64 start;
+	int result;
 
 	/* Start new sequence, if necessary.
 	 */
 	if (vips__region_start(reg))
 		return -1;
 
-	/* Ask for evaluation.
+	/* Ask for evaluation. VIPS_CACHE_POLICY_COST needs to know how long
+	 * this image takes to make.
 	 */
 	stop = FALSE;
-	if (im->generate_fn(reg, reg->seq, im->client1, im->client2, &stop))
+	if ((profile = vips__profile_summary))
+		vips__profile_generate_start(&frame, im);
+	start = vips__cache_cost ? g_get_monotonic_time() : 0;
+	result = im->generate_fn(reg, reg->seq, im->client1, im->client2, &stop);
+	if (start)
+		vips__cache_generate_time(im, g_get_monotonic_time() - start);
+	if (profile)
+		vips__profile_generate_stop(&frame,
+			(gint64) reg->valid.width * reg->valid.height);
+	if (result)
 		return -1;
 	if (stop) {
 		vips_error("vips_region_generate", "%s", _("stop requested"));
@@ -2,6 +2,9 @@
  *
  * 28/3/10
  * 	- from im_iterate(), reworked for threadpool
+ * 18/10/26
+ * 	- add adaptive tile geometry
+ * 	- shared lock-free tile claims with a generation count
  */
 
 /*
@@ -49,6 +52,20 @@
 
 #include "sink.h"
 
+/* Time this many work units before we think about resizing tiles.
+ */
+#define SINK_MIN_UNITS (8)
+
+/* Never shrink tiles narrower than this.
+ */
+#define SINK_MIN_TILE_WIDTH (16)
+
+/* Time at most this many work units per area, and count each as at most
+ * SINK_MAX_UNIT_TIME microseconds, so the total always fits in an int.
+ */
+#define SINK_MAX_UNITS (64)
+#define SINK_MAX_UNIT_TIME (G_MAXINT / SINK_MAX_UNITS)
+
 /* A part of the image we are scanning.
  *
  * We can't let any threads fall too far behind as that would mess up seq
@@ -183,6 +200,10 @@ sink_area_allocate_fn(VipsThreadState *state, void *a, gboolean *stop)
 		sink_base->y += sink_base->tile_height;
 
 		if (sink_base->y >= VIPS_RECT_BOTTOM(&sink->area->rect)) {
+			/* Between areas, so we can change the tile size.
+			 */
+			vips_sink_base_adapt(sink_base);
+
 			/* Block until the previous area is done.
 			 */
 			if (sink->area->rect.top > 0)
@@ -370,6 +391,10 @@ vips_sink_base_init(SinkBase *sink_base, VipsImage *image)
 		&sink_base->n_lines);
 
 	sink_base->processed = 0;
+
+	sink_base->tile_target = vips__tile_target;
+	sink_base->unit_time = 0;
+	sink_base->n_units = 0;
 }
 
 static int
@@ -409,6 +434,7 @@ sink_work(VipsThreadState *state, void *a)
 	SinkThreadState *sstate = (SinkThreadState *) state;
 	Sink *sink = (Sink *) a;
 	SinkArea *area = sstate->area;
+	gint64 start = vips_sink_base_unit_start(&sink->sink_base);
 
 	int result;
 
@@ -417,6 +443,8 @@ sink_work(VipsThreadState *state, void *a)
 		result = sink->generate_fn(sstate->reg, sstate->seq,
 			sink->a, sink->b, &state->stop);
 
+	vips_sink_base_unit_done(&sink->sink_base, start);
+
 	/* Tell the allocator we're done.
 	 */
 	vips_semaphore_upn(&area->n_thread, 1);
@@ -441,6 +469,164 @@ vips_sink_base_progress(void *a)
 	return 0;
 }
 
+/* The number of tiles we need to cover an area, for sinks which hand out
+ * tiles by index, or -1 if there are too many to claim.
+ */
+int
+vips_sink_base_n_tiles(VipsRect *area, int tile_width, int tile_height)
+{
+	int tiles_across = VIPS_ROUND_UP(area->width, tile_width) / tile_width;
+	int tiles_down = VIPS_ROUND_UP(area->height, tile_height) / tile_height;
+
+	if ((gint64) tiles_across * tiles_down >= SINK_CLAIM_MAX_TILES) {
+		vips_error("vips_sink", "%s", _("too many tiles"));
+		return -1;
+	}
+
+	return tiles_across * tiles_down;
+}
+
+/* Find the position of tile @index in an area, in left-to-right,
+ * top-to-bottom order.
+ */
+void
+vips_sink_base_tile(VipsRect *area, int tile_width, int tile_height,
+	int index, VipsRect *tile)
+{
+	int tiles_across = VIPS_ROUND_UP(area->width, tile_width) / tile_width;
+
+	VipsRect rect;
+
+	rect.left = area->left + (index % tiles_across) * tile_width;
+	rect.top = area->top + (index / tiles_across) * tile_height;
+	rect.width = tile_width;
+	rect.height = tile_height;
+	vips_rect_intersectrect(area, &rect, tile);
+}
+
+/* Open an area for claims after it has moved. Call with the area closed
+ * (n_tiles set to zero) and its geometry updated. The atomic sets make the
+ * new geometry visible to workers before any can claim.
+ */
+void
+vips_sink_base_claim_open(int *claim, int *n_tiles, int new_n_tiles)
+{
+	guint generation;
+
+	generation = ((guint) g_atomic_int_get(claim) >>
+					 SINK_CLAIM_INDEX_BITS) + 1;
+	g_atomic_int_set(claim, (int) (generation << SINK_CLAIM_INDEX_BITS));
+	g_atomic_int_set(n_tiles, new_n_tiles);
+}
+
+/* Claim the next tile index, or -1 if the area is used up or is being
+ * moved. This can run in many workers at once.
+ */
+int
+vips_sink_base_claim(int *claim, int *n_tiles)
+{
+	int old;
+	int index;
+
+	do {
+		old = g_atomic_int_get(claim);
+		index = old & (SINK_CLAIM_MAX_TILES - 1);
+
+		/* If the area moves after we read n_tiles, the generation in
+		 * the claim word changes and the CAS fails.
+		 */
+		if (index >= g_atomic_int_get(n_tiles))
+			return -1;
+	} while (!g_atomic_int_compare_and_exchange(claim, old, old + 1));
+
+	return index;
+}
+
+/* Start timing a work unit. Returns 0 if we're not adapting tile size.
+ */
+gint64
+vips_sink_base_unit_start(SinkBase *sink_base)
+{
+	return sink_base->tile_target ? g_get_monotonic_time() : 0;
+}
+
+/* A work unit has finished. This runs in many workers at once.
+ */
+void
+vips_sink_base_unit_done(SinkBase *sink_base, gint64 start)
+{
+	if (start) {
+		gint64 time = g_get_monotonic_time() - start;
+
+		/* Enough units timed already?
+		 */
+		if (g_atomic_int_add(&sink_base->n_units, 1) < SINK_MAX_UNITS)
+			g_atomic_int_add(&sink_base->unit_time,
+				VIPS_MIN(time, SINK_MAX_UNIT_TIME));
+	}
+}
+
+/* Resize tiles towards the target time per work unit. Small units waste time
+ * handing out work, large units need more memory and balance badly between
+ * workers. Call between areas, when no worker can be working out tile
+ * positions.
+ *
+ * Tile height must always divide n_lines, so we only ever double or halve
+ * it. Strip-shaped tiles stay as wide as the image.
+ */
+void
+vips_sink_base_adapt(SinkBase *sink_base)
+{
+	int n_units = VIPS_MIN(SINK_MAX_UNITS,
+		g_atomic_int_get(&sink_base->n_units));
+	int width = sink_base->im->Xsize;
+	gboolean strip = sink_base->tile_width >= width;
+
+	gint64 mean;
+
+	if (!sink_base->tile_target ||
+		n_units < SINK_MIN_UNITS)
+		return;
+
+	mean = g_atomic_int_get(&sink_base->unit_time) / n_units;
+	g_atomic_int_set(&sink_base->unit_time, 0);
+	g_atomic_int_set(&sink_base->n_units, 0);
+
+	if (mean < sink_base->tile_target / 2) {
+		/* Too small: grow the shorter side.
+		 */
+		gboolean can_grow_height =
+			sink_base->n_lines % (sink_base->tile_height * 2) == 0;
+
+		if (!strip &&
+			(sink_base->tile_width <= sink_base->tile_height ||
+				!can_grow_height))
+			sink_base->tile_width =
+				VIPS_MIN(width, sink_base->tile_width * 2);
+		else if (can_grow_height)
+			sink_base->tile_height *= 2;
+	}
+	else if (mean > sink_base->tile_target * 2) {
+		/* Too large: shrink the longer side.
+		 */
+		gboolean can_shrink_height = sink_base->tile_height % 2 == 0;
+
+		if (can_shrink_height &&
+			(strip ||
+				sink_base->tile_height >= sink_base->tile_width ||
+				sink_base->tile_width <= SINK_MIN_TILE_WIDTH))
+			sink_base->tile_height /= 2;
+		else if (!strip &&
+			sink_base->tile_width > SINK_MIN_TILE_WIDTH)
+			sink_base->tile_width = VIPS_MAX(SINK_MIN_TILE_WIDTH,
+				sink_base->tile_width / 2);
+	}
+
+	VIPS_DEBUG_MSG("vips_sink_base_adapt: mean %" G_GINT64_FORMAT "us, "
+				   "now %d x %d tiles\n",
+		mean, sink_base->tile_width, sink_base->tile_height);
+}
+
 /**
  * vips_sink_tile: (method)
  * @im: scan over this image
@@ -485,9 +671,12 @@ vips_sink_tile(VipsImage *im,
 	if (sink_init(&sink, im, start_fn, generate_fn, stop_fn, a, b))
 		return -1;
 
+	/* The caller has asked for a tile size, so we can't adapt it.
+	 */
 	if (tile_width > 0) {
 		sink.sink_base.tile_width = tile_width;
 		sink.sink_base.tile_height = tile_height;
+		sink.sink_base.tile_target = 0;
 	}
 
 	/* vips_sink_base_progress() signals progress on im, so we have to do
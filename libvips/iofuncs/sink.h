@@ -56,6 +56,15 @@ typedef struct _SinkBase {
 	int tile_height;
 	int n_lines;
 
+	/* In adaptive mode, the time in microseconds we'd like each work
+	 * unit to take, or 0 for a fixed tilesize. Workers add to unit_time
+	 * and n_units, and we resize tiles between areas. We only time a
+	 * bounded sample of units per area, so unit_time can't overflow.
+	 */
+	int tile_target;
+	int unit_time; // (atomic)
+	int n_units;   // (atomic)
+
 	/* The number of pixels allocate has allocated. Used for progress
 	 * feedback.
 	 */
@@ -68,6 +77,22 @@ void vips_sink_base_init(SinkBase *sink_base, VipsImage *image);
 VipsThreadState *vips_sink_thread_state_new(VipsImage *im, void *a);
 int vips_sink_base_allocate(VipsThreadState *state, void *a, gboolean *stop);
 int vips_sink_base_progress(void *a);
+int vips_sink_base_n_tiles(VipsRect *area, int tile_width, int tile_height);
+void vips_sink_base_tile(VipsRect *area, int tile_width, int tile_height,
+	int index, VipsRect *tile);
+
+/* Sinks which hand out tiles by index claim them with a CAS on a single
+ * word. The low bits are the index of the next tile, the high bits count
+ * positions, so a claim read before the area moved can never succeed.
+ */
+#define SINK_CLAIM_INDEX_BITS (24)
+#define SINK_CLAIM_MAX_TILES (1 << SINK_CLAIM_INDEX_BITS)
+
+void vips_sink_base_claim_open(int *claim, int *n_tiles, int new_n_tiles);
+int vips_sink_base_claim(int *claim, int *n_tiles);
+gint64 vips_sink_base_unit_start(SinkBase *sink_base);
+void vips_sink_base_unit_done(SinkBase *sink_base, gint64 start);
+void vips_sink_base_adapt(SinkBase *sink_base);
 
 #ifdef __cplusplus
 }
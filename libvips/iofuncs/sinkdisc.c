@@ -9,6 +9,11 @@
  * 	- we could get stuck if allocate failed (thanks Tim)
  * 23/2/12
  * 	- we could deadlock if generate failed
+ * 18/10/26
+ * 	- workers claim tiles from the current buffer with an atomic counter,
+ * 	  allocate only runs when the buffer is used up
+ * 	- a ring of N buffers and a single writer thread, so writes can lag
+ * 	  computation by more than one buffer
  */
 
 /*
@@ -63,6 +68,19 @@
 
 #include "sink.h"
 
+/* The default number of buffers in the ring, and the most memory they can
+ * use. We always have at least two.
+ */
+static int vips_sink_disc_n_buffers = 2;
+static size_t vips_sink_disc_max_mem = 256 * 1024 * 1024;
+
+/* Time spent stalled waiting for the writer, and time spent writing, in
+ * microseconds. Updated once per buffer, so a lock is fine.
+ */
+static GMutex vips_sink_disc_stats_lock;
+static guint64 vips_sink_disc_stall_time = 0;
+static guint64 vips_sink_disc_write_time = 0;
+
 /* A buffer we are going to write to disc in a background thread.
  */
 typedef struct _WriteBuffer {
@@ -70,13 +88,14 @@ typedef struct _WriteBuffer {
 
 	VipsRegion *region;	  /* Pixels */
 	VipsRect area;		  /* Part of image this region covers */
-	VipsSemaphore go;	  /* Start bg thread loop */
-	VipsSemaphore nwrite; /* Number of threads writing to region */
-	VipsSemaphore done;	  /* Bg thread has done write */
-	VipsSemaphore finish; /* Bg thread has finished */
+	int tile_width;		  /* Tile size for this position */
+	int tile_height;
+	int n_tiles;		  /* Number of tiles open for claims (atomic) */
+	int claim;			  /* Next tile and generation, see sink.h (atomic) */
+	VipsSemaphore nwrite; /* Number of tiles not yet written to region */
+	VipsSemaphore done;	  /* Writer has done write */
+	gboolean queued;	  /* Waiting for the writer, and done not yet seen */
 	int write_errno;	  /* Save write errors here */
-	gboolean running;	  /* Whether the bg writer thread is running */
-	gboolean kill;		  /* Set to ask thread to exit */
 } WriteBuffer;
 
 /* Per-call state.
@@ -84,28 +103,51 @@ typedef struct _WriteBuffer {
 typedef struct _Write {
 	SinkBase sink_base;
 
-	/* We are current writing tiles to buf, buf_back is in the hands of
-	 * the bg write thread.
+	/* A ring of buffers. Workers fill buf, the writer thread works
+	 * through the buffers queued behind it in ring order. Workers read
+	 * buf without a lock when they claim tiles, so update it with atomic
+	 * ops.
 	 */
+	WriteBuffer **ring;
+	int n_buffers;
+	int front;
 	WriteBuffer *buf;
-	WriteBuffer *buf_back;
+
+	/* The writer thread. go counts queued buffers, next is the ring index
+	 * of the next buffer to write.
+	 */
+	VipsSemaphore go;
+	VipsSemaphore finish;
+	int next;
+	gboolean running;
+	gboolean kill;
 
 	/* The file format write operation.
 	 */
 	VipsRegionWrite write_fn;
 	void *a;
+
+	/* In NUMA mode, the node we run the writer thread on, so it is
+	 * next to the workers filling the buffers. -1 for no pinning.
+	 */
+	int node;
 } Write;
 
 static int
 write_check_error(Write *write)
 {
-	if (write->buf->write_errno ||
-		write->buf_back->write_errno) {
-		vips_error_system(write->buf->write_errno ?
-			write->buf->write_errno : write->buf_back->write_errno,
-			"wbuffer_write", "%s", _("write failed"));
-		return -1;
-	}
+	int i;
+
+	if (!write->ring)
+		return 0;
+
+	for (i = 0; i < write->n_buffers; i++)
+		if (write->ring[i] &&
+			write->ring[i]->write_errno) {
+			vips_error_system(write->ring[i]->write_errno,
+				"wbuffer_write", "%s", _("write failed"));
+			return -1;
+		}
 
 	return 0;
 }
@@ -152,24 +194,9 @@ write_thread_state_new(VipsImage *im, void *a)
 static void
 wbuffer_free(WriteBuffer *wbuffer)
 {
-	/* Is there a thread running this region? Kill it!
-	 */
-	if (wbuffer->running) {
-		wbuffer->kill = TRUE;
-		vips_semaphore_up(&wbuffer->go);
-
-		vips_semaphore_down(&wbuffer->finish);
-
-		VIPS_DEBUG_MSG("wbuffer_free:\n");
-
-		wbuffer->running = FALSE;
-	}
-
 	VIPS_UNREF(wbuffer->region);
-	vips_semaphore_destroy(&wbuffer->go);
 	vips_semaphore_destroy(&wbuffer->nwrite);
 	vips_semaphore_destroy(&wbuffer->done);
-	vips_semaphore_destroy(&wbuffer->finish);
 	g_free(wbuffer);
 }
 
@@ -178,32 +205,49 @@ wbuffer_write(WriteBuffer *wbuffer)
 {
 	Write *write = wbuffer->write;
 
+	gint64 start;
+
 	VIPS_DEBUG_MSG("wbuffer_write: %d bytes from wbuffer %p\n",
 		wbuffer->region->bpl * wbuffer->area.height, wbuffer);
 
 	VIPS_GATE_START("wbuffer_write: work");
 
+	start = g_get_monotonic_time();
+
 	wbuffer->write_errno = write->write_fn(wbuffer->region,
 		&wbuffer->area, write->a);
 
+	g_mutex_lock(&vips_sink_disc_stats_lock);
+	vips_sink_disc_write_time += g_get_monotonic_time() - start;
+	g_mutex_unlock(&vips_sink_disc_stats_lock);
+
 	VIPS_GATE_STOP("wbuffer_write: work");
 }
 
-/* Run this as a thread to do a BG write.
+/* Run this as a thread to do BG writes. We write buffers in ring order,
+ * which is the order allocate queues them in.
  */
 static void
-wbuffer_write_thread(void *data, void *user_data)
+write_thread(void *data, void *user_data)
 {
-	WriteBuffer *wbuffer = (WriteBuffer *) data;
+	Write *write = (Write *) data;
+
+	if (write->node >= 0)
+		vips__numa_pin(write->node);
 
 	for (;;) {
-		/* Wait to be told to write.
+		WriteBuffer *wbuffer;
+
+		/* Wait for a buffer to be queued.
 		 */
-		vips_semaphore_down(&wbuffer->go);
+		vips_semaphore_down(&write->go);
 
-		if (wbuffer->kill)
+		if (write->kill)
 			break;
 
+		wbuffer = write->ring[write->next];
+		write->next = (write->next + 1) % write->n_buffers;
+
 		/* Now block until the last worker finishes on this buffer.
 		 */
 		vips_semaphore_downn(&wbuffer->nwrite, 0);
@@ -215,9 +259,12 @@ wbuffer_write_thread(void *data, void *user_data)
 		vips_semaphore_up(&wbuffer->done);
 	}
 
+	if (write->node >= 0)
+		vips__numa_pin(-1);
+
 	/* We are exiting: tell the main thread.
 	 */
-	vips_semaphore_up(&wbuffer->finish);
+	vips_semaphore_up(&write->finish);
 }
 
 static WriteBuffer *
@@ -229,13 +276,12 @@ wbuffer_new(Write *write)
 		return NULL;
 	wbuffer->write = write;
 	wbuffer->region = NULL;
-	vips_semaphore_init(&wbuffer->go, 0, "go");
+	wbuffer->n_tiles = 0;
+	wbuffer->claim = 0;
 	vips_semaphore_init(&wbuffer->nwrite, 0, "nwrite");
 	vips_semaphore_init(&wbuffer->done, 0, "done");
-	vips_semaphore_init(&wbuffer->finish, 0, "finish");
+	wbuffer->queued = FALSE;
 	wbuffer->write_errno = 0;
-	wbuffer->running = FALSE;
-	wbuffer->kill = FALSE;
 
 	if (!(wbuffer->region = vips_region_new(write->sink_base.im))) {
 		wbuffer_free(wbuffer);
@@ -246,58 +292,73 @@ wbuffer_new(Write *write)
 	 */
 	vips__region_no_ownership(wbuffer->region);
 
-	/* Make this last (picks up parts of wbuffer on startup).
-	 */
-	if (vips_thread_execute("wbuffer", wbuffer_write_thread, wbuffer)) {
-		wbuffer_free(wbuffer);
-		return NULL;
-	}
-
-	wbuffer->running = TRUE;
-
 	return wbuffer;
 }
 
-/* Block until the previous write completes, then write the front buffer.
+/* Queue the front buffer for the writer.
  */
-static int
+static void
 wbuffer_flush(Write *write)
 {
 	VIPS_DEBUG_MSG("wbuffer_flush:\n");
 
-	/* Block until the other buffer has been written. We have to do this
-	 * before we can set this buffer writing or we'll lose output ordering.
-	 */
-	if (write->buf->area.top > 0) {
-		vips_semaphore_down(&write->buf_back->done);
+	write->buf->queued = TRUE;
+	vips_semaphore_up(&write->go);
+}
+
+/* If the writer still has this buffer, block until it's done with it. This
+ * is where computation stalls if the writer can't keep up.
+ */
+static int
+wbuffer_wait(WriteBuffer *wbuffer)
+{
+	Write *write = wbuffer->write;
+
+	if (wbuffer->queued) {
+		gint64 start = g_get_monotonic_time();
+		gint64 stall;
+
+		vips_semaphore_down(&wbuffer->done);
+		wbuffer->queued = FALSE;
+
+		stall = g_get_monotonic_time() - start;
+		g_mutex_lock(&vips_sink_disc_stats_lock);
+		vips_sink_disc_stall_time += stall;
+		g_mutex_unlock(&vips_sink_disc_stats_lock);
+		if (vips__profile_summary)
+			vips__profile_write_wait(stall);
 
 		if (write_check_error(write))
 			return -1;
 	}
 
-	/* Set the background writer going for this buffer.
-	 */
-	vips_semaphore_up(&write->buf->go);
-
 	return 0;
 }
 
-/* Move a wbuffer to a position.
+/* Move a wbuffer to a position. The buffer must be idle: all tiles claimed
+ * and written.
  */
 static int
 wbuffer_position(WriteBuffer *wbuffer, int top, int height)
 {
+	Write *write = wbuffer->write;
+
 	VipsRect image, area;
+	int n_tiles;
 	int result;
 
+	/* Close the buffer to claims while we move it.
+	 */
+	g_atomic_int_set(&wbuffer->n_tiles, 0);
+
 	image.left = 0;
 	image.top = 0;
-	image.width = wbuffer->write->sink_base.im->Xsize;
-	image.height = wbuffer->write->sink_base.im->Ysize;
+	image.width = write->sink_base.im->Xsize;
+	image.height = write->sink_base.im->Ysize;
 
 	area.left = 0;
 	area.top = top;
-	area.width = wbuffer->write->sink_base.im->Xsize;
+	area.width = write->sink_base.im->Xsize;
 	area.height = height;
 
 	vips_rect_intersectrect(&area, &image, &wbuffer->area);
@@ -310,18 +371,82 @@ wbuffer_position(WriteBuffer *wbuffer, int top, int height)
 
 	vips__region_no_ownership(wbuffer->region);
 
+	if (result)
+		return result;
+
 	/* This should be an exclusive buffer, hopefully.
 	 */
-	if (!result)
-		g_assert(!wbuffer->region->buffer->done);
+	g_assert(!wbuffer->region->buffer->done);
 
-	return result;
+	/* Count all the tiles in as writers now, so the bg thread can't
+	 * start on this buffer until every tile has been written. Each work
+	 * unit signals one tile done.
+	 */
+	wbuffer->tile_width = write->sink_base.tile_width;
+	wbuffer->tile_height = write->sink_base.tile_height;
+	if ((n_tiles = vips_sink_base_n_tiles(&wbuffer->area,
+			 wbuffer->tile_width, wbuffer->tile_height)) < 0)
+		return -1;
+	vips_semaphore_upn(&wbuffer->nwrite, -n_tiles);
+
+	/* Open the buffer for claims.
+	 */
+	vips_sink_base_claim_open(&wbuffer->claim, &wbuffer->n_tiles, n_tiles);
+
+	return 0;
+}
+
+/* Try to claim the next tile in a buffer. This can run in many workers at
+ * once.
+ */
+static gboolean
+wbuffer_claim(WriteThreadState *wstate, WriteBuffer *wbuffer)
+{
+	VipsThreadState *state = (VipsThreadState *) wstate;
+	Write *write = wbuffer->write;
+
+	int index;
+
+	/* The buffer is used up, or is being moved: allocate must deal with
+	 * it.
+	 */
+	if ((index = vips_sink_base_claim(&wbuffer->claim,
+			 &wbuffer->n_tiles)) < 0)
+		return FALSE;
+
+	vips_sink_base_tile(&wbuffer->area,
+		wbuffer->tile_width, wbuffer->tile_height, index, &state->pos);
+
+	/* The thread needs to know which buffer it's writing to.
+	 */
+	wstate->buf = wbuffer;
+
+	VIPS_DEBUG_MSG("  thread %p claimed "
+				   "left = %d, top = %d, width = %d, height = %d\n",
+		g_thread_self(),
+		state->pos.left, state->pos.top,
+		state->pos.width, state->pos.height);
+
+	return TRUE;
+}
+
+/* Our VipsThreadpoolClaim function ... grab the next tile in the current
+ * buffer, if there is one.
+ */
+static gboolean
+wbuffer_claim_fn(VipsThreadState *state, void *a)
+{
+	Write *write = (Write *) a;
+
+	return wbuffer_claim((WriteThreadState *) state,
+		(WriteBuffer *) g_atomic_pointer_get(&write->buf));
 }
 
 /* Our VipsThreadpoolAllocate function ... move the thread to the next tile
- * that needs doing. If no buffer is available (the bg writer hasn't yet
- * finished with it), we block. If all tiles are done, we return FALSE to end
- * iteration.
+ * that needs doing. If the current buffer is used up, we queue it for the
+ * writer and move on to the next one in the ring. If that buffer is still
+ * queued (the writer hasn't yet finished with it), we block. If all tiles
+ * are done, we set @stop to end iteration.
  */
 static gboolean
 wbuffer_allocate_fn(VipsThreadState *state, void *a, gboolean *stop)
@@ -330,94 +455,61 @@ wbuffer_allocate_fn(VipsThreadState *state, void *a, gboolean *stop)
 	Write *write = (Write *) a;
 	SinkBase *sink_base = (SinkBase *) write;
 
-	VipsRect image;
-	VipsRect tile;
+	WriteBuffer *buf;
 
 	VIPS_DEBUG_MSG("wbuffer_allocate_fn:\n");
 
-	/* Is the state x/y OK? New line or maybe new buffer or maybe even
-	 * all done.
+	/* Other workers can claim from a buffer as soon as it's positioned,
+	 * so we may need to move on more than once.
 	 */
-	if (sink_base->x >= write->buf->area.width) {
-		sink_base->x = 0;
-		sink_base->y += sink_base->tile_height;
-
-		if (sink_base->y >= VIPS_RECT_BOTTOM(&write->buf->area)) {
-			VIPS_DEBUG_MSG("wbuffer_allocate_fn: "
-						   "finished top = %d, height = %d\n",
-				write->buf->area.top, write->buf->area.height);
-
-			/* Block until the write of the previous buffer
-			 * is done, then set write of this buffer going.
-			 */
-			if (wbuffer_flush(write)) {
-				*stop = TRUE;
-				return -1;
-			}
-
-			/* End of image?
-			 */
-			if (sink_base->y >= sink_base->im->Ysize) {
-				*stop = TRUE;
-				return 0;
-			}
+	while (!wbuffer_claim(wstate, write->buf)) {
+		int top = VIPS_RECT_BOTTOM(&write->buf->area);
 
-			VIPS_DEBUG_MSG("wbuffer_allocate_fn: "
-						   "starting top = %d, height = %d\n",
-				sink_base->y, sink_base->n_lines);
+		VIPS_DEBUG_MSG("wbuffer_allocate_fn: "
+					   "finished top = %d, height = %d\n",
+			write->buf->area.top, write->buf->area.height);
 
-			/* Swap buffers.
-			 */
-			VIPS_SWAP(WriteBuffer *, write->buf, write->buf_back);
+		/* Add the pixels we've just handed out to progress.
+		 */
+		sink_base->processed +=
+			(guint64) write->buf->area.width * write->buf->area.height;
 
-			/* Position buf at the new y.
-			 */
-			if (wbuffer_position(write->buf,
-					sink_base->y, sink_base->n_lines)) {
-				*stop = TRUE;
-				return -1;
-			}
+		/* Queue this buffer for writing.
+		 */
+		wbuffer_flush(write);
 
-			/* This will be the first tile of a new buffer ... mark this as a
-			 * good place to stall for a moment if we want to stress the
-			 * caching system. See threadpool.c.
-			 */
-            state->stall = TRUE;
+		/* End of image?
+		 */
+		if (top >= sink_base->im->Ysize) {
+			*stop = TRUE;
+			return 0;
 		}
-	}
-
-	/* x, y and buf are good: save params for thread.
-	 */
-	image.left = 0;
-	image.top = 0;
-	image.width = sink_base->im->Xsize;
-	image.height = sink_base->im->Ysize;
-	tile.left = sink_base->x;
-	tile.top = sink_base->y;
-	tile.width = sink_base->tile_width;
-	tile.height = sink_base->tile_height;
-	vips_rect_intersectrect(&image, &tile, &state->pos);
-
-	/* The thread needs to know which buffer it's writing to.
-	 */
-	wstate->buf = write->buf;
 
-	VIPS_DEBUG_MSG("  thread %p allocated "
-				   "left = %d, top = %d, width = %d, height = %d\n",
-		g_thread_self(),
-		tile.left, tile.top, tile.width, tile.height);
+		VIPS_DEBUG_MSG("wbuffer_allocate_fn: "
+					   "starting top = %d, height = %d\n",
+			top, sink_base->n_lines);
 
-	/* Add to the number of writers on the buffer.
-	 */
-	vips_semaphore_upn(&write->buf->nwrite, -1);
+		/* Wait for the writer to finish with the next buffer in the
+		 * ring, position it at the new y, and make it current. We can
+		 * change the tile size here.
+		 */
+		write->front = (write->front + 1) % write->n_buffers;
+		buf = write->ring[write->front];
+		vips_sink_base_adapt(sink_base);
+		if (wbuffer_wait(buf) ||
+			wbuffer_position(buf, top, sink_base->n_lines)) {
+			*stop = TRUE;
+			return -1;
+		}
 
-	/* Move state on.
-	 */
-	sink_base->x += sink_base->tile_width;
+		g_atomic_pointer_set(&write->buf, buf);
 
-	/* Add the number of pixels we've just allocated to progress.
-	 */
-	sink_base->processed += (guint64) state->pos.width * state->pos.height;
+		/* This will be the first tile of a new buffer ... mark this as a
+		 * good place to stall for a moment if we want to stress the
+		 * caching system. See threadpool.c.
+		 */
+		state->stall = TRUE;
+	}
 
 	return 0;
 }
@@ -428,6 +520,8 @@ static int
 wbuffer_work_fn(VipsThreadState *state, void *a)
 {
 	WriteThreadState *wstate = (WriteThreadState *) state;
+	Write *write = (Write *) a;
+	gint64 start = vips_sink_base_unit_start(&write->sink_base);
 
 	int result;
 
@@ -441,6 +535,8 @@ wbuffer_work_fn(VipsThreadState *state, void *a)
 	VIPS_DEBUG_MSG("wbuffer_work_fn: thread %p result = %d\n",
 		g_thread_self(), result);
 
+	vips_sink_base_unit_done(&write->sink_base, start);
+
 	/* Tell the bg write thread we've left.
 	 */
 	vips_semaphore_upn(&wstate->buf->nwrite, 1);
@@ -448,23 +544,89 @@ wbuffer_work_fn(VipsThreadState *state, void *a)
 	return result;
 }
 
-static void
+static int
 write_init(Write *write,
 	VipsImage *image, VipsRegionWrite write_fn, void *a)
 {
+	size_t buffer_size;
+	int i;
+
 	vips_sink_base_init(&write->sink_base, image);
 
-	write->buf = wbuffer_new(write);
-	write->buf_back = wbuffer_new(write);
+	/* Size the ring. Workers block when every buffer is queued for the
+	 * writer, so this is also our memory budget.
+	 */
+	buffer_size = VIPS_IMAGE_SIZEOF_LINE(image) * write->sink_base.n_lines;
+	write->n_buffers = vips_sink_disc_n_buffers;
+	if (vips_sink_disc_max_mem > 0 &&
+		buffer_size > 0)
+		write->n_buffers = VIPS_MIN(write->n_buffers,
+			vips_sink_disc_max_mem / buffer_size);
+	write->n_buffers = VIPS_MAX(2, write->n_buffers);
+
+	VIPS_DEBUG_MSG("write_init: %d buffers of %zd bytes\n",
+		write->n_buffers, buffer_size);
+
+	write->ring = NULL;
+	write->front = 0;
+	write->buf = NULL;
+	vips_semaphore_init(&write->go, 0, "go");
+	vips_semaphore_init(&write->finish, 0, "finish");
+	write->next = 0;
+	write->running = FALSE;
+	write->kill = FALSE;
 	write->write_fn = write_fn;
 	write->a = a;
+
+	/* Set this before we start the bg thread.
+	 */
+	write->node = vips__numa_node_current();
+
+	write->ring = VIPS_ARRAY(NULL, write->n_buffers, WriteBuffer *);
+	if (!write->ring)
+		return -1;
+	for (i = 0; i < write->n_buffers; i++)
+		write->ring[i] = NULL;
+	for (i = 0; i < write->n_buffers; i++)
+		if (!(write->ring[i] = wbuffer_new(write)))
+			return -1;
+	write->buf = write->ring[0];
+
+	/* Make this last (picks up parts of write on startup).
+	 */
+	if (vips_thread_execute("wbuffer", write_thread, write))
+		return -1;
+	write->running = TRUE;
+
+	return 0;
 }
 
 static void
 write_free(Write *write)
 {
-	VIPS_FREEF(wbuffer_free, write->buf);
-	VIPS_FREEF(wbuffer_free, write->buf_back);
+	int i;
+
+	/* Is the writer thread running? Kill it!
+	 */
+	if (write->running) {
+		write->kill = TRUE;
+		vips_semaphore_up(&write->go);
+
+		vips_semaphore_down(&write->finish);
+
+		VIPS_DEBUG_MSG("write_free:\n");
+
+		write->running = FALSE;
+	}
+
+	if (write->ring) {
+		for (i = 0; i < write->n_buffers; i++)
+			VIPS_FREEF(wbuffer_free, write->ring[i]);
+		VIPS_FREE(write->ring);
+	}
+
+	vips_semaphore_destroy(&write->go);
+	vips_semaphore_destroy(&write->finish);
 }
 
 /**
@@ -499,8 +661,13 @@ write_free(Write *write)
  * disc files. Things like [method@Image.jpegsave], for example, use this to write
  * images to files in JPEG format.
  *
+ * Pixels are computed into a ring of buffers, and @write_fn runs in a
+ * background thread, so computation can run ahead of a slow writer by up to
+ * the length of the ring. Use [func@sink_disc_set_buffers] to change the
+ * ring length.
+ *
  * ::: seealso
- *     [func@concurrency_set].
+ *     [func@concurrency_set], [func@sink_disc_get_stats].
  *
  * Returns: 0 on success, -1 on error.
  */
@@ -509,36 +676,42 @@ vips_sink_disc(VipsImage *im, VipsRegionWrite write_fn, void *a)
 {
 	Write write;
 	int result;
+	int i;
 
 	vips_image_preeval(im);
 
-	write_init(&write, im, write_fn, a);
-
 	result = 0;
-	if (!write.buf ||
-		!write.buf_back ||
+	if (write_init(&write, im, write_fn, a) ||
 		wbuffer_position(write.buf, 0, write.sink_base.n_lines) ||
-		vips_threadpool_run(im,
+		vips__threadpool_run_claim(im,
 			write_thread_state_new,
+			wbuffer_claim_fn,
 			wbuffer_allocate_fn,
 			wbuffer_work_fn,
 			vips_sink_base_progress,
 			&write))
 		result = -1;
 
-	/* Just before allocate signalled stop, it set write.buf writing. We
-	 * need to wait for this write to finish.
+	/* Just before allocate signalled stop, it queued write.buf. We
+	 * need to wait for this and any earlier queued writes to finish.
 	 *
-	 * We can't just free the buffers (which will wait for the bg threads
-	 * to finish), since the bg thread might see the kill before it gets a
-	 * chance to write.
+	 * We can't just free the buffers (which will kill the bg thread),
+	 * since the bg thread might see the kill before it gets a chance to
+	 * write.
 	 *
 	 * If the pool exited with an error, write.buf might not have been
-	 * started (if the allocate failed), and in any case, we don't care if
-	 * the final write went through or not.
+	 * queued (if the allocate failed), and in any case, we don't care if
+	 * the final writes went through or not.
 	 */
 	if (!result)
-		vips_semaphore_down(&write.buf->done);
+		for (i = 0; i < write.n_buffers; i++) {
+			int j = (write.front + 1 + i) % write.n_buffers;
+
+			if (write.ring[j]->queued) {
+				vips_semaphore_down(&write.ring[j]->done);
+				write.ring[j]->queued = FALSE;
+			}
+		}
 
 	vips_image_posteval(im);
 
@@ -552,3 +725,84 @@ vips_sink_disc(VipsImage *im, VipsRegionWrite write_fn, void *a)
 
 	return result;
 }
+
+/**
+ * vips_sink_disc_set_buffers:
+ * @n_buffers: number of buffers
+ * @max_mem: memory limit in bytes, or 0 for no limit
+ *
+ * Set the number of buffers [method@Image.sink_disc] computes pixels into.
+ * Computation can run ahead of the file writer by up to this many buffers,
+ * so a longer ring can help with formats that write in bursts, like PNG
+ * and JPEG, or with slow targets.
+ *
+ * The ring is shortened if it would need more than @max_mem bytes. There
+ * are always at least two buffers.
+ *
+ * The default is 2 buffers and 256mb, or the values of the
+ * `VIPS_SINK_DISC_BUFFERS` and `VIPS_SINK_DISC_MAX_MEM` environment
+ * variables.
+ *
+ * ::: seealso
+ *     [func@sink_disc_get_stats].
+ */
+void
+vips_sink_disc_set_buffers(int n_buffers, size_t max_mem)
+{
+	vips_sink_disc_n_buffers = VIPS_MAX(2, n_buffers);
+	vips_sink_disc_max_mem = max_mem;
+}
+
+/**
+ * vips_sink_disc_get_buffers:
+ *
+ * Get the number of buffers [method@Image.sink_disc] computes pixels into.
+ *
+ * ::: seealso
+ *     [func@sink_disc_set_buffers].
+ *
+ * Returns: the maximum length of the ring
+ */
+int
+vips_sink_disc_get_buffers(void)
+{
+	return vips_sink_disc_n_buffers;
+}
+
+/**
+ * vips_sink_disc_get_stats:
+ * @stall: (out) (optional): return microseconds spent waiting for the writer
+ * @write: (out) (optional): return microseconds spent writing
+ *
+ * Get the total time [method@Image.sink_disc] workers have spent stalled
+ * waiting for the file writer to hand back a buffer, and the total time
+ * spent in file writers, since libvips started.
+ *
+ * If @stall is a large fraction of run time, the writer is the bottleneck
+ * and a longer ring may help, see [func@sink_disc_set_buffers].
+ */
+void
+vips_sink_disc_get_stats(guint64 *stall, guint64 *write)
+{
+	g_mutex_lock(&vips_sink_disc_stats_lock);
+
+	if (stall)
+		*stall = vips_sink_disc_stall_time;
+	if (write)
+		*write = vips_sink_disc_write_time;
+
+	g_mutex_unlock(&vips_sink_disc_stats_lock);
+}
+
+/* Pick up the ring size from the environment.
+ */
+void
+vips__sink_disc_init(void)
+{
+	const char *str;
+
+	if ((str = g_getenv("VIPS_SINK_DISC_BUFFERS")))
+		vips_sink_disc_n_buffers = VIPS_MAX(2, atoi(str));
+	if ((str = g_getenv("VIPS_SINK_DISC_MAX_MEM")))
+		vips_sink_disc_max_mem = vips__parse_size(str);
+}
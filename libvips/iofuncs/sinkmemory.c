@@ -8,6 +8,8 @@
  * 	- from sinkdisc.c
  * 23/2/12
  * 	- we could deadlock if generate failed
+ * 18/10/26
+ * 	- workers claim tiles from the current area with an atomic counter
  */
 
 /*
@@ -61,7 +63,11 @@ typedef struct _SinkMemoryArea {
 	struct _SinkMemory *memory;
 
 	VipsRect rect;		  /* Part of image this area covers */
-	VipsSemaphore nwrite; /* Number of threads writing to this area */
+	int tile_width;		  /* Tile size for this position */
+	int tile_height;
+	int n_tiles;		  /* Number of tiles open for claims (atomic) */
+	int claim;			  /* Next tile and generation, see sink.h (atomic) */
+	VipsSemaphore nwrite; /* Number of tiles not yet written to area */
 } SinkMemoryArea;
 
 /* Per-call state.
@@ -70,7 +76,9 @@ typedef struct _SinkMemory {
 	SinkBase sink_base;
 
 	/* We are current writing tiles to area, we'll delay starting a new
-	 * area if old_area (the previous position) hasn't completed.
+	 * area if old_area (the previous position) hasn't completed. Workers
+	 * read area without a lock when they claim tiles, so swap these with
+	 * atomic ops.
 	 */
 	SinkMemoryArea *area;
 	SinkMemoryArea *old_area;
@@ -135,19 +143,27 @@ sink_memory_area_new(SinkMemory *memory)
 	if (!(area = VIPS_NEW(NULL, SinkMemoryArea)))
 		return NULL;
 	area->memory = memory;
+	area->n_tiles = 0;
+	area->claim = 0;
 	vips_semaphore_init(&area->nwrite, 0, "nwrite");
 
 	return area;
 }
 
-/* Move an area to a position.
+/* Move an area to a position. The area must be idle: all tiles claimed and
+ * written.
  */
-static void
+static int
 sink_memory_area_position(SinkMemoryArea *area, int top, int height)
 {
 	SinkMemory *memory = area->memory;
 
 	VipsRect all, rect;
+	int n_tiles;
+
+	/* Close the area to claims while we move it.
+	 */
+	g_atomic_int_set(&area->n_tiles, 0);
 
 	all.left = 0;
 	all.top = 0;
@@ -160,13 +176,71 @@ sink_memory_area_position(SinkMemoryArea *area, int top, int height)
 	rect.height = height;
 
 	vips_rect_intersectrect(&all, &rect, &area->rect);
+
+	/* Count all the tiles in as writers now. Each work unit signals one
+	 * tile done.
+	 */
+	area->tile_width = memory->sink_base.tile_width;
+	area->tile_height = memory->sink_base.tile_height;
+	if ((n_tiles = vips_sink_base_n_tiles(&area->rect,
+			 area->tile_width, area->tile_height)) < 0)
+		return -1;
+	vips_semaphore_upn(&area->nwrite, -n_tiles);
+
+	/* Open the area for claims.
+	 */
+	vips_sink_base_claim_open(&area->claim, &area->n_tiles, n_tiles);
+
+	return 0;
+}
+
+/* Try to claim the next tile in an area. This can run in many workers at
+ * once.
+ */
+static gboolean
+sink_memory_area_claim(SinkMemoryThreadState *smstate, SinkMemoryArea *area)
+{
+	VipsThreadState *state = (VipsThreadState *) smstate;
+
+	int index;
+
+	/* The area is used up, or is being moved: allocate must deal with
+	 * it.
+	 */
+	if ((index = vips_sink_base_claim(&area->claim,
+			 &area->n_tiles)) < 0)
+		return FALSE;
+
+	vips_sink_base_tile(&area->rect,
+		area->tile_width, area->tile_height, index, &state->pos);
+
+	/* The thread needs to know which area it's writing to.
+	 */
+	smstate->area = area;
+
+	VIPS_DEBUG_MSG("  %p claimed %d x %d:\n",
+		g_thread_self(), state->pos.left, state->pos.top);
+
+	return TRUE;
+}
+
+/* Our VipsThreadpoolClaim function ... grab the next tile in the current
+ * area, if there is one.
+ */
+static gboolean
+sink_memory_area_claim_fn(VipsThreadState *state, void *a)
+{
+	SinkMemory *memory = (SinkMemory *) a;
+
+	return sink_memory_area_claim((SinkMemoryThreadState *) state,
+		(SinkMemoryArea *) g_atomic_pointer_get(&memory->area));
 }
 
 /* Our VipsThreadpoolAllocate function ... move the thread to the next tile
  * that needs doing. If we fill the current area, we block until the previous
  * area is finished, then swap areas.
  *
- * If all tiles are done, we return FALSE to end iteration.
+ * If all tiles are done, we set @stop to end iteration.
  */
 static gboolean
 sink_memory_area_allocate_fn(VipsThreadState *state, void *a, gboolean *stop)
@@ -175,74 +249,47 @@ sink_memory_area_allocate_fn(VipsThreadState *state, void *a, gboolean *stop)
 	SinkMemory *memory = (SinkMemory *) a;
 	SinkBase *sink_base = (SinkBase *) memory;
 
-	VipsRect image;
-	VipsRect tile;
+	SinkMemoryArea *area;
 
 	VIPS_DEBUG_MSG("sink_memory_area_allocate_fn: %p\n", g_thread_self());
 
-	/* Is the state x/y OK? New line or maybe new buffer or maybe even
-	 * all done.
+	/* Other workers can claim from an area as soon as it's positioned,
+	 * so we may need to move on more than once.
 	 */
-	if (sink_base->x >= memory->area->rect.width) {
-		sink_base->x = 0;
-		sink_base->y += sink_base->tile_height;
-
-		if (sink_base->y >= VIPS_RECT_BOTTOM(&memory->area->rect)) {
-			/* Block until the previous area is done.
-			 */
-			if (memory->area->rect.top > 0)
-				vips_semaphore_downn(
-					&memory->old_area->nwrite, 0);
-
-			/* End of image?
-			 */
-			if (sink_base->y >= sink_base->im->Ysize) {
-				*stop = TRUE;
-				return 0;
-			}
-
-			/* Swap buffers.
-			 */
-			VIPS_SWAP(SinkMemoryArea *,
-				memory->area, memory->old_area);
-
-			/* Position buf at the new y.
-			 */
-			sink_memory_area_position(memory->area,
-				sink_base->y, sink_base->n_lines);
+	while (!sink_memory_area_claim(smstate, memory->area)) {
+		int top = VIPS_RECT_BOTTOM(&memory->area->rect);
+
+		/* Add the pixels we've just handed out to progress.
+		 */
+		sink_base->processed += (guint64) memory->area->rect.width *
+			memory->area->rect.height;
+
+		/* Block until the previous area is done.
+		 */
+		if (memory->area->rect.top > 0)
+			vips_semaphore_downn(&memory->old_area->nwrite, 0);
+
+		/* End of image?
+		 */
+		if (top >= sink_base->im->Ysize) {
+			*stop = TRUE;
+			return 0;
 		}
-	}
-
-	/* x, y and buf are good: save params for thread.
-	 */
-	image.left = 0;
-	image.top = 0;
-	image.width = sink_base->im->Xsize;
-	image.height = sink_base->im->Ysize;
-	tile.left = sink_base->x;
-	tile.top = sink_base->y;
-	tile.width = sink_base->tile_width;
-	tile.height = sink_base->tile_height;
-	vips_rect_intersectrect(&image, &tile, &state->pos);
 
-	/* The thread needs to know which area it's writing to.
-	 */
-	smstate->area = memory->area;
-
-	VIPS_DEBUG_MSG("  %p allocated %d x %d:\n",
-		g_thread_self(), state->pos.left, state->pos.top);
-
-	/* Add to the number of writers on the area.
-	 */
-	vips_semaphore_upn(&memory->area->nwrite, -1);
-
-	/* Move state on.
-	 */
-	sink_base->x += sink_base->tile_width;
+		/* Position the old area at the new y, then swap. We can
+		 * change the tile size here.
+		 */
+		vips_sink_base_adapt(sink_base);
+		if (sink_memory_area_position(memory->old_area,
+				top, sink_base->n_lines)) {
+			*stop = TRUE;
+			return -1;
+		}
 
-	/* Add the number of pixels we've just allocated to progress.
-	 */
-	sink_base->processed += (guint64) state->pos.width * state->pos.height;
+		area = memory->old_area;
+		memory->old_area = memory->area;
+		g_atomic_pointer_set(&memory->area, area);
+	}
 
 	return 0;
 }
@@ -255,6 +302,7 @@ sink_memory_area_work_fn(VipsThreadState *state, void *a)
 	SinkMemory *memory = (SinkMemory *) a;
 	SinkMemoryThreadState *smstate = (SinkMemoryThreadState *) state;
 	SinkMemoryArea *area = smstate->area;
+	gint64 start = vips_sink_base_unit_start(&memory->sink_base);
 
 	int result;
 
@@ -267,6 +315,8 @@ sink_memory_area_work_fn(VipsThreadState *state, void *a)
 	VIPS_DEBUG_MSG("sink_memory_area_work_fn: %p result = %d\n",
 		g_thread_self(), result);
 
+	vips_sink_base_unit_done(&memory->sink_base, start);
+
 	/* Tell the allocator we're done.
 	 */
 	vips_semaphore_upn(&area->nwrite, 1);
@@ -331,13 +381,17 @@ vips_sink_memory(VipsImage *image)
 
 	vips_image_preeval(image);
 
-	sink_memory_area_position(memory.area, 0, memory.sink_base.n_lines);
-	result = vips_threadpool_run(image,
-		sink_memory_thread_state_new,
-		sink_memory_area_allocate_fn,
-		sink_memory_area_work_fn,
-		vips_sink_base_progress,
-		&memory);
+	result = 0;
+	if (sink_memory_area_position(memory.area,
+			0, memory.sink_base.n_lines) ||
+		vips__threadpool_run_claim(image,
+			sink_memory_thread_state_new,
+			sink_memory_area_claim_fn,
+			sink_memory_area_allocate_fn,
+			sink_memory_area_work_fn,
+			vips_sink_base_progress,
+			&memory))
+		result = -1;
 
 	vips_image_posteval(image);
 
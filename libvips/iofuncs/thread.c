@@ -2,6 +2,8 @@
  *
  * 29/9/22
  * 	- from threadpool.c
+ * 18/10/26
+ * 	- add NUMA mode
  */
 
 /*
@@ -36,6 +38,10 @@
 #define VIPS_DEBUG_RED
  */
 
+/* sched_getcpu() and the CPU_SET() family are non-portable GNU extensions.
+ */
+#define _GNU_SOURCE
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif /*HAVE_CONFIG_H*/
@@ -43,6 +49,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#if defined(HAVE_SCHED_GETCPU) && defined(HAVE_SCHED_SETAFFINITY)
+#define HAVE_NUMA
+#include <sched.h>
+#endif /*defined(HAVE_SCHED_GETCPU) && defined(HAVE_SCHED_SETAFFINITY)*/
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif /*HAVE_UNISTD_H*/
@@ -65,6 +75,15 @@
  */
 int vips__concurrency = 0;
 
+/* Max n threads shared by all threadpools ... 0 means get from environment,
+ * -1 means no limit.
+ */
+int vips__concurrency_total = 0;
+
+/* Pin workers to the NUMA node of the thread that starts a pipeline.
+ */
+gboolean vips__numa = FALSE;
+
 /* Default tile geometry ... can be set by vips_init().
  */
 int vips__tile_width = VIPS__TILE_WIDTH;
@@ -72,6 +91,11 @@ int vips__tile_height = VIPS__TILE_HEIGHT;
 int vips__fatstrip_height = VIPS__FATSTRIP_HEIGHT;
 int vips__thinstrip_height = VIPS__THINSTRIP_HEIGHT;
 
+/* The time in microseconds we'd like each work unit to take. Sinks resize
+ * tiles to hit this. 0 means fixed tile geometry.
+ */
+int vips__tile_target = 0;
+
 /* Set this GPrivate to indicate that is a libvips thread.
  */
 static GPrivate is_vips_thread_key;
@@ -114,6 +138,32 @@ vips_thread_run(gpointer data)
 	return result;
 }
 
+/* As vips_g_thread_new(), but leave any failure in @error rather than the
+ * vips error buffer, for callers that can carry on without a thread.
+ */
+GThread *
+vips__g_thread_try_new(const char *domain, GThreadFunc func, gpointer data,
+	GError **error)
+{
+	GThread *thread;
+	VipsThreadInfo *info;
+
+	info = g_new(VipsThreadInfo, 1);
+	info->domain = domain;
+	info->func = func;
+	info->data = data;
+
+	thread = g_thread_try_new(domain, vips_thread_run, info, error);
+
+	VIPS_DEBUG_MSG_RED("vips_g_thread_new: g_thread_create(%s) = %p\n",
+		domain, thread);
+
+	if (!thread)
+		g_free(info);
+
+	return thread;
+}
+
 /**
  * vips_g_thread_new:
  * @domain: (nullable): an (optional) name for the new thread
@@ -129,20 +179,9 @@ GThread *
 vips_g_thread_new(const char *domain, GThreadFunc func, gpointer data)
 {
 	GThread *thread;
-	VipsThreadInfo *info;
 	GError *error = NULL;
 
-	info = g_new(VipsThreadInfo, 1);
-	info->domain = domain;
-	info->func = func;
-	info->data = data;
-
-	thread = g_thread_try_new(domain, vips_thread_run, info, &error);
-
-	VIPS_DEBUG_MSG_RED("vips_g_thread_new: g_thread_create(%s) = %p\n",
-		domain, thread);
-
-	if (!thread) {
+	if (!(thread = vips__g_thread_try_new(domain, func, data, &error))) {
 		if (error)
 			vips_g_error(&error);
 		else
@@ -188,6 +227,22 @@ vips__concurrency_get_default(void)
 	return nthr;
 }
 
+/* The default total concurrency, set by the environment variable
+ * VIPS_CONCURRENCY_TOTAL, or if that is not set, no limit.
+ */
+static int
+vips__concurrency_total_get_default(void)
+{
+	const char *str;
+	int x;
+
+	if ((str = g_getenv("VIPS_CONCURRENCY_TOTAL")) &&
+		(x = atoi(str)) > 0)
+		return VIPS_MIN(x, MAX_THREADS);
+
+	return -1;
+}
+
 /**
  * vips_concurrency_set:
  * @concurrency: number of threads to run
@@ -249,6 +304,243 @@ vips_concurrency_get(void)
 	return vips__concurrency;
 }
 
+/**
+ * vips_concurrency_set_total:
+ * @total: max number of worker threads across all threadpools
+ *
+ * Sets the maximum number of worker threads that all calls to
+ * [func@threadpool_run] can use between them. This is useful for servers
+ * which process many images at once: without a limit, each image being
+ * computed can start up to [func@concurrency_get] threads.
+ *
+ * Running threadpools share the workers fairly. Each threadpool can always
+ * run at least one worker, so the true number of workers can go over the
+ * limit if more than @total images are being computed at once.
+ *
+ * The special value 0 means "default". In this case, the limit is set by
+ * the environment variable `VIPS_CONCURRENCY_TOTAL`, or if that is not set,
+ * there is no limit. Use -1 for no limit.
+ *
+ * ::: seealso
+ *     [func@concurrency_get_total], [func@concurrency_set].
+ */
+void
+vips_concurrency_set_total(int total)
+{
+	if (total == 0)
+		total = vips__concurrency_total_get_default();
+	else if (total < 0)
+		total = -1;
+	else if (total > MAX_THREADS) {
+		total = MAX_THREADS;
+
+		g_warning("threads clipped to %d", MAX_THREADS);
+	}
+
+	vips__concurrency_total = total;
+}
+
+/**
+ * vips_concurrency_get_total:
+ *
+ * Returns the maximum number of worker threads that all calls to
+ * [func@threadpool_run] can use between them, or -1 for no limit.
+ *
+ * You can also use the command-line argument `--vips-concurrency-total` or
+ * the environment variable `VIPS_CONCURRENCY_TOTAL` to set this value.
+ *
+ * ::: seealso
+ *     [func@concurrency_set_total].
+ *
+ * Returns: max number of worker threads across all threadpools.
+ */
+int
+vips_concurrency_get_total(void)
+{
+	return vips__concurrency_total;
+}
+
+#ifdef HAVE_NUMA
+/* Don't look for more than this many nodes.
+ */
+#define MAX_NODES (64)
+
+/* The CPUs we were started with, and the subset of those CPUs in each NUMA
+ * node.
+ */
+static cpu_set_t vips__numa_all;
+static cpu_set_t vips__numa_node[MAX_NODES];
+static int vips__numa_n_nodes = 0;
+
+/* Parse a sysfs cpulist, eg. "0-7,16-23".
+ */
+static void
+vips__numa_parse_cpulist(const char *str, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+
+	while (*str) {
+		char *end;
+		long first;
+		long last;
+
+		first = last = strtol(str, &end, 10);
+		if (end == str)
+			break;
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str)
+				break;
+		}
+
+		for (long i = VIPS_MAX(0, first);
+			 i <= last && i < CPU_SETSIZE; i++)
+			CPU_SET(i, set);
+
+		str = end;
+		if (*str != ',')
+			break;
+		str += 1;
+	}
+}
+
+static void *
+vips__numa_init(void *data)
+{
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &vips__numa_all))
+		return NULL;
+
+	for (int i = 0; i < MAX_NODES; i++) {
+		char filename[VIPS_PATH_MAX];
+		char *cpulist;
+		cpu_set_t node;
+
+		g_snprintf(filename, VIPS_PATH_MAX,
+			"/sys/devices/system/node/node%d/cpulist", i);
+		if (!g_file_get_contents(filename, &cpulist, NULL, NULL))
+			break;
+		vips__numa_parse_cpulist(cpulist, &node);
+		g_free(cpulist);
+
+		/* Only the CPUs we're allowed to run on.
+		 */
+		CPU_AND(&vips__numa_node[i], &node, &vips__numa_all);
+		vips__numa_n_nodes = i + 1;
+	}
+
+	g_info("found %d NUMA nodes", vips__numa_n_nodes);
+
+	return NULL;
+}
+#endif /*HAVE_NUMA*/
+
+/* The NUMA node the calling thread is running on, or -1 if NUMA mode is off,
+ * or if there's only one node.
+ */
+int
+vips__numa_node_current(void)
+{
+#ifdef HAVE_NUMA
+	static GOnce once = G_ONCE_INIT;
+
+	int cpu;
+
+	if (!vips__numa)
+		return -1;
+
+	VIPS_ONCE(&once, vips__numa_init, NULL);
+
+	if (vips__numa_n_nodes < 2 ||
+		(cpu = sched_getcpu()) < 0 ||
+		cpu >= CPU_SETSIZE)
+		return -1;
+
+	for (int i = 0; i < vips__numa_n_nodes; i++)
+		if (CPU_ISSET(cpu, &vips__numa_node[i]))
+			return i;
+#endif /*HAVE_NUMA*/
+
+	return -1;
+}
+
+/* The number of CPUs we can use in a node.
+ */
+int
+vips__numa_node_n_cpus(int node)
+{
+#ifdef HAVE_NUMA
+	if (node >= 0 &&
+		node < vips__numa_n_nodes)
+		return CPU_COUNT(&vips__numa_node[node]);
+#endif /*HAVE_NUMA*/
+
+	return vips_concurrency_get();
+}
+
+/* Pin the calling thread to a node, or unpin it with -1. Threads are reused,
+ * so workers must unpin before they finish.
+ */
+void
+vips__numa_pin(int node)
+{
+#ifdef HAVE_NUMA
+	cpu_set_t *set;
+
+	if (vips__numa_n_nodes < 2)
+		return;
+
+	set = node >= 0 && node < vips__numa_n_nodes
+		? &vips__numa_node[node]
+		: &vips__numa_all;
+	if (CPU_COUNT(set) > 0 &&
+		sched_setaffinity(0, sizeof(cpu_set_t), set))
+		g_info("unable to set thread affinity");
+#endif /*HAVE_NUMA*/
+}
+
+/**
+ * vips_concurrency_set_numa:
+ * @numa: enable NUMA mode
+ *
+ * Enable or disable NUMA mode. In NUMA mode, workers are pinned to the NUMA
+ * node of the thread that started the computation. Pixel buffers are
+ * allocated by the workers which first write to them, so they stay on that
+ * node, and the background writer in [method@Image.sink_disc] runs there too.
+ *
+ * Each computation can then only use the cores in one node, so this mode is
+ * useful for servers which compute many images at once on machines with
+ * several sockets, and should usually be left off otherwise.
+ *
+ * This only has an effect on Linux with more than one NUMA node. You can
+ * also enable NUMA mode with the environment variable `VIPS_NUMA` or the
+ * command-line argument `--vips-numa`.
+ *
+ * ::: seealso
+ *     [func@concurrency_get_numa], [func@concurrency_set].
+ */
+void
+vips_concurrency_set_numa(gboolean numa)
+{
+	vips__numa = numa;
+}
+
+/**
+ * vips_concurrency_get_numa:
+ *
+ * Find out if NUMA mode is enabled.
+ *
+ * ::: seealso
+ *     [func@concurrency_set_numa].
+ *
+ * Returns: `TRUE` if NUMA mode is enabled.
+ */
+gboolean
+vips_concurrency_get_numa(void)
+{
+	return vips__numa;
+}
+
 /**
  * vips_get_tile_size: (method)
  * @im: image to guess for
@@ -263,6 +555,12 @@ vips_concurrency_get(void)
  * The buffer height is the height of each buffer we fill in sink disc. Since
  * we have two buffers, the largest range of input locality is twice the output
  * buffer size, plus whatever margin we add for things like convolution.
+ *
+ * This is only a starting point. If you set the environment variable
+ * `VIPS_TILE_TARGET` or the command-line argument `--vips-tile-target` to a
+ * time in microseconds, sinks will time the first few tiles and then
+ * grow or shrink them between buffers to get close to that time per tile.
+ * Tile height is always kept a factor of the buffer height.
  */
 void
 vips_get_tile_size(VipsImage *im,
@@ -334,6 +632,17 @@ vips_get_tile_size(VipsImage *im,
 void
 vips__thread_init(void)
 {
+	const char *str;
+
 	if (vips__concurrency == 0)
 		vips__concurrency = vips__concurrency_get_default();
+	if (vips__concurrency_total == 0)
+		vips__concurrency_total = vips__concurrency_total_get_default();
+	else if (vips__concurrency_total > MAX_THREADS)
+		vips__concurrency_total = MAX_THREADS;
+	if (g_getenv("VIPS_NUMA"))
+		vips__numa = TRUE;
+	if (vips__tile_target == 0 &&
+		(str = g_getenv("VIPS_TILE_TARGET")))
+		vips__tile_target = VIPS_MAX(0, atoi(str));
 }
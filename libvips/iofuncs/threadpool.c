@@ -23,6 +23,10 @@
  * 	- don't depend on image width when setting n_lines
  * 27/2/19 jtorresfabra
  * 	- free threadpool earlier
+ * 18/10/26
+ * 	- add claim, a lock-free way to get work units
+ * 	- share vips_concurrency_get_total() workers between all threadpools
+ * 	- pin workers to a NUMA node in NUMA mode
  */
 
 /*
@@ -106,6 +110,13 @@ static GPrivate worker_key;
  */
 #define MAX_THREADS (1024)
 
+/* The number of workers running in all threadpools, and the number of
+ * threadpools running. We use these to share vips_concurrency_get_total()
+ * workers between pools.
+ */
+static int vips__n_workers = 0; // (atomic)
+static int vips__n_pools = 0;	// (atomic)
+
 /* Start up threadpools. This is called during vips_init.
  */
 void
@@ -151,6 +162,17 @@ vips_thread_execute(const char *domain, GFunc func, gpointer data)
 	return vips_threadset_run(vips__threadset, domain, func, data);
 }
 
+/* Run @func in a thread from the threadset, or in the calling thread if we
+ * can't start one. Running inline is a fallback, not an error, so this never
+ * touches the error buffer, which other threads and the caller share.
+ */
+void
+vips__thread_execute_or_run(const char *domain, GFunc func, gpointer data)
+{
+	if (vips__threadset_try_run(vips__threadset, domain, func, data))
+		func(data, NULL);
+}
+
 G_DEFINE_TYPE(VipsThreadState, vips_thread_state, VIPS_TYPE_OBJECT);
 
 static void
@@ -242,8 +264,12 @@ typedef struct _VipsThreadpool {
 	/* Start a thread, do a unit of work (runs in parallel) and allocate
 	 * a unit of work (serial). Plus the mutex we use to serialize work
 	 * allocation.
+	 *
+	 * Claim is optional. If set, workers try it first to get a unit of
+	 * work without taking allocate_lock.
 	 */
 	VipsThreadStartFn start;
+	VipsThreadpoolClaimFn claim;
 	VipsThreadpoolAllocateFn allocate;
 	VipsThreadpoolWorkFn work;
 	GMutex allocate_lock;
@@ -251,6 +277,10 @@ typedef struct _VipsThreadpool {
 
 	int max_workers; /* Max number of workers in pool */
 
+	/* In NUMA mode, pin workers to this node. -1 for no pinning.
+	 */
+	int node;
+
 	/* The number of workers in the pool (as a negative number, so
 	 * -4 means 4 workers are running).
 	 */
@@ -296,18 +326,51 @@ vips_worker_allocate(VipsWorker *worker)
 	return 0;
 }
 
-/* Run this once per main loop. Get some work (single-threaded), then do it
- * (many-threaded).
+/* Has a thread been asked to exit? Grab the flag and stop if yes.
+ *
+ * This runs for every tile, so test with a plain read first and only write
+ * to the shared counter when a shrink is pending.
  */
-static void
-vips_worker_work_unit(VipsWorker *worker)
+static gboolean
+vips_worker_volunteer_exit(VipsWorker *worker)
 {
 	VipsThreadpool *pool = worker->pool;
 
+	int exit;
+
+	do {
+		exit = g_atomic_int_get(&pool->exit);
+		if (exit <= 0)
+			return FALSE;
+	} while (!g_atomic_int_compare_and_exchange(&pool->exit,
+		exit, exit - 1));
+
+	/* A thread had been asked to exit, and we've grabbed the flag.
+	 */
+	worker->stop = TRUE;
+
+	return TRUE;
+}
+
+/* Get a unit of work with allocate (single-threaded). Return FALSE if
+ * this worker should stop.
+ */
+static gboolean
+vips_worker_allocate_serial(VipsWorker *worker)
+{
+	VipsThreadpool *pool = worker->pool;
+
+	gint64 start;
+
 	VIPS_GATE_START("vips_worker_work_unit: wait");
 
+	start = vips__profile_summary ? g_get_monotonic_time() : 0;
+
 	vips__worker_lock(&pool->allocate_lock);
 
+	if (vips__profile_summary && start)
+		vips__profile_allocate_wait(g_get_monotonic_time() - start);
+
 	VIPS_GATE_STOP("vips_worker_work_unit: wait");
 
 	/* Has another worker signaled stop while we've been waiting?
@@ -315,31 +378,21 @@ vips_worker_work_unit(VipsWorker *worker)
 	if (pool->stop) {
 		worker->stop = TRUE;
 		g_mutex_unlock(&pool->allocate_lock);
-		return;
+		return FALSE;
 	}
 
 	/* Has a thread been asked to exit? Volunteer if yes.
 	 */
-	if (g_atomic_int_add(&pool->exit, -1) > 0) {
-		/* A thread had been asked to exit, and we've grabbed the
-		 * flag.
-		 */
-		worker->stop = TRUE;
+	if (vips_worker_volunteer_exit(worker)) {
 		g_mutex_unlock(&pool->allocate_lock);
-		return;
-	}
-	else {
-		/* No one had been asked to exit and we've mistakenly taken
-		 * the exit count below zero. Put it back up again.
-		 */
-		g_atomic_int_inc(&pool->exit);
+		return FALSE;
 	}
 
 	if (vips_worker_allocate(worker)) {
 		pool->error = TRUE;
 		worker->stop = TRUE;
 		g_mutex_unlock(&pool->allocate_lock);
-		return;
+		return FALSE;
 	}
 
 	/* Have we just signalled stop?
@@ -347,11 +400,44 @@ vips_worker_work_unit(VipsWorker *worker)
 	if (pool->stop) {
 		worker->stop = TRUE;
 		g_mutex_unlock(&pool->allocate_lock);
-		return;
+		return FALSE;
 	}
 
 	g_mutex_unlock(&pool->allocate_lock);
 
+	return TRUE;
+}
+
+/* Run this once per main loop. Get some work (lock-free if we can,
+ * single-threaded if we can't), then do it (many-threaded).
+ */
+static void
+vips_worker_work_unit(VipsWorker *worker)
+{
+	VipsThreadpool *pool = worker->pool;
+
+	gboolean claimed;
+
+	/* Try to claim a unit without allocate_lock. We need the per-thread
+	 * state for this, and only allocate can build that, so the first unit
+	 * for each worker always comes from allocate.
+	 *
+	 * Claim never takes allocate_lock, so we must check for exit here too,
+	 * or the pool can't shrink while claim succeeds.
+	 */
+	claimed = FALSE;
+	if (pool->claim &&
+		worker->state) {
+		if (vips_worker_volunteer_exit(worker))
+			return;
+
+		claimed = pool->claim(worker->state, pool->a);
+	}
+
+	if (!claimed &&
+		!vips_worker_allocate_serial(worker))
+		return;
+
 	if (worker->state->stall &&
 		vips__stall) {
 		/* Sleep for 0.5s. Handy for stressing the seq system. Stall
@@ -371,6 +457,58 @@ vips_worker_work_unit(VipsWorker *worker)
 	}
 }
 
+/* The number of workers a pool can have if it's to get no more than its
+ * fair share of the process-wide limit, or 0 for no limit.
+ */
+static int
+vips_threadpool_fair_share(void)
+{
+	int total = vips_concurrency_get_total();
+
+	if (total <= 0)
+		return 0;
+
+	return VIPS_MAX(1, total / VIPS_MAX(1, g_atomic_int_get(&vips__n_pools)));
+}
+
+/* Take a worker from the process-wide limit. A pool can always have one
+ * worker (so nested pools can't deadlock), any more must fit in both the
+ * pool's fair share and the total.
+ */
+static gboolean
+vips_threadpool_worker_take(int n_working)
+{
+	int total = vips_concurrency_get_total();
+	int share = vips_threadpool_fair_share();
+	int n_workers;
+
+	if (n_working == 0 ||
+		total <= 0) {
+		g_atomic_int_inc(&vips__n_workers);
+		return TRUE;
+	}
+
+	if (n_working >= share)
+		return FALSE;
+
+	do {
+		n_workers = g_atomic_int_get(&vips__n_workers);
+		if (n_workers >= total)
+			return FALSE;
+	} while (!g_atomic_int_compare_and_exchange(&vips__n_workers,
+		n_workers, n_workers + 1));
+
+	return TRUE;
+}
+
+/* Give workers back to the process-wide limit.
+ */
+static void
+vips_threadpool_worker_release(int n)
+{
+	g_atomic_int_add(&vips__n_workers, -n);
+}
+
 /* What runs as a thread ... loop, waiting to be told to do stuff.
  */
 static void
@@ -383,6 +521,9 @@ vips_thread_main_loop(void *a, void *b)
 
 	g_private_set(&worker_key, worker);
 
+	if (pool->node >= 0)
+		vips__numa_pin(pool->node);
+
 	/* Process work units! Always tick, even if we are stopping, so the
 	 * main thread will wake up for exit.
 	 */
@@ -409,6 +550,16 @@ vips_thread_main_loop(void *a, void *b)
 	VIPS_FREE(worker);
 	g_private_set(&worker_key, NULL);
 
+	/* This thread will be reused, perhaps by a pool on another node.
+	 */
+	if (pool->node >= 0)
+		vips__numa_pin(-1);
+
+	/* Only give our slot back once we've really left the pool, or the
+	 * process-wide limit could be exceeded.
+	 */
+	vips_threadpool_worker_release(1);
+
 	/* We are done: tell the main thread.
 	 */
 	vips_semaphore_upn(&pool->n_workers, 1);
@@ -501,10 +652,12 @@ vips_threadpool_new(VipsImage *im)
 	if (!(pool = VIPS_NEW(NULL, VipsThreadpool)))
 		return NULL;
 	pool->im = im;
+	pool->claim = NULL;
 	pool->allocate = NULL;
 	pool->work = NULL;
 	g_mutex_init(&pool->allocate_lock);
 	pool->max_workers = vips_concurrency_get();
+	pool->node = vips__numa_node_current();
 	vips_semaphore_init(&pool->n_workers, 0, "n_workers");
 	vips_semaphore_init(&pool->tick, 0, "tick");
 	pool->error = FALSE;
@@ -522,6 +675,12 @@ vips_threadpool_new(VipsImage *im)
 	n_tiles = VIPS_CLIP(1, n_tiles, 1024);
 	pool->max_workers = VIPS_MIN(pool->max_workers, n_tiles);
 
+	/* In NUMA mode, we only have the CPUs in our node.
+	 */
+	if (pool->node >= 0)
+		pool->max_workers = VIPS_MIN(pool->max_workers,
+			VIPS_MAX(1, vips__numa_node_n_cpus(pool->node)));
+
 	/* VIPS_META_CONCURRENCY on the image can optionally override
 	 * concurrency.
 	 */
@@ -633,6 +792,25 @@ vips_threadpool_run(VipsImage *im,
 	VipsThreadpoolWorkFn work,
 	VipsThreadpoolProgressFn progress,
 	void *a)
+{
+	return vips__threadpool_run_claim(im,
+		start, NULL, allocate, work, progress, a);
+}
+
+/* As vips_threadpool_run(), but workers try @claim before they queue up for
+ * @allocate. Sinks which can hand out most of their work units with a
+ * single atomic op use this to avoid serialising all workers on
+ * allocate_lock. @claim may be NULL, in which case every unit comes from
+ * @allocate.
+ */
+int
+vips__threadpool_run_claim(VipsImage *im,
+	VipsThreadStartFn start,
+	VipsThreadpoolClaimFn claim,
+	VipsThreadpoolAllocateFn allocate,
+	VipsThreadpoolWorkFn work,
+	VipsThreadpoolProgressFn progress,
+	void *a)
 {
 	VipsThreadpool *pool;
 	int result;
@@ -643,20 +821,31 @@ vips_threadpool_run(VipsImage *im,
 		return -1;
 
 	pool->start = start;
+	pool->claim = claim;
 	pool->allocate = allocate;
 	pool->work = work;
 	pool->a = a;
 
+	g_atomic_int_inc(&vips__n_pools);
+
 	/* Start with half of the max number of threads, then let it drift up
 	 * and down with load.
 	 */
-	for (n_working = 0; n_working < 1 + pool->max_workers / 2; n_working++)
+	for (n_working = 0; n_working < 1 + pool->max_workers / 2; n_working++) {
+		if (!vips_threadpool_worker_take(n_working))
+			break;
+
 		if (vips_worker_new(pool)) {
+			vips_threadpool_worker_release(1);
+			g_atomic_int_add(&vips__n_pools, -1);
 			vips_threadpool_free(pool);
 			return -1;
 		}
+	}
 
 	for (;;) {
+		int share;
+
 		/* Wait for a tick from a worker.
 		 */
 		vips_semaphore_down(&pool->tick);
@@ -676,20 +865,29 @@ vips_threadpool_run(VipsImage *im,
 			break;
 
 		n_waiting = g_atomic_int_get(&pool->n_waiting);
+		share = vips_threadpool_fair_share();
 		VIPS_DEBUG_MSG("n_waiting = %d\n", n_waiting);
 		VIPS_DEBUG_MSG("n_working = %d\n", n_working);
 		VIPS_DEBUG_MSG("exit = %d\n", pool->exit);
 
-		if (n_waiting > 3 &&
+		/* Shrink if workers are stalled, or if other pools have started
+		 * and we're now over our share of the total.
+		 */
+		if ((n_waiting > 3 ||
+				(share > 0 &&
+					n_working > share)) &&
 			n_working > 1) {
 			VIPS_DEBUG_MSG("shrinking thread pool\n");
 			g_atomic_int_inc(&pool->exit);
 			n_working -= 1;
 		}
 		else if (n_waiting < 2 &&
-			n_working < pool->max_workers) {
+			n_working < pool->max_workers &&
+			vips_threadpool_worker_take(n_working)) {
 			VIPS_DEBUG_MSG("expanding thread pool\n");
 			if (vips_worker_new(pool)) {
+				vips_threadpool_worker_release(1);
+				g_atomic_int_add(&vips__n_pools, -1);
 				vips_threadpool_free(pool);
 				return -1;
 			}
@@ -707,6 +905,8 @@ vips_threadpool_run(VipsImage *im,
 
 	vips_threadpool_free(pool);
 
+	g_atomic_int_add(&vips__n_pools, -1);
+
 	if (!vips_image_get_concurrency(im, 0))
 		g_info("threadpool completed with %d workers", n_working);
 
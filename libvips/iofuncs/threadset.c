@@ -210,10 +210,10 @@ vips_threadset_work(void *pointer)
 	return NULL;
 }
 
-/* Add a new thread to the set.
+/* Add a new thread to the set. Failure is left in @error.
  */
 static gboolean
-vips_threadset_add_thread(VipsThreadset *set)
+vips_threadset_add_thread(VipsThreadset *set, GError **error)
 {
 	gboolean reused = FALSE;
 
@@ -235,8 +235,8 @@ vips_threadset_add_thread(VipsThreadset *set)
 		 */
 		GThread *thread;
 
-		if (!(thread = vips_g_thread_new("libvips worker",
-				  vips_threadset_work, set)))
+		if (!(thread = vips__g_thread_try_new("libvips worker",
+				  vips_threadset_work, set, error)))
 			return FALSE;
 
 		/* Ensure threads are freed on exit.
@@ -288,25 +288,11 @@ vips_threadset_new(int max_threads)
 	return set;
 }
 
-/**
- * vips_threadset_run:
- * @set: the threadset to run the task in
- * @domain: the name of the task (useful for debugging)
- * @func: (scope async) (closure data): the task to execute
- * @data: (nullable): the task's data
- *
- * Execute a task in a thread. If there are no idle threads and the maximum
- * thread limit specified by @max_threads has not been reached, a new thread
- * will be spawned.
- *
- * ::: seealso
- *     [ctor@Threadset.new].
- *
- * Returns: 0 on success, or -1 on error.
+/* Run a task, leaving any failure to start a thread in @error.
  */
-int
-vips_threadset_run(VipsThreadset *set,
-	const char *domain, GFunc func, gpointer data)
+static int
+vips_threadset_run_error(VipsThreadset *set,
+	const char *domain, GFunc func, gpointer data, GError **error)
 {
 	VipsThreadExec *task;
 
@@ -317,7 +303,7 @@ vips_threadset_run(VipsThreadset *set,
 	 * oversubscription by threads that haven't started yet.
 	 */
 	if (g_async_queue_length_unlocked(set->queue) >= set->queue_guard)
-		if (!vips_threadset_add_thread(set)) {
+		if (!vips_threadset_add_thread(set, error)) {
 			g_async_queue_unlock(set->queue);
 
 			/* Thread create has failed.
@@ -338,6 +324,56 @@ vips_threadset_run(VipsThreadset *set,
 	return 0;
 }
 
+/**
+ * vips_threadset_run:
+ * @set: the threadset to run the task in
+ * @domain: the name of the task (useful for debugging)
+ * @func: (scope async) (closure data): the task to execute
+ * @data: (nullable): the task's data
+ *
+ * Execute a task in a thread. If there are no idle threads and the maximum
+ * thread limit specified by @max_threads has not been reached, a new thread
+ * will be spawned.
+ *
+ * ::: seealso
+ *     [ctor@Threadset.new].
+ *
+ * Returns: 0 on success, or -1 on error.
+ */
+int
+vips_threadset_run(VipsThreadset *set,
+	const char *domain, GFunc func, gpointer data)
+{
+	GError *error = NULL;
+
+	if (vips_threadset_run_error(set, domain, func, data, &error)) {
+		if (error)
+			vips_g_error(&error);
+		else
+			vips_error(domain,
+				"%s", _("unable to create thread"));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* As vips_threadset_run(), but don't touch the error buffer on failure.
+ */
+int
+vips__threadset_try_run(VipsThreadset *set,
+	const char *domain, GFunc func, gpointer data)
+{
+	GError *error = NULL;
+
+	if (vips_threadset_run_error(set, domain, func, data, &error)) {
+		g_clear_error(&error);
+		return -1;
+	}
+
+	return 0;
+}
+
 /**
  * vips_threadset_free:
  * @set: the threadset to free
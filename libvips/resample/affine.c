@@ -90,6 +90,8 @@
  * 	- premultiply alpha
  * 18/5/20
  * 	- add "premultiplied" flag
+ * 18/10/26
+ * 	- interpolate runs of in-range pixels with a single span call
  */
 
 /*
@@ -223,6 +225,14 @@ vips_affine_dispose(GObject *gobject)
  * output image, and that affinei_gen() is asked for.
  */
 
+/* Clip a position in space 2 against iarea.
+ */
+#define INSIDE(IX, IY) \
+	((int) floor(IX) >= ile && \
+		(int) floor(IX) <= iri && \
+		(int) floor(IY) >= ito && \
+		(int) floor(IY) <= ibo)
+
 static int
 vips_affine_gen(VipsRegion *out_region,
 	void *seq, void *a, void *b, gboolean *stop)
@@ -233,8 +243,8 @@ vips_affine_gen(VipsRegion *out_region,
 	VipsInterpolate *interpolate = affine->affine_interpolate;
 	const int window_size = vips_interpolate_get_window_size(interpolate);
 	const int window_offset = vips_interpolate_get_window_offset(interpolate);
-	const VipsInterpolateMethod interpolate_method =
-		vips_interpolate_get_method(interpolate);
+	const VipsInterpolateSpanMethod interpolate_span =
+		vips_interpolate_get_span_method(interpolate);
 
 	/* Area we generate in the output image.
 	 */
@@ -363,42 +373,53 @@ vips_affine_gen(VipsRegion *out_region,
 
 		q = VIPS_REGION_ADDR(out_region, le, y);
 
-		for (x = le; x < ri; x++) {
-			int fx, fy;
+		x = le;
+		while (x < ri) {
+			/* Start of this run.
+			 */
+			const double sx = ix;
+			const double sy = iy;
 
-			fx = floor(ix);
-			fy = floor(iy);
+			int n;
 
-			/* Clip against iarea.
+			/* Find the run of pixels we can interpolate. We step
+			 * exactly as the span method will, so we agree about
+			 * every position.
 			 */
-			if (fx >= ile &&
-				fx <= iri &&
-				fy >= ito &&
-				fy <= ibo) {
-				/* Verify that we can read the whole stencil.
-				 * With DEBUG on this will range-check.
+			for (n = 0; x + n < ri && INSIDE(ix, iy); n++) {
+				ix += ddx;
+				iy += ddy;
+			}
+
+			if (n > 0) {
+				/* Verify that we can read the stencil at the
+				 * start. With DEBUG on this will range-check.
 				 */
 				g_assert(VIPS_REGION_ADDR(ir,
-					(int) ix - window_offset,
-					(int) iy - window_offset));
+					(int) sx - window_offset,
+					(int) sy - window_offset));
 				g_assert(VIPS_REGION_ADDR(ir,
-					(int) ix - window_offset +
-						window_size - 1,
-					(int) iy - window_offset +
-						window_size - 1));
+					(int) sx - window_offset + window_size - 1,
+					(int) sy - window_offset + window_size - 1));
+
+				interpolate_span(interpolate, q, ir,
+					sx, sy, ddx, ddy, n);
 
-				interpolate_method(interpolate, q, ir, ix, iy);
+				x += n;
+				q += n * ps;
 			}
-			else {
-				/* Out of range: paint the background.
-				 */
+
+			/* Out of range: paint the background.
+			 */
+			while (x < ri && !INSIDE(ix, iy)) {
 				for (z = 0; z < ps; z++)
 					q[z] = affine->ink[z];
-			}
 
-			ix += ddx;
-			iy += ddy;
-			q += ps;
+				ix += ddx;
+				iy += ddy;
+				q += ps;
+				x += 1;
+			}
 		}
 	}
 
@@ -4,6 +4,8 @@
  * 	- revise window_size / window_offset stuff again
  * 7/2/16
  * 	- double intermediate for 32-bit int types
+ * 18/10/26
+ * 	- add interpolate_span, with a vector path for uchar
  */
 
 /*
@@ -50,8 +52,10 @@
 #include <cstdlib>
 
 #include <vips/vips.h>
+#include <vips/vector.h>
 #include <vips/internal.h>
 
+#include "presample.h"
 #include "templates.h"
 
 #define VIPS_TYPE_INTERPOLATE_BICUBIC \
@@ -484,9 +488,8 @@ static void inline bicubic_notab(void *pout, const VipsPel *pin,
 	}
 }
 
-static void
-vips_interpolate_bicubic_interpolate(VipsInterpolate *interpolate,
-	void *out, VipsRegion *in, double x, double y)
+static void inline
+vips_interpolate_bicubic_pixel(void *out, VipsRegion *in, double x, double y)
 {
 	/* Find the mask index. We round-to-nearest, so we need to generate
 	 * indexes in 0 to VIPS_TRANSFORM_SCALE, 2^n + 1 values. We multiply
@@ -618,6 +621,44 @@ vips_interpolate_bicubic_interpolate(VipsInterpolate *interpolate,
 	}
 }
 
+static void
+vips_interpolate_bicubic_interpolate(VipsInterpolate *interpolate,
+	void *out, VipsRegion *in, double x, double y)
+{
+	vips_interpolate_bicubic_pixel(out, in, x, y);
+}
+
+static void
+vips_interpolate_bicubic_interpolate_span(VipsInterpolate *interpolate,
+	void *out, VipsRegion *in,
+	double x, double y, double dx, double dy, int n)
+{
+	const int ps = VIPS_IMAGE_SIZEOF_PEL(in->im);
+
+	VipsPel *restrict q = (VipsPel *) out;
+
+#ifdef HAVE_HWY
+	if (in->im->BandFmt == VIPS_FORMAT_UCHAR &&
+		(in->im->Bands == 3 || in->im->Bands == 4) &&
+		vips_vector_isenabled()) {
+		vips_interpolate_bicubic_uchar_hwy(q,
+			VIPS_REGION_ADDR(in, in->valid.left, in->valid.top),
+			VIPS_REGION_LSKIP(in), in->im->Bands,
+			in->valid.left, in->valid.top,
+			vips_bicubic_matrixi, x, y, dx, dy, n);
+		return;
+	}
+#endif /*HAVE_HWY*/
+
+	for (int i = 0; i < n; i++) {
+		vips_interpolate_bicubic_pixel(q, in, x, y);
+
+		x += dx;
+		y += dy;
+		q += ps;
+	}
+}
+
 static void
 vips_interpolate_bicubic_class_init(VipsInterpolateBicubicClass *iclass)
 {
@@ -629,6 +670,8 @@ vips_interpolate_bicubic_class_init(VipsInterpolateBicubicClass *iclass)
 	object_class->description = _("bicubic interpolation (Catmull-Rom)");
 
 	interpolate_class->interpolate = vips_interpolate_bicubic_interpolate;
+	vips__interpolate_set_span_method(interpolate_class,
+		vips_interpolate_bicubic_interpolate_span);
 	interpolate_class->window_size = 4;
 
 	/* Build the tables of pre-computed coefficients.
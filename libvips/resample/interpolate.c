@@ -18,6 +18,8 @@
  * 	- faster bilinear
  * 27/2/19 s-sajid-ali
  * 	- more accurate bilinear
+ * 18/10/26
+ * 	- add interpolate_span
  */
 
 /*
@@ -60,8 +62,11 @@
 #include <stdlib.h>
 
 #include <vips/vips.h>
+#include <vips/vector.h>
 #include <vips/internal.h>
 
+#include "presample.h"
+
 /**
  * VipsInterpolate:
  *
@@ -94,6 +99,28 @@ G_DEFINE_ABSTRACT_TYPE(VipsInterpolate, vips_interpolate, VIPS_TYPE_OBJECT);
  *     [struct@InterpolateClass].
  */
 
+/**
+ * VipsInterpolateSpanMethod:
+ * @interpolate: the interpolator
+ * @out: write the interpolated pixels here
+ * @in: read source pixels from here
+ * @x: interpolate the first pixel at this position
+ * @y: interpolate the first pixel at this position
+ * @dx: step along the line by this much in x
+ * @dy: step along the line by this much in y
+ * @n: number of pixels to interpolate
+ *
+ * Interpolate a run of @n pixels. The first is at (@x, @y), and each
+ * following pixel is found by adding (@dx, @dy) to the previous position.
+ * Pixels are written one after the other at @out.
+ *
+ * Every position must be valid for [callback@InterpolateMethod], and the
+ * result must be the same as calling it for each pixel.
+ *
+ * ::: seealso
+ *     [method@Interpolate.get_span_method].
+ */
+
 /**
  * VipsInterpolateClass:
  * @interpolate: the interpolation method
@@ -166,6 +193,33 @@ vips_interpolate_real_get_window_offset(VipsInterpolate *interpolate)
 	}
 }
 
+/* Span methods are attached to interpolator types as qdata, so we don't
+ * need to change the layout of VipsInterpolateClass.
+ */
+static GQuark vips_interpolate_span_quark = 0;
+
+static void
+vips_interpolate_real_interpolate_span(VipsInterpolate *interpolate,
+	void *out, VipsRegion *in,
+	double x, double y, double dx, double dy, int n)
+{
+	VipsInterpolateClass *class = VIPS_INTERPOLATE_GET_CLASS(interpolate);
+	const VipsInterpolateMethod interpolate_method = class->interpolate;
+	const int ps = VIPS_IMAGE_SIZEOF_PEL(in->im);
+
+	VipsPel *restrict q = (VipsPel *) out;
+
+	int i;
+
+	for (i = 0; i < n; i++) {
+		interpolate_method(interpolate, q, in, x, y);
+
+		x += dx;
+		y += dy;
+		q += ps;
+	}
+}
+
 static void
 vips_interpolate_class_init(VipsInterpolateClass *class)
 {
@@ -187,6 +241,9 @@ vips_interpolate_class_init(VipsInterpolateClass *class)
 	class->get_window_offset = vips_interpolate_real_get_window_offset;
 	class->window_size = -1;
 	class->window_offset = -1;
+
+	vips_interpolate_span_quark =
+		g_quark_from_static_string("vips-interpolate-span");
 }
 
 static void
@@ -242,6 +299,75 @@ vips_interpolate_get_method(VipsInterpolate *interpolate)
 	return class->interpolate;
 }
 
+/* Interpolators which can do better than calling interpolate once for each
+ * pixel, for example by hoisting setup out of the loop or by using SIMD, can
+ * call this from class_init. Subclasses inherit the span method of their
+ * parent unless they set their own.
+ */
+void
+vips__interpolate_set_span_method(VipsInterpolateClass *class,
+	VipsInterpolateSpanMethod interpolate_span)
+{
+	g_type_set_qdata(G_TYPE_FROM_CLASS(class),
+		vips_interpolate_span_quark, (gpointer) interpolate_span);
+}
+
+/**
+ * vips_interpolate_get_span_method: (skip)
+ * @interpolate: interpolator to use
+ *
+ * Look up the span method for this interpolator and return it. Use this
+ * instead of [func@interpolate_span] to cache method dispatch.
+ *
+ * Interpolators without a span method of their own get one which calls
+ * [callback@InterpolateMethod] once for each pixel.
+ *
+ * Returns: a pointer to the span interpolation function
+ */
+VipsInterpolateSpanMethod
+vips_interpolate_get_span_method(VipsInterpolate *interpolate)
+{
+	GType type;
+
+	for (type = G_OBJECT_TYPE(interpolate); type;
+		 type = g_type_parent(type)) {
+		VipsInterpolateSpanMethod interpolate_span;
+
+		if ((interpolate_span = (VipsInterpolateSpanMethod)
+				 g_type_get_qdata(type, vips_interpolate_span_quark)))
+			return interpolate_span;
+	}
+
+	return vips_interpolate_real_interpolate_span;
+}
+
+/**
+ * vips_interpolate_span: (skip)
+ * @interpolate: interpolator to use
+ * @out: write result here
+ * @in: read source data from here
+ * @x: interpolate the first pixel at this position
+ * @y: interpolate the first pixel at this position
+ * @dx: step along the line by this much in x
+ * @dy: step along the line by this much in y
+ * @n: number of pixels to interpolate
+ *
+ * Look up the span method for this interpolator and call it. Use
+ * [method@Interpolate.get_span_method] to get a direct pointer to the
+ * function and avoid the lookup overhead.
+ *
+ * You need to set @in and @out up correctly, and every position along the
+ * span must be inside the window you prepared on @in.
+ */
+void
+vips_interpolate_span(VipsInterpolate *interpolate,
+	void *out, VipsRegion *in,
+	double x, double y, double dx, double dy, int n)
+{
+	vips_interpolate_get_span_method(interpolate)(interpolate,
+		out, in, x, y, dx, dy, n);
+}
+
 /**
  * vips_interpolate_get_window_size:
  * @interpolate: interpolator to use
@@ -566,6 +692,58 @@ vips_interpolate_bilinear_interpolate(VipsInterpolate *interpolate,
 	SWITCH_INTERPOLATE(in->im->BandFmt, BILINEAR_INT, BILINEAR_FLOAT);
 }
 
+/* Loop one of the bilinear methods above along a span.
+ */
+#define BILINEAR_SPAN(TYPE, METHOD) \
+	{ \
+		for (i = 0; i < n; i++) { \
+			const int ix = (int) x; \
+			const int iy = (int) y; \
+\
+			const VipsPel *restrict p1 = VIPS_REGION_ADDR(in, ix, iy); \
+			const VipsPel *restrict p2 = p1 + ps; \
+			const VipsPel *restrict p3 = p1 + ls; \
+			const VipsPel *restrict p4 = p3 + ps; \
+\
+			METHOD(TYPE); \
+\
+			out = (VipsPel *) out + ps; \
+			x += dx; \
+			y += dy; \
+		} \
+	}
+
+#define BILINEAR_INT_SPAN(TYPE) BILINEAR_SPAN(TYPE, BILINEAR_INT)
+#define BILINEAR_FLOAT_SPAN(TYPE) BILINEAR_SPAN(TYPE, BILINEAR_FLOAT)
+
+static void
+vips_interpolate_bilinear_interpolate_span(VipsInterpolate *interpolate,
+	void *out, VipsRegion *in,
+	double x, double y, double dx, double dy, int n)
+{
+	const int ps = VIPS_IMAGE_SIZEOF_PEL(in->im);
+	const int ls = VIPS_REGION_LSKIP(in);
+	const int b = in->im->Bands *
+		(vips_band_format_iscomplex(in->im->BandFmt) ? 2 : 1);
+
+	int i, z;
+
+#ifdef HAVE_HWY
+	if (in->im->BandFmt == VIPS_FORMAT_UCHAR &&
+		(b == 3 || b == 4) &&
+		vips_vector_isenabled()) {
+		vips_interpolate_bilinear_uchar_hwy((VipsPel *) out,
+			VIPS_REGION_ADDR(in, in->valid.left, in->valid.top), ls,
+			b, in->valid.left, in->valid.top,
+			x, y, dx, dy, n);
+		return;
+	}
+#endif /*HAVE_HWY*/
+
+	SWITCH_INTERPOLATE(in->im->BandFmt,
+		BILINEAR_INT_SPAN, BILINEAR_FLOAT_SPAN);
+}
+
 static void
 vips_interpolate_bilinear_class_init(VipsInterpolateBilinearClass *class)
 {
@@ -577,6 +755,8 @@ vips_interpolate_bilinear_class_init(VipsInterpolateBilinearClass *class)
 	object_class->description = _("bilinear interpolation");
 
 	interpolate_class->interpolate = vips_interpolate_bilinear_interpolate;
+	vips__interpolate_set_span_method(interpolate_class,
+		vips_interpolate_bilinear_interpolate_span);
 	interpolate_class->window_size = 2;
 }
 
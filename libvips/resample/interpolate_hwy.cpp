@@ -0,0 +1,266 @@
+/* 18/10/26
+ * 	- from reduceh_hwy.cpp
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#include <vips/vips.h>
+#include <vips/vector.h>
+#include <vips/debug.h>
+#include <vips/internal.h>
+
+#include "presample.h"
+
+#ifdef HAVE_HWY
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "libvips/resample/interpolate_hwy.cpp"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+namespace HWY_NAMESPACE {
+
+using namespace hwy::HWY_NAMESPACE;
+
+#if HWY_TARGET != HWY_SCALAR
+/* One lane per band, so 3 and 4 band images both fit in a vector.
+ */
+using DI32x4 = FixedTag<int32_t, 4>;
+using DU8x4 = FixedTag<uint8_t, 4>;
+using VI32x4 = Vec<DI32x4>;
+constexpr DI32x4 di32x4;
+constexpr DU8x4 du8x4;
+
+template <int32_t bands>
+HWY_ATTR HWY_INLINE VI32x4
+load_pel(const uint8_t *HWY_RESTRICT p)
+{
+	if (bands == 4)
+		return PromoteTo(di32x4, LoadU(du8x4, p));
+
+	/* A four byte load could run off the end of the region for the
+	 * final 3-band pixel, so go via a temporary.
+	 */
+	const uint8_t pel[4] = { p[0], p[1], p[2], 0 };
+
+	return PromoteTo(di32x4, LoadU(du8x4, pel));
+}
+
+template <int32_t bands>
+HWY_ATTR HWY_INLINE void
+store_pel(uint8_t *HWY_RESTRICT q, VI32x4 v)
+{
+	if (bands == 4)
+		StoreU(DemoteTo(du8x4, v), du8x4, q);
+	else {
+		uint8_t pel[4];
+
+		StoreU(DemoteTo(du8x4, v), du8x4, pel);
+		q[0] = pel[0];
+		q[1] = pel[1];
+		q[2] = pel[2];
+	}
+}
+
+/* Same arithmetic as BILINEAR_INT in interpolate.c, so we are bit-exact
+ * with the C path.
+ */
+template <int32_t bands>
+HWY_ATTR HWY_INLINE void
+bilinear_span(uint8_t *HWY_RESTRICT q, const uint8_t *HWY_RESTRICT pin,
+	int32_t lskip, int32_t left, int32_t top,
+	double x, double y, double dx, double dy, int32_t n)
+{
+	const auto initial = Set(di32x4, VIPS_INTERPOLATE_SCALE >> 1);
+
+	for (int32_t i = 0; i < n; ++i) {
+		const int ix = (int) x;
+		const int iy = (int) y;
+
+		const int X = (x - ix) * VIPS_INTERPOLATE_SCALE;
+		const int Y = (y - iy) * VIPS_INTERPOLATE_SCALE;
+
+		const int Yd = VIPS_INTERPOLATE_SCALE - Y;
+
+		const int c4 = (Y * X) >> VIPS_INTERPOLATE_SHIFT;
+		const int c2 = (Yd * X) >> VIPS_INTERPOLATE_SHIFT;
+		const int c3 = Y - c4;
+		const int c1 = Yd - c2;
+
+		const uint8_t *HWY_RESTRICT p1 = pin +
+			(iy - top) * lskip + (ix - left) * bands;
+		const uint8_t *HWY_RESTRICT p3 = p1 + lskip;
+
+		auto sum = Add(initial, Mul(Set(di32x4, c1), load_pel<bands>(p1)));
+		sum = Add(sum, Mul(Set(di32x4, c2), load_pel<bands>(p1 + bands)));
+		sum = Add(sum, Mul(Set(di32x4, c3), load_pel<bands>(p3)));
+		sum = Add(sum, Mul(Set(di32x4, c4), load_pel<bands>(p3 + bands)));
+
+		store_pel<bands>(q, ShiftRight<VIPS_INTERPOLATE_SHIFT>(sum));
+
+		q += bands;
+		x += dx;
+		y += dy;
+	}
+}
+
+/* Same arithmetic as bicubic_unsigned_int() in templates.h: each row is
+ * rounded to an int before the vertical pass, so we are bit-exact with the
+ * C path.
+ */
+template <int32_t bands>
+HWY_ATTR HWY_INLINE void
+bicubic_span(uint8_t *HWY_RESTRICT q, const uint8_t *HWY_RESTRICT pin,
+	int32_t lskip, int32_t left, int32_t top,
+	const int32_t matrixi[VIPS_TRANSFORM_SCALE + 1][4],
+	double x, double y, double dx, double dy, int32_t n)
+{
+	const auto initial = Set(di32x4, VIPS_INTERPOLATE_SCALE >> 1);
+
+	for (int32_t i = 0; i < n; ++i) {
+		/* Find the mask index, see bicubic.cpp.
+		 */
+		const int sx = x * VIPS_TRANSFORM_SCALE * 2;
+		const int sy = y * VIPS_TRANSFORM_SCALE * 2;
+
+		const int six = sx & (VIPS_TRANSFORM_SCALE * 2 - 1);
+		const int siy = sy & (VIPS_TRANSFORM_SCALE * 2 - 1);
+
+		const int tx = (six + 1) >> 1;
+		const int ty = (siy + 1) >> 1;
+
+		const int ix = (int) x;
+		const int iy = (int) y;
+
+		const int32_t *cx = matrixi[tx];
+		const int32_t *cy = matrixi[ty];
+
+		const auto cx0 = Set(di32x4, cx[0]);
+		const auto cx1 = Set(di32x4, cx[1]);
+		const auto cx2 = Set(di32x4, cx[2]);
+		const auto cx3 = Set(di32x4, cx[3]);
+
+		/* Back and up one to get the top-left of the 4x4.
+		 */
+		const uint8_t *HWY_RESTRICT p = pin +
+			(iy - 1 - top) * lskip + (ix - 1 - left) * bands;
+
+		auto sum = initial;
+
+		for (int32_t j = 0; j < 4; ++j) {
+			auto row = Add(initial, Mul(cx0, load_pel<bands>(p)));
+			row = Add(row, Mul(cx1, load_pel<bands>(p + bands)));
+			row = Add(row, Mul(cx2, load_pel<bands>(p + 2 * bands)));
+			row = Add(row, Mul(cx3, load_pel<bands>(p + 3 * bands)));
+			row = ShiftRight<VIPS_INTERPOLATE_SHIFT>(row);
+
+			sum = Add(sum, Mul(Set(di32x4, cy[j]), row));
+
+			p += lskip;
+		}
+
+		/* DemoteTo() saturates, so this clips to 0 - 255 for us.
+		 */
+		store_pel<bands>(q, ShiftRight<VIPS_INTERPOLATE_SHIFT>(sum));
+
+		q += bands;
+		x += dx;
+		y += dy;
+	}
+}
+#endif /*HWY_TARGET != HWY_SCALAR*/
+
+HWY_ATTR void
+vips_interpolate_bilinear_uchar_hwy(VipsPel *pout, const VipsPel *pin,
+	int32_t lskip, int32_t bands, int32_t left, int32_t top,
+	double x, double y, double dx, double dy, int32_t n)
+{
+#if HWY_TARGET != HWY_SCALAR
+	if (bands == 3)
+		bilinear_span<3>(pout, pin, lskip, left, top, x, y, dx, dy, n);
+	else
+		bilinear_span<4>(pout, pin, lskip, left, top, x, y, dx, dy, n);
+#endif
+}
+
+HWY_ATTR void
+vips_interpolate_bicubic_uchar_hwy(VipsPel *pout, const VipsPel *pin,
+	int32_t lskip, int32_t bands, int32_t left, int32_t top,
+	const int32_t matrixi[VIPS_TRANSFORM_SCALE + 1][4],
+	double x, double y, double dx, double dy, int32_t n)
+{
+#if HWY_TARGET != HWY_SCALAR
+	if (bands == 3)
+		bicubic_span<3>(pout, pin, lskip, left, top,
+			matrixi, x, y, dx, dy, n);
+	else
+		bicubic_span<4>(pout, pin, lskip, left, top,
+			matrixi, x, y, dx, dy, n);
+#endif
+}
+
+} /*namespace HWY_NAMESPACE*/
+
+#if HWY_ONCE
+HWY_EXPORT(vips_interpolate_bilinear_uchar_hwy);
+HWY_EXPORT(vips_interpolate_bicubic_uchar_hwy);
+
+void
+vips_interpolate_bilinear_uchar_hwy(VipsPel *pout, const VipsPel *pin,
+	int lskip, int bands, int left, int top,
+	double x, double y, double dx, double dy, int n)
+{
+	/* clang-format off */
+	HWY_DYNAMIC_DISPATCH(vips_interpolate_bilinear_uchar_hwy)(pout, pin,
+		lskip, bands, left, top, x, y, dx, dy, n);
+	/* clang-format on */
+}
+
+void
+vips_interpolate_bicubic_uchar_hwy(VipsPel *pout, const VipsPel *pin,
+	int lskip, int bands, int left, int top,
+	const int matrixi[VIPS_TRANSFORM_SCALE + 1][4],
+	double x, double y, double dx, double dy, int n)
+{
+	/* clang-format off */
+	HWY_DYNAMIC_DISPATCH(vips_interpolate_bicubic_uchar_hwy)(pout, pin,
+		lskip, bands, left, top, matrixi, x, y, dx, dy, n);
+	/* clang-format on */
+}
+#endif /*HWY_ONCE*/
+
+#endif /*HAVE_HWY*/
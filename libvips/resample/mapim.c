@@ -12,6 +12,9 @@
  * 21/12/21
  * 	- improve edge antialiasing with "background" and "extend"
  * 	- add "premultiplied" param
+ * 18/10/26
+ * 	- split output tiles until the input area each part needs is below
+ * 	  MAX_FOOTPRINT, unless the input is in memory
  */
 
 /*
@@ -64,6 +67,14 @@
 
 #include "presample.h"
 
+/* The most input we fetch for a piece of output, in bytes. Tiles with
+ * a larger footprint (eg. a polar or lens distortion map, where a small
+ * output tile can fan out over much of the input) are split in half and
+ * tried again. Input that's already in memory costs nothing to fetch, so
+ * we don't split for that.
+ */
+#define MAX_FOOTPRINT (4 * 1024 * 1024)
+
 typedef struct _VipsMapim {
 	VipsResample parent_instance;
 
@@ -86,6 +97,11 @@ typedef struct _VipsMapim {
 	 */
 	gboolean premultiplied;
 
+	/* The input pixels are all in memory, so there's nothing to gain by
+	 * splitting tiles.
+	 */
+	gboolean in_memory;
+
 	/* Need an image vector for start_many / stop_many
 	 */
 	VipsImage *in_array[3];
@@ -143,7 +159,8 @@ G_DEFINE_TYPE(VipsMapim, vips_mapim, VIPS_TYPE_RESAMPLE);
 /* Scan a region and find min/max in the two axes.
  */
 static void
-vips_mapim_region_minmax(VipsRegion *region, VipsRect *r, VipsRect *bounds)
+vips_mapim_region_minmax(VipsRegion *region,
+	const VipsRect *r, VipsRect *bounds)
 {
 	double min_x;
 	double max_x;
@@ -304,15 +321,13 @@ vips_mapim_region_minmax(VipsRegion *region, VipsRect *r, VipsRect *bounds)
 		} \
 	}
 
+/* Generate the area r of the output. The index region must already hold r.
+ */
 static int
-vips_mapim_gen(VipsRegion *out_region,
-	void *seq, void *a, void *b, gboolean *stop)
+vips_mapim_gen_area(VipsRegion *out_region, VipsRegion **ir,
+	const VipsMapim *mapim, const VipsRect *r)
 {
-	VipsRect *r = &out_region->valid;
-	VipsRegion **ir = (VipsRegion **) seq;
-	const VipsImage **in_array = (const VipsImage **) a;
-	const VipsMapim *mapim = (VipsMapim *) b;
-	const VipsImage *in = in_array[0];
+	const VipsImage *in = ir[0]->im;
 	const int window_size =
 		vips_interpolate_get_window_size(mapim->interpolate);
 	const int window_offset =
@@ -326,20 +341,6 @@ vips_mapim_gen(VipsRegion *out_region,
 	VipsRect bounds, need, image, clipped;
 	int x, y, z;
 
-#ifdef DEBUG_VERBOSE
-	printf("vips_mapim_gen: generating left=%d, top=%d, width=%d, height=%d\n",
-		r->left,
-		r->top,
-		r->width,
-		r->height);
-#endif /*DEBUG_VERBOSE*/
-
-	/* Fetch the chunk of the index image we need, and find the max/min in
-	 * x and y.
-	 */
-	if (vips_region_prepare(ir[1], r))
-		return -1;
-
 	VIPS_GATE_START("vips_mapim_gen: work");
 
 	vips_mapim_region_minmax(ir[1], r, &bounds);
@@ -364,18 +365,54 @@ vips_mapim_gen(VipsRegion *out_region,
 	image.height = in->Ysize;
 	vips_rect_intersectrect(&need, &image, &clipped);
 
+	if (vips_rect_isempty(&clipped)) {
+		vips_region_paint_pel(out_region, r, mapim->ink);
+		return 0;
+	}
+
+	/* Too much input for this much output? Split along the longer axis
+	 * and try again. The halves are done one after the other, so nearby
+	 * output is generated together and reuses the same input.
+	 */
+	if (!mapim->in_memory &&
+		(double) clipped.width * clipped.height * ps > MAX_FOOTPRINT &&
+		(r->width > 1 || r->height > 1)) {
+		VipsRect half1 = *r;
+		VipsRect half2 = *r;
+
+		if (r->width >= r->height) {
+			half1.width = r->width / 2;
+			half2.left += half1.width;
+			half2.width -= half1.width;
+		}
+		else {
+			half1.height = r->height / 2;
+			half2.top += half1.height;
+			half2.height -= half1.height;
+		}
+
 #ifdef DEBUG_VERBOSE
-	printf("vips_mapim_gen: preparing left=%d, top=%d, width=%d, height=%d\n",
+		printf("vips_mapim_gen_area: splitting left=%d, top=%d, "
+			   "width=%d, height=%d\n",
+			r->left,
+			r->top,
+			r->width,
+			r->height);
+#endif /*DEBUG_VERBOSE*/
+
+		return vips_mapim_gen_area(out_region, ir, mapim, &half1) ||
+			vips_mapim_gen_area(out_region, ir, mapim, &half2);
+	}
+
+#ifdef DEBUG_VERBOSE
+	printf("vips_mapim_gen_area: preparing left=%d, top=%d, "
+		   "width=%d, height=%d\n",
 		clipped.left,
 		clipped.top,
 		clipped.width,
 		clipped.height);
 #endif /*DEBUG_VERBOSE*/
 
-	if (vips_rect_isempty(&clipped)) {
-		vips_region_paint_pel(out_region, r, mapim->ink);
-		return 0;
-	}
 	if (vips_region_prepare(ir[0], &clipped))
 		return -1;
 
@@ -427,6 +464,30 @@ vips_mapim_gen(VipsRegion *out_region,
 	return 0;
 }
 
+static int
+vips_mapim_gen(VipsRegion *out_region,
+	void *seq, void *a, void *b, gboolean *stop)
+{
+	VipsRect *r = &out_region->valid;
+	VipsRegion **ir = (VipsRegion **) seq;
+	const VipsMapim *mapim = (VipsMapim *) b;
+
+#ifdef DEBUG_VERBOSE
+	printf("vips_mapim_gen: generating left=%d, top=%d, width=%d, height=%d\n",
+		r->left,
+		r->top,
+		r->width,
+		r->height);
+#endif /*DEBUG_VERBOSE*/
+
+	/* Fetch the chunk of the index image we need.
+	 */
+	if (vips_region_prepare(ir[1], r))
+		return -1;
+
+	return vips_mapim_gen_area(out_region, ir, mapim, r);
+}
+
 static int
 vips_mapim_build(VipsObject *object)
 {
@@ -457,6 +518,11 @@ vips_mapim_build(VipsObject *object)
 		return -1;
 	in = t[0];
 
+	mapim->in_memory = in->dtype == VIPS_IMAGE_SETBUF ||
+		in->dtype == VIPS_IMAGE_SETBUF_FOREIGN ||
+		in->dtype == VIPS_IMAGE_MMAPIN ||
+		in->dtype == VIPS_IMAGE_MMAPINRW;
+
 	window_size = vips_interpolate_get_window_size(mapim->interpolate);
 	window_offset =
 		vips_interpolate_get_window_offset(mapim->interpolate);
@@ -488,6 +554,7 @@ vips_mapim_build(VipsObject *object)
 		if (vips_premultiply(in, &t[2], NULL))
 			return -1;
 		have_premultiplied = TRUE;
+		mapim->in_memory = FALSE;
 
 		/* vips_premultiply() makes a float image. When we
 		 * vips_unpremultiply() below, we need to cast back to the
@@ -13,6 +13,9 @@
  *
  * Nohalo level 1 with LBB finishing scheme by N. Robidoux and
  * C. Racette, 11-18/5/2010
+ *
+ * 18/10/26
+ * 	- add interpolate_span
  */
 
 /*
@@ -245,6 +248,7 @@
 #include <vips/vips.h>
 #include <vips/internal.h>
 
+#include "presample.h"
 #include "templates.h"
 
 #define VIPS_TYPE_INTERPOLATE_NOHALO \
@@ -1540,6 +1544,93 @@ vips_interpolate_nohalo_interpolate(VipsInterpolate *restrict interpolate,
 	}
 }
 
+#define SPAN(T, conversion) \
+	{ \
+		for (int i = 0; i < n; i++) { \
+			const int ix = (int) (absolute_x + 0.5); \
+			const int iy = (int) (absolute_y + 0.5); \
+\
+			const VipsPel *restrict p = VIPS_REGION_ADDR(in, ix, iy); \
+\
+			nohalo_##conversion<T>(q, \
+				p, \
+				bands, \
+				lskip, \
+				absolute_x - ix, \
+				absolute_y - iy); \
+\
+			absolute_x += dx; \
+			absolute_y += dy; \
+			q += ps; \
+		} \
+	}
+
+/*
+ * Nohalo's stencil is data-dependent, so there's no vector path, but we
+ * can still do the type dispatch and address setup once per span rather
+ * than once per pixel.
+ */
+static void
+vips_interpolate_nohalo_interpolate_span(VipsInterpolate *restrict interpolate,
+	void *restrict out,
+	VipsRegion *restrict in,
+	double absolute_x,
+	double absolute_y,
+	double dx,
+	double dy,
+	int n)
+{
+	const int ps = VIPS_IMAGE_SIZEOF_PEL(in->im);
+	const int lskip = VIPS_REGION_LSKIP(in) /
+		VIPS_IMAGE_SIZEOF_ELEMENT(in->im);
+	const int actual_bands = in->im->Bands;
+	const int bands = vips_band_format_iscomplex(in->im->BandFmt)
+		? 2 * actual_bands
+		: actual_bands;
+
+	VipsPel *restrict q = (VipsPel *) out;
+
+	switch (in->im->BandFmt) {
+	case VIPS_FORMAT_UCHAR:
+		SPAN(unsigned char, nosign);
+		break;
+
+	case VIPS_FORMAT_CHAR:
+		SPAN(signed char, withsign);
+		break;
+
+	case VIPS_FORMAT_USHORT:
+		SPAN(unsigned short, nosign);
+		break;
+
+	case VIPS_FORMAT_SHORT:
+		SPAN(signed short, withsign);
+		break;
+
+	case VIPS_FORMAT_UINT:
+		SPAN(unsigned int, nosign);
+		break;
+
+	case VIPS_FORMAT_INT:
+		SPAN(signed int, withsign);
+		break;
+
+	case VIPS_FORMAT_FLOAT:
+	case VIPS_FORMAT_COMPLEX:
+		SPAN(float, fptypes);
+		break;
+
+	case VIPS_FORMAT_DOUBLE:
+	case VIPS_FORMAT_DPCOMPLEX:
+		SPAN(double, fptypes);
+		break;
+
+	default:
+		g_assert(0);
+		break;
+	}
+}
+
 static void
 vips_interpolate_nohalo_class_init(VipsInterpolateNohaloClass *klass)
 {
@@ -1551,6 +1642,8 @@ vips_interpolate_nohalo_class_init(VipsInterpolateNohaloClass *klass)
 		_("edge sharpening resampler with halo reduction");
 
 	interpolate_class->interpolate = vips_interpolate_nohalo_interpolate;
+	vips__interpolate_set_span_method(interpolate_class,
+		vips_interpolate_nohalo_interpolate_span);
 	interpolate_class->window_size = 6;
 	interpolate_class->window_offset = 2;
 }
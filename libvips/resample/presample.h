@@ -71,6 +71,29 @@ GType vips_resample_get_type(void);
 
 int vips_reduce_get_points(VipsKernel kernel, double shrink);
 
+/* Precalculated interpolation matrices for a kernel and shrink. short (used
+ * for pel sizes up to int), and double (for all others). We go to
+ * scale + 1 so we can round-to-nearest safely.
+ *
+ * These never change once made, so they are shared between operations.
+ */
+typedef struct _VipsReduceMask {
+	VipsKernel kernel;
+	double shrink;
+	int n_point;
+
+	short *matrixs[VIPS_TRANSFORM_SCALE + 1];
+	double *matrixf[VIPS_TRANSFORM_SCALE + 1];
+
+	/* Protected by the cache lock.
+	 */
+	int ref_count;
+	gboolean cached;
+} VipsReduceMask;
+
+VipsReduceMask *vips_reduce_mask_get(VipsKernel kernel, double shrink);
+void vips_reduce_mask_unref(VipsReduceMask *mask);
+
 void vips_reduceh_uchar_hwy(VipsPel *pout, VipsPel *pin,
 	int n, int width, int bands,
 	short *restrict cs[VIPS_TRANSFORM_SCALE + 1],
@@ -85,6 +108,17 @@ void vips_shrinkv_add_line_uchar_hwy(VipsPel *pin,
 void vips_shrinkv_write_line_uchar_hwy(VipsPel *pout,
 	int ne, int vshrink, unsigned int *restrict sum);
 
+void vips__interpolate_set_span_method(VipsInterpolateClass *class,
+	VipsInterpolateSpanMethod interpolate_span);
+
+void vips_interpolate_bilinear_uchar_hwy(VipsPel *pout, const VipsPel *pin,
+	int lskip, int bands, int left, int top,
+	double x, double y, double dx, double dy, int n);
+void vips_interpolate_bicubic_uchar_hwy(VipsPel *pout, const VipsPel *pin,
+	int lskip, int bands, int left, int top,
+	const int matrixi[VIPS_TRANSFORM_SCALE + 1][4],
+	double x, double y, double dx, double dy, int n);
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
@@ -10,6 +10,8 @@
  * 	- deprecate @centre option, it's now always on
  * 22/4/22 kleisauke
  * 	- add @gap option
+ * 18/10/26
+ * 	- fuse reducev and reduceh for uchar images with a vector path
  */
 
 /*
@@ -53,6 +55,7 @@
 #include <math.h>
 
 #include <vips/vips.h>
+#include <vips/vector.h>
 #include <vips/debug.h>
 #include <vips/internal.h>
 
@@ -88,12 +91,285 @@ typedef struct _VipsReduce {
 	 */
 	gboolean centre;
 
+	/* The residual shrinks, offsets and masks we use when we can run
+	 * both passes in one operation.
+	 */
+	double residual_hshrink;
+	double residual_vshrink;
+	double hoffset;
+	double voffset;
+	VipsReduceMask *hmask;
+	VipsReduceMask *vmask;
+
 } VipsReduce;
 
 typedef VipsResampleClass VipsReduceClass;
 
 G_DEFINE_TYPE(VipsReduce, vips_reduce, VIPS_TYPE_RESAMPLE);
 
+#ifdef HAVE_HWY
+/* The geometry reducev or reduceh will pick for one axis.
+ */
+typedef struct _VipsReduceAxis {
+	int size;
+	int int_shrink;
+	double residual_shrink;
+	double offset;
+	int n_point;
+} VipsReduceAxis;
+
+/* Must match the calculation in vips_reducev_build() and
+ * vips_reduceh_build(). FALSE for a bad @gap: we let the separate passes
+ * report that.
+ */
+static gboolean
+vips_reduce_axis(VipsReduce *reduce, int size, double shrink,
+	VipsReduceAxis *axis)
+{
+	double extra_pixels;
+
+	axis->size = VIPS_ROUND_UINT((double) size / shrink);
+	extra_pixels = axis->size * shrink - size;
+	axis->int_shrink = 1;
+	axis->residual_shrink = shrink;
+
+	if (reduce->gap > 0.0 &&
+		reduce->kernel != VIPS_KERNEL_NEAREST) {
+		if (reduce->gap < 1.0 ||
+			axis->size <= 0)
+			return FALSE;
+
+		axis->int_shrink = VIPS_MAX(1,
+			floor((double) size / axis->size / reduce->gap));
+		extra_pixels /= axis->int_shrink;
+		axis->residual_shrink /= axis->int_shrink;
+	}
+
+	axis->offset = (1 + extra_pixels) / 2.0 - 1;
+	axis->n_point =
+		vips_reduce_get_points(reduce->kernel, axis->residual_shrink);
+
+	return TRUE;
+}
+
+/* Enough to cover the overread of the widest vector load in
+ * vips_reduceh_uchar_hwy().
+ */
+#define LINE_PAD (256)
+
+typedef struct _VipsReduceSequence {
+	VipsRegion *ir;
+
+	/* One line of input after the vertical pass.
+	 */
+	VipsPel *line;
+} VipsReduceSequence;
+
+static int
+vips_reduce_stop(void *vseq, void *a, void *b)
+{
+	VipsReduceSequence *seq = (VipsReduceSequence *) vseq;
+
+	VIPS_UNREF(seq->ir);
+	VIPS_FREE(seq->line);
+
+	return 0;
+}
+
+static void *
+vips_reduce_start(VipsImage *out, void *a, void *b)
+{
+	VipsImage *in = (VipsImage *) a;
+
+	VipsReduceSequence *seq;
+
+	if (!(seq = VIPS_NEW(out, VipsReduceSequence)))
+		return NULL;
+
+	seq->ir = vips_region_new(in);
+	seq->line = VIPS_ARRAY(NULL,
+		VIPS_IMAGE_SIZEOF_LINE(in) + LINE_PAD, VipsPel);
+	if (!seq->ir ||
+		!seq->line) {
+		vips_reduce_stop(seq, in, NULL);
+		return NULL;
+	}
+
+	return seq;
+}
+
+/* Run the reducev and reduceh vector paths one output line at a time. The
+ * vertically reduced line only ever lives in seq->line, so it stays in
+ * cache, and we never make the intermediate image.
+ */
+static int
+vips_reduce_uchar_vector_gen(VipsRegion *out_region, void *vseq,
+	void *a, void *b, gboolean *stop)
+{
+	VipsImage *in = (VipsImage *) a;
+	VipsReduce *reduce = (VipsReduce *) b;
+	VipsReduceSequence *seq = (VipsReduceSequence *) vseq;
+	VipsRegion *ir = seq->ir;
+	VipsRect *r = &out_region->valid;
+	const int ps = VIPS_IMAGE_SIZEOF_PEL(in);
+	const int bands = in->Bands;
+
+	VipsRect s;
+	VipsPel *p0;
+	int lskip;
+	double X;
+	double Y;
+
+#ifdef DEBUG
+	printf("vips_reduce_uchar_vector_gen: generating %d x %d at %d x %d\n",
+		r->width, r->height, r->left, r->top);
+#endif /*DEBUG*/
+
+	s.left = r->left * reduce->residual_hshrink - reduce->hoffset;
+	s.top = r->top * reduce->residual_vshrink - reduce->voffset;
+	s.width = r->width * reduce->residual_hshrink +
+		reduce->hmask->n_point;
+	s.height = r->height * reduce->residual_vshrink +
+		reduce->vmask->n_point;
+	if (vips_region_prepare(ir, &s))
+		return -1;
+
+	VIPS_GATE_START("vips_reduce_uchar_vector_gen: work");
+
+	lskip = VIPS_REGION_LSKIP(ir);
+
+	/* The start (ie. x == 0) of seq->line, see vips_reduceh_gen().
+	 */
+	p0 = seq->line - ir->valid.left * ps;
+
+	X = (r->left + 0.5) * reduce->residual_hshrink - 0.5 -
+		reduce->hoffset;
+	Y = (r->top + 0.5) * reduce->residual_vshrink - 0.5 -
+		reduce->voffset;
+
+	for (int y = 0; y < r->height; y++) {
+		VipsPel *q =
+			VIPS_REGION_ADDR(out_region, r->left, r->top + y);
+		const int py = (int) Y;
+		VipsPel *p = VIPS_REGION_ADDR(ir, ir->valid.left, py);
+		const int sy = Y * VIPS_TRANSFORM_SCALE * 2;
+		const int siy = sy & (VIPS_TRANSFORM_SCALE * 2 - 1);
+		const int ty = (siy + 1) >> 1;
+
+		vips_reducev_uchar_hwy(seq->line, p,
+			reduce->vmask->n_point, ir->valid.width * bands, lskip,
+			reduce->vmask->matrixs[ty]);
+
+		vips_reduceh_uchar_hwy(q, p0,
+			reduce->hmask->n_point, r->width, bands,
+			reduce->hmask->matrixs, X, reduce->residual_hshrink);
+
+		Y += reduce->residual_vshrink;
+	}
+
+	VIPS_GATE_STOP("vips_reduce_uchar_vector_gen: work");
+
+	VIPS_COUNT_PIXELS(out_region, "vips_reduce_uchar_vector_gen");
+
+	return 0;
+}
+
+/* Both passes in one, as long as the vector paths in reducev and reduceh
+ * can both run.
+ */
+static int
+vips_reduce_build_fused(VipsReduce *reduce,
+	VipsReduceAxis *haxis, VipsReduceAxis *vaxis)
+{
+	VipsObject *object = VIPS_OBJECT(reduce);
+	VipsResample *resample = VIPS_RESAMPLE(reduce);
+	VipsImage **t = (VipsImage **) vips_object_local_array(object, 5);
+
+	VipsImage *in;
+
+	in = resample->in;
+
+	if (vaxis->int_shrink > 1) {
+		g_info("shrinkv by %d", vaxis->int_shrink);
+		if (vips_shrinkv(in, &t[0], vaxis->int_shrink,
+				"ceil", TRUE,
+				NULL))
+			return -1;
+		in = t[0];
+	}
+
+	if (haxis->int_shrink > 1) {
+		g_info("shrinkh by %d", haxis->int_shrink);
+		if (vips_shrinkh(in, &t[1], haxis->int_shrink,
+				"ceil", TRUE,
+				NULL))
+			return -1;
+		in = t[1];
+	}
+
+	g_info("reduce: %d x %d point mask",
+		haxis->n_point, vaxis->n_point);
+
+	reduce->residual_hshrink = haxis->residual_shrink;
+	reduce->residual_vshrink = vaxis->residual_shrink;
+	reduce->hoffset = haxis->offset;
+	reduce->voffset = vaxis->offset;
+	reduce->hmask = vips_reduce_mask_get(reduce->kernel,
+		haxis->residual_shrink);
+	reduce->vmask = vips_reduce_mask_get(reduce->kernel,
+		vaxis->residual_shrink);
+
+	/* Add new pixels around the input so we can interpolate at the edges.
+	 */
+	if (vips_embed(in, &t[2],
+			ceil(haxis->n_point / 2.0) - 1,
+			ceil(vaxis->n_point / 2.0) - 1,
+			in->Xsize + haxis->n_point, in->Ysize + vaxis->n_point,
+			"extend", VIPS_EXTEND_COPY,
+			NULL))
+		return -1;
+	in = t[2];
+
+	t[3] = vips_image_new();
+	if (vips_image_pipelinev(t[3],
+			VIPS_DEMAND_STYLE_FATSTRIP, in, NULL))
+		return -1;
+
+	/* Don't change xres/yres, leave that to the application layer.
+	 */
+	t[3]->Xsize = haxis->size;
+	t[3]->Ysize = vaxis->size;
+
+	if (vips_image_generate(t[3],
+			vips_reduce_start, vips_reduce_uchar_vector_gen,
+			vips_reduce_stop,
+			in, reduce))
+		return -1;
+
+	in = t[3];
+
+	vips_reorder_margin_hint(in,
+		VIPS_MAX(haxis->n_point, vaxis->n_point));
+
+	/* As reducev, keep a few output lines for sequential input.
+	 */
+	if (vips_image_is_sequential(in)) {
+		g_info("reduce sequential line cache");
+
+		if (vips_sequential(in, &t[4],
+				"tile_height", 10,
+				NULL))
+			return -1;
+		in = t[4];
+	}
+
+	if (vips_image_write(in, resample->out))
+		return -1;
+
+	return 0;
+}
+#endif /*HAVE_HWY*/
+
 static int
 vips_reduce_build(VipsObject *object)
 {
@@ -105,6 +381,36 @@ vips_reduce_build(VipsObject *object)
 	if (VIPS_OBJECT_CLASS(vips_reduce_parent_class)->build(object))
 		return -1;
 
+#ifdef HAVE_HWY
+	{
+		VipsImage *in = resample->in;
+
+		VipsReduceAxis haxis;
+		VipsReduceAxis vaxis;
+
+		/* If both passes would take the uchar vector path, we can run
+		 * them together and skip the intermediate image.
+		 */
+		if (in->Coding == VIPS_CODING_NONE &&
+			in->BandFmt == VIPS_FORMAT_UCHAR &&
+			(in->Bands == 3 || in->Bands == 4) &&
+			vips_vector_isenabled() &&
+			vips_reduce_axis(reduce, in->Xsize, reduce->hshrink,
+				&haxis) &&
+			vips_reduce_axis(reduce, in->Ysize, reduce->vshrink,
+				&vaxis) &&
+			haxis.size > 0 &&
+			vaxis.size > 0 &&
+			haxis.residual_shrink != 1.0 &&
+			vaxis.residual_shrink != 1.0 &&
+			haxis.n_point <= MAX_POINT &&
+			vaxis.n_point <= MAX_POINT) {
+			g_info("reduce: using fused vector path");
+			return vips_reduce_build_fused(reduce, &haxis, &vaxis);
+		}
+	}
+#endif /*HAVE_HWY*/
+
 	if (vips_reducev(resample->in, &t[0], reduce->vshrink,
 			"kernel", reduce->kernel,
 			"gap", reduce->gap,
@@ -119,6 +425,17 @@ vips_reduce_build(VipsObject *object)
 	return 0;
 }
 
+static void
+vips_reduce_dispose(GObject *gobject)
+{
+	VipsReduce *reduce = (VipsReduce *) gobject;
+
+	VIPS_FREEF(vips_reduce_mask_unref, reduce->hmask);
+	VIPS_FREEF(vips_reduce_mask_unref, reduce->vmask);
+
+	G_OBJECT_CLASS(vips_reduce_parent_class)->dispose(gobject);
+}
+
 static void
 vips_reduce_class_init(VipsReduceClass *class)
 {
@@ -128,6 +445,7 @@ vips_reduce_class_init(VipsReduceClass *class)
 
 	VIPS_DEBUG_MSG("vips_reduce_class_init\n");
 
+	gobject_class->dispose = vips_reduce_dispose;
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
 
@@ -210,6 +528,9 @@ vips_reduce_init(VipsReduce *reduce)
  *
  * This will not work well for shrink factors greater than three.
  *
+ * For 3 and 4 band uchar images, the two passes are run together, so no
+ * intermediate image is made.
+ *
  * Set @gap to speed up reducing by having [method@Image.shrink] to shrink
  * with a box filter first. The bigger @gap, the closer the result
  * to the fair resampling. The smaller @gap, the faster resizing.
@@ -13,6 +13,8 @@
  * 	- fix pixel shift
  * 22/4/22 kleisauke
  * 	- add @gap option
+ * 18/10/26
+ * 	- share masks between operations, see reducemask.cpp
  */
 
 /*
@@ -86,10 +88,9 @@ typedef struct _VipsReduceh {
 	 */
 	double residual_hshrink;
 
-	/* Precalculated interpolation matrices. short (used for pel
-	 * sizes up to int), and double (for all others). We go to
-	 * scale + 1 so we can round-to-nearest safely.
+	/* The shared mask we use, and pointers into it.
 	 */
+	VipsReduceMask *mask;
 	short *matrixs[VIPS_TRANSFORM_SCALE + 1];
 	double *matrixf[VIPS_TRANSFORM_SCALE + 1];
 
@@ -475,30 +476,14 @@ vips_reduceh_build(VipsObject *object)
 	 */
 	reduceh->hoffset = (1 + extra_pixels) / 2.0 - 1;
 
-	/* Build the tables of pre-computed coefficients.
+	/* Get the tables of pre-computed coefficients.
 	 */
+	reduceh->mask = vips_reduce_mask_get(reduceh->kernel,
+		reduceh->residual_hshrink);
+	g_assert(reduceh->mask->n_point == reduceh->n_point);
 	for (int x = 0; x < VIPS_TRANSFORM_SCALE + 1; x++) {
-		reduceh->matrixf[x] =
-			VIPS_ARRAY(object, reduceh->n_point, double);
-		reduceh->matrixs[x] =
-			VIPS_ARRAY(object, reduceh->n_point, short);
-		if (!reduceh->matrixf[x] ||
-			!reduceh->matrixs[x])
-			return -1;
-
-		vips_reduce_make_mask(reduceh->matrixf[x], reduceh->kernel,
-			reduceh->n_point, reduceh->residual_hshrink,
-			(float) x / VIPS_TRANSFORM_SCALE);
-
-		for (int i = 0; i < reduceh->n_point; i++)
-			reduceh->matrixs[x][i] = (short) (reduceh->matrixf[x][i] *
-				VIPS_INTERPOLATE_SCALE);
-#ifdef DEBUG
-		printf("vips_reduceh_build: mask %d\n    ", x);
-		for (int i = 0; i < reduceh->n_point; i++)
-			printf("%d ", reduceh->matrixs[x][i]);
-		printf("\n");
-#endif /*DEBUG*/
+		reduceh->matrixf[x] = reduceh->mask->matrixf[x];
+		reduceh->matrixs[x] = reduceh->mask->matrixs[x];
 	}
 
 	/* Unpack for processing.
@@ -563,6 +548,16 @@ vips_reduceh_build(VipsObject *object)
 	return 0;
 }
 
+static void
+vips_reduceh_dispose(GObject *gobject)
+{
+	VipsReduceh *reduceh = (VipsReduceh *) gobject;
+
+	VIPS_FREEF(vips_reduce_mask_unref, reduceh->mask);
+
+	G_OBJECT_CLASS(vips_reduceh_parent_class)->dispose(gobject);
+}
+
 static void
 vips_reduceh_class_init(VipsReducehClass *reduceh_class)
 {
@@ -573,6 +568,7 @@ vips_reduceh_class_init(VipsReducehClass *reduceh_class)
 
 	VIPS_DEBUG_MSG("vips_reduceh_class_init\n");
 
+	gobject_class->dispose = vips_reduceh_dispose;
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
 
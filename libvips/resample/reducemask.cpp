@@ -0,0 +1,231 @@
+/* a cache of reduce masks, shared by reduceh and reducev
+ *
+ * 18/10/26
+ * 	- from reduceh.cpp
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+
+#include "presample.h"
+#include "templates.h"
+
+/* Keep up to this many masks.
+ */
+#define MASK_CACHE_MAX (50)
+
+/* Don't keep masks larger than this. They are rare and large.
+ */
+#define MASK_CACHE_MAX_POINT (200)
+
+static GMutex vips_reduce_mask_lock;
+static GSList *vips_reduce_mask_cache = nullptr;
+
+static VipsReduceMask *
+vips_reduce_mask_new(VipsKernel kernel, double shrink)
+{
+	const int n_point = vips_reduce_get_points(kernel, shrink);
+
+	VipsReduceMask *mask;
+	double *matrixf;
+	short *matrixs;
+
+	mask = g_new0(VipsReduceMask, 1);
+	mask->kernel = kernel;
+	mask->shrink = shrink;
+	mask->n_point = n_point;
+
+	matrixf = g_new(double, (VIPS_TRANSFORM_SCALE + 1) * n_point);
+	matrixs = g_new(short, (VIPS_TRANSFORM_SCALE + 1) * n_point);
+
+	for (int x = 0; x < VIPS_TRANSFORM_SCALE + 1; x++) {
+		mask->matrixf[x] = matrixf + x * n_point;
+		mask->matrixs[x] = matrixs + x * n_point;
+
+		vips_reduce_make_mask(mask->matrixf[x], kernel, n_point, shrink,
+			(float) x / VIPS_TRANSFORM_SCALE);
+
+		for (int i = 0; i < n_point; i++)
+			mask->matrixs[x][i] = (short) (mask->matrixf[x][i] *
+				VIPS_INTERPOLATE_SCALE);
+#ifdef DEBUG
+		printf("vips_reduce_mask_new: mask %d\n    ", x);
+		for (int i = 0; i < n_point; i++)
+			printf("%d ", mask->matrixs[x][i]);
+		printf("\n");
+#endif /*DEBUG*/
+	}
+
+	return mask;
+}
+
+static void
+vips_reduce_mask_free(VipsReduceMask *mask)
+{
+	g_free(mask->matrixf[0]);
+	g_free(mask->matrixs[0]);
+	g_free(mask);
+}
+
+static VipsReduceMask *
+vips_reduce_mask_lookup(VipsKernel kernel, double shrink)
+{
+	for (GSList *p = vips_reduce_mask_cache; p; p = p->next) {
+		VipsReduceMask *mask = (VipsReduceMask *) p->data;
+
+		if (mask->kernel == kernel &&
+			mask->shrink == shrink)
+			return mask;
+	}
+
+	return nullptr;
+}
+
+/* Drop masks no one is using.
+ */
+static void
+vips_reduce_mask_trim(void)
+{
+	GSList *p;
+	GSList *next;
+
+	for (p = vips_reduce_mask_cache; p; p = next) {
+		VipsReduceMask *mask = (VipsReduceMask *) p->data;
+
+		next = p->next;
+
+		if (mask->ref_count == 0) {
+			vips_reduce_mask_cache =
+				g_slist_delete_link(vips_reduce_mask_cache, p);
+			vips_reduce_mask_free(mask);
+		}
+	}
+}
+
+/* Get a ref to the mask for a kernel and shrink. Making a mask means
+ * evaluating the kernel (VIPS_TRANSFORM_SCALE + 1) * n_point times, which
+ * can cost more than a small resize, so we keep recent masks for reuse.
+ */
+VipsReduceMask *
+vips_reduce_mask_get(VipsKernel kernel, double shrink)
+{
+	VipsReduceMask *mask;
+	VipsReduceMask *new_mask;
+
+	g_mutex_lock(&vips_reduce_mask_lock);
+	if ((mask = vips_reduce_mask_lookup(kernel, shrink))) {
+		mask->ref_count += 1;
+		g_mutex_unlock(&vips_reduce_mask_lock);
+
+		return mask;
+	}
+	g_mutex_unlock(&vips_reduce_mask_lock);
+
+	/* Make outside the lock, it can take a while.
+	 */
+	new_mask = vips_reduce_mask_new(kernel, shrink);
+
+	g_mutex_lock(&vips_reduce_mask_lock);
+
+	/* Someone else might have made it while we were busy.
+	 */
+	if ((mask = vips_reduce_mask_lookup(kernel, shrink)))
+		vips_reduce_mask_free(new_mask);
+	else {
+		mask = new_mask;
+
+		if (mask->n_point <= MASK_CACHE_MAX_POINT) {
+			if (g_slist_length(vips_reduce_mask_cache) >=
+				MASK_CACHE_MAX)
+				vips_reduce_mask_trim();
+
+			if (g_slist_length(vips_reduce_mask_cache) <
+				MASK_CACHE_MAX) {
+				mask->cached = TRUE;
+				vips_reduce_mask_cache =
+					g_slist_prepend(vips_reduce_mask_cache, mask);
+			}
+		}
+	}
+
+	mask->ref_count += 1;
+
+	g_mutex_unlock(&vips_reduce_mask_lock);
+
+	return mask;
+}
+
+/* Drop a ref. Uncached masks go when their last user does.
+ */
+void
+vips_reduce_mask_unref(VipsReduceMask *mask)
+{
+	gboolean free_mask;
+
+	g_mutex_lock(&vips_reduce_mask_lock);
+	g_assert(mask->ref_count > 0);
+	mask->ref_count -= 1;
+	free_mask = !mask->cached && mask->ref_count == 0;
+	g_mutex_unlock(&vips_reduce_mask_lock);
+
+	if (free_mask)
+		vips_reduce_mask_free(mask);
+}
+
+/* Free the cache, called from vips_shutdown(). Masks still in use belong
+ * to leaked operations, so just detach them and let their last unref free
+ * them.
+ */
+void
+vips__reduce_mask_shutdown(void)
+{
+	g_mutex_lock(&vips_reduce_mask_lock);
+
+	vips_reduce_mask_trim();
+
+	for (GSList *p = vips_reduce_mask_cache; p; p = p->next)
+		((VipsReduceMask *) p->data)->cached = FALSE;
+	VIPS_FREEF(g_slist_free, vips_reduce_mask_cache);
+
+	g_mutex_unlock(&vips_reduce_mask_lock);
+}
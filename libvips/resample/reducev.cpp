@@ -23,6 +23,8 @@
  * 	- speed up the mask construction for uchar/ushort images
  * 22/4/22 kleisauke
  * 	- add @gap option
+ * 18/10/26
+ * 	- share masks between operations
  */
 
 /*
@@ -129,10 +131,9 @@ typedef struct _VipsReducev {
 	 */
 	double residual_vshrink;
 
-	/* Precalculated interpolation matrices. short (used for pel
-	 * sizes up to int), and double (for all others). We go to
-	 * scale + 1 so we can round-to-nearest safely.
+	/* The shared mask we use, and pointers into it.
 	 */
+	VipsReduceMask *mask;
 	short *matrixs[VIPS_TRANSFORM_SCALE + 1];
 	double *matrixf[VIPS_TRANSFORM_SCALE + 1];
 
@@ -232,6 +233,16 @@ vips_reducev_start(VipsImage *out, void *a, void *b)
 	return seq;
 }
 
+static void
+vips_reducev_dispose(GObject *gobject)
+{
+	VipsReducev *reducev = (VipsReducev *) gobject;
+
+	VIPS_FREEF(vips_reduce_mask_unref, reducev->mask);
+
+	G_OBJECT_CLASS(vips_reducev_parent_class)->dispose(gobject);
+}
+
 #ifdef HAVE_ORC
 static void
 vips_reducev_finalize(GObject *gobject)
@@ -908,28 +919,14 @@ vips_reducev_build(VipsObject *object)
 	 */
 	reducev->voffset = (1 + extra_pixels) / 2.0 - 1;
 
-	/* Build the tables of pre-computed coefficients.
+	/* Get the tables of pre-computed coefficients.
 	 */
+	reducev->mask = vips_reduce_mask_get(reducev->kernel,
+		reducev->residual_vshrink);
+	g_assert(reducev->mask->n_point == reducev->n_point);
 	for (int y = 0; y < VIPS_TRANSFORM_SCALE + 1; y++) {
-		reducev->matrixf[y] = VIPS_ARRAY(object, reducev->n_point, double);
-		reducev->matrixs[y] = VIPS_ARRAY(object, reducev->n_point, short);
-		if (!reducev->matrixf[y] ||
-			!reducev->matrixs[y])
-			return -1;
-
-		vips_reduce_make_mask(reducev->matrixf[y], reducev->kernel,
-			reducev->n_point, reducev->residual_vshrink,
-			(float) y / VIPS_TRANSFORM_SCALE);
-
-		for (int i = 0; i < reducev->n_point; i++)
-			reducev->matrixs[y][i] =
-				(short) (reducev->matrixf[y][i] * VIPS_INTERPOLATE_SCALE);
-#ifdef DEBUG
-		printf("vips_reducev_build: mask %d\n    ", y);
-		for (int i = 0; i < reducev->n_point; i++)
-			printf("%d ", reducev->matrixs[y][i]);
-		printf("\n");
-#endif /*DEBUG*/
+		reducev->matrixf[y] = reducev->mask->matrixf[y];
+		reducev->matrixs[y] = reducev->mask->matrixs[y];
 	}
 
 	/* Unpack for processing.
@@ -1054,6 +1051,7 @@ vips_reducev_class_init(VipsReducevClass *reducev_class)
 
 	VIPS_DEBUG_MSG("vips_reducev_class_init\n");
 
+	gobject_class->dispose = vips_reducev_dispose;
 #ifdef HAVE_ORC
 	gobject_class->finalize = vips_reducev_finalize;
 #endif /*HAVE_ORC*/
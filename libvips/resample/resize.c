@@ -37,6 +37,8 @@
  * 	- much better handling of "nearest"
  * 22/4/22 kleisauke
  * 	- add @gap option
+ * 18/10/26
+ * 	- use vips_reduce() when we reduce on both axes, so it can fuse them
  */
 
 /*
@@ -208,9 +210,20 @@ vips_resize_build(VipsObject *object)
 	hscale = VIPS_MAX(hscale, 1.0 / in->Xsize);
 	vscale = VIPS_MAX(vscale, 1.0 / in->Ysize);
 
-	/* Any residual downsizing.
+	/* Any residual downsizing. On both axes, vips_reduce() can run the two
+	 * passes together.
 	 */
-	if (vscale < 1.0) {
+	if (vscale < 1.0 &&
+		hscale < 1.0) {
+		g_info("residual reduce by %g x %g", hscale, vscale);
+		if (vips_reduce(in, &t[2], 1.0 / hscale, 1.0 / vscale,
+				"kernel", resize->kernel,
+				"gap", resize->gap,
+				NULL))
+			return -1;
+		in = t[2];
+	}
+	else if (vscale < 1.0) {
 		g_info("residual reducev by %g", vscale);
 		if (vips_reducev(in, &t[2], 1.0 / vscale,
 				"kernel", resize->kernel,
@@ -219,8 +232,7 @@ vips_resize_build(VipsObject *object)
 			return -1;
 		in = t[2];
 	}
-
-	if (hscale < 1.0) {
+	else if (hscale < 1.0) {
 		g_info("residual reduceh by %g", hscale);
 		if (vips_reduceh(in, &t[3], 1.0 / hscale,
 				"kernel", resize->kernel,
@@ -559,8 +559,34 @@ struct LongT<double> {
 	typedef long double type;
 };
 
+/* Our inner loop for resampling with a convolution of type CT, with the
+ * number of points fixed at compile time so the compiler can unroll it.
+ */
+template <int n, typename T, typename CT, typename IT>
+static IT inline reduce_sum_fixed(const T *restrict in, int stride,
+	const CT *restrict c)
+{
+	IT sum;
+
+	sum = 0;
+	for (int i = 0; i < n; i++) {
+		sum += (IT) c[i] * in[0];
+		in += stride;
+	}
+
+	return sum;
+}
+
 /* Our inner loop for resampling with a convolution of type CT. Operate on
  * elements of type T, gather results in an intermediate of type IT.
+ *
+ * Masks always have an odd number of points, and the residual shrink is
+ * usually between 1 and 2, so most masks have between 3 and 13 points.
+ * Those sizes switch to a loop with a fixed trip count, which the compiler
+ * can unroll. This is a plain runtime switch on @n, not a specialised
+ * pixel loop, and @n is the same for the whole region, so the branch
+ * predicts well. The sum is done in the same order, so the result does not
+ * change.
  */
 template <typename T, typename CT, typename IT = typename LongT<T>::type>
 static IT inline reduce_sum(const T *restrict in, int stride,
@@ -568,6 +594,29 @@ static IT inline reduce_sum(const T *restrict in, int stride,
 {
 	IT sum;
 
+	switch (n) {
+	case 3:
+		return reduce_sum_fixed<3, T, CT, IT>(in, stride, c);
+
+	case 5:
+		return reduce_sum_fixed<5, T, CT, IT>(in, stride, c);
+
+	case 7:
+		return reduce_sum_fixed<7, T, CT, IT>(in, stride, c);
+
+	case 9:
+		return reduce_sum_fixed<9, T, CT, IT>(in, stride, c);
+
+	case 11:
+		return reduce_sum_fixed<11, T, CT, IT>(in, stride, c);
+
+	case 13:
+		return reduce_sum_fixed<13, T, CT, IT>(in, stride, c);
+
+	default:
+		break;
+	}
+
 	sum = 0;
 	for (int i = 0; i < n; i++) {
 		sum += (IT) c[i] * in[0];
@@ -760,6 +760,22 @@ class TestArithmetic:
                 im4 = (im2 > im).ifthenelse(im2, im)
                 assert (im3 - im4).abs().max() == 0
 
+    def test_fused(self):
+        # chains of point operations are fused into one generate ...
+        # wider than a chunk to test the line loop
+        im = pyvips.Image.xyz(700, 20)[0]
+        for fmt in noncomplex_formats:
+            im2 = im.cast(fmt)
+
+            fused = ((im2 * 2 + 1).sin().abs() > 0.5).invert()
+            a = (im2 * 2 + 1).copy_memory()
+            b = a.sin().copy_memory()
+            c = b.abs().copy_memory()
+            d = (c > 0.5).copy_memory()
+            unfused = d.invert()
+
+            assert (fused - unfused).abs().max() == 0
+
 
 if __name__ == '__main__':
     pytest.main()
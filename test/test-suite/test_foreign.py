@@ -307,6 +307,87 @@ class TestForeign:
         im10 = pyvips.Image.jpegload_buffer(r10)
         assert im0.avg() == im10.avg()
 
+    @skip_if_no("jpegsave")
+    def test_jpegload_restart(self):
+        # tall enough to decode in several bands, with a restart marker at
+        # the start of every MCU row
+        im = pyvips.Image.new_from_file(JPEG_FILE)
+        im = im.replicate(1, 1 + 2048 // im.height)
+        mcus_per_row = (im.width + 15) // 16
+
+        r0 = im.jpegsave_buffer(subsample_mode="on")
+        rr = im.jpegsave_buffer(subsample_mode="on",
+                                restart_interval=mcus_per_row)
+
+        # restart markers don't change the pixels, so a banded decode
+        # must match a sequential one exactly
+        for shrink in [1, 2]:
+            seq = pyvips.Image.jpegload_buffer(r0, shrink=shrink)
+            banded = pyvips.Image.jpegload_buffer(rr, shrink=shrink)
+            assert (seq - banded).abs().max() == 0
+
+        # and we can read from the middle without decoding from the top
+        seq = pyvips.Image.jpegload_buffer(r0)
+        banded = pyvips.Image.jpegload_buffer(rr, access="random")
+        area = banded.crop(10, 1000, 100, 300)
+        assert (seq.crop(10, 1000, 100, 300) - area).abs().max() == 0
+
+    def test_load_roi(self):
+        for filename in [JPEG_FILE, PNG_FILE]:
+            with open(filename, "rb") as f:
+                whole = pyvips.Image.new_from_buffer(f.read(), "")
+
+            # a crop at the head of a pipeline lets the loader decode just
+            # the crop, and that must match a crop of the whole image
+            im = pyvips.Image.new_from_file(filename)
+            area = im.crop(17, 23, 51, 37)
+            assert (whole.crop(17, 23, 51, 37) - area).abs().max() == 0
+
+            # we must still be able to read pixels outside the crop
+            assert (whole - im).abs().max() == 0
+
+    @skip_if_no("pngload")
+    def test_load_roi_truncated(self):
+        # a tall png with the tail cut off: a crop near the top must finish
+        # without reading the tail, the whole image must fail
+        big = pyvips.Image.new_from_file(PNG_FILE).replicate(1, 20)
+        data = big.pngsave_buffer()
+        truncated = data[:len(data) // 2]
+        filename = temp_filename(self.tempdir, ".png")
+        with open(filename, "wb") as f:
+            f.write(truncated)
+
+        for im in [pyvips.Image.new_from_file(filename, fail_on="truncated"),
+                   pyvips.Image.new_from_buffer(truncated, "",
+                                                fail_on="truncated"),
+                   pyvips.Image.new_from_source(
+                       pyvips.Source.new_from_file(filename), "",
+                       fail_on="truncated")]:
+            area = im.crop(17, 23, 51, 37)
+            assert (big.crop(17, 23, 51, 37) - area).abs().max() == 0
+
+            with pytest.raises(pyvips.error.Error):
+                im.avg()
+
+    @skip_if_no("jpegsave")
+    def test_jpegsave_restart(self):
+        # tall enough to encode in several bands, with restart markers that
+        # fall at the start of MCU rows
+        im = pyvips.Image.new_from_file(JPEG_FILE)
+        im = im.replicate(1, 1 + 4096 // im.height)
+
+        for image, mcu in [[im, 16], [im.extract_band(1), 8]]:
+            mcus_per_row = (image.width + mcu - 1) // mcu
+            for interval in [mcus_per_row, 2 * mcus_per_row]:
+                r0 = image.jpegsave_buffer(subsample_mode="on")
+                rr = image.jpegsave_buffer(subsample_mode="on",
+                                           restart_interval=interval)
+
+                # the DCT is the same, so the pixels must match exactly
+                seq = pyvips.Image.jpegload_buffer(r0)
+                banded = pyvips.Image.jpegload_buffer(rr)
+                assert (seq - banded).abs().max() == 0
+
     @skip_if_no("jpegsave")
     def test_jpegsave_exif(self):
         def exif_valid(im):
@@ -649,6 +730,17 @@ class TestForeign:
         rgb = pyvips.Image.pngload_buffer(data)
         assert rgb.format == "uchar"
 
+        # large images are deflated in parallel strips
+        big = self.colour.replicate(4, 4)
+        for filter in ["none", "sub", "up", "avg", "paeth", "all"]:
+            data = big.pngsave_buffer(filter=filter)
+            after = pyvips.Image.pngload_buffer(data)
+            assert (big - after).abs().max() == 0
+        big16 = big.cast("ushort") * 256
+        data = big16.pngsave_buffer(bitdepth=16, filter="all")
+        after = pyvips.Image.pngload_buffer(data)
+        assert (big16 - after).abs().max() == 0
+
         # we should be able to save a 16-bit image as an 8-bit WebP
         if have("webpsave"):
             data = rgb16.webpsave_buffer(lossless=True)
@@ -907,6 +999,23 @@ class TestForeign:
         assert y.get("tile-width") == 192
         assert y.get("tile-height") == 224
 
+    @skip_if_no("tiffload")
+    def test_tiff_mapped(self):
+        # uncompressed strip images are mapped, and support random access
+        for image in [self.colour, self.colour.cast("ushort") << 8,
+                      self.mono.cast("float")]:
+            for rows in [1, 16, image.height]:
+                filename = temp_filename(self.tempdir, ".tif")
+                image.tiffsave(filename, compression="none",
+                               tile_height=rows)
+                im = pyvips.Image.new_from_file(filename, access="random")
+                assert (im.rot90() - image.rot90()).abs().max() == 0
+
+        # compressed strips still go via libtiff
+        buf = self.colour.tiffsave_buffer(compression="deflate")
+        im = pyvips.Image.new_from_buffer(buf, "")
+        assert (im - self.colour).abs().max() == 0
+
     @skip_if_no("tiffload")
     @pytest.mark.xfail(raises=AssertionError, reason="fails when libtiff was configured with --disable-old-jpeg")
     def test_tiff_ojpeg(self):
@@ -1145,6 +1254,17 @@ class TestForeign:
             assert x1.get("page-height") == x2.get("page-height")
             assert x1.get("gif-loop") == x2.get("gif-loop")
 
+            # stream mode writes each changed rectangle as it is encoded,
+            # and lossless frames should decode to the same pixels
+            w2 = x1.webpsave_buffer(stream=True, lossless=True, exact=True)
+            x3 = pyvips.Image.new_from_buffer(w2, "", n=-1)
+            assert x1.width == x3.width
+            assert x1.height == x3.height
+            assert expected_delay == x3.get("delay")
+            assert x1.get("page-height") == x3.get("page-height")
+            assert x1.get("gif-loop") == x3.get("gif-loop")
+            assert (x1 - x3).abs().max() == 0
+
         # WebP image that happens to contain the string "<svg"
         if have("svgload"):
             x = pyvips.Image.new_from_file(WEBP_LOOKS_LIKE_SVG_FILE)
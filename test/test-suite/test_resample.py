@@ -74,6 +74,23 @@ class TestResample:
 
             assert (x - im).abs().max() == 0
 
+    def test_affine_span(self):
+        im = pyvips.Image.new_from_file(JPEG_FILE)
+
+        # a rotate has background at both ends of most lines, and uchar
+        # 3 and 4 band images can take the vector span path ... check they
+        # match the ushort C path
+        for name in ["bilinear", "bicubic", "nohalo"]:
+            interpolate = pyvips.Interpolate.new(name)
+            for x in [im, im.bandjoin(255)]:
+                a = x.rotate(17, interpolate=interpolate)
+                b = x.cast("ushort") \
+                    .rotate(17, interpolate=interpolate) \
+                    .cast("uchar")
+                assert a.width == b.width
+                assert a.height == b.height
+                assert (a - b).abs().max() <= 2
+
     def test_reduce(self):
         im = pyvips.Image.new_from_file(JPEG_FILE)
         # cast down to 0-127, the smallest range, so we aren't messed up by
@@ -102,6 +119,41 @@ class TestResample:
                 d = abs(shr.avg() - im.avg())
                 assert d == 0
 
+    def test_reduce_mask_shared(self):
+        im = pyvips.Image.new_from_file(JPEG_FILE).cast("float")
+
+        # reduceh and reducev share cached masks ... a reduceh must match a
+        # reducev of the rotated image, and a second run (on a copy, so it
+        # misses the operation cache but hits the mask cache) must match
+        # the first
+        for fac in [1.1, 1.5, 2.7]:
+            for kernel in ["linear", "cubic", "lanczos3", "mks2021"]:
+                a = im.reduceh(fac, kernel=kernel).rot90()
+                b = im.rot90().reducev(fac, kernel=kernel)
+                c = im.copy().reduceh(fac, kernel=kernel).rot90()
+                assert a.width == b.width
+                assert a.height == b.height
+                assert (a - b).abs().max() == 0
+                assert (a - c).abs().max() == 0
+
+    def test_reduce_fused(self):
+        im = pyvips.Image.new_from_file(JPEG_FILE)
+
+        # uchar 3 and 4 band images run both passes together ... check they
+        # match the ushort path, which runs them one after the other
+        for x in [im, im.bandjoin(255)]:
+            for fac in [1.5, 2.7]:
+                for gap in [0.0, 2.0]:
+                    a = x.reduce(fac, fac * 1.3, gap=gap)
+                    b = x.cast("ushort") \
+                        .reduce(fac, fac * 1.3, gap=gap) \
+                        .cast("uchar")
+                    assert a.width == b.width
+                    assert a.height == b.height
+                    # with a gap, the box shrinks round in a different
+                    # order
+                    assert (a - b).abs().max() <= (2 if gap == 0 else 4)
+
     def test_resize(self):
         im = pyvips.Image.new_from_file(JPEG_FILE)
         im2 = im.resize(0.25)
@@ -298,6 +350,20 @@ class TestResample:
         interp = pyvips.Interpolate.new('bicubic')
         assert im.mapim(mp, interpolate=interp).avg() == im.avg()
 
+    def test_mapim_footprint(self):
+        im = pyvips.Image.new_from_file(JPEG_FILE)
+
+        # each 128x128 output tile fans out over 2048x2048 pixels of this
+        # large input, well over MAX_FOOTPRINT, so mapim must split tiles
+        # to stay within its input budget
+        big = im.zoom(16, 16)
+        mp = pyvips.Image.xyz(im.width, im.height) * 16
+        assert (big.mapim(mp) - im).abs().max() == 0
+
+        # an input in memory is never split
+        mp = pyvips.Image.xyz(im.width, im.height)
+        assert (im.copy_memory().mapim(mp) - im).abs().max() == 0
+
 
 if __name__ == '__main__':
     pytest.main()
@@ -0,0 +1,65 @@
+#include <vips/vips.h>
+
+static void
+compute(void)
+{
+	VipsImage *black;
+	VipsImage *im;
+	void *buf;
+	size_t size;
+
+	if (vips_black(&black, 2000, 2000, "bands", 3, NULL) ||
+		vips_linear1(black, &im, 1.0, 10.0, "uchar", TRUE, NULL))
+		vips_error_exit(NULL);
+	if (!(buf = vips_image_write_to_memory(im, &size)))
+		vips_error_exit(NULL);
+
+	g_free(buf);
+	g_object_unref(im);
+	g_object_unref(black);
+}
+
+int
+main(int argc, char **argv)
+{
+	guint64 hits;
+	guint64 misses;
+	size_t cached;
+	size_t mem;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	vips_cache_set_max(0);
+	vips_buffer_pool_set_max_mem(32 * 1024 * 1024);
+
+	/* Later runs should reuse the pixel buffers from the first.
+	 */
+	compute();
+	compute();
+	compute();
+
+	/* Workers return their buffers in vips_thread_shutdown(), just after
+	 * the computation finishes.
+	 */
+	g_usleep(G_USEC_PER_SEC / 10);
+
+	vips_buffer_pool_get_stats(&hits, &misses, &cached);
+	g_assert(misses > 0);
+	g_assert(hits > 0);
+	g_assert(cached > 0);
+	g_assert(cached <= vips_buffer_pool_get_max_mem());
+
+	/* Pooled memory isn't tracked, so emptying the pool won't change the
+	 * tracked total.
+	 */
+	mem = vips_tracked_get_mem();
+	vips_buffer_pool_set_max_mem(0);
+	vips_buffer_pool_get_stats(NULL, NULL, &cached);
+	g_assert(cached == 0);
+	g_assert(vips_tracked_get_mem() == mem);
+
+	vips_shutdown();
+
+	return 0;
+}
@@ -0,0 +1,92 @@
+#include <vips/vips.h>
+
+/* Make an operation which is slow to compute, fill the cache with cheap
+ * operations, then shrink the cache. Return TRUE if the slow operation
+ * survived.
+ */
+static gboolean
+slow_survives(VipsCachePolicy policy)
+{
+	VipsImage *in;
+	VipsImage *slow;
+	VipsImage *again;
+	double avg;
+	gboolean survived;
+
+	vips_cache_set_max(0);
+	vips_cache_set_max(1000);
+	vips_cache_set_policy(policy);
+
+	if (vips_black(&in, 1000, 1000, NULL) ||
+		vips_gaussblur(in, &slow, 5, NULL) ||
+		vips_avg(slow, &avg, NULL))
+		vips_error_exit(NULL);
+
+	for (int i = 0; i < 320; i++) {
+		VipsImage *cheap;
+
+		if (vips_black(&cheap, i + 1, 1, NULL))
+			vips_error_exit(NULL);
+		g_object_unref(cheap);
+	}
+
+	vips_cache_set_max(vips_cache_get_size() / 2);
+
+	/* A hit gives us back the same output image.
+	 */
+	if (vips_gaussblur(in, &again, 5, NULL))
+		vips_error_exit(NULL);
+	survived = again == slow;
+
+	g_object_unref(again);
+	g_object_unref(slow);
+	g_object_unref(in);
+
+	return survived;
+}
+
+/* Run a lot of cheap operations and return the number left in the cache.
+ */
+static int
+fill(int max)
+{
+	vips_cache_set_max(max);
+
+	for (int i = 0; i < 320; i++) {
+		VipsImage *cheap;
+
+		if (vips_black(&cheap, i + 1, 1, NULL))
+			vips_error_exit(NULL);
+		g_object_unref(cheap);
+	}
+
+	return vips_cache_get_size();
+}
+
+int
+main(int argc, char **argv)
+{
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	vips_cache_set_max_mem(1024 * 1024 * 1024);
+	vips_cache_set_max_files(1000);
+
+	/* The slow operation is the least recently used, so LRU drops it,
+	 * but with COST it outlives the cheap ones.
+	 */
+	g_assert(!slow_survives(VIPS_CACHE_POLICY_LRU));
+	g_assert(slow_survives(VIPS_CACHE_POLICY_COST));
+
+	/* The limit holds even when it's smaller than the number of shards,
+	 * and 0 turns caching off.
+	 */
+	g_assert(fill(0) == 0);
+	g_assert(fill(5) <= 5);
+	g_assert(fill(100) <= 100);
+	g_assert(fill(0) == 0);
+
+	vips_shutdown();
+
+	return 0;
+}
@@ -82,6 +82,29 @@ cat $image | $vipsthumbnail stdin -s 100 -o .jpg | cat > $tmp/t1.jpg
 echo ok
 test_size $tmp/t1.jpg 66 100
 
+# several files at once, one thread each
+echo -n "testing thumbnail of several files ... "
+for i in 1 2 3 4; do
+  cp $image $tmp/batch$i.jpg
+done
+$vipsthumbnail $tmp/batch1.jpg $tmp/batch2.jpg $tmp/batch3.jpg \
+  $tmp/batch4.jpg -s 100 --jobs 2 -o tn_%s.jpg
+for i in 1 2 3 4; do
+  test_size $tmp/tn_batch$i.jpg 66 100
+done
+echo ok
+
+# the file workers must not starve their pipelines of threads
+echo -n "testing thumbnail of several files with few threads ... "
+rm -f $tmp/tn_batch*.jpg
+VIPS_MAX_THREADS=4 VIPS_CONCURRENCY=4 $vipsthumbnail \
+  $tmp/batch1.jpg $tmp/batch2.jpg $tmp/batch3.jpg $tmp/batch4.jpg \
+  -s 100 --jobs 4 -o tn_%s.jpg
+for i in 1 2 3 4; do
+  test_size $tmp/tn_batch$i.jpg 66 100
+done
+echo ok
+
 # test max-coord
 # this will coredumop on an assert fail in debug builds, so block coredumps
 ulimit -c 0
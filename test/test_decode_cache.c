@@ -0,0 +1,79 @@
+#include <vips/vips.h>
+#include <glib/gstdio.h>
+
+static double
+load_avg(const char *filename)
+{
+	VipsImage *im;
+	double avg;
+
+	if (!(im = vips_image_new_from_file(filename, NULL)) ||
+		vips_avg(im, &avg, NULL))
+		vips_error_exit(NULL);
+	g_object_unref(im);
+
+	return avg;
+}
+
+int
+main(int argc, char **argv)
+{
+	VipsImage *im;
+	char *filename;
+	double avg;
+	guint64 hits;
+	guint64 misses;
+	guint64 misses2;
+	size_t cached;
+	size_t mem;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	if (!vips_type_find("VipsOperation", "tiffsave"))
+		/* tiffsave not available, skip test with return code 77.
+		 */
+		return 77;
+
+	/* Turn off the operation cache, or the second load would just reuse
+	 * the first.
+	 */
+	vips_cache_set_max(0);
+	vips_decode_cache_set_max_mem(100 * 1024 * 1024);
+
+	filename = g_build_filename(g_get_tmp_dir(),
+		"test_decode_cache.tif", NULL);
+	if (vips_gaussnoise(&im, 1000, 1000, NULL) ||
+		vips_tiffsave(im, filename, "tile", TRUE, NULL))
+		vips_error_exit(NULL);
+	g_object_unref(im);
+
+	/* The second load should find all its tiles in the cache.
+	 */
+	avg = load_avg(filename);
+	vips_decode_cache_get_stats(&hits, &misses, &cached);
+	g_assert(hits == 0);
+	g_assert(misses > 0);
+	g_assert(cached > 0);
+
+	g_assert(load_avg(filename) == avg);
+	vips_decode_cache_get_stats(&hits, &misses2, NULL);
+	g_assert(hits > 0);
+	g_assert(misses2 == misses);
+
+	/* Cached tiles aren't tracked, so emptying the cache won't change
+	 * the tracked total.
+	 */
+	mem = vips_tracked_get_mem();
+	vips_decode_cache_set_max_mem(0);
+	vips_decode_cache_get_stats(NULL, NULL, &cached);
+	g_assert(cached == 0);
+	g_assert(vips_tracked_get_mem() == mem);
+
+	g_unlink(filename);
+	g_free(filename);
+
+	vips_shutdown();
+
+	return 0;
+}
@@ -0,0 +1,171 @@
+#include <vips/vips.h>
+
+/* Pick loaders the way libvips did before the signature table: walk every
+ * loader in priority order and take the first whose is_a() says yes.
+ */
+
+static void *
+find_file(VipsForeignLoadClass *load_class, const char *filename, void *b)
+{
+	const char *nickname = VIPS_OBJECT_CLASS(load_class)->nickname;
+	const char **suffs = VIPS_FOREIGN_CLASS(load_class)->suffs;
+
+	if (g_str_has_suffix(nickname, "_buffer") ||
+		g_str_has_suffix(nickname, "_source"))
+		return NULL;
+
+	if (load_class->is_a) {
+		if (load_class->is_a(filename))
+			return load_class;
+	}
+	else if (suffs &&
+		vips_filename_suffix_match(filename, suffs))
+		return load_class;
+
+	return NULL;
+}
+
+static void *
+find_buffer(VipsForeignLoadClass *load_class, VipsBlob *blob, void *b)
+{
+	const char *nickname = VIPS_OBJECT_CLASS(load_class)->nickname;
+
+	const void *data;
+	size_t length;
+
+	if (!g_str_has_suffix(nickname, "_buffer") ||
+		!load_class->is_a_buffer)
+		return NULL;
+
+	data = vips_blob_get(blob, &length);
+	if (load_class->is_a_buffer(data, length))
+		return load_class;
+
+	return NULL;
+}
+
+static void *
+find_source(VipsForeignLoadClass *load_class, VipsSource *source, void *b)
+{
+	const char *nickname = VIPS_OBJECT_CLASS(load_class)->nickname;
+
+	if (!g_str_has_suffix(nickname, "_source") ||
+		!load_class->is_a_source)
+		return NULL;
+
+	(void) vips_source_rewind(source);
+	if (load_class->is_a_source(source))
+		return load_class;
+
+	return NULL;
+}
+
+static gboolean
+same(const char *filename, const char *kind,
+	VipsForeignLoadClass *before, const char *after)
+{
+	const char *name = before ? G_OBJECT_CLASS_NAME(before) : NULL;
+
+	vips_error_clear();
+
+	if (g_strcmp0(name, after) != 0) {
+		printf("%s: %s loader was %s, now %s\n",
+			filename, kind,
+			name ? name : "none",
+			after ? after : "none");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+check_file(const char *filename)
+{
+	VipsForeignLoadClass *before;
+	const char *after;
+	char *buf;
+	gsize length;
+	VipsBlob *blob;
+	VipsSource *source;
+	gboolean ok;
+
+	ok = TRUE;
+
+	before = vips_foreign_map("VipsForeignLoad",
+		(VipsSListMap2Fn) find_file, (void *) filename, NULL);
+	after = vips_foreign_find_load(filename);
+	if (!same(filename, "file", before, after))
+		ok = FALSE;
+
+	if (!g_file_get_contents(filename, &buf, &length, NULL))
+		return FALSE;
+	blob = vips_blob_new((VipsCallbackFn) g_free, buf, length);
+
+	before = vips_foreign_map("VipsForeignLoad",
+		(VipsSListMap2Fn) find_buffer, blob, NULL);
+	after = vips_foreign_find_load_buffer(buf, length);
+	if (!same(filename, "buffer", before, after))
+		ok = FALSE;
+
+	if (!(source = vips_source_new_from_blob(blob)))
+		vips_error_exit(NULL);
+	before = vips_foreign_map("VipsForeignLoad",
+		(VipsSListMap2Fn) find_source, source, NULL);
+	(void) vips_source_rewind(source);
+	after = vips_foreign_find_load_source(source);
+	if (!same(filename, "source", before, after))
+		ok = FALSE;
+
+	VIPS_UNREF(source);
+	vips_area_unref(VIPS_AREA(blob));
+
+	return ok;
+}
+
+static gboolean
+check_directory(const char *dirname)
+{
+	GDir *dir;
+	const char *name;
+	gboolean ok;
+
+	if (!(dir = g_dir_open(dirname, 0, NULL)))
+		return FALSE;
+
+	ok = TRUE;
+	while ((name = g_dir_read_name(dir))) {
+		char *path = g_build_filename(dirname, name, NULL);
+
+		if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+			if (!check_directory(path))
+				ok = FALSE;
+		}
+		else if (!check_file(path))
+			ok = FALSE;
+
+		g_free(path);
+	}
+
+	g_dir_close(dir);
+
+	return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+	gboolean ok;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	if (argc != 2)
+		vips_error_exit("usage: %s test-images-directory", argv[0]);
+
+	ok = check_directory(argv[1]);
+
+	vips_shutdown();
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+#include <string.h>
+
+#include <vips/vips.h>
+
+/* Transform an image and return the pixels.
+ */
+static void *
+transform(VipsImage *in, const char *name, gboolean rotate, size_t *size)
+{
+	VipsInterpolate *interpolate;
+	VipsImage *out;
+	void *buf;
+
+	if (!(interpolate = vips_interpolate_new(name)))
+		vips_error_exit(NULL);
+
+	if (rotate) {
+		if (vips_rotate(in, &out, 17, "interpolate", interpolate, NULL))
+			vips_error_exit(NULL);
+	}
+	else {
+		if (vips_affine(in, &out, 1.3, 0.2, -0.1, 0.9,
+				"interpolate", interpolate, NULL))
+			vips_error_exit(NULL);
+	}
+
+	if (!(buf = vips_image_write_to_memory(out, size)))
+		vips_error_exit(NULL);
+
+	g_object_unref(out);
+	g_object_unref(interpolate);
+
+	return buf;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *names[] = { "bilinear", "bicubic", "nohalo" };
+
+	VipsImage *noise;
+	VipsImage *uchar;
+	VipsImage *in;
+	gboolean ok;
+	int bands;
+	int i;
+	int rotate;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	/* We want to run every transform twice.
+	 */
+	vips_cache_set_max(0);
+
+	ok = TRUE;
+
+	/* uchar 3 and 4 band images can take the vector span path, which
+	 * must match the C path exactly.
+	 */
+	for (bands = 3; bands <= 4; bands++) {
+		if (vips_gaussnoise(&noise, 301 * bands, 237,
+				"mean", 128.0, "sigma", 60.0, NULL) ||
+			vips_cast_uchar(noise, &uchar, NULL) ||
+			vips_bandfold(uchar, &in, "factor", bands, NULL))
+			vips_error_exit(NULL);
+		g_object_unref(uchar);
+		g_object_unref(noise);
+
+		for (i = 0; i < VIPS_NUMBER(names); i++)
+			for (rotate = 0; rotate < 2; rotate++) {
+				void *vector;
+				void *scalar;
+				size_t vector_size;
+				size_t scalar_size;
+
+				vips_vector_set_enabled(TRUE);
+				vector = transform(in, names[i], rotate, &vector_size);
+				vips_vector_set_enabled(FALSE);
+				scalar = transform(in, names[i], rotate, &scalar_size);
+
+				if (vector_size != scalar_size ||
+					memcmp(vector, scalar, vector_size) != 0) {
+					printf("%s, %d bands, %s: vector and scalar differ\n",
+						names[i], bands, rotate ? "rotate" : "affine");
+					ok = FALSE;
+				}
+
+				g_free(vector);
+				g_free(scalar);
+			}
+
+		g_object_unref(in);
+	}
+
+	vips_shutdown();
+
+	return ok ? 0 : 1;
+}
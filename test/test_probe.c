@@ -0,0 +1,211 @@
+#include <string.h>
+
+#include <vips/vips.h>
+
+/* Truncate test images to these lengths.
+ */
+static const int truncate_lengths[] = { 1, 4, 16, 100, 1000, 10000 };
+
+static int n_compared = 0;
+
+/* Check a probe against an image loaded from the same bytes. If the load
+ * worked, the probe must work too and give the same properties. The probe
+ * can succeed on an image the loader rejects, since it only reads the
+ * header.
+ */
+static gboolean
+probe_matches(const char *name, VipsSource *source, VipsImage *image)
+{
+	VipsProbe probe;
+
+	if (vips_probe_source(source, &probe)) {
+		vips_error_clear();
+		return !image;
+	}
+	if (!image)
+		return TRUE;
+
+	n_compared += 1;
+
+	if (probe.width != image->Xsize ||
+		probe.height != vips_image_get_page_height(image) ||
+		probe.bands != image->Bands ||
+		probe.format != image->BandFmt ||
+		probe.orientation != vips_image_get_orientation(image) ||
+		probe.n_pages != vips_image_get_n_pages(image)) {
+		printf("%s: probe %s gave %d x %d, %d bands, %s, "
+			   "orientation %d, %d pages\n",
+			name, probe.loader,
+			probe.width, probe.height, probe.bands,
+			vips_enum_nick(VIPS_TYPE_BAND_FORMAT, probe.format),
+			probe.orientation, probe.n_pages);
+		printf("%s: load gave %d x %d, %d bands, %s, "
+			   "orientation %d, %d pages\n",
+			name,
+			image->Xsize, vips_image_get_page_height(image), image->Bands,
+			vips_enum_nick(VIPS_TYPE_BAND_FORMAT, image->BandFmt),
+			vips_image_get_orientation(image),
+			vips_image_get_n_pages(image));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+check_buffer(const char *name, const void *buf, size_t length)
+{
+	VipsSource *source;
+	VipsImage *image;
+	gboolean ok;
+
+	if (!(source = vips_source_new_from_memory(buf, length)))
+		vips_error_exit(NULL);
+	if (!(image = vips_image_new_from_buffer(buf, length, "", NULL)))
+		vips_error_clear();
+
+	ok = probe_matches(name, source, image);
+
+	VIPS_UNREF(image);
+	VIPS_UNREF(source);
+
+	return ok;
+}
+
+static gboolean
+check_file(const char *filename)
+{
+	VipsSource *source;
+	VipsImage *image;
+	gboolean ok;
+	char *buf;
+	gsize length;
+	int i;
+
+	if (!(source = vips_source_new_from_file(filename)))
+		vips_error_exit(NULL);
+	if (!(image = vips_image_new_from_file(filename, NULL)))
+		vips_error_clear();
+
+	/* The probe only uses source loaders, so it can fail on files that
+	 * have only a filename loader.
+	 */
+	if (vips_foreign_find_load_source(source))
+		ok = probe_matches(filename, source, image);
+	else {
+		vips_error_clear();
+		ok = TRUE;
+	}
+
+	VIPS_UNREF(image);
+	VIPS_UNREF(source);
+
+	if (!g_file_get_contents(filename, &buf, &length, NULL))
+		return FALSE;
+	for (i = 0; i < VIPS_NUMBER(truncate_lengths); i++)
+		if (truncate_lengths[i] < length &&
+			!check_buffer(filename, buf, truncate_lengths[i]))
+			ok = FALSE;
+	g_free(buf);
+
+	return ok;
+}
+
+static gboolean
+check_directory(const char *dirname)
+{
+	GDir *dir;
+	const char *name;
+	gboolean ok;
+
+	if (!(dir = g_dir_open(dirname, 0, NULL)))
+		return FALSE;
+
+	ok = TRUE;
+	while ((name = g_dir_read_name(dir))) {
+		char *path = g_build_filename(dirname, name, NULL);
+
+		if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+			if (!check_directory(path))
+				ok = FALSE;
+		}
+		else if (!check_file(path))
+			ok = FALSE;
+
+		g_free(path);
+	}
+
+	g_dir_close(dir);
+
+	return ok;
+}
+
+/* A valid signature followed by junk, so the probe gets past the magic
+ * check.
+ */
+static gboolean
+check_garbage(void)
+{
+	static const struct {
+		const char *magic;
+		size_t length;
+	} magics[] = {
+		{ "\xff\xd8\xff", 3 },
+		{ "\x89PNG\r\n\x1a\n", 8 },
+		{ "RIFF\0\0\0\0WEBP", 12 },
+		{ "II*\0", 4 },
+		{ "MM\0*", 4 },
+		{ "II+\0", 4 },
+		{ "MM\0+", 4 },
+	};
+
+	GRand *rand;
+	unsigned char buf[4096];
+	gboolean ok;
+	int i, j, k;
+
+	rand = g_rand_new_with_seed(42);
+	ok = TRUE;
+
+	for (i = 0; i < VIPS_NUMBER(magics); i++)
+		for (j = 0; j < 100; j++) {
+			size_t length = g_rand_int_range(rand,
+				magics[i].length, sizeof(buf));
+
+			for (k = 0; k < length; k++)
+				buf[k] = g_rand_int_range(rand, 0, 256);
+			memcpy(buf, magics[i].magic, magics[i].length);
+
+			if (!check_buffer("garbage", buf, length))
+				ok = FALSE;
+		}
+
+	g_rand_free(rand);
+
+	return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+	gboolean ok;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	if (argc != 2)
+		vips_error_exit("usage: %s test-images-directory", argv[0]);
+
+	ok = check_directory(argv[1]);
+	if (!check_garbage())
+		ok = FALSE;
+
+	/* We must have compared something.
+	 */
+	if (n_compared == 0)
+		ok = FALSE;
+
+	vips_shutdown();
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+#include <string.h>
+
+#include <vips/vips.h>
+
+/* Count the times reduce picks the fused path.
+ */
+static int n_fused = 0;
+
+static void
+log_handler(const char *domain, GLogLevelFlags level,
+	const char *message, void *user_data)
+{
+	if (strcmp(message, "reduce: using fused vector path") == 0)
+		n_fused += 1;
+}
+
+/* Reduce by a fractional amount on both axes, noting if we took the fused
+ * path.
+ */
+static VipsImage *
+reduce(VipsImage *in, gboolean *fused)
+{
+	int n = n_fused;
+	VipsImage *out;
+
+	if (vips_reduce(in, &out, 1.5, 2.7, NULL))
+		vips_error_exit(NULL);
+
+	*fused = n_fused > n;
+
+	return out;
+}
+
+int
+main(int argc, char **argv)
+{
+	VipsImage *noise;
+	VipsImage *in;
+	gboolean ok;
+	int bands;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	/* We need every reduce to build.
+	 */
+	vips_cache_set_max(0);
+
+	g_log_set_handler("VIPS", G_LOG_LEVEL_INFO, log_handler, NULL);
+
+	ok = TRUE;
+
+	/* uchar 3 and 4 band images with a fractional shrink on both axes
+	 * must take the fused path, and must match the two-pass ushort path.
+	 */
+	for (bands = 3; bands <= 4; bands++) {
+		VipsImage *t;
+		VipsImage *a;
+		VipsImage *b;
+		VipsImage *diff;
+		gboolean fused;
+		double max;
+
+		if (vips_gaussnoise(&noise, 301 * bands, 237,
+				"mean", 128.0, "sigma", 60.0, NULL) ||
+			vips_cast_uchar(noise, &t, NULL) ||
+			vips_bandfold(t, &in, "factor", bands, NULL))
+			vips_error_exit(NULL);
+		g_object_unref(t);
+		g_object_unref(noise);
+
+		vips_vector_set_enabled(TRUE);
+		if (!vips_vector_isenabled()) {
+			g_object_unref(in);
+			vips_shutdown();
+			return 77;
+		}
+
+		a = reduce(in, &fused);
+		if (!fused) {
+			printf("%d bands: fused path not taken\n", bands);
+			ok = FALSE;
+		}
+
+		if (vips_cast_ushort(in, &t, NULL))
+			vips_error_exit(NULL);
+		b = reduce(t, &fused);
+		g_object_unref(t);
+		if (fused) {
+			printf("%d bands: ushort took the fused path\n", bands);
+			ok = FALSE;
+		}
+
+		if (vips_subtract(a, b, &t, NULL) ||
+			vips_abs(t, &diff, NULL) ||
+			vips_max(diff, &max, NULL))
+			vips_error_exit(NULL);
+		g_object_unref(diff);
+		g_object_unref(t);
+		if (max > 2) {
+			printf("%d bands: fused and two-pass differ by %g\n",
+				bands, max);
+			ok = FALSE;
+		}
+		g_object_unref(a);
+		g_object_unref(b);
+
+		/* Without vector, we must use the two-pass path.
+		 */
+		vips_vector_set_enabled(FALSE);
+		a = reduce(in, &fused);
+		g_object_unref(a);
+		if (fused) {
+			printf("%d bands: fused path taken without vector\n", bands);
+			ok = FALSE;
+		}
+
+		g_object_unref(in);
+	}
+
+	vips_shutdown();
+
+	return ok ? 0 : 1;
+}
@@ -54,4 +54,3 @@ if [ $exit_code -ne 0 ]; then
   exit 1
 fi
 echo ok
-
@@ -0,0 +1,137 @@
+#!/bin/sh
+
+# threadpool and sink checks which need no deprecated API, see also
+# test_threading.sh
+
+# set -x
+
+. ./variables.sh
+
+exit_code=0
+
+# sink_disc hands out tiles lock-free ... check we get the same result for a
+# range of thread counts
+$vips --vips-concurrency=1 sharpen $image $tmp/s1.v
+for cpus in 2 4 8 16 32 64; do
+	echo trying sink_disc with cpus = $cpus ...
+	$vips --vips-concurrency=$cpus sharpen $image $tmp/s2.v
+
+	$vips subtract $tmp/s1.v $tmp/s2.v $tmp/s4.v
+	$vips abs $tmp/s4.v $tmp/s5.v
+	max=$($vips max $tmp/s5.v)
+	if [ $(echo "$max > 0" | bc) -eq 1 ]; then
+		echo error, sink_disc with $cpus threads, max == $max
+		exit 1
+	fi
+done
+
+# a total concurrency limit must not stop nested threadpools from making
+# progress
+echo -n "checking total concurrency limit ... "
+VIPS_CONCURRENCY_TOTAL=1 $vips sharpen $image $tmp/s2.v || exit_code=$?
+if [ $exit_code -ne 0 ]; then
+  echo FAILED
+  exit 1
+fi
+echo ok
+
+# the profile summary should attribute time to the operation we ran
+echo -n "checking profile summary ... "
+if ! $vips --vips-profile-summary sharpen $image $tmp/s2.v | \
+	grep -q "^sharpen "; then
+  echo FAILED
+  exit 1
+fi
+echo ok
+
+# a longer write-behind ring must not change the output
+echo -n "checking sink_disc ring ... "
+VIPS_SINK_DISC_BUFFERS=8 $vips sharpen $image $tmp/s3.v || exit_code=$?
+if [ $exit_code -ne 0 ]; then
+  echo FAILED
+  exit 1
+fi
+$vips subtract $tmp/s1.v $tmp/s3.v $tmp/t8.v
+$vips abs $tmp/t8.v $tmp/t9.v
+max=$($vips max $tmp/t9.v)
+if [ $(echo "$max > 0" | bc) -eq 1 ]; then
+  echo FAILED
+  exit 1
+fi
+echo ok
+
+# resizing tiles towards a target time must not change the output
+for target in 1 10000000; do
+  echo -n "checking tile target $target ... "
+  VIPS_TILE_TARGET=$target $vips sharpen $image $tmp/s3.v || exit_code=$?
+  if [ $exit_code -ne 0 ]; then
+    echo FAILED
+    exit 1
+  fi
+  $vips subtract $tmp/s1.v $tmp/s3.v $tmp/t8.v
+  $vips abs $tmp/t8.v $tmp/t9.v
+  max=$($vips max $tmp/t9.v)
+  if [ $(echo "$max > 0" | bc) -eq 1 ]; then
+    echo FAILED
+    exit 1
+  fi
+  echo ok
+done
+
+# encoding a JPEG in parallel bands must give the same bytes as encoding it
+# in one thread
+if test_supported jpegsave; then
+  echo -n "checking banded jpegsave ... "
+  $vips replicate $image $tmp/tall.v 1 8
+  width=$($vipsheader -f width $tmp/tall.v)
+  mcus_per_row=$(( (width + 15) / 16 ))
+  options="[subsample-mode=on,restart-interval=$mcus_per_row]"
+  $vips --vips-concurrency=1 copy $tmp/tall.v $tmp/seq.jpg$options
+  $vips --vips-concurrency=4 copy $tmp/tall.v $tmp/banded.jpg$options
+  if ! cmp -s $tmp/seq.jpg $tmp/banded.jpg; then
+    echo FAILED
+    exit 1
+  fi
+  echo ok
+fi
+
+# palette saves must not depend on the number of threads
+$vips replicate $image $tmp/big.v 6 6
+
+if test_supported gifsave; then
+  echo -n "checking gifsave threading ... "
+  height=$($vipsheader -f height $image)
+
+  # a large single frame, with and without dithering
+  for dither in 0 1; do
+    $vips --vips-concurrency=1 gifsave $tmp/big.v $tmp/g1.gif --dither $dither
+    $vips --vips-concurrency=4 gifsave $tmp/big.v $tmp/g4.gif --dither $dither
+    if ! cmp -s $tmp/g1.gif $tmp/g4.gif; then
+      echo FAILED
+      exit 1
+    fi
+  done
+
+  # three frames with two threads: the last batch is a single frame
+  $vips replicate $image $tmp/frames.v 1 3
+  $vips --vips-concurrency=1 gifsave $tmp/frames.v $tmp/g1.gif \
+    --page-height $height
+  $vips --vips-concurrency=2 gifsave $tmp/frames.v $tmp/g4.gif \
+    --page-height $height
+  if ! cmp -s $tmp/g1.gif $tmp/g4.gif; then
+    echo FAILED
+    exit 1
+  fi
+  echo ok
+fi
+
+if test_supported pngsave; then
+  echo -n "checking palette pngsave threading ... "
+  $vips --vips-concurrency=1 pngsave $tmp/big.v $tmp/p1.png --palette
+  $vips --vips-concurrency=4 pngsave $tmp/big.v $tmp/p4.png --palette
+  if ! cmp -s $tmp/p1.png $tmp/p4.png; then
+    echo FAILED
+    exit 1
+  fi
+  echo ok
+fi
@@ -107,6 +107,8 @@
  * 	- support ".suffix" as a magic output format for stdout write
  * 30/4/25
  *  - rename import/export profile args as input/oputput
+ * 18/10/26
+ * 	- thumbnail several files at once, one thread each, see --jobs
  */
 
 #ifdef HAVE_CONFIG_H
@@ -142,6 +144,12 @@ static gboolean no_rotate_image = FALSE;
 static char *smartcrop_image = NULL;
 static char *thumbnail_intent = NULL;
 static gboolean version = FALSE;
+static int thumbnail_jobs = 0;
+
+/* Set if we are running several thumbnails at once, each with a single
+ * thread.
+ */
+static gboolean thumbnail_single_thread = FALSE;
 
 /* Deprecated and unused.
  */
@@ -187,6 +195,10 @@ static GOptionEntry options[] = {
 	{ "no-rotate", 0, 0,
 		G_OPTION_ARG_NONE, &no_rotate_image,
 		N_("don't auto-rotate"), NULL },
+	{ "jobs", 'j', 0,
+		G_OPTION_ARG_INT, &thumbnail_jobs,
+		N_("thumbnail N files at once (default: one per thread)"),
+		N_("N") },
 	{ "version", 'v', 0, G_OPTION_ARG_NONE, &version,
 		N_("print version"), NULL },
 
@@ -400,6 +412,24 @@ thumbnail_process(VipsObject *process, const char *name)
 			return -1;
 	}
 
+	/* With many small images it's quicker to run one image per thread
+	 * than to split each image between threads.
+	 */
+	if (thumbnail_single_thread) {
+		VipsImage *x;
+
+		/* The thumbnail might be shared, so tag a copy.
+		 */
+		if (vips_copy(image, &x, NULL)) {
+			VIPS_UNREF(image);
+			return -1;
+		}
+		VIPS_UNREF(image);
+		image = x;
+
+		vips_image_set_int(image, VIPS_META_CONCURRENCY, 1);
+	}
+
 	/* If the output format is something like ".jpg", we write to stdout
 	 * instead.
 	 */
@@ -535,6 +565,131 @@ thumbnail_parse_geometry(const char *geometry)
 	return 0;
 }
 
+/* Make one thumbnail, reporting any error.
+ */
+static int
+thumbnail_file(const char *prgname, const char *name)
+{
+	/* Hang resources for processing this thumbnail off @process.
+	 */
+	VipsObject *process = VIPS_OBJECT(vips_image_new());
+	int result;
+
+	result = 0;
+	if (thumbnail_process(process, name)) {
+		fprintf(stderr, "%s: unable to thumbnail %s\n", prgname, name);
+		fprintf(stderr, "%s", vips_error_buffer());
+		vips_error_clear();
+
+		result = -1;
+	}
+
+	g_object_unref(process);
+
+	return result;
+}
+
+/* A set of files being thumbnailed by a set of workers.
+ */
+typedef struct _ThumbnailBatch {
+	const char *prgname;
+	char **files;
+	int n_files;
+
+	GMutex lock;
+	int next;
+
+	/* Set for files which failed. Only one worker ever looks at each
+	 * element.
+	 */
+	gboolean *failed;
+} ThumbnailBatch;
+
+static void *
+thumbnail_worker(void *data)
+{
+	ThumbnailBatch *batch = (ThumbnailBatch *) data;
+
+	for (;;) {
+		int i;
+
+		g_mutex_lock(&batch->lock);
+		i = batch->next;
+		batch->next += 1;
+		g_mutex_unlock(&batch->lock);
+
+		if (i >= batch->n_files)
+			break;
+
+		/* The error buffer is shared by all workers, so we can't
+		 * report errors here. Just note the failure.
+		 */
+		VipsObject *process = VIPS_OBJECT(vips_image_new());
+		if (thumbnail_process(process, batch->files[i]))
+			batch->failed[i] = TRUE;
+		g_object_unref(process);
+	}
+
+	return NULL;
+}
+
+/* Thumbnail all the files, up to n_jobs at once.
+ *
+ * The workers must not come from the libvips threadset: each one runs a
+ * pipeline which needs threads of its own, and a fixed VIPS_MAX_THREADS
+ * would let the workers take every thread and deadlock.
+ *
+ * Failed files are run again one at a time at the end, so each gets the
+ * right error message.
+ */
+static int
+thumbnail_batch(const char *prgname, char **files, int n_files, int n_jobs)
+{
+	ThumbnailBatch batch;
+	GThread **workers;
+	int result;
+	int i;
+
+	batch.prgname = prgname;
+	batch.files = files;
+	batch.n_files = n_files;
+	g_mutex_init(&batch.lock);
+	batch.next = 0;
+	batch.failed = g_new0(gboolean, n_files);
+
+	/* We are one of the workers, so start n_jobs - 1 more. If we can't
+	 * make a thread, we'll just do more of the work ourselves.
+	 */
+	workers = g_new0(GThread *, n_jobs);
+	for (i = 1; i < n_jobs; i++)
+		workers[i] = vips_g_thread_new("thumbnail",
+			thumbnail_worker, &batch);
+
+	thumbnail_worker(&batch);
+
+	for (i = 1; i < n_jobs; i++)
+		if (workers[i])
+			g_thread_join(workers[i]);
+
+	g_free(workers);
+	g_mutex_clear(&batch.lock);
+
+	/* All workers have gone, so the error buffer is ours again. Throw
+	 * away the mixed-up messages and rerun the failures to report them.
+	 */
+	vips_error_clear();
+
+	result = 0;
+	for (i = 0; i < n_files; i++)
+		if (batch.failed[i] &&
+			thumbnail_file(prgname, files[i]))
+			result = -1;
+
+	g_free(batch.failed);
+
+	return result;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -542,6 +697,8 @@ main(int argc, char **argv)
 	GOptionGroup *main_group;
 	GError *error = NULL;
 	int i;
+	int n_files;
+	int n_jobs;
 	int result;
 
 	if (VIPS_INIT(argv[0]))
@@ -604,27 +761,33 @@ main(int argc, char **argv)
 				  "libvips built without exif support");
 #endif /*!HAVE_EXIF*/
 
-	result = 0;
+	for (n_files = 0; argv[n_files + 1]; n_files++)
+		;
 
-	for (i = 1; argv[i]; i++) {
-		/* Hang resources for processing this thumbnail off @process.
-		 */
-		VipsObject *process = VIPS_OBJECT(vips_image_new());
+	/* Several output files can be made at once, but stdin and stdout can
+	 * only be used one at a time.
+	 */
+	n_jobs = thumbnail_jobs > 0 ? thumbnail_jobs : vips_concurrency_get();
+	n_jobs = VIPS_MIN(n_jobs, n_files);
+	if (thumbnail_output_format())
+		n_jobs = 1;
+	for (i = 1; argv[i]; i++)
+		if (vips_isprefix("stdin", argv[i]))
+			n_jobs = 1;
 
-		if (thumbnail_process(process, argv[i])) {
-			fprintf(stderr, "%s: unable to thumbnail %s\n",
-				argv[0], argv[i]);
-			fprintf(stderr, "%s", vips_error_buffer());
-			vips_error_clear();
+	result = 0;
 
+	if (n_jobs > 1) {
+		thumbnail_single_thread = TRUE;
+		result = thumbnail_batch(argv[0], argv + 1, n_files, n_jobs);
+	}
+	else
+		for (i = 1; argv[i]; i++)
 			/* We had a conversion failure: return an error code
 			 * when we finally exit.
 			 */
-			result = -1;
-		}
-
-		g_object_unref(process);
-	}
+			if (thumbnail_file(argv[0], argv[i]))
+				result = -1;
 
 	/* We don't free this on error exit, sadly.
 	 */